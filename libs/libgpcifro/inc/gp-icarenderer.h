@@ -99,7 +99,12 @@
  *
  * - #GP_ICA_RENDERER_AVAIL_NONE - изображение не может быть получено в данный момент ( загружается, обрабатывается и т.п.);
  * - #GP_ICA_RENDERER_AVAIL_ALL - изображение готово;
- * - #GP_ICA_RENDERER_AVAIL_NOT_CHANGED - изображение не изменилось с момента последней проверки.
+ * - #GP_ICA_RENDERER_AVAIL_NOT_CHANGED - изображение не изменилось с момента последней проверки;
+ * - #GP_ICA_RENDERER_AVAIL_PART - изображение изменилось только в возвращенной области.
+ *
+ * В состоянии #GP_ICA_RENDERER_AVAIL_ALL возвращается область, занимаемая изображением, и вне ее буфер
+ * не выводится. В состоянии #GP_ICA_RENDERER_AVAIL_PART возвращается только область изменений, а
+ * границы изображения остаются прежними: достаточно перерисовать эту область.
  *
  * Если модуль находится в состоянии формирования изображения (#GP_ICA_RENDERER_AVAIL_NONE) он может
  * сообщить прогрес выполнения этой задачи в ответ на вызов функции #gp_ica_renderer_get_completion.
@@ -144,6 +149,7 @@ GpIcaRendererType;
  * @GP_ICA_RENDERER_AVAIL_NONE: Изображение подготавливается.
  * @GP_ICA_RENDERER_AVAIL_ALL: Изображение готово.
  * @GP_ICA_RENDERER_AVAIL_NOT_CHANGED: Изображение не изменилось.
+ * @GP_ICA_RENDERER_AVAIL_PART: Изображение изменилось частично.
  *
  * Состояние формирования изображения.
  */
@@ -151,7 +157,8 @@ typedef enum
 {
   GP_ICA_RENDERER_AVAIL_NONE,
   GP_ICA_RENDERER_AVAIL_ALL,
-  GP_ICA_RENDERER_AVAIL_NOT_CHANGED
+  GP_ICA_RENDERER_AVAIL_NOT_CHANGED,
+  GP_ICA_RENDERER_AVAIL_PART
 }
 GpIcaRendererAvailability;
 
@@ -334,7 +341,8 @@ void gp_ica_renderer_set_total_completion(GpIcaRenderer *renderer, gint completi
  *
  * Копирование изображения в буфер.
  * Производит копирование сформированного изображения в буфер и возвращает координаты
- * области в которой изображение было изменено.
+ * области в которой изображение было изменено. Для #GP_ICA_RENDERER_AVAIL_PART это область
+ * изменений внутри ранее возвращенного изображения.
  *
  * Returns: Результат (статус) операции копирования.
  */
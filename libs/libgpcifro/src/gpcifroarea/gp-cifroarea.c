@@ -172,6 +172,9 @@ static gboolean gp_cifro_area_check_drawing (GpCifroAreaPriv *priv, gint widget_
 static void gp_cifro_area_update_visible (GpCifroAreaPriv *priv);
 
 static gboolean gp_cifro_area_check_layers (GpCifroArea *carea);
+static void gp_cifro_area_visible_matrix (GpCifroAreaPriv *priv, cairo_matrix_t *matrix);
+static void gp_cifro_area_damage_layer (GpCifroAreaPriv *priv, GpCifroAreaLayer *layer, gint x, gint y,
+                                        gint width, gint height, cairo_region_t *damage);
 
 static gboolean gp_cifro_area_leave (GtkWidget *widget, GdkEventCrossing *event, GpCifroAreaPriv *priv);
 static gboolean gp_cifro_area_key_press (GtkWidget *widget, GdkEventKey *event, GpCifroAreaPriv *priv);
@@ -746,6 +749,8 @@ static gboolean gp_cifro_area_check_layers (GpCifroArea *carea)
 
   gint new_renderer_state;
   gboolean queue_draw = FALSE;
+  cairo_region_t *damage;
+  gint x, y, width, height;
   gint i;
 
   completion_total = 0;
@@ -772,6 +777,8 @@ static gboolean gp_cifro_area_check_layers (GpCifroArea *carea)
   else
     completion_total = 1000;
 
+  damage = cairo_region_create();
+
   for( i = 0; i < priv->layers_num; i++ )
     {
 
@@ -785,11 +792,37 @@ static gboolean gp_cifro_area_check_layers (GpCifroArea *carea)
     if( !layer->surface ) continue;
     if( layer->renderer_type == GP_ICA_RENDERER_STATE) continue;
 
+    x = layer->x;
+    y = layer->y;
+    width = layer->width;
+    height = layer->height;
+
     cairo_surface_flush( layer->surface );
-    new_renderer_state = gp_ica_renderer_render(layer->renderer, layer->renderer_id, &layer->x, &layer->y,
-                                                &layer->width, &layer->height);
+    new_renderer_state = gp_ica_renderer_render(layer->renderer, layer->renderer_id, &x, &y, &width, &height);
     cairo_surface_mark_dirty( layer->surface );
 
+    // Изображение изменилось частично: границы изображения прежние, перерисовываем только область изменений.
+    if( new_renderer_state == GP_ICA_RENDERER_AVAIL_PART )
+      {
+      if( layer->render_state != GP_ICA_RENDERER_AVAIL_NONE )
+        {
+        gp_cifro_area_damage_layer( priv, layer, x, y, width, height, damage );
+        continue;
+        }
+
+      // Прежних границ изображения нет: считаем его готовым целиком и перерисовываем весь слой.
+      x = 0;
+      y = 0;
+      width = cairo_image_surface_get_width( layer->surface );
+      height = cairo_image_surface_get_height( layer->surface );
+      new_renderer_state = GP_ICA_RENDERER_AVAIL_ALL;
+      }
+
+    layer->x = x;
+    layer->y = y;
+    layer->width = width;
+    layer->height = height;
+
     if( new_renderer_state == GP_ICA_RENDERER_AVAIL_ALL) queue_draw = TRUE;
     if( new_renderer_state != layer->render_state && new_renderer_state != GP_ICA_RENDERER_AVAIL_NOT_CHANGED) queue_draw = TRUE;
     layer->render_state = new_renderer_state;
@@ -798,8 +831,15 @@ static gboolean gp_cifro_area_check_layers (GpCifroArea *carea)
 
   priv->completion_total = completion_total;
 
-  if( queue_draw && !priv->check_layers )
-    gtk_widget_queue_draw( GTK_WIDGET( carea ) );
+  if( !priv->check_layers )
+    {
+    if( queue_draw )
+      gtk_widget_queue_draw( GTK_WIDGET( carea ) );
+    else if( !cairo_region_is_empty( damage ) )
+      gtk_widget_queue_draw_region( GTK_WIDGET( carea ), damage );
+    }
+
+  cairo_region_destroy( damage );
 
   priv->check_layers = FALSE;
 
@@ -808,6 +848,110 @@ static gboolean gp_cifro_area_check_layers (GpCifroArea *carea)
 }
 
 
+/* Матрица преобразования из координат видимой области в координаты виджета. */
+static void gp_cifro_area_visible_matrix (GpCifroAreaPriv *priv, cairo_matrix_t *matrix)
+{
+  gdouble cairo_width;
+  gdouble cairo_height;
+  gdouble shift_width;
+  gdouble shift_height;
+  gdouble angle;
+  gdouble db_w, db_h;
+
+  cairo_width = priv->widget_width;
+  cairo_height = priv->widget_height;
+  shift_width = ( ( priv->widget_width - priv->visible_width ) / 2.0 );
+  shift_height = ( ( priv->widget_height - priv->visible_height ) / 2.0 );
+
+  db_w = (priv->border_left - priv->border_right) / 2.0;
+  db_h = (priv->border_top - priv->border_bottom) / 2.0;
+
+  angle = priv->angle;
+  if( priv->swap_x ) angle = -angle;
+  if( priv->swap_y ) angle = -angle;
+
+  cairo_matrix_init_identity( matrix );
+
+  if( priv->swap_x )
+  {
+    cairo_matrix_scale( matrix, -1.0, 1.0 );
+    cairo_matrix_translate( matrix, -cairo_width - 2 * db_w, 0 );
+  }
+
+  if( priv->swap_y )
+  {
+    cairo_matrix_scale( matrix, 1.0, -1.0 );
+    cairo_matrix_translate( matrix, 0, -cairo_height - 2 * db_h );
+  }
+
+  if( priv->angle != 0.0 )
+  {
+    cairo_matrix_translate( matrix, cairo_width / 2.0 + db_w, cairo_height / 2.0 + db_h );
+    cairo_matrix_rotate( matrix, angle );
+    cairo_matrix_translate( matrix, -cairo_width / 2.0 - db_w, -cairo_height / 2.0 - db_h );
+  }
+
+  cairo_matrix_translate( matrix, shift_width + db_w, shift_height + db_h );
+}
+
+
+/* Добавление изменившейся области изображения слоя (в координатах изображения) к области перерисовки виджета. */
+static void gp_cifro_area_damage_layer (GpCifroAreaPriv *priv, GpCifroAreaLayer *layer, gint x, gint y,
+                                        gint width, gint height, cairo_region_t *damage)
+{
+  cairo_rectangle_int_t rect;
+
+  if( width <= 0 || height <= 0 ) return;
+
+  rect.x = x;
+  rect.y = y;
+  rect.width = width;
+  rect.height = height;
+
+  if( layer->renderer_type == GP_ICA_RENDERER_VISIBLE )
+    {
+    cairo_matrix_t matrix;
+    gdouble corners_x[4] = { x, x + width, x, x + width };
+    gdouble corners_y[4] = { y, y, y + height, y + height };
+    gdouble min_x = G_MAXDOUBLE, max_x = -G_MAXDOUBLE;
+    gdouble min_y = G_MAXDOUBLE, max_y = -G_MAXDOUBLE;
+    gint i;
+
+    gp_cifro_area_visible_matrix( priv, &matrix );
+
+    // При повороте область изменений -- описанный прямоугольник вокруг повернутой области.
+    for( i = 0; i < 4; i++ )
+      {
+      cairo_matrix_transform_point( &matrix, &corners_x[i], &corners_y[i] );
+      min_x = MIN( min_x, corners_x[i] );
+      max_x = MAX( max_x, corners_x[i] );
+      min_y = MIN( min_y, corners_y[i] );
+      max_y = MAX( max_y, corners_y[i] );
+      }
+
+    // Запас в один пиксель на сглаживание краев.
+    rect.x = floor( min_x ) - 1;
+    rect.y = floor( min_y ) - 1;
+    rect.width = ceil( max_x ) - rect.x + 1;
+    rect.height = ceil( max_y ) - rect.y + 1;
+
+    if( priv->clip )
+      {
+      cairo_rectangle_int_t clip = { priv->clip_x, priv->clip_y, priv->clip_width, priv->clip_height };
+      cairo_region_t *clipped = cairo_region_create_rectangle( &rect );
+
+      cairo_region_intersect_rectangle( clipped, &clip );
+      cairo_region_union( damage, clipped );
+      cairo_region_destroy( clipped );
+
+      return;
+      }
+    }
+
+  cairo_region_union_rectangle( damage, &rect );
+}
+
+
 /* Обработчик события выхода мышки за пределы виджета. */
 static gboolean gp_cifro_area_leave (GtkWidget *widget, GdkEventCrossing *event, GpCifroAreaPriv *priv)
 {
@@ -1102,25 +1246,10 @@ cairo_surface_t *gp_cifro_area_draw_to_surface(GpCifroArea *carea)
 static void draw_layers(GpCifroAreaPriv *priv, cairo_t *cairo)
 {
   GpCifroAreaLayer *layer;
-  gdouble cairo_width;
-  gdouble cairo_height;
-  gdouble shift_width;
-  gdouble shift_height;
-  gdouble angle;
-  gdouble db_w, db_h;
+  cairo_matrix_t visible_matrix;
   gint i;
 
-  cairo_width = priv->widget_width;
-  cairo_height = priv->widget_height;
-  shift_width = ( ( priv->widget_width - priv->visible_width ) / 2.0 );
-  shift_height = ( ( priv->widget_height - priv->visible_height ) / 2.0 );
-
-  db_w = (priv->border_left - priv->border_right) / 2.0;
-  db_h = (priv->border_top - priv->border_bottom) / 2.0;
-
-  angle = priv->angle;
-  if( priv->swap_x ) angle = -angle;
-  if( priv->swap_y ) angle = -angle;
+  gp_cifro_area_visible_matrix( priv, &visible_matrix );
 
   cairo_set_operator( cairo, CAIRO_OPERATOR_OVER );
 
@@ -1145,29 +1274,12 @@ static void draw_layers(GpCifroAreaPriv *priv, cairo_t *cairo)
         cairo_clip( cairo );
       }
 
-      if( priv->swap_x )
-      {
-        cairo_scale( cairo, -1.0, 1.0 );
-        cairo_translate( cairo, -cairo_width - 2 * db_w, 0 );
-      }
-
-      if( priv->swap_y )
-      {
-        cairo_scale( cairo, 1.0, -1.0 );
-        cairo_translate( cairo, 0, -cairo_height - 2 * db_h );
-      }
+      cairo_transform( cairo, &visible_matrix );
 
-      if( priv->angle != 0.0 )
-      {
-        cairo_translate( cairo, cairo_width / 2.0 + db_w, cairo_height / 2.0 + db_h );
-        cairo_rotate( cairo, angle );
-        cairo_translate( cairo, -cairo_width / 2.0 - db_w, -cairo_height / 2.0 - db_h );
-      }
-
-      cairo_rectangle( cairo, layer->x + shift_width + db_w, layer->y + shift_height + db_h, layer->width, layer->height );
+      cairo_rectangle( cairo, layer->x, layer->y, layer->width, layer->height );
       cairo_clip( cairo );
 
-      cairo_set_source_surface( cairo, layer->surface, shift_width + db_w, shift_height + db_h );
+      cairo_set_source_surface( cairo, layer->surface, 0, 0 );
     }
     else if( layer->renderer_type == GP_ICA_RENDERER_AREA)
     {
@@ -1241,6 +1353,8 @@ gint gp_cifro_area_add_layer (GpCifroArea *carea, GpIcaRenderer *layer_renderer)
 
     layer = g_malloc( sizeof(GpCifroAreaLayer) );
     layer->surface = NULL;
+    layer->x = layer->y = 0;
+    layer->width = layer->height = 0;
     layer->dont_draw = FALSE;
     layer->renderer_id = i;
     layer->renderer = layer_renderer;
@@ -22,6 +22,13 @@
 namespace Gp
 {
   #if VALA_0_18
+  /**
+   * Тип функции отбора заданий (см. Dispatcher.remove_queued()).
+   * @param worker задание.
+   * @return true, если задание удовлетворяет условию.
+   */
+  public delegate bool WorkerFilterFunc(Gp.Worker worker);
+
   /**
    * Абстрактный диспетчер, выполняющий задания типа GpWorker.
    */
@@ -32,25 +39,244 @@ namespace Gp
      * @param worker задание, которое будет добавлено в диспетчер.
      */
     public abstract void add(Gp.Worker worker) throws ThreadError;
+
+    /**
+     * Удаление из очереди еще не начатых заданий, удовлетворяющих условию.
+     * Выполняющиеся задания не прерываются.
+     * Если диспетчер не хранит очередь заданий, то метод ничего не делает.
+     * @param filter условие отбора удаляемых заданий.
+     * @return количество удаленных заданий.
+     */
+    public virtual uint remove_queued(WorkerFilterFunc filter) { return 0; }
+  }
+
+  /**
+   * Очередь заданий с приоритетами (двоичная куча) для реализаций Dispatcher.
+   *
+   * Задания упорядочены по приоритету (Worker.get_priority(), меньшее значение -- более
+   * высокий приоритет), задания с одинаковым приоритетом -- по порядковому номеру добавления.
+   * Очередь не thread-safe: доступ к ней синхронизирует диспетчер.
+   */
+  [Compact]
+  internal class WorkerQueue
+  {
+    /**
+    * Элемент очереди заданий.
+    */
+    public struct Item
+    {
+      public Gp.Worker worker;
+      public int priority; //< Приоритет задания на момент добавления.
+      public uint64 seq;   //< Порядковый номер добавления.
+      public uint group;   //< Группа заданий (0 -- задание не входит в группу).
+    }
+
+    /**
+    * Двоичная куча первых length элементов массива.
+    */
+    private Item[] items;
+
+    /**
+    * Количество заданий в очереди.
+    */
+    public int length;
+
+    public WorkerQueue()
+    {
+      this.items = new Item[16];
+      this.length = 0;
+    }
+
+    /**
+    * Добавляет задание в очередь.
+    */
+    public void push(Gp.Worker worker, int priority, uint64 seq, uint group = 0)
+    {
+      if(this.length == this.items.length)
+        this.items.resize(2 * this.items.length);
+
+      int i = this.length++;
+      this.items[i] = { worker, priority, seq, group };
+
+      // Просеивание вверх.
+      while(i > 0 && before(ref this.items[i], ref this.items[(i - 1) / 2]))
+      {
+        this.swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+      }
+    }
+
+    /**
+    * Извлекает из очереди самое приоритетное задание.
+    * @return задание, либо null, если очередь пуста.
+    */
+    public Gp.Worker? pop()
+    {
+      if(this.length == 0)
+        return null;
+
+      Gp.Worker top = this.items[0].worker;
+
+      this.length--;
+      this.swap(0, this.length);
+      this.items[this.length] = Item();
+
+      this.sift_down(0);
+
+      return top;
+    }
+
+    /**
+    * Удаляет из очереди задания, отобранные filter, либо (если filter == null) задания группы group.
+    * @return количество удаленных заданий.
+    */
+    public uint remove(WorkerFilterFunc? filter, uint group = 0)
+    {
+      int kept = 0;
+
+      for(int i = 0; i < this.length; i++)
+      {
+        bool drop = (filter != null) ? filter(this.items[i].worker) : (this.items[i].group == group);
+
+        if(!drop)
+        {
+          if(kept != i)
+            this.items[kept] = this.items[i];
+          kept++;
+        }
+      }
+
+      uint removed = (uint)(this.length - kept);
+
+      for(int i = kept; i < this.length; i++)
+        this.items[i] = Item();
+
+      this.length = kept;
+
+      // Восстанавливаем свойства кучи.
+      for(int i = this.length / 2 - 1; i >= 0; i--)
+        this.sift_down(i);
+
+      return removed;
+    }
+
+    /**
+    * Сравнивает элементы очереди: true, если a нужно выполнить раньше b.
+    */
+    private static bool before(ref Item a, ref Item b)
+    {
+      return (a.priority < b.priority) || (a.priority == b.priority && a.seq < b.seq);
+    }
+
+    private void swap(int i, int j)
+    {
+      Item tmp = this.items[i];
+      this.items[i] = this.items[j];
+      this.items[j] = tmp;
+    }
+
+    private void sift_down(int i)
+    {
+      while(true)
+      {
+        int best = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+
+        if(left < this.length && before(ref this.items[left], ref this.items[best]))
+          best = left;
+        if(right < this.length && before(ref this.items[right], ref this.items[best]))
+          best = right;
+
+        if(best == i)
+          break;
+
+        this.swap(i, best);
+        i = best;
+      }
+    }
   }
 
   /**
    * Диспетчер на основе GThreadPool, обрабатывающий задачи типа GpWorker в потоках.
+   *
+   * Задания выполняются в порядке приоритета (Worker.get_priority(), меньшее значение -- более
+   * высокий приоритет), задания с одинаковым приоритетом -- в порядке добавления.
+   * Для этого задания хранятся в собственной очереди с приоритетами (двоичной куче),
+   * а в pool на каждое задание кладется маркер: получив маркер, поток пула
+   * достает из кучи и выполняет самое приоритетное задание.
    */
   public class DispatcherThreadPool : Dispatcher
   {
+    /**
+    * Маркер задания из очереди с приоритетами.
+    */
+    private class QueueToken : Object, Gp.Worker
+    {
+      public void run() { }
+    }
+
     /**
     * Объект GThreadPool, на основе которого реализован DispatcherThreadPool.
+    *
+    * Задания, добавленные напрямую в pool, выполняются в порядке добавления,
+    * без учета приоритета.
     */
     public ThreadPool<Gp.Worker> pool;
 
+    /**
+    * Очередь заданий с приоритетами.
+    */
+    private WorkerQueue queue;
+    private uint64 queue_seq;
+    /**
+    * Мьютекс для доступа к queue и queue_seq.
+    */
+    private Mutex queue_mutex;
+
+    private QueueToken token;
+
     /**
      * Добавление задания в диспетчер.
      * @param worker задание, которое будет добавлено в диспетчер.
      */
     public override void add(Gp.Worker worker) throws ThreadError
     {
-        this.pool.add(worker);
+      int priority = worker.get_priority();
+
+      this.queue_mutex.lock();
+        this.queue.push(worker, priority, this.queue_seq++);
+      this.queue_mutex.unlock();
+
+      this.pool.add(this.token);
+    }
+
+    /**
+     * Удаление из очереди с приоритетами еще не начатых заданий, удовлетворяющих условию.
+     * Функция filter вызывается под мьютексом очереди и не должна добавлять задания в диспетчер.
+     * Маркеры удаленных заданий в pool станут пустыми.
+     * @param filter условие отбора удаляемых заданий.
+     * @return количество удаленных заданий.
+     */
+    public override uint remove_queued(WorkerFilterFunc filter)
+    {
+      this.queue_mutex.lock();
+        uint removed = this.queue.remove(filter);
+      this.queue_mutex.unlock();
+
+      return removed;
+    }
+
+    /**
+     * Количество заданий, ожидающих выполнения в очереди с приоритетами.
+     */
+    public uint get_queued_num()
+    {
+      this.queue_mutex.lock();
+        uint rval = this.queue.length;
+      this.queue_mutex.unlock();
+
+      return rval;
     }
 
     /**
@@ -60,7 +286,325 @@ namespace Gp
      */
     public DispatcherThreadPool(int max_threads, bool exclusive) throws ThreadError
     {
-        this.pool = new ThreadPool<Gp.Worker>.with_owned_data(Worker.run_and_unref, max_threads, exclusive);
+        this.queue = new WorkerQueue();
+        this.queue_seq = 0;
+        this.queue_mutex = Mutex();
+        this.token = new QueueToken();
+
+        this.pool = new ThreadPool<Gp.Worker>.with_owned_data(this.run_next, max_threads, exclusive);
+    }
+
+    /**
+    * Функция потоков pool: выполняет задание, добавленное напрямую в pool,
+    * либо (если получен маркер) самое приоритетное задание из очереди.
+    */
+    private void run_next(owned Gp.Worker worker)
+    {
+      if(worker != this.token)
+      {
+        worker.run();
+        return;
+      }
+
+      this.queue_mutex.lock();
+        Gp.Worker? next = this.queue.pop();
+      this.queue_mutex.unlock();
+
+      if(next != null)
+        next.run();
+    }
+  }
+
+  /**
+   * Диспетчер с "воровством" заданий (work stealing), обрабатывающий задачи типа GpWorker в потоках.
+   *
+   * У каждого потока своя очередь заданий с приоритетами под своим мьютексом,
+   * поэтому потоки не конкурируют за одну общую очередь (как в DispatcherThreadPool).
+   * Задание, добавленное из потока диспетчера (например, задание, порождающее задания),
+   * попадает в очередь этого потока, а значит, выполнится на том же ядре, "теплом" по кэшу;
+   * задания, добавленные из других потоков, раскладываются по очередям по кругу.
+   * Поток выполняет самое приоритетное задание своей очереди, а когда она пуста --
+   * забирает самое приоритетное задание из очереди другого потока.
+   * Порядок приоритетов поэтому соблюдается в пределах очереди потока, а между потоками -- приблизительно.
+   *
+   * Задания можно объединять в группы (new_group(), add_to_group()) и удалять еще не начатые
+   * задания группы разом (cancel_group()).
+   *
+   * При уничтожении диспетчера не начатые задания отбрасываются, выполняющиеся -- завершаются.
+   */
+  public class DispatcherWorkStealing : Dispatcher
+  {
+    /**
+    * Очередь заданий потока.
+    */
+    [Compact]
+    private class Slot
+    {
+      public Mutex mutex;
+      public WorkerQueue queue;
+      public uint64 seq; //< Счетчик добавленных в очередь заданий.
+      public unowned Thread<void*>? thread;
+
+      public Slot()
+      {
+        this.mutex = Mutex();
+        this.queue = new WorkerQueue();
+      }
+    }
+
+    /**
+    * Общее состояние потоков диспетчера.
+    * Потоки держат ссылку на него, а не на сам диспетчер, чтобы диспетчер мог быть уничтожен.
+    */
+    private class Pool : Object
+    {
+      public Slot[] slots;
+
+      /**
+      * Количество заданий во всех очередях (меняется под мьютексом очереди).
+      */
+      public int pending;
+      public int stopping;
+      public int next_slot;
+
+      /**
+      * Мьютекс и условная переменная для ожидания заданий простаивающими потоками.
+      */
+      public Mutex idle_mutex;
+      public Cond idle_cond;
+
+      public Pool(int threads_num)
+      {
+        this.slots = new Slot[threads_num];
+        for(int i = 0; i < threads_num; i++)
+          this.slots[i] = new Slot();
+
+        this.idle_mutex = Mutex();
+        this.idle_cond = Cond();
+      }
+
+      /**
+      * Номер очереди потока диспетчера, из которого вызван метод, либо -1.
+      */
+      public int self_slot()
+      {
+        unowned Thread<void*> self = Thread.self<void*>();
+
+        for(int i = 0; i < this.slots.length; i++)
+          if(this.slots[i].thread == self)
+            return i;
+
+        return -1;
+      }
+
+      public void push(Gp.Worker worker, uint group)
+      {
+        int index = this.self_slot();
+
+        if(index < 0)
+          index = (int)((uint)AtomicInt.add(ref this.next_slot, 1) % this.slots.length);
+
+        int priority = worker.get_priority();
+        unowned Slot slot = this.slots[index];
+
+        slot.mutex.lock();
+          slot.queue.push(worker, priority, slot.seq++, group);
+          AtomicInt.inc(ref this.pending);
+        slot.mutex.unlock();
+
+        this.idle_mutex.lock();
+          this.idle_cond.signal();
+        this.idle_mutex.unlock();
+      }
+
+      /**
+      * Извлекает задание из очереди slots[index], а если она пуста -- из очередей других потоков.
+      */
+      public Gp.Worker? take(int index)
+      {
+        for(int i = 0; i < this.slots.length; i++)
+        {
+          unowned Slot slot = this.slots[(index + i) % this.slots.length];
+
+          slot.mutex.lock();
+            Gp.Worker? worker = slot.queue.pop();
+            if(worker != null)
+              AtomicInt.add(ref this.pending, -1);
+          slot.mutex.unlock();
+
+          if(worker != null)
+            return worker;
+        }
+
+        return null;
+      }
+
+      public uint remove(WorkerFilterFunc? filter, uint group)
+      {
+        uint removed = 0;
+
+        foreach(unowned Slot slot in this.slots)
+        {
+          slot.mutex.lock();
+            uint slot_removed = slot.queue.remove(filter, group);
+            AtomicInt.add(ref this.pending, -(int)slot_removed);
+          slot.mutex.unlock();
+
+          removed += slot_removed;
+        }
+
+        return removed;
+      }
+
+      public void stop()
+      {
+        this.idle_mutex.lock();
+          AtomicInt.set(ref this.stopping, 1);
+          this.idle_cond.broadcast();
+        this.idle_mutex.unlock();
+      }
+
+      /**
+      * Функция потока с очередью slots[index].
+      */
+      public void* run(int index)
+      {
+        while(AtomicInt.get(ref this.stopping) == 0)
+        {
+          Gp.Worker? worker = this.take(index);
+
+          if(worker != null)
+          {
+            worker.run();
+            continue;
+          }
+
+          this.idle_mutex.lock();
+            while(AtomicInt.get(ref this.pending) == 0 && AtomicInt.get(ref this.stopping) == 0)
+              this.idle_cond.wait(this.idle_mutex);
+          this.idle_mutex.unlock();
+        }
+
+        return null;
+      }
+    }
+
+    private Pool pool;
+    private Thread<void*>[] threads;
+    private int last_group;
+
+    /**
+     * Создание диспетчера GpDispatcherWorkStealing.
+     * @param threads_num количество потоков, 0 -- по количеству процессоров.
+     */
+    public DispatcherWorkStealing(int threads_num = 0) throws ThreadError
+    {
+      if(threads_num <= 0)
+        threads_num = (int)get_num_processors();
+
+      this.pool = new Pool(threads_num);
+      this.threads = new Thread<void*>[threads_num];
+
+      for(int i = 0; i < threads_num; i++)
+      {
+        this.threads[i] = start_thread(this.pool, i);
+        this.pool.slots[i].thread = this.threads[i];
+      }
+    }
+
+    ~DispatcherWorkStealing()
+    {
+      this.pool.stop();
+      this.pool.remove((worker) => { return true; }, 0);
+
+      // Диспетчер может быть уничтожен и из собственного потока (последней ссылкой в задании),
+      // этот поток завершится сам.
+      unowned Thread<void*> self = Thread.self<void*>();
+
+      for(int i = 0; i < this.threads.length; i++)
+      {
+        Thread<void*> thread = (owned)this.threads[i];
+
+        if(thread != self)
+          thread.join();
+      }
+    }
+
+    private static Thread<void*> start_thread(Pool pool, int index) throws ThreadError
+    {
+      try
+      {
+        return new Thread<void*>.try("gp-dispatcher", () => { return pool.run(index); });
+      }
+      catch(Error e)
+      {
+        throw new ThreadError.AGAIN(e.message);
+      }
+    }
+
+    /**
+     * Добавление задания в диспетчер.
+     * @param worker задание, которое будет добавлено в диспетчер.
+     */
+    public override void add(Gp.Worker worker) throws ThreadError
+    {
+      this.pool.push(worker, 0);
+    }
+
+    /**
+     * Создание новой группы заданий.
+     * @return идентификатор группы (не 0).
+     */
+    public uint new_group()
+    {
+      uint group;
+
+      do
+        group = (uint)AtomicInt.add(ref this.last_group, 1) + 1;
+      while(unlikely(group == 0));
+
+      return group;
+    }
+
+    /**
+     * Добавление задания в диспетчер в составе группы.
+     * @param worker задание, которое будет добавлено в диспетчер.
+     * @param group идентификатор группы, полученный от new_group().
+     */
+    public void add_to_group(Gp.Worker worker, uint group) throws ThreadError
+    {
+      this.pool.push(worker, group);
+    }
+
+    /**
+     * Удаление из очередей еще не начатых заданий группы.
+     * Выполняющиеся задания группы не прерываются.
+     * @param group идентификатор группы.
+     * @return количество удаленных заданий.
+     */
+    public uint cancel_group(uint group)
+      requires(group != 0)
+    {
+      return this.pool.remove(null, group);
+    }
+
+    /**
+     * Удаление из очередей еще не начатых заданий, удовлетворяющих условию.
+     * Функция filter вызывается под мьютексом очереди потока и не должна добавлять задания в диспетчер.
+     * @param filter условие отбора удаляемых заданий.
+     * @return количество удаленных заданий.
+     */
+    public override uint remove_queued(WorkerFilterFunc filter)
+    {
+      return this.pool.remove(filter, 0);
+    }
+
+    /**
+     * Количество заданий, ожидающих выполнения.
+     */
+    public uint get_queued_num()
+    {
+      return (uint)AtomicInt.get(ref this.pool.pending);
     }
   }
 
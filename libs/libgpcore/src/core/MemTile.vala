@@ -46,13 +46,39 @@ namespace Gp
     /**
     * Данные, выделенные с помощью GLib.malloc памяти.
     */
-    private uint8[] ptr = new uint8[MemTile.N_BYTES];
+    private uint8[] ptr = MemTile.pool_take();
 
     /**
     * Размер выделенной с помощью GLib.malloc памяти.
     */
     public const ulong N_BYTES = sizeof(Gp.Tile) + sizeof(TileStatus) + Gp.TILE_DATA_SIZE;
 
+    /**
+    * Максимальное количество буферов в пуле повторно используемой памяти.
+    */
+    public const int POOL_MAX = 64;
+
+    private struct PoolBuf
+    {
+      public uint8[] data;
+    }
+
+    /*
+    * Пул освободившейся памяти размером N_BYTES, из которого берется память для новых объектов.
+    * Пополняется функцией recycle_malloc_data, доступ -- под pool_mutex.
+    * Создается при первом обращении, а поля пула не инициализируются в class_init:
+    * recycle_malloc_data может быть вызвана до создания первого объекта MemTile.
+    */
+    private static PoolBuf[]? pool;
+    private static int pool_len;
+    private static Mutex pool_mutex;
+
+    ~MemTile()
+    {
+      if(this.ptr != null)
+        MemTile.recycle_malloc_data((owned)this.ptr);
+    }
+
     /**
     * Описание содержащейся в объекте плитки.
     */
@@ -102,6 +128,51 @@ namespace Gp
 
     // Статические функции -->
 
+    /*
+    * Берет память из пула или выделяет новую. Память заполнена нулями.
+    */
+    private static uint8[] pool_take()
+    {
+      uint8[]? data = null;
+
+      pool_mutex.lock();
+      if(pool == null)
+        pool = new PoolBuf[MemTile.POOL_MAX];
+      if(pool_len > 0)
+        data = (owned)pool[--pool_len].data;
+      pool_mutex.unlock();
+
+      if(data == null)
+        return new uint8[MemTile.N_BYTES];
+
+      Memory.set(data, 0, MemTile.N_BYTES);
+      return (owned)data;
+    }
+
+    /**
+    * Функция возвращает память, выделенную с помощью GLib.malloc, в пул,
+    * из которого она будет взята новым объектом MemTile.
+    * Если размер памяти отличается от N_BYTES или пул заполнен, память освобождается.
+    *
+    * Подходит в качестве Gp.SmartCacheRecycleFunc для групп кэша, хранящих данные объектов MemTile:
+    * тогда память вытесненных из кэша плиток используется для отрисовки новых без обращения к malloc.
+    * Функция потокобезопасна.
+    *
+    * @param malloc_data Память, содержание памяти описано в документации по "Gp.MemTile".
+    */
+    public static void recycle_malloc_data(owned uint8[] malloc_data)
+    {
+      if(malloc_data.length != MemTile.N_BYTES)
+        return;
+
+      pool_mutex.lock();
+      if(pool == null)
+        pool = new PoolBuf[MemTile.POOL_MAX];
+      if(pool_len < MemTile.POOL_MAX)
+        pool[pool_len++].data = (owned)malloc_data;
+      pool_mutex.unlock();
+    }
+
     /**
     * Функция позволяет взять из объекта Gp.MemTile данные, выделенные с помощью GLib.malloc.
     * При этом в объекте не остается указателя на данные.
@@ -141,6 +212,20 @@ namespace Gp
       return true;
     }
 
+    /**
+    * Функция позволяет получить указатель на отрисованные данные плитки (например, в формате ARGB32)
+    * в памяти, выделенной с помощью GLib.malloc.
+    *
+    * @param malloc_data Память, содержание памяти описано в документации по "Gp.MemTile".
+    */
+    [CCode (array_length = false)]
+    public static unowned uint8[] get_buf_from_malloc_data(uint8[] malloc_data)
+      requires(malloc_data.length >= MemTile.N_BYTES)
+    {
+      return malloc_data[sizeof(Gp.Tile) + sizeof(Gp.TileStatus)
+                        :sizeof(Gp.Tile) + sizeof(Gp.TileStatus) + Gp.TILE_DATA_SIZE];
+    }
+
     /**
     * Функция достает из памяти, выделенной с помощью GLib.malloc, описание плитки.
     *
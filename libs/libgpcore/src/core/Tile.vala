@@ -35,6 +35,11 @@ namespace Gp
   */
   public const int TILE_DATA_SIZE = 4 * TILE_SIDE * TILE_SIDE;
 
+  /**
+  * Значение Tile.get_key для плиток, ключ которых нельзя закодировать в 64 бита.
+  */
+  public const uint64 TILE_NO_KEY = uint64.MAX;
+
   /**
   * Делитель для получения условных единиц.
   */
@@ -142,41 +147,105 @@ namespace Gp
     }
 
     /**
-    * Метод получения индекса плитки (что-то вроде MD5-суммы).
+    * Метод получения индекса плитки (хэш-значения).
     *
-    * Предполагается, что индекс соседних плиток, в т.ч. в разных масштабах,
-    * скорее всего будут разными. Поэтому его можно использовать в качестве индекса
-    * кэша GpSmartCache (конечно, не забывая проверять на возможные коллизии).
+    * Индексы соседних плиток, в т.ч. в разных масштабах, скорее всего будут разными,
+    * но совпадения возможны. Поэтому индекс подходит для хэш-таблиц,
+    * а в качестве идентификатора данных в GpSmartCache следует использовать get_key.
     *
     * Индекс генерируется на основе значений координат и масштаба,
     * тип не учитывается.
     *
     * //Функция совместима с GHashFunc.//
     *
-    *  === Детали реализации расчета индекса ===
+    * @return значение индекса плитки (свертка get_key до 32 бит).
+    */
+    public uint get_index()
+    {
+      uint64 key = this.get_key();
+
+      // Плитки вне диапазона get_key хэшируем прямо по полям.
+      if(key == TILE_NO_KEY)
+        return (uint)this.x ^ ((uint)this.y * 0x9E3779B1U) ^ (this.l * 0x85EBCA77U);
+
+      return (uint)(key ^ (key >> 32));
+    }
+
+    /**
+    * Метод получения 64-битного ключа плитки, например, для GpSmartCache.
+    *
+    * Ключ генерируется на основе значений координат и масштаба, тип не учитывается.
+    * Ключ кодирует координаты и размер без потерь только в ограниченном диапазоне:
+    *
+    * * если размер l -- степень двойки (как у плиток, выбираемых GpStapler'ом по масштабу),
+    * координаты x и y должны лежать в диапазоне [-2^27^, 2^27^) (для плитки со стороной 1 см это ±1342 км);
+    *
+    * * для прочих размеров (фиксированные размеры плиток) l должен быть меньше 2^21^ - 1 (около 21 км),
+    * а x и y -- лежать в диапазоне [-2^20^, 2^20^) (для плитки со стороной 100 м это ±104858 км).
     *
-    * * Сначала кладем в младшие (sizeof(uint) / 4) байт index'а младшие (sizeof(uint) / 4) байт x.
+    * В этом диапазоне ключи разных плиток всегда различаются. Для плиток вне диапазона
+    * возвращается TILE_NO_KEY: такие плитки нельзя хранить в GpSmartCache.
     *
-    * * Затем кладем в следующие (sizeof(uint) / 4) байт index'а младшие (sizeof(uint) / 4) байт y.
+    *  === Детали реализации расчета ключа ===
     *
-    * * Затем кладем в оставшиеся (sizeof(uint) / 2) байт index'а xor-сумму младших (sizeof(uint) / 2) байт l и старших (sizeof(uint) / 2) байт l.
+    * Для размеров -- степеней двойки:
     *
-    * ==== Или, к примеру для теоретической 64-битной системы типа ILP64/SILP64: ====
+    * * Младшие 28 бит ключа -- младшие 28 бит x.
     *
-    * * Сначала кладем в младшие 2 байта index'а младшие 2 байта x.
+    * * Следующие 28 бит -- младшие 28 бит y.
     *
-    * * Затем кладем в следующие 2 байта index'а младшие 2 байта y.
+    * * Старшие 8 бит -- log,,2,,(l) (0..31), старший бит ключа равен 0.
     *
-    * * Затем кладем в оставшиеся 4 байта index'а xor-сумму младших 4 байт l и старших 4-х байт l.
+    * Для прочих размеров:
     *
-    * @return значение индекса плитки.
+    * * Младшие 21 бит ключа -- младшие 21 бит x, следующие 21 бит -- младшие 21 бит y.
+    *
+    * * Следующие 21 бит -- l, старший бит ключа равен 1.
+    *
+    * @return значение ключа плитки, либо TILE_NO_KEY.
     */
-    public uint get_index()
+    public uint64 get_key()
+    {
+      if(this.l != 0 && (this.l & (this.l - 1)) == 0)
+      {
+        const int COORD_BITS = 28;
+        const uint64 COORD_MASK = (1 << COORD_BITS) - 1;
+        uint level = 0;
+
+        if(!coord_fits(this.x, COORD_BITS) || !coord_fits(this.y, COORD_BITS))
+          return TILE_NO_KEY;
+
+        while((1U << level) != this.l)
+          level++;
+
+        return
+          ((uint64)this.x & COORD_MASK) |
+          (((uint64)this.y & COORD_MASK) << COORD_BITS) |
+          ((uint64)level << (2 * COORD_BITS));
+      }
+      else
+      {
+        const int COORD_BITS = 21;
+        const uint64 COORD_MASK = (1 << COORD_BITS) - 1;
+
+        // Значение l = 2^21 - 1 при x = y = -1 дало бы TILE_NO_KEY.
+        if(this.l >= COORD_MASK || !coord_fits(this.x, COORD_BITS) || !coord_fits(this.y, COORD_BITS))
+          return TILE_NO_KEY;
+
+        return
+          ((uint64)this.x & COORD_MASK) |
+          (((uint64)this.y & COORD_MASK) << COORD_BITS) |
+          ((uint64)this.l << (2 * COORD_BITS)) |
+          ((uint64)1 << 63);
+      }
+    }
+
+    /**
+    * Проверяет, что координата лежит в диапазоне [-2^(bits - 1), 2^(bits - 1)).
+    */
+    private static bool coord_fits(int coord, int bits)
     {
-      return
-        (uint)((this.x & ((1 << (8 * (sizeof(uint) / 4))) - 1))) +
-        (uint)((this.y & ((1 << (8 * (sizeof(uint) / 4))) - 1)) << (8 * sizeof(uint) / 4)) +
-        (uint)((this.l ^ (this.l >> (8 * sizeof(uint) / 2))) << (8 * sizeof(uint) / 2));
+      return coord >= -(1 << (bits - 1)) && coord < (1 << (bits - 1));
     }
 
     /**
@@ -400,6 +400,161 @@ namespace Gp
   } //< Class.
 
 
+  /**
+   * Функция перевода "сырого" значения uint16 в значение для палитры (см. PaletteLut.for_uint16).
+   * @param raw сырое значение.
+   * @return значение для Palette.get_pixel.
+   */
+  public delegate float PaletteLutValueFunc(uint16 raw);
+
+  /**
+   * Таблица цветов палитры для пакетного перевода массивов значений в ARGB32.
+   *
+   * Вместо вычислений для каждого пикселя (Palette.get_pixel без параметра pixel) --
+   * выборка из заранее вычисленной таблицы.
+   *
+   * Для значений uint16 таблица содержит цвета всех 65536 сырых значений, результат
+   * map_uint16 совпадает с get_pixel(func(raw)) точно.
+   *
+   * Для значений float таблица содержит FLOAT_SIZE цветов на отрезке [d1; d2] палитры,
+   * цвет ячейки -- цвет значения в ее середине. Поэтому map_float квантует значения
+   * с шагом (d2 - d1) / FLOAT_SIZE: значение, отстоящее от границы цветов палитры
+   * меньше чем на половину шага, может получить цвет соседней градации, а у непрерывных
+   * шкал (BRONZE, GRAY, CUSTOM без градаций) цвет может отличаться на одну ступень.
+   * Значения вне отрезка вычисляются через get_pixel. Если нужны точные цвета,
+   * следует установить свойство exact -- тогда map_float вычисляет get_pixel для каждого значения.
+   * Цикл выборки не содержит ветвлений по типу шкалы и векторизуется компилятором
+   * (gather-инструкции при сборке с поддержкой AVX2).
+   *
+   * Таблица строится для конкретной палитры: после изменения палитры нужно построить новую,
+   * проверить это можно методом matches(). Методы map_* thread-safe.
+   */
+  public class PaletteLut : Object
+  {
+    /**
+    * Количество цветов в таблице для значений float.
+    */
+    public const int FLOAT_SIZE = 4096;
+
+    private Palette palette;   //< Палитра, по которой построена таблица.
+    private PaletteType type;
+
+    private uint32[] float_lut;
+    private bool float_valid;  //< false, если отрезок [d1; d2] пуст (все значения через get_pixel).
+    private float float_k;     //< Количество ячеек таблицы на единицу значения.
+
+    private uint32[] uint16_lut = null;
+
+    /**
+    * Вычислять цвета значений float через get_pixel, без таблицы (см. map_float).
+    */
+    public bool exact { get; set; default = false; }
+
+    /**
+     * Построение таблицы для значений float.
+     * @param palette палитра.
+     * @param type тип палитры.
+     */
+    public PaletteLut(Palette palette, PaletteType type)
+    {
+      this.palette = palette;
+      this.type = type;
+
+      this.float_lut = new uint32[FLOAT_SIZE];
+      this.float_valid = (palette.d2 > palette.d1);
+      this.float_k = this.float_valid ? FLOAT_SIZE / (palette.d2 - palette.d1) : 0;
+
+      if(this.float_valid)
+      {
+        Palette plt = palette; //< get_pixel меняет палитру.
+        float step = (palette.d2 - palette.d1) / FLOAT_SIZE;
+
+        // Цвет ячейки -- цвет значения в ее середине.
+        for(int i = 0; i < FLOAT_SIZE; i++)
+          this.float_lut[i] = plt.get_pixel(palette.d1 + (i + 0.5f) * step, type);
+      }
+    }
+
+    /**
+     * Построение таблицы для значений uint16 (и для значений float).
+     * @param palette палитра.
+     * @param type тип палитры.
+     * @param func функция перевода сырого значения в значение для палитры.
+     * @param transparent_zero сырому значению 0 соответствует прозрачный цвет (0).
+     */
+    public PaletteLut.for_uint16(Palette palette, PaletteType type, PaletteLutValueFunc func, bool transparent_zero = false)
+    {
+      this(palette, type);
+
+      Palette plt = palette;
+
+      this.uint16_lut = new uint32[uint16.MAX + 1];
+      for(int raw = 0; raw <= uint16.MAX; raw++)
+        this.uint16_lut[raw] = plt.get_pixel(func((uint16)raw), type);
+
+      if(transparent_zero)
+        this.uint16_lut[0] = 0;
+    }
+
+    /**
+     * Проверяет, что таблица построена для такой палитры.
+     * @param palette палитра.
+     * @param type тип палитры.
+     * @return true, если таблицей можно пользоваться вместо палитры.
+     */
+    public bool matches(Palette palette, PaletteType type)
+    {
+      return this.type == type &&
+        this.palette.d1 == palette.d1 && this.palette.d2 == palette.d2 &&
+        this.palette.c1 == palette.c1 && this.palette.c2 == palette.c2 &&
+        this.palette.br == palette.br && this.palette.n == palette.n &&
+        this.palette.cur_scale == palette.cur_scale;
+    }
+
+    /**
+     * Переводит массив значений float в цвета ARGB32.
+     * Без свойства exact цвета берутся из таблицы с точностью до ее ячейки (см. описание класса).
+     * @param vals значения.
+     * @param argb массив для цветов (не меньше count элементов).
+     * @param count количество значений.
+     */
+    public void map_float([CCode (array_length = false)] float[] vals,
+                          [CCode (array_length = false)] uint32[] argb, int count)
+    {
+      Palette plt = this.palette;
+      float d1 = this.palette.d1;
+      bool use_lut = this.float_valid && !this.exact;
+
+      for(int i = 0; i < count; i++)
+      {
+        float pos = (vals[i] - d1) * this.float_k;
+
+        if(likely(use_lut && pos >= 0 && pos < FLOAT_SIZE))
+          argb[i] = this.float_lut[(int)pos];
+        else
+          argb[i] = plt.get_pixel(vals[i], this.type);
+      }
+    }
+
+    /**
+     * Переводит массив сырых значений uint16 в цвета ARGB32.
+     * Таблица должна быть построена конструктором for_uint16.
+     * @param vals сырые значения.
+     * @param argb массив для цветов (не меньше count элементов).
+     * @param count количество значений.
+     */
+    public void map_uint16([CCode (array_length = false)] uint16[] vals,
+                           [CCode (array_length = false)] uint32[] argb, int count)
+      requires(this.uint16_lut != null)
+    {
+      unowned uint32[] lut = this.uint16_lut;
+
+      for(int i = 0; i < count; i++)
+        argb[i] = lut[vals[i]];
+    }
+  }
+
+
   public class PaletteBox : Gp.Barista, Gp.Prefable
   {
     public PaletteType type = PaletteType.ADVANCED;// { public get; private set; }
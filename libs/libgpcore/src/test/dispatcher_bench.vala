@@ -0,0 +1,146 @@
+// Сравнение пропускной способности DispatcherThreadPool и DispatcherWorkStealing.
+// См. --help.
+
+#if VALA_0_18
+// Задание с небольшой вычислительной нагрузкой; задание с depth > 0 порождает два дочерних задания.
+class BenchWorker : Object, Gp.Worker
+{
+  public static int remaining;
+  public static Mutex mutex;
+  public static Cond cond;
+  public static uint64 sink;
+
+  private Gp.Dispatcher dispatcher;
+  private int depth;
+  private int work;
+  private int priority;
+
+  public BenchWorker(Gp.Dispatcher dispatcher, int depth, int work, int priority)
+  {
+    this.dispatcher = dispatcher;
+    this.depth = depth;
+    this.work = work;
+    this.priority = priority;
+  }
+
+  public int get_priority()
+  {
+    return this.priority;
+  }
+
+  public void run()
+  {
+    if(this.depth > 0)
+    {
+      try
+      {
+        this.dispatcher.add(new BenchWorker(this.dispatcher, this.depth - 1, this.work, this.priority - 1));
+        this.dispatcher.add(new BenchWorker(this.dispatcher, this.depth - 1, this.work, this.priority - 1));
+      }
+      catch(ThreadError e)
+      {
+        error("ThreadError: %s", e.message);
+      }
+    }
+
+    uint64 x = (uint64)this.priority;
+    for(int i = 0; i < this.work; i++)
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    sink += x;
+
+    if(AtomicInt.dec_and_test(ref remaining))
+    {
+      mutex.lock();
+        cond.signal();
+      mutex.unlock();
+    }
+  }
+}
+#endif
+
+public class Main : Object
+{
+#if VALA_0_18
+  private static int threads_num = 0;
+  private static int tasks_num = 100000;
+  private static int depth = 10;
+  private static int work = 1000;
+
+  private const GLib.OptionEntry[] options =
+  {
+    { "threads-num", 'n', 0, OptionArg.INT, ref threads_num, "Number of threads (0 -- number of processors)", null },
+    { "tasks-num", 't', 0, OptionArg.INT, ref tasks_num, "Number of independent tasks", null },
+    { "depth", 'd', 0, OptionArg.INT, ref depth, "Depth of task trees spawned from worker threads", null },
+    { "work", 'k', 0, OptionArg.INT, ref work, "Iterations of work per task", null },
+    { null }
+  };
+
+  // Выполняет roots корневых заданий, каждое из которых порождает дерево заданий глубины tree_depth.
+  // Возвращает количество выполненных заданий в секунду.
+  private static double bench(Gp.Dispatcher dispatcher, int roots, int tree_depth) throws ThreadError
+  {
+    int total = roots * ((1 << (tree_depth + 1)) - 1);
+
+    AtomicInt.set(ref BenchWorker.remaining, total);
+    var timer = new Timer();
+
+    for(int i = 0; i < roots; i++)
+      dispatcher.add(new BenchWorker(dispatcher, tree_depth, work, GLib.Priority.DEFAULT + i % 64));
+
+    BenchWorker.mutex.lock();
+      while(AtomicInt.get(ref BenchWorker.remaining) > 0)
+        BenchWorker.cond.wait(BenchWorker.mutex);
+    BenchWorker.mutex.unlock();
+
+    return total / timer.elapsed();
+  }
+#endif
+
+  public static int main(string[] args)
+  {
+#if VALA_0_18
+    try
+    {
+      var opt_context = new OptionContext("- Dispatcher benchmark");
+      opt_context.set_help_enabled(true);
+      opt_context.add_main_entries(options, null);
+      opt_context.parse(ref args);
+    }
+    catch(OptionError e)
+    {
+      warning("error: %s\n", e.message);
+      warning("Run '%s --help' to see a full list of available command line options.\n", args[0]);
+      return -1;
+    }
+
+    if(threads_num <= 0)
+      threads_num = (int)get_num_processors();
+
+    BenchWorker.mutex = Mutex();
+    BenchWorker.cond = Cond();
+
+    try
+    {
+      var pool = new Gp.DispatcherThreadPool(threads_num, true);
+      var stealing = new Gp.DispatcherWorkStealing(threads_num);
+
+      stdout.printf("threads: %d, work: %d\n", threads_num, work);
+
+      stdout.printf("independent tasks (%d):\n", tasks_num);
+      stdout.printf("  DispatcherThreadPool:   %12.0f tasks/s\n", bench(pool, tasks_num, 0));
+      stdout.printf("  DispatcherWorkStealing: %12.0f tasks/s\n", bench(stealing, tasks_num, 0));
+
+      int roots = int.max(1, tasks_num >> (depth + 1));
+      stdout.printf("task trees (%d x depth %d):\n", roots, depth);
+      stdout.printf("  DispatcherThreadPool:   %12.0f tasks/s\n", bench(pool, roots, depth));
+      stdout.printf("  DispatcherWorkStealing: %12.0f tasks/s\n", bench(stealing, roots, depth));
+    }
+    catch(ThreadError e)
+    {
+      stdout.printf("ThreadError: %s\n", e.message);
+      return -1;
+    }
+#endif
+    return 0;
+  }
+}
@@ -1,5 +1,5 @@
 
-// Тест DispatcherLoop и DispatcherThreadPool.
+// Тест DispatcherLoop, DispatcherThreadPool и DispatcherWorkStealing.
 // См. --help.
 
 #if VALA_0_18
@@ -24,17 +24,127 @@ class WorkerExample : Object, Gp.Worker
     }
   }
 }
+
+// Задание с приоритетом, записывающее свой приоритет в общий журнал.
+class PriorityWorker : Object, Gp.Worker
+{
+  public static Mutex mutex;
+  public static Cond cond;
+  public static bool gate_open;
+  public static bool gate_busy;
+  public static int[] log;
+
+  public int priority { private set; get; }
+  public bool gate { private set; get; }
+
+  public PriorityWorker(int priority, bool gate = false)
+  {
+    this.priority = priority;
+    this.gate = gate;
+  }
+
+  public int get_priority()
+  {
+    return this.priority;
+  }
+
+  public void run()
+  {
+    mutex.lock();
+      // Задание-"шлагбаум" занимает поток, пока в очередь добавляются остальные задания.
+      if(this.gate)
+      {
+        gate_busy = true;
+        cond.broadcast();
+      }
+
+      while(this.gate && !gate_open)
+        cond.wait(mutex);
+
+      if(!this.gate)
+        log += this.priority;
+    mutex.unlock();
+  }
+}
+
+// Проверка порядка выполнения заданий однопоточного dispatcher: по приоритету,
+// при равных приоритетах -- в порядке добавления.
+// Если задан filter, то до начала выполнения отобранные им задания удаляются из очереди,
+// если задан group (только для DispatcherWorkStealing) -- задания с приоритетом >= 200 добавляются
+// в группу, которая затем отменяется.
+bool check_priorities(Gp.Dispatcher dispatcher, int[] expected,
+  Gp.WorkerFilterFunc? filter = null, bool group = false) throws ThreadError
+{
+  int[] priorities = { 300, 0, 200, -100, 0, 100, 300, 200 };
+
+  PriorityWorker.mutex = Mutex();
+  PriorityWorker.cond = Cond();
+  PriorityWorker.gate_open = false;
+  PriorityWorker.gate_busy = false;
+  PriorityWorker.log = new int[0];
+
+  dispatcher.add(new PriorityWorker(0, true));
+
+  // Ждем, пока поток диспетчера займется "шлагбаумом".
+  PriorityWorker.mutex.lock();
+    while(!PriorityWorker.gate_busy)
+      PriorityWorker.cond.wait(PriorityWorker.mutex);
+  PriorityWorker.mutex.unlock();
+
+  var stealing = dispatcher as Gp.DispatcherWorkStealing;
+  uint group_id = group ? stealing.new_group() : 0;
+
+  foreach(int priority in priorities)
+    if(group && priority >= 200)
+      stealing.add_to_group(new PriorityWorker(priority), group_id);
+    else
+      dispatcher.add(new PriorityWorker(priority));
+
+  if(filter != null && (int)dispatcher.remove_queued(filter) != priorities.length - expected.length)
+    return false;
+
+  if(group && (int)stealing.cancel_group(group_id) != priorities.length - expected.length)
+    return false;
+
+  PriorityWorker.mutex.lock();
+    PriorityWorker.gate_open = true;
+    PriorityWorker.cond.broadcast();
+  PriorityWorker.mutex.unlock();
+
+  for(int i = 0; i < 1000; i++)
+  {
+    PriorityWorker.mutex.lock();
+      bool done = (PriorityWorker.log.length == expected.length);
+    PriorityWorker.mutex.unlock();
+
+    if(done)
+      break;
+
+    Thread.usleep(1000);
+  }
+
+  if(PriorityWorker.log.length != expected.length)
+    return false;
+
+  for(int i = 0; i < expected.length; i++)
+    if(PriorityWorker.log[i] != expected[i])
+      return false;
+
+  return true;
+}
 #endif
 
 public class Main : Object
 {
 #if VALA_0_18
   private static int threads_num = 0;
+  private static bool work_stealing = false;
   private static Gp.Dispatcher dispatcher;
 
   private const GLib.OptionEntry[] options =
   {
     { "threads-num", 'n', 0, OptionArg.INT, ref threads_num, "Number of threads", null },
+    { "work-stealing", 'w', 0, OptionArg.NONE, ref work_stealing, "Use DispatcherWorkStealing", null },
     { null }
   };
 
@@ -60,6 +170,8 @@ public class Main : Object
     {
       if(threads_num == 0)
         dispatcher = new Gp.DispatcherLoop();
+      else if(work_stealing)
+        dispatcher = new Gp.DispatcherWorkStealing(threads_num);
       else
         dispatcher = new Gp.DispatcherThreadPool(threads_num, false);
 
@@ -75,6 +187,46 @@ public class Main : Object
       return -1;
     }
 
+    try
+    {
+      if(!check_priorities(new Gp.DispatcherThreadPool(1, false), { -100, 0, 0, 100, 200, 200, 300, 300 }))
+      {
+        stdout.printf("DispatcherThreadPool: wrong order of prioritized tasks\n");
+        return -1;
+      }
+
+      if(!check_priorities(new Gp.DispatcherThreadPool(1, false), { -100, 0, 0, 100 },
+        (worker) => { return (worker as PriorityWorker).priority >= 200; }))
+      {
+        stdout.printf("DispatcherThreadPool: wrong removal of queued tasks\n");
+        return -1;
+      }
+
+      if(!check_priorities(new Gp.DispatcherWorkStealing(1), { -100, 0, 0, 100, 200, 200, 300, 300 }))
+      {
+        stdout.printf("DispatcherWorkStealing: wrong order of prioritized tasks\n");
+        return -1;
+      }
+
+      if(!check_priorities(new Gp.DispatcherWorkStealing(1), { -100, 0, 0, 100 },
+        (worker) => { return (worker as PriorityWorker).priority >= 200; }))
+      {
+        stdout.printf("DispatcherWorkStealing: wrong removal of queued tasks\n");
+        return -1;
+      }
+
+      if(!check_priorities(new Gp.DispatcherWorkStealing(1), { -100, 0, 0, 100 }, null, true))
+      {
+        stdout.printf("DispatcherWorkStealing: wrong cancellation of task group\n");
+        return -1;
+      }
+    }
+    catch(ThreadError e)
+    {
+      stdout.printf("ThreadError: %s\n", e.message);
+      return -1;
+    }
+
     int main_x_times = 12;
     for(int i = 0; i < main_x_times ; i++)
     {
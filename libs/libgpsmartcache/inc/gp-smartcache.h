@@ -31,29 +31,54 @@
  * \defgroup gpsmartcache gpsmartcache - Библиотека кэширования данных
  *
  * Библиотека gpsmartcache предназначена для кеширования данных.
- * Доступ к данным осуществляется по двум идентификаторам ( номеру группы и номеру данных ), что
+ * Доступ к данным осуществляется по двум идентификаторам ( номеру группы и 64-битному номеру данных ), что
  * позволяет очищать данные одной указанной группы. Для упрощения генерации уникальных номеров групп имеются
  * вызовы #gp_smart_cache_reg_group и #gp_smart_cache_unreg_group.
  * Кэш хранит указатель на данные и их размер. При необходимости кэш удаляет
  * хранимые данные вызовом g_free.
- * Данные хранятся в отсортированном по идентификатору массиве. Для удаления устаревших
- * данных при нехватке места в кэше имеется двунаправленный связный список
- * идентификаторов, отсортированный по времени обращения к данным.
- *
- * Библиотека обеспечивает многопоточную работу.
+ * Данные распределены по нескольким независимым сегментам, каждый из которых
+ * защищен своим мьютексом и хранит записи в хэш-таблице с открытой адресацией,
+ * поэтому сохранение, поиск и удаление данных выполняются за постоянное время.
+ * Для удаления устаревших данных при нехватке места в кэше каждый сегмент
+ * ведет списки записей, связанные через поля самих записей; порядок вытеснения
+ * определяется политикой (#GpSmartCachePolicy), задаваемой при создании кэша.
+ * Из всех сегментов первыми вытесняются кандидаты, к которым дольше всего
+ * не было обращений.
+ * Если включен сжатый уровень кэша (#gp_smart_cache_set_compressed_size), вытесняемые
+ * данные, которые хорошо сжимаются, не удаляются, а хранятся в сжатом виде
+ * и распаковываются при следующем обращении к ним.
+ * Если включен дисковый уровень кэша (#gp_smart_cache_set_disk_file), вытесняемые данные
+ * сохраняются в файл и загружаются из него при промахе, в том числе после перезапуска приложения.
+ * Дисковый уровень используется только для постоянных групп (#gp_smart_cache_reg_persistent_group),
+ * номера которых не меняются между запусками.
+ *
+ * Группы конкурируют за общий объем кэша. Чтобы одна группа с большим объемом данных
+ * не вытесняла данные остальных, для группы можно задать ограничения объема и вес
+ * (#gp_smart_cache_set_group_quota).
+ *
+ * Библиотека обеспечивает многопоточную работу: потоки, обращающиеся к данным
+ * из разных сегментов, не блокируют друг друга.
  *
  * Основные функции библиотеки:
  *
  * - #gp_smart_cache_new - создать объект GpSmartCache
+ * - #gp_smart_cache_new_with_policy - создать объект GpSmartCache с указанной политикой вытеснения
  * - #gp_smart_cache_set_size - установить размер кэша
  * - #gp_smart_cache_get_size - узнать размер кэша
  * - #gp_smart_cache_get_free - узнать размер свободного места
+ * - #gp_smart_cache_set_compressed_size - включить сжатый уровень кэша
+ * - #gp_smart_cache_set_disk_file - включить дисковый уровень кэша
+ * - #gp_smart_cache_set_group_stamp - задать поколение данных группы на диске
  * - #gp_smart_cache_reg_group - получить уникальный идентификатор группы
+ * - #gp_smart_cache_reg_persistent_group - зарегистрировать постоянный идентификатор группы
  * - #gp_smart_cache_unreg_group - освободить идентификатор группы
+ * - #gp_smart_cache_reg_group_full, #gp_smart_cache_set_group_quota - ограничить объем данных группы
  * - #gp_smart_cache_set - сохранить данные
  * - #gp_smart_cache_get - считать данные
+ * - #gp_smart_cache_acquire, #gp_smart_cache_release - получить доступ к данным без копирования
  * - #gp_smart_cache_clean - очистить все данные указанной группы
  * - #gp_smart_cache_clean_by_condition - очистить данные, удовлетворяющие условию
+ * - #gp_smart_cache_get_stats, #gp_smart_cache_get_group_stats - получить статистику работы кэша
  *
  * \name Основные функции библиотеки.
  *
@@ -69,6 +94,86 @@
 
 G_BEGIN_DECLS
 
+/**
+ * GP_SMART_CACHE_PERSISTENT_GROUP_MIN:
+ *
+ * Наименьший номер постоянной группы (#gp_smart_cache_reg_persistent_group).
+ * Номера, которые выдает #gp_smart_cache_reg_group, всегда меньше.
+ */
+#define GP_SMART_CACHE_PERSISTENT_GROUP_MIN 0x80000000u
+
+/**
+ * GpSmartCachePolicy:
+ * @GP_SMART_CACHE_POLICY_LRU: вытесняются данные, к которым дольше всего не было обращений;
+ * @GP_SMART_CACHE_POLICY_CLOCK: приближение LRU ("второй шанс"): обращение к данным
+ *   только устанавливает бит, записи не перемещаются;
+ * @GP_SMART_CACHE_POLICY_SLRU: сегментированный LRU: данные, к которым обращались повторно,
+ *   переходят в защищенный сегмент и не вытесняются однократным просмотром большого объема данных;
+ * @GP_SMART_CACHE_POLICY_ARC: адаптивный кэш (ARC): баланс между недавно и часто используемыми
+ *   данными подстраивается по истории вытесненных записей.
+ *
+ * Политика вытеснения данных из кэша.
+ */
+typedef enum
+{
+   GP_SMART_CACHE_POLICY_LRU,
+   GP_SMART_CACHE_POLICY_CLOCK,
+   GP_SMART_CACHE_POLICY_SLRU,
+   GP_SMART_CACHE_POLICY_ARC
+} GpSmartCachePolicy;
+
+/**
+ * GpSmartCacheStats:
+ * @hits: количество успешных обращений к данным (#gp_smart_cache_get, #gp_smart_cache_acquire);
+ * @misses: количество обращений к отсутствующим в кэше данным;
+ * @inserts: количество сохранений данных (#gp_smart_cache_set);
+ * @evictions: количество записей, вытесненных из-за нехватки места;
+ * @bytes_evicted: объем вытесненных данных, байт;
+ * @lock_contended: количество обращений, ожидавших освобождения мьютекса (только для кэша в целом);
+ * @lock_wait: суммарное время ожидания мьютексов, секунд (только для кэша в целом);
+ * @records: количество хранимых записей;
+ * @bytes: объем хранимых данных, байт;
+ * @avg_age: средний возраст хранимых записей (время с момента сохранения данных), секунд;
+ * @avg_evicted_age: среднее время хранения вытесненных записей, секунд;
+ * @compressions: количество записей, перенесенных в сжатый уровень вместо вытеснения;
+ * @decompressions: количество записей, возвращенных из сжатого уровня при обращении к ним;
+ * @compressed_evictions: количество записей, вытесненных из сжатого уровня;
+ * @compressed_records: количество записей в сжатом уровне (не входят в @records);
+ * @compressed_bytes: объем сжатых данных, байт;
+ * @disk_stores: количество записей, сохраненных в дисковый уровень;
+ * @disk_loads: количество записей, загруженных из дискового уровня;
+ * @disk_records: количество записей в дисковом уровне (только для кэша в целом);
+ * @disk_bytes: объем данных в дисковом уровне, байт (только для кэша в целом).
+ *
+ * Снимок статистики работы кэша, см. #gp_smart_cache_get_stats и #gp_smart_cache_get_group_stats.
+ */
+typedef struct _GpSmartCacheStats
+{
+   guint64 hits;
+   guint64 misses;
+   guint64 inserts;
+   guint64 evictions;
+   guint64 bytes_evicted;
+   guint64 lock_contended;
+   gdouble lock_wait;
+   guint records;
+   guint64 bytes;
+   gdouble avg_age;
+   gdouble avg_evicted_age;
+   guint64 compressions;
+   guint64 decompressions;
+   guint64 compressed_evictions;
+   guint compressed_records;
+   guint64 compressed_bytes;
+   guint64 disk_stores;
+   guint64 disk_loads;
+   guint disk_records;
+   guint64 disk_bytes;
+} GpSmartCacheStats;
+
+#define GP_SMART_CACHE_TYPE_POLICY           gp_smart_cache_policy_get_type()
+GType gp_smart_cache_policy_get_type (void);
+
 // Описание класса.
 #define GP_SMART_CACHE_TYPE                  gp_smart_cache_get_type()
 #define GP_SMART_CACHE( obj )                ( G_TYPE_CHECK_INSTANCE_CAST ( ( obj ), GP_SMART_CACHE_TYPE, GpSmartCache ) )
@@ -109,6 +214,27 @@ static const gsize GP_SMART_CACHE_FREE_K = 10;
 */
 GpSmartCache *gp_smart_cache_new ();
 
+/**
+ * gp_smart_cache_new_with_policy:
+ * @policy: политика вытеснения данных.
+ *
+ * Создание объекта #GpSmartCache с указанной политикой вытеснения данных.
+ * Вызов #gp_smart_cache_new создает кэш с политикой #GP_SMART_CACHE_POLICY_LRU.
+ *
+ * Returns: Новый объект #GpSmartCache.
+*/
+GpSmartCache *gp_smart_cache_new_with_policy (GpSmartCachePolicy policy);
+
+/**
+ * gp_smart_cache_get_policy:
+ * @self: Объект #GpSmartCache.
+ *
+ * Функция вернет политику вытеснения данных кэша.
+ *
+ * Returns: Политика вытеснения данных.
+ */
+GpSmartCachePolicy gp_smart_cache_get_policy (GpSmartCache *self);
+
 /**
  * gp_smart_cache_set_size:
  * @self: указатель на объект.
@@ -139,6 +265,86 @@ gsize gp_smart_cache_get_size (GpSmartCache *self);
  */
 gsize gp_smart_cache_get_free (GpSmartCache *self);
 
+/**
+ * gp_smart_cache_set_compressed_size:
+ * @self: Объект #GpSmartCache.
+ * @size: размер сжатого уровня, байт (0 -- сжатый уровень отключен).
+ *
+ * Функция устанавливает объем сжатого уровня кэша.
+ *
+ * Данные, вытесняемые из кэша, сжимаются и переносятся в сжатый уровень,
+ * если сжатие уменьшает их размер хотя бы вдвое (например, плитки с однотонными областями).
+ * При обращении к таким данным они распаковываются и возвращаются в кэш.
+ * Объем сжатого уровня не входит в размер кэша (#gp_smart_cache_set_size) и
+ * делится поровну между сегментами кэша. По умолчанию сжатый уровень отключен.
+ * Содержимое сжатого уровня очищается.
+ */
+void gp_smart_cache_set_compressed_size (GpSmartCache *self, gsize size);
+
+/**
+ * gp_smart_cache_get_compressed_size:
+ * @self: Объект #GpSmartCache.
+ *
+ * Функция вернет объем сжатого уровня кэша.
+ *
+ * Returns: Объем сжатого уровня, байт.
+ */
+gsize gp_smart_cache_get_compressed_size (GpSmartCache *self);
+
+/**
+ * gp_smart_cache_set_disk_file:
+ * @self: Объект #GpSmartCache.
+ * @filename: (allow-none): Имя файла дискового уровня или NULL, чтобы отключить дисковый уровень.
+ * @size: Размер файла, байт.
+ *
+ * Функция включает дисковый уровень кэша.
+ *
+ * Данные, вытесняемые из кэша, сохраняются в файл, отображенный в память.
+ * При обращении к отсутствующим в памяти данным они загружаются из файла.
+ * Когда файл заполняется, самые старые данные в нем перезаписываются.
+ * Если файл уже содержит данные (например, от предыдущего запуска приложения),
+ * они становятся доступны ("теплый" старт).
+ *
+ * Файл размечается на слябы, число которых определяется размером @size. Если файл записан
+ * с другим размером (или другой версией библиотеки) либо не является файлом кэша,
+ * он размечается заново и все его данные теряются; об этом сообщается в журнал (g_message
+ * или g_warning). Поэтому для "теплого" старта размер файла не должен меняться между запусками.
+ *
+ * Данные на диске переживают перезапуск, поэтому на диск сохраняются и загружаются с него
+ * только данные постоянных групп (#gp_smart_cache_reg_persistent_group): номера групп
+ * #gp_smart_cache_reg_group в другом запуске могут принадлежать другим данным.
+ * Актуальность данных группы подтверждается ее поколением (#gp_smart_cache_set_group_stamp).
+ *
+ * Returns: TRUE, если файл удалось открыть.
+ */
+gboolean gp_smart_cache_set_disk_file (GpSmartCache *self, const gchar *filename, gsize size);
+
+/**
+ * gp_smart_cache_set_group_stamp:
+ * @self: Объект #GpSmartCache.
+ * @group: Идентификатор группы.
+ * @stamp: Поколение данных группы.
+ *
+ * Функция задает поколение данных группы в дисковом уровне кэша.
+ *
+ * Данные группы сохраняются на диск с текущим поколением, а данные другого поколения
+ * из дискового уровня никогда не выдаются и удаляются при вызове функции.
+ * Если поколение изменилось, данные группы в памяти тоже удаляются.
+ * В качестве поколения можно использовать, например, время изменения источника данных группы.
+ * По умолчанию поколение группы равно 0.
+ */
+void gp_smart_cache_set_group_stamp (GpSmartCache *self, guint group, guint64 stamp);
+
+/**
+ * gp_smart_cache_sync_disk:
+ * @self: Объект #GpSmartCache.
+ *
+ * Функция сохраняет в дисковый уровень данные, которых в нем еще нет, и сбрасывает файл на диск.
+ * Вызывается, например, перед завершением приложения, чтобы при следующем запуске
+ * были доступны все данные кэша.
+ */
+void gp_smart_cache_sync_disk (GpSmartCache *self);
+
 /**
  * gp_smart_cache_reg_group:
  * @self: Объект #GpSmartCache.
@@ -149,10 +355,41 @@ gsize gp_smart_cache_get_free (GpSmartCache *self);
  * для хранения данных в кэше. Если группа не используется, необходимо вызвать
  * #gp_smart_cache_unreg_group для освобождения данного номера.
  *
+ * Номер группы меньше #GP_SMART_CACHE_PERSISTENT_GROUP_MIN и от запуска к запуску может меняться,
+ * поэтому данные такой группы не сохраняются в дисковый уровень кэша.
+ *
  * Returns: Новый уникальный номер группы.
  */
 guint gp_smart_cache_reg_group (GpSmartCache *self);
 
+/**
+ * gp_smart_cache_reg_persistent_group:
+ * @self: Объект #GpSmartCache.
+ * @group: Постоянный идентификатор группы, не меньше #GP_SMART_CACHE_PERSISTENT_GROUP_MIN.
+ *
+ * Функция регистрирует заданный идентификатор группы, данные которой хранятся
+ * в дисковом уровне кэша (#gp_smart_cache_set_disk_file).
+ *
+ * Идентификатор должен обозначать одни и те же данные во всех запусках приложения,
+ * его можно получить из имени источника данных функцией #gp_smart_cache_persistent_group_id.
+ * Группа освобождается вызовом #gp_smart_cache_unreg_group.
+ *
+ * Returns: TRUE, если идентификатор зарегистрирован, FALSE, если он вне диапазона постоянных групп или уже занят.
+ */
+gboolean gp_smart_cache_reg_persistent_group (GpSmartCache *self, guint group);
+
+/**
+ * gp_smart_cache_persistent_group_id:
+ * @name: Имя источника данных группы.
+ *
+ * Функция вычисляет постоянный идентификатор группы по имени: для одного имени
+ * результат одинаков во всех запусках. Разные имена могут дать один идентификатор,
+ * тогда #gp_smart_cache_reg_persistent_group для второго из них вернет FALSE.
+ *
+ * Returns: Идентификатор для #gp_smart_cache_reg_persistent_group.
+ */
+guint gp_smart_cache_persistent_group_id (const gchar *name);
+
 /**
  * gp_smart_cache_unreg_group:
  * @self: Объект #GpSmartCache.
@@ -165,6 +402,76 @@ guint gp_smart_cache_reg_group (GpSmartCache *self);
  */
 void gp_smart_cache_unreg_group (GpSmartCache *self, guint group);
 
+/**
+ * gp_smart_cache_reg_group_full:
+ * @self: Объект #GpSmartCache.
+ * @soft_quota: Мягкое ограничение объема данных группы, байт (0 -- без ограничения).
+ * @hard_quota: Жесткое ограничение объема данных группы, байт (0 -- без ограничения).
+ * @weight: Вес группы при вытеснении (1 -- обычный).
+ *
+ * Функция генерирует уникальный идентификатор группы, как #gp_smart_cache_reg_group,
+ * и задает ограничения группы, как #gp_smart_cache_set_group_quota.
+ *
+ * Returns: Новый уникальный номер группы.
+ */
+guint gp_smart_cache_reg_group_full (GpSmartCache *self, gsize soft_quota, gsize hard_quota, guint weight);
+
+/**
+ * gp_smart_cache_set_group_quota:
+ * @self: Объект #GpSmartCache.
+ * @group: Идентификатор группы.
+ * @soft_quota: Мягкое ограничение объема данных группы, байт (0 -- без ограничения).
+ * @hard_quota: Жесткое ограничение объема данных группы, байт (0 -- без ограничения).
+ * @weight: Вес группы при вытеснении (1 -- обычный, не больше 16).
+ *
+ * Функция задает ограничения объема данных группы и ее вес при вытеснении.
+ *
+ * Пока группа превышает мягкое ограничение, при нехватке места в кэше ее данные
+ * вытесняются раньше данных остальных групп.
+ * Жесткое ограничение группа не превышает: при сохранении данных вытесняются
+ * ее собственные давно использованные данные (а данные больше ограничения не сохраняются).
+ * Запись группы с весом weight избегает вытеснения weight - 1 раз, то есть хранится дольше
+ * записей групп с меньшим весом, к которым обращались так же давно.
+ *
+ * Данные распределены по сегментам кэша, поэтому ограничения соблюдаются в каждом сегменте
+ * для его доли объема и для кэша в целом выполняются приближенно.
+ * Ограничения можно изменять в любой момент, #gp_smart_cache_unreg_group их снимает.
+ */
+void gp_smart_cache_set_group_quota (GpSmartCache *self, guint group, gsize soft_quota, gsize hard_quota,
+                                     guint weight);
+
+/**
+ * GpSmartCacheRecycleFunc:
+ * @data: (transfer full) (element-type guint8) (array length=size): Освобождаемые данные.
+ * @size: Размер данных.
+ * @user_data: Указатель на пользовательские данные.
+ *
+ * Тип функции, которой кэш передает данные группы вместо их освобождения,
+ * например, чтобы использовать память повторно. Функция должна сама освободить данные или сохранить их.
+ *
+ * Функция вызывается под внутренними мьютексами кэша и не должна обращаться к кэшу.
+ */
+typedef void (*GpSmartCacheRecycleFunc)(gpointer data, guint size, gpointer user_data);
+
+/**
+ * gp_smart_cache_set_group_recycle_func:
+ * @self: Объект #GpSmartCache.
+ * @group: Идентификатор группы.
+ * @func: (scope notified) (closure user_data) (allow-none): Функция повторного использования данных, либо NULL.
+ * @user_data: Указатель на пользовательские данные для @func.
+ * @destroy: (allow-none): Функция освобождения @user_data.
+ *
+ * Функция задает функцию, которой передаются вытесненные и удаленные данные группы
+ * вместо их освобождения с помощью g_free. Это позволяет, к примеру, собирать буферы
+ * одинакового размера в пул и использовать их для новых данных без выделения памяти.
+ * Сжатые копии данных (см. #gp_smart_cache_set_compressed_size) освобождаются как обычно.
+ *
+ * Если @func равна NULL, данные группы снова освобождаются с помощью g_free.
+ * #gp_smart_cache_unreg_group снимает функцию группы.
+ */
+void gp_smart_cache_set_group_recycle_func (GpSmartCache *self, guint group, GpSmartCacheRecycleFunc func,
+                                            gpointer user_data, GDestroyNotify destroy);
+
 /**
  * gp_smart_cache_set:
  * @self: Объект #GpSmartCache.
@@ -177,7 +484,7 @@ void gp_smart_cache_unreg_group (GpSmartCache *self, guint group);
  * После передачи данных кэшу он может при необходимости освободить выделенную под
  * них память вызовом g_free.
  */
-void gp_smart_cache_set (GpSmartCache *self, guint group, guint index, gpointer data, guint size);
+void gp_smart_cache_set (GpSmartCache *self, guint group, guint64 index, gpointer data, guint size);
 
 /**
  * gp_smart_cache_set_unowned:
@@ -193,7 +500,7 @@ void gp_smart_cache_set (GpSmartCache *self, guint group, guint index, gpointer
  * по указателю data с помощью g_free.
  * Вместо этого GpSmartCache самостоятельно выделит под данные память внутри себя.
  */
-void gp_smart_cache_set_unowned(GpSmartCache *self, guint group, guint index, gpointer data, guint size);
+void gp_smart_cache_set_unowned(GpSmartCache *self, guint group, guint64 index, gpointer data, guint size);
 
 /**
  * gp_smart_cache_get:
@@ -212,7 +519,7 @@ void gp_smart_cache_set_unowned(GpSmartCache *self, guint group, guint index, gp
  * Returns: TRUE - если данные есть в кэше, иначе FALSE.
  *
  */
-gboolean gp_smart_cache_get(GpSmartCache *self, guint group, guint index, guint *size, gpointer buff, guint buff_size);
+gboolean gp_smart_cache_get(GpSmartCache *self, guint group, guint64 index, guint *size, gpointer buff, guint buff_size);
 
 /**
  * gp_smart_cache_get2:
@@ -242,9 +549,80 @@ gboolean gp_smart_cache_get(GpSmartCache *self, guint group, guint index, guint
  * Returns: TRUE - если данные есть в кэше, иначе FALSE.
  *
  */
-gboolean gp_smart_cache_get2 (GpSmartCache *self, guint group, guint index, guint *size, gpointer buff1,
+gboolean gp_smart_cache_get2 (GpSmartCache *self, guint group, guint64 index, guint *size, gpointer buff1,
                               guint buff1_size, gpointer buff2, guint buff2_size);
 
+/**
+ * gp_smart_cache_acquire:
+ * @self: Объект #GpSmartCache.
+ * @group: Идентификатор группы.
+ * @index: Идентификатор данных.
+ * @size: (out): Переменная для сохранения размера данных, хранимых в кэше.
+ *
+ * Функция получает доступ к данным кэша без копирования.
+ * Если данные нашлись, вернет указатель на них прямо в памяти кэша,
+ * а в переменную size запишет их размер.
+ *
+ * До вызова #gp_smart_cache_release данные не вытесняются из кэша и не освобождаются,
+ * даже если их заменят вызовом #gp_smart_cache_set или удалят вызовом #gp_smart_cache_clean
+ * (в этом случае данные освобождаются при последнем #gp_smart_cache_release).
+ * Данные можно только читать. Изменять их может лишь #gp_smart_cache_modify.
+ * Каждому успешному вызову #gp_smart_cache_acquire должен соответствовать вызов #gp_smart_cache_release.
+ *
+ * Returns: (transfer none) (nullable) (array length=size) (element-type guint8): Указатель на данные
+ * в кэше, или NULL, если данных нет.
+ */
+const guint8 *gp_smart_cache_acquire (GpSmartCache *self, guint group, guint64 index, guint *size);
+
+/**
+ * gp_smart_cache_release:
+ * @self: Объект #GpSmartCache.
+ * @group: Идентификатор группы.
+ * @index: Идентификатор данных.
+ * @data: Указатель на данные, полученный от #gp_smart_cache_acquire.
+ *
+ * Функция завершает доступ к данным, полученный вызовом #gp_smart_cache_acquire.
+ * После вызова указатель data использовать нельзя.
+ */
+void gp_smart_cache_release (GpSmartCache *self, guint group, guint64 index, gconstpointer data);
+
+/**
+ * gp_smart_cache_get_stats:
+ * @self: Объект #GpSmartCache.
+ * @stats: (out caller-allocates): Структура для сохранения статистики.
+ *
+ * Функция получает снимок статистики работы кэша в целом:
+ * количество попаданий и промахов, сохранений и вытеснений данных, время ожидания мьютексов
+ * и средний возраст записей. Счетчики накапливаются с момента создания кэша
+ * или последнего вызова #gp_smart_cache_reset_stats.
+ *
+ * Статистика ведется всегда, получение снимка не останавливает работу с кэшем.
+ * По соотношению попаданий и промахов и среднему времени хранения вытесненных записей
+ * можно подобрать размер кэша.
+ */
+void gp_smart_cache_get_stats (GpSmartCache *self, GpSmartCacheStats *stats);
+
+/**
+ * gp_smart_cache_get_group_stats:
+ * @self: Объект #GpSmartCache.
+ * @group: Идентификатор группы.
+ * @stats: (out caller-allocates): Структура для сохранения статистики.
+ *
+ * Функция получает снимок статистики работы кэша с данными указанной группы.
+ * Поля lock_contended и lock_wait для группы не ведутся и всегда равны нулю.
+ * Статистика группы удаляется при вызове #gp_smart_cache_unreg_group.
+ */
+void gp_smart_cache_get_group_stats (GpSmartCache *self, guint group, GpSmartCacheStats *stats);
+
+/**
+ * gp_smart_cache_reset_stats:
+ * @self: Объект #GpSmartCache.
+ *
+ * Функция обнуляет счетчики статистики кэша и всех групп.
+ * Сведения о хранимых данных (records, bytes, avg_age) не изменяются.
+ */
+void gp_smart_cache_reset_stats (GpSmartCache *self);
+
 /**
  * GpSmartCacheAccessFunc:
  * @data: (transfer none) (element-type guint8) (array length=size): Элемент данных в кэше.
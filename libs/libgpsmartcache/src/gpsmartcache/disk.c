@@ -0,0 +1,699 @@
+/*
+ * GP_SMART_CACHE - data caching library, this library is part of GRTL.
+ *
+ * This file is part of GRTL.
+ *
+ * GRTL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * GRTL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with GRTL. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Формат файла: заголовок (DiskHeader) размером DISK_HEADER_SIZE байт, за ним slabs_num слябов
+ * по DISK_SLAB_SIZE байт. Сляб начинается с DiskSlab, за которым подряд идут записи:
+ * заголовок DiskItem и данные, выровненные на 8 байт.
+ *
+ * Слябы заполняются по кругу, номер заполнения (DiskSlab::seq) растет,
+ * поэтому при открытии файла слябы просматриваются от самого старого к самому новому
+ * и более новая запись с тем же идентификатором заменяет старую.
+ */
+
+#include "disk.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef G_OS_WIN32
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
+#define DISK_MAGIC "GPSCDISK"
+#define DISK_VERSION 2
+#define DISK_HEADER_SIZE 4096
+#define DISK_SLAB_SIZE ( 4 << 20 )
+#define DISK_MIN_SLABS 2
+
+#define DISK_ITEM_MAGIC 0x4D455449U
+
+#define DISK_ALIGN( X ) ( ( ( X ) + 7 ) & ~(gsize) 7 )
+#define DISK_SLAB_DATA DISK_ALIGN( sizeof( DiskSlab ) )
+
+typedef struct _disk_header
+{
+   gchar magic[8];
+   guint32 version;
+   guint32 slab_size;
+   guint32 slabs_num;
+   guint32 reserved;
+} DiskHeader;
+
+typedef struct _disk_slab
+{
+   guint64 seq; // <-- номер заполнения сляба, 0 -- сляб не использовался
+   guint32 used; // <-- занятое место от начала сляба, байт
+   guint32 reserved;
+} DiskSlab;
+
+typedef struct _disk_item
+{
+   guint32 magic;
+   guint32 deleted; // <-- запись удалена или заменена
+   guint32 group;
+   guint32 size; // <-- размер данных, байт
+   guint64 index;
+   guint64 stamp; // <-- поколение группы на момент сохранения
+} DiskItem;
+
+/*
+ * Идентификатор записи.
+ */
+typedef struct _disk_key
+{
+   guint64 index;
+   guint group;
+} DiskKey;
+
+/*
+ * Запись индекса.
+ */
+typedef struct _disk_entry
+{
+   DiskKey key;
+   guint64 stamp;
+   guint slab;
+   guint offset; // <-- смещение DiskItem от начала сляба
+   guint size;
+} DiskEntry;
+
+struct _DiskTier
+{
+   GMutex mutex; // <-- защищает все остальные поля и содержимое файла
+
+  #ifdef G_OS_WIN32
+   HANDLE file;
+   HANDLE mapping;
+  #else
+   gint fd;
+  #endif
+   guint8 *map; // <-- отображение файла в память
+   gsize map_size;
+
+   guint slabs_num;
+   guint current; // <-- сляб, в который дописываются записи
+   guint64 seq; // <-- последний выданный номер заполнения сляба
+
+   GHashTable *index; // <-- DiskEntry::key -> DiskEntry
+   GHashTable *stamps; // <-- номер группы -> поколение (guint64)
+
+   guint records;
+   guint64 bytes;
+};
+
+static inline DiskSlab *disk_slab( DiskTier *disk, guint n )
+{
+   return (DiskSlab*) ( disk->map + DISK_HEADER_SIZE + (gsize) n * DISK_SLAB_SIZE );
+}
+
+static inline DiskItem *disk_item( DiskTier *disk, guint slab, guint offset )
+{
+   return (DiskItem*) ( (guint8*) disk_slab( disk, slab ) + offset );
+}
+
+static inline guint64 disk_group_stamp( DiskTier *disk, guint group )
+{
+   guint64 *stamp = g_hash_table_lookup( disk->stamps, GUINT_TO_POINTER( group ));
+
+   return stamp ? *stamp : 0;
+}
+
+static guint disk_key_hash( gconstpointer key )
+{
+   const DiskKey *k = key;
+
+   return g_int64_hash( &k->index ) ^ ( k->group * 0x9e3779b9U );
+}
+
+static gboolean disk_key_equal( gconstpointer a, gconstpointer b )
+{
+   const DiskKey *ka = a, *kb = b;
+
+   return ka->index == kb->index && ka->group == kb->group;
+}
+
+static void disk_entry_free( gpointer entry )
+{
+   g_slice_free( DiskEntry, entry );
+}
+
+/*
+ * Исключает запись из индекса, помечая ее в файле удаленной.
+ */
+static void disk_entry_delete( DiskTier *disk, DiskEntry *entry )
+{
+   DiskKey key = entry->key;
+
+   disk_item( disk, entry->slab, entry->offset )->deleted = TRUE;
+
+   disk->records-- ;
+   disk->bytes -= entry->size;
+
+   g_hash_table_remove( disk->index, &key );
+}
+
+/*
+ * Добавляет запись из файла в индекс, заменяя запись с тем же идентификатором.
+ */
+static void disk_entry_add( DiskTier *disk, guint slab, guint offset )
+{
+   DiskItem *item = disk_item( disk, slab, offset );
+   DiskEntry *entry = g_slice_new( DiskEntry );
+   DiskEntry *old;
+
+   entry->key.index = item->index;
+   entry->key.group = item->group;
+   entry->stamp = item->stamp;
+   entry->slab = slab;
+   entry->offset = offset;
+   entry->size = item->size;
+
+   if (( old = g_hash_table_lookup( disk->index, &entry->key ) ))
+      disk_entry_delete( disk, old );
+
+   g_hash_table_insert( disk->index, &entry->key, entry );
+
+   disk->records++ ;
+   disk->bytes += entry->size;
+}
+
+/*
+ * Освобождает сляб n для новых записей, исключая его записи из индекса.
+ */
+static void disk_slab_reclaim( DiskTier *disk, guint n )
+{
+   DiskSlab *slab = disk_slab( disk, n );
+   gsize offset = DISK_SLAB_DATA;
+
+   while ( offset < slab->used )
+   {
+      DiskItem *item = disk_item( disk, n, offset );
+      DiskKey key = { item->index, item->group };
+      DiskEntry *entry = g_hash_table_lookup( disk->index, &key );
+
+      if (entry && entry->slab == n && entry->offset == offset)
+      {
+         disk->records-- ;
+         disk->bytes -= entry->size;
+         g_hash_table_remove( disk->index, &key );
+      }
+
+      offset += DISK_ALIGN( sizeof( DiskItem ) + item->size );
+   }
+
+   slab->seq = ++disk->seq;
+   slab->used = DISK_SLAB_DATA;
+}
+
+/*
+ * Восстанавливает индекс по содержимому файла.
+ * Вернет FALSE, если файл новый или имеет другой формат. Во втором случае его данные будут потеряны
+ * при разметке, о чем сообщается в журнал.
+ */
+static gboolean disk_load( DiskTier *disk, const gchar *filename )
+{
+   static const gchar empty[sizeof( ((DiskHeader*) NULL)->magic )] = { 0 };
+   DiskHeader *header = (DiskHeader*) disk->map;
+   guint newest = 0;
+   guint i, n;
+
+   if (memcmp( header->magic, DISK_MAGIC, sizeof( header->magic )))
+   {
+      // Новый файл заполнен нулями
+      if (memcmp( header->magic, empty, sizeof( header->magic )))
+         g_warning( "GpSmartCache: %s is not a cache file, it will be overwritten", filename );
+      return FALSE;
+   }
+
+   if (header->version != DISK_VERSION || header->slab_size != DISK_SLAB_SIZE || header->slabs_num != disk->slabs_num)
+   {
+      g_message( "GpSmartCache: %s has different format ( version %u, %u slabs of %u bytes; expected version %u, %u slabs of %u bytes ), cached data discarded",
+                 filename, header->version, header->slabs_num, header->slab_size,
+                 DISK_VERSION, disk->slabs_num, DISK_SLAB_SIZE );
+      return FALSE;
+   }
+
+   for ( n = 0; n < disk->slabs_num; n++ )
+   {
+      DiskSlab *slab = disk_slab( disk, n );
+
+      if (slab->used < DISK_SLAB_DATA || slab->used > DISK_SLAB_SIZE)
+      {
+         slab->seq = 0;
+         slab->used = DISK_SLAB_DATA;
+      }
+
+      if (slab->seq > disk->seq)
+      {
+         disk->seq = slab->seq;
+         newest = n;
+      }
+   }
+
+   // Слябы заполняются по кругу, поэтому самый старый следует за самым новым
+   for ( i = 1; i <= disk->slabs_num; i++ )
+   {
+      guint s = ( newest + i ) % disk->slabs_num;
+      DiskSlab *slab = disk_slab( disk, s );
+      gsize offset = DISK_SLAB_DATA;
+
+      if ( !slab->seq)
+         continue;
+
+      while ( offset < slab->used )
+      {
+         DiskItem *item = disk_item( disk, s, offset );
+         gsize next;
+
+         // Запись могла не дописаться при аварийном завершении
+         if (offset + sizeof( DiskItem ) > slab->used || item->magic != DISK_ITEM_MAGIC)
+            break;
+
+         next = offset + DISK_ALIGN( sizeof( DiskItem ) + item->size );
+         if (next > slab->used)
+            break;
+
+         if ( !item->deleted)
+            disk_entry_add( disk, s, offset );
+
+         offset = next;
+      }
+
+      slab->used = offset;
+   }
+
+   disk->current = newest;
+
+   return TRUE;
+}
+
+/*
+ * Размечает пустой файл.
+ */
+static void disk_format( DiskTier *disk )
+{
+   DiskHeader *header = (DiskHeader*) disk->map;
+   guint n;
+
+   memset( header, 0, DISK_HEADER_SIZE );
+   memcpy( header->magic, DISK_MAGIC, sizeof( header->magic ));
+   header->version = DISK_VERSION;
+   header->slab_size = DISK_SLAB_SIZE;
+   header->slabs_num = disk->slabs_num;
+
+   for ( n = 0; n < disk->slabs_num; n++ )
+   {
+      disk_slab( disk, n )->seq = 0;
+      disk_slab( disk, n )->used = DISK_SLAB_DATA;
+   }
+
+   disk->seq = 0;
+   disk->current = 0;
+}
+
+/*
+ * Открывает файл и отображает его в память. Вернет FALSE в случае ошибки.
+ */
+static gboolean disk_map( DiskTier *disk, const gchar *filename )
+{
+  #ifdef G_OS_WIN32
+   gunichar2 *wfilename = g_utf8_to_utf16( filename, -1, NULL, NULL, NULL );
+   LARGE_INTEGER size;
+
+   disk->file = CreateFileW( wfilename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+   g_free( wfilename );
+
+   if (disk->file == INVALID_HANDLE_VALUE)
+   {
+      g_warning( "GpSmartCache: CreateFile( %s ) failed ( %lu )", filename, GetLastError());
+      return FALSE;
+   }
+
+   size.QuadPart = disk->map_size;
+   if ( !SetFilePointerEx( disk->file, size, NULL, FILE_BEGIN ) || !SetEndOfFile( disk->file ))
+   {
+      g_warning( "GpSmartCache: can't resize %s ( %lu )", filename, GetLastError());
+      return FALSE;
+   }
+
+   disk->mapping = CreateFileMappingW( disk->file, NULL, PAGE_READWRITE, 0, 0, NULL );
+   if ( !disk->mapping)
+   {
+      g_warning( "GpSmartCache: CreateFileMapping( %s ) failed ( %lu )", filename, GetLastError());
+      return FALSE;
+   }
+
+   disk->map = MapViewOfFile( disk->mapping, FILE_MAP_ALL_ACCESS, 0, 0, disk->map_size );
+   if ( !disk->map)
+   {
+      g_warning( "GpSmartCache: MapViewOfFile( %s ) failed ( %lu )", filename, GetLastError());
+      return FALSE;
+   }
+  #else
+   struct stat st;
+
+   disk->fd = open( filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR );
+   if (disk->fd < 0)
+   {
+      g_warning( "GpSmartCache: open( %s ) failed ( %s )", filename, strerror( errno ));
+      return FALSE;
+   }
+
+   if (fstat( disk->fd, &st ) < 0 || ( (gsize) st.st_size != disk->map_size && ftruncate( disk->fd, disk->map_size ) < 0 ))
+   {
+      g_warning( "GpSmartCache: can't resize %s ( %s )", filename, strerror( errno ));
+      return FALSE;
+   }
+
+   disk->map = mmap( NULL, disk->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0 );
+   if (disk->map == MAP_FAILED)
+   {
+      disk->map = NULL;
+      g_warning( "GpSmartCache: mmap( %s ) failed ( %s )", filename, strerror( errno ));
+      return FALSE;
+   }
+  #endif
+
+   return TRUE;
+}
+
+/*
+ * Закрывает отображение и файл.
+ */
+static void disk_unmap( DiskTier *disk )
+{
+  #ifdef G_OS_WIN32
+   if (disk->map)
+   {
+      FlushViewOfFile( disk->map, 0 );
+      UnmapViewOfFile( disk->map );
+   }
+   if (disk->mapping)
+      CloseHandle( disk->mapping );
+   if (disk->file != INVALID_HANDLE_VALUE)
+      CloseHandle( disk->file );
+  #else
+   if (disk->map)
+   {
+      msync( disk->map, disk->map_size, MS_SYNC );
+      munmap( disk->map, disk->map_size );
+   }
+   if (disk->fd >= 0)
+      close( disk->fd );
+  #endif
+}
+
+DiskTier *disk_tier_open( const gchar *filename, gsize size )
+{
+   DiskTier *disk = g_new0( DiskTier, 1 );
+
+   g_mutex_init( &disk->mutex );
+
+  #ifdef G_OS_WIN32
+   disk->file = INVALID_HANDLE_VALUE;
+  #else
+   disk->fd = -1;
+  #endif
+
+   disk->slabs_num = MAX( size / DISK_SLAB_SIZE, DISK_MIN_SLABS );
+   disk->map_size = DISK_HEADER_SIZE + (gsize) disk->slabs_num * DISK_SLAB_SIZE;
+
+   disk->index = g_hash_table_new_full( disk_key_hash, disk_key_equal, NULL, disk_entry_free );
+   disk->stamps = g_hash_table_new_full( g_direct_hash, g_direct_equal, NULL, g_free );
+
+   if ( !disk_map( disk, filename ))
+   {
+      disk_tier_close( disk );
+      return NULL;
+   }
+
+   if ( !disk_load( disk, filename ))
+   {
+      g_hash_table_remove_all( disk->index );
+      disk->records = 0;
+      disk->bytes = 0;
+
+      disk_format( disk );
+   }
+
+   // Записи дописываются в самый новый сляб (в пустом файле -- в первый)
+   if ( !disk_slab( disk, disk->current )->seq)
+      disk_slab( disk, disk->current )->seq = ++disk->seq;
+
+   return disk;
+}
+
+void disk_tier_close( DiskTier *disk )
+{
+   disk_unmap( disk );
+
+   g_hash_table_destroy( disk->index );
+   g_hash_table_destroy( disk->stamps );
+   g_mutex_clear( &disk->mutex );
+
+   g_free( disk );
+}
+
+void disk_tier_sync( DiskTier *disk )
+{
+   g_mutex_lock( &disk->mutex );
+
+  #ifdef G_OS_WIN32
+   FlushViewOfFile( disk->map, 0 );
+  #else
+   msync( disk->map, disk->map_size, MS_SYNC );
+  #endif
+
+   g_mutex_unlock( &disk->mutex );
+}
+
+typedef struct _disk_clean_data
+{
+   DiskTier *disk;
+   guint group;
+   guint64 stamp; // <-- для disk_tier_set_group_stamp: поколение, записи которого сохраняются
+   GpSmartCacheAccessFunc condition;
+   gpointer user_data;
+} DiskCleanData;
+
+/*
+ * GHRFunc для удаления записей группы из индекса.
+ */
+static gboolean disk_clean_func( gpointer key, DiskEntry *entry, DiskCleanData *clean )
+{
+   DiskItem *item;
+
+   if (entry->key.group != clean->group)
+      return FALSE;
+
+   item = disk_item( clean->disk, entry->slab, entry->offset );
+
+   if (clean->condition && !clean->condition( item + 1, entry->size, clean->user_data ))
+      return FALSE;
+
+   item->deleted = TRUE;
+   clean->disk->records-- ;
+   clean->disk->bytes -= entry->size;
+
+   return TRUE;
+}
+
+static gboolean disk_stamp_condition( gconstpointer data, guint size, DiskCleanData *clean )
+{
+   return ( (const DiskItem*) data - 1 )->stamp != clean->stamp;
+}
+
+void disk_tier_set_group_stamp( DiskTier *disk, guint group, guint64 stamp )
+{
+   DiskCleanData clean = { disk, group, stamp, (GpSmartCacheAccessFunc) disk_stamp_condition, NULL };
+
+   clean.user_data = &clean;
+
+   g_mutex_lock( &disk->mutex );
+
+   g_hash_table_insert( disk->stamps, GUINT_TO_POINTER( group ), g_memdup( &stamp, sizeof( stamp )));
+   g_hash_table_foreach_remove( disk->index, (GHRFunc) disk_clean_func, &clean );
+
+   g_mutex_unlock( &disk->mutex );
+}
+
+gboolean disk_tier_store( DiskTier *disk, guint group, guint64 index, gconstpointer data, guint size )
+{
+   gsize need = DISK_ALIGN( sizeof( DiskItem ) + size );
+   DiskKey key = { index, group };
+   DiskEntry *entry;
+   DiskSlab *slab;
+   DiskItem *item;
+   guint64 stamp;
+
+   if (need > DISK_SLAB_SIZE - DISK_SLAB_DATA)
+      return FALSE;
+
+   g_mutex_lock( &disk->mutex );
+
+   stamp = disk_group_stamp( disk, group );
+
+   if (( entry = g_hash_table_lookup( disk->index, &key ) ))
+   {
+      // Данные уже сохранены
+      if (entry->stamp == stamp)
+      {
+         g_mutex_unlock( &disk->mutex );
+         return FALSE;
+      }
+
+      disk_entry_delete( disk, entry );
+   }
+
+   slab = disk_slab( disk, disk->current );
+
+   if (slab->used + need > DISK_SLAB_SIZE)
+   {
+      disk->current = ( disk->current + 1 ) % disk->slabs_num;
+      disk_slab_reclaim( disk, disk->current );
+      slab = disk_slab( disk, disk->current );
+   }
+
+   item = disk_item( disk, disk->current, slab->used );
+   item->magic = DISK_ITEM_MAGIC;
+   item->deleted = FALSE;
+   item->group = group;
+   item->index = index;
+   item->stamp = stamp;
+   item->size = size;
+   memcpy( item + 1, data, size );
+
+   disk_entry_add( disk, disk->current, slab->used );
+   slab->used += need;
+
+   g_mutex_unlock( &disk->mutex );
+
+   return TRUE;
+}
+
+gboolean disk_tier_lookup( DiskTier *disk, guint group, guint64 index, guint *size )
+{
+   DiskKey key = { index, group };
+   DiskEntry *entry;
+   gboolean found;
+
+   g_mutex_lock( &disk->mutex );
+
+   entry = g_hash_table_lookup( disk->index, &key );
+   found = entry && entry->stamp == disk_group_stamp( disk, group );
+
+   if (found)
+      *size = entry->size;
+
+   g_mutex_unlock( &disk->mutex );
+
+   return found;
+}
+
+gboolean disk_tier_read( DiskTier *disk, guint group, guint64 index, gpointer data, guint size )
+{
+   DiskKey key = { index, group };
+   DiskEntry *entry;
+   gboolean found;
+
+   g_mutex_lock( &disk->mutex );
+
+   entry = g_hash_table_lookup( disk->index, &key );
+   found = entry && entry->stamp == disk_group_stamp( disk, group ) && entry->size == size;
+
+   if (found)
+      memcpy( data, disk_item( disk, entry->slab, entry->offset ) + 1, size );
+
+   g_mutex_unlock( &disk->mutex );
+
+   return found;
+}
+
+void disk_tier_remove( DiskTier *disk, guint group, guint64 index )
+{
+   DiskKey key = { index, group };
+   DiskEntry *entry;
+
+   g_mutex_lock( &disk->mutex );
+
+   if (( entry = g_hash_table_lookup( disk->index, &key ) ))
+      disk_entry_delete( disk, entry );
+
+   g_mutex_unlock( &disk->mutex );
+}
+
+typedef struct _disk_modify_data
+{
+   DiskTier *disk;
+   guint group;
+   GpSmartCacheAccessFunc condition;
+   gpointer condition_user_data;
+   GpSmartCacheAccessFunc modifier;
+   gpointer modifier_user_data;
+} DiskModifyData;
+
+static void disk_modify_func( gpointer key, DiskEntry *entry, DiskModifyData *modify )
+{
+   DiskItem *item;
+
+   if (entry->key.group != modify->group)
+      return;
+
+   item = disk_item( modify->disk, entry->slab, entry->offset );
+
+   // Данные изменяются прямо в отображении файла
+   if ( !modify->condition || modify->condition( item + 1, entry->size, modify->condition_user_data ))
+      modify->modifier( item + 1, entry->size, modify->modifier_user_data );
+}
+
+void disk_tier_modify( DiskTier *disk, guint group, GpSmartCacheAccessFunc condition, gpointer condition_user_data,
+                       GpSmartCacheAccessFunc modifier, gpointer modifier_user_data )
+{
+   DiskModifyData modify = { disk, group, condition, condition_user_data, modifier, modifier_user_data };
+
+   g_mutex_lock( &disk->mutex );
+   g_hash_table_foreach( disk->index, (GHFunc) disk_modify_func, &modify );
+   g_mutex_unlock( &disk->mutex );
+}
+
+void disk_tier_clean( DiskTier *disk, guint group, GpSmartCacheAccessFunc condition, gpointer user_data )
+{
+   DiskCleanData clean = { disk, group, 0, condition, user_data };
+
+   g_mutex_lock( &disk->mutex );
+   g_hash_table_foreach_remove( disk->index, (GHRFunc) disk_clean_func, &clean );
+   g_mutex_unlock( &disk->mutex );
+}
+
+void disk_tier_get_usage( DiskTier *disk, guint *records, guint64 *bytes )
+{
+   g_mutex_lock( &disk->mutex );
+
+   *records = disk->records;
+   *bytes = disk->bytes;
+
+   g_mutex_unlock( &disk->mutex );
+}
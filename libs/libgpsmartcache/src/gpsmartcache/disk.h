@@ -0,0 +1,111 @@
+/*
+ * GP_SMART_CACHE - data caching library, this library is part of GRTL.
+ *
+ * This file is part of GRTL.
+ *
+ * GRTL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * GRTL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with GRTL. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * \file disk.h
+ *
+ * \brief Дисковый уровень кэша.
+ *
+ * Данные хранятся в файле, отображенном в память, который разбит на слябы одинакового размера.
+ * Записи дописываются в текущий сляб, а когда место в файле заканчивается,
+ * самый старый сляб очищается целиком и используется заново.
+ * Индекс записей хранится в памяти и при открытии файла восстанавливается по заголовкам записей,
+ * поэтому данные сохраняются между запусками приложения.
+ *
+ * Каждая запись помечается "поколением" своей группы (disk_tier_set_group_stamp),
+ * записи другого поколения не выдаются.
+ *
+ * Все функции потокобезопасны. Используется только внутри реализации GpSmartCache.
+ *
+ */
+
+#ifndef _disk_h
+#define _disk_h
+
+#include "gp-smartcache.h"
+
+G_BEGIN_DECLS
+
+typedef struct _DiskTier DiskTier;
+
+/*
+ * Открывает файл дискового уровня размером около size байт, при необходимости создавая его.
+ * Если файл уже содержит данные в подходящем формате, они становятся доступны.
+ * Вернет NULL, если файл не удалось открыть.
+ */
+DiskTier *disk_tier_open( const gchar *filename, gsize size );
+
+/*
+ * Сохраняет изменения на диск и закрывает файл дискового уровня.
+ */
+void disk_tier_close( DiskTier *disk );
+
+/*
+ * Сохраняет изменения на диск.
+ */
+void disk_tier_sync( DiskTier *disk );
+
+/*
+ * Устанавливает поколение данных группы. Записи группы других поколений удаляются.
+ * До вызова поколение группы равно 0.
+ */
+void disk_tier_set_group_stamp( DiskTier *disk, guint group, guint64 stamp );
+
+/*
+ * Сохраняет данные. Вернет FALSE, если данные не помещаются в сляб
+ * или уже сохранены (в текущем поколении группы).
+ */
+gboolean disk_tier_store( DiskTier *disk, guint group, guint64 index, gconstpointer data, guint size );
+
+/*
+ * Проверяет наличие данных текущего поколения группы и записывает в size их размер.
+ */
+gboolean disk_tier_lookup( DiskTier *disk, guint group, guint64 index, guint *size );
+
+/*
+ * Считывает данные размером size байт в буфер data.
+ * Вернет FALSE, если данных нет или их размер изменился.
+ */
+gboolean disk_tier_read( DiskTier *disk, guint group, guint64 index, gpointer data, guint size );
+
+/*
+ * Удаляет данные.
+ */
+void disk_tier_remove( DiskTier *disk, guint group, guint64 index );
+
+/*
+ * Изменяет данные группы, удовлетворяющие условию (см. gp_smart_cache_modify).
+ */
+void disk_tier_modify( DiskTier *disk, guint group, GpSmartCacheAccessFunc condition, gpointer condition_user_data,
+                       GpSmartCacheAccessFunc modifier, gpointer modifier_user_data );
+
+/*
+ * Удаляет данные группы, удовлетворяющие условию, или все данные группы, если condition == NULL.
+ */
+void disk_tier_clean( DiskTier *disk, guint group, GpSmartCacheAccessFunc condition, gpointer user_data );
+
+/*
+ * Вернет количество и объем хранимых записей.
+ */
+void disk_tier_get_usage( DiskTier *disk, guint *records, guint64 *bytes );
+
+G_END_DECLS
+
+#endif /* _disk_h */
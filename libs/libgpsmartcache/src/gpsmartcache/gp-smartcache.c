@@ -36,6 +36,8 @@
 #include <glib.h>
 #include <stdlib.h>
 #include "gp-smartcache.h"
+#include "rle.h"
+#include "disk.h"
 #include <string.h>
 
 /*! \cond */
@@ -47,7 +49,7 @@
 
   /*
    * Функция выполняет действия, необходимые для обновления статистики в GUI.
-   * Должна вызываться только под локом!
+   * Потокобезопасна, может вызываться из любого потока (в том числе под мьютексом сегмента).
    */
   static void free_changed(GpSmartCache *cache);
 
@@ -61,259 +63,1763 @@
 typedef struct _GpSmartCachePriv GpSmartCachePriv;
 #define GP_SMART_CACHE_GET_PRIVATE( obj ) ( G_TYPE_INSTANCE_GET_PRIVATE( ( obj ), GP_SMART_CACHE_TYPE, GpSmartCachePriv ) )
 
+/*
+ * Количество сегментов кэша (двоичный логарифм).
+ * Каждый сегмент защищен собственным мьютексом, поэтому потоки,
+ * обращающиеся к данным из разных сегментов, друг друга не блокируют.
+ */
+#define SHARDS_BITS 4
+#define SHARDS_NUM ( 1 << SHARDS_BITS )
+
+/*
+ * Начальная (она же минимальная) емкость хэш-таблицы сегмента, должна быть степенью двойки.
+ */
+#define SHARD_MIN_CAPACITY 64
+
+/*
+ * Максимальная доля защищенного сегмента SLRU в доле размера кэша, приходящейся на сегмент, в процентах.
+ */
+#define SLRU_PROTECTED_PERCENT 80
+
+/*
+ * Минимальная степень сжатия данных, при которой их выгодно хранить в сжатом уровне кэша.
+ */
+#define COMPRESSED_MIN_RATIO 2
+
+/*
+ * Максимальный вес группы при вытеснении (см. gp_smart_cache_set_group_quota).
+ */
+#define GROUP_MAX_WEIGHT 16
+
+/*
+ * Списки записей сегмента. Назначение списков зависит от политики вытеснения:
+ *
+ * - LRU: LIST_T1 -- все записи по времени доступа;
+ * - CLOCK: LIST_T1 -- кольцо записей, "стрелка" указывает на хвост списка;
+ * - SLRU: LIST_T1 -- испытательный сегмент, LIST_T2 -- защищенный сегмент;
+ * - ARC: LIST_T1 и LIST_T2 -- записи, использованные один и несколько раз,
+ *   LIST_B1 и LIST_B2 -- "призраки" записей, вытесненных из LIST_T1 и LIST_T2 (без данных).
+ *
+ * При любой политике LIST_C -- записи сжатого уровня по времени вытеснения из основного кэша.
+ */
+enum
+{
+   LIST_T1,
+   LIST_T2,
+   LIST_B1,
+   LIST_B2,
+   LIST_C,
+   LISTS_NUM
+};
+
+enum { PROP_0, PROP_POLICY };
+
+#define RECORD_IS_GHOST( R ) ( ( R )->list == LIST_B1 || ( R )->list == LIST_B2 )
+#define RECORD_IS_COMPRESSED( R ) ( ( R )->list == LIST_C )
+
 typedef struct _record_id
 {
+   guint64 index;
    guint group;
-   guint index;
 } RecordId;
 
-typedef struct _record
+typedef struct _record Record;
+
+struct _record
 {
    RecordId id;
+   guint hash; // <-- хэш идентификатора, см. record_id_hash
+
+   gpointer data; // <-- данные (NULL у "призраков" ARC, сжатые данные у записей сжатого уровня)
+   guint size; // <-- размер данных (у записей сжатого уровня -- до сжатия)
+   guint csize; // <-- размер сжатых данных записи сжатого уровня
+
+   guint stamp; // <-- "время" последнего обращения к данным, см. _GpSmartCachePriv::clock
+   gint64 born; // <-- время сохранения данных, мкс от создания кэша (_GpSmartCachePriv::created)
+
+   guint pins; // <-- количество незавершенных gp_smart_cache_acquire, запись с pins > 0 не вытесняется
 
+   Record *prev; // <-- соседние записи в списке сегмента (в сторону головы)
+   Record *next; // <-- соседние записи в списке сегмента (в сторону хвоста)
+   guint8 list; // <-- номер списка сегмента, в котором находится запись
+   guint8 referenced; // <-- бит обращения для политики CLOCK
+   guint8 chances; // <-- сколько раз запись уже избежала вытеснения благодаря весу группы
+
+   Record *group_prev; // <-- соседние записи в списке группы (см. ShardGroup)
+   Record *group_next;
+};
+
+/*
+ * Данные, удаленные из кэша (замененные, очищенные) в момент,
+ * когда их еще использовали после gp_smart_cache_acquire.
+ * Данные освобождаются, а память возвращается кэшу при последнем gp_smart_cache_release.
+ */
+typedef struct _detached
+{
    gpointer data;
    guint size;
+   guint group;
+   guint pins; // <-- количество незавершенных gp_smart_cache_acquire
+   guint epoch; // <-- "поколение" кэша, в котором под данные была выделена память
+} Detached;
 
-   GList *access; // <-- соответствующий элемент из списка идентификаторов данных
-} Record;
+/*
+ * Счетчики статистики сегмента (по всем данным сегмента или по одной группе).
+ */
+typedef struct _counters
+{
+   guint64 hits; // <-- количество успешных обращений к данным
+   guint64 misses; // <-- количество обращений к отсутствующим данным
+   guint64 inserts; // <-- количество сохранений данных
+   guint64 evictions; // <-- количество вытесненных записей
+   guint64 bytes_evicted; // <-- объем вытесненных данных, байт
+   gint64 evicted_age; // <-- суммарный возраст вытесненных записей, мкс
+
+   guint records; // <-- количество записей с данными
+   gsize bytes; // <-- объем данных
+   gint64 born_sum; // <-- сумма Record::born записей с данными, мкс
+
+   guint64 compressions; // <-- количество записей, перенесенных в сжатый уровень
+   guint64 decompressions; // <-- количество записей, возвращенных из сжатого уровня
+   guint64 compressed_evictions; // <-- количество записей, вытесненных из сжатого уровня
+   guint compressed_records; // <-- количество записей сжатого уровня
+   gsize compressed_bytes; // <-- объем сжатых данных
+
+   guint64 disk_stores; // <-- количество записей, сохраненных на диск при вытеснении
+   guint64 disk_loads; // <-- количество записей, загруженных с диска
+} Counters;
+
+// Данные группы с номером N хранятся в дисковом уровне, см. gp_smart_cache_reg_persistent_group
+#define GROUP_IS_PERSISTENT( N ) ( ( N ) >= GP_SMART_CACHE_PERSISTENT_GROUP_MIN )
 
-struct _GpSmartCachePriv
+/*
+ * Группа в сегменте: статистика, ограничения объема и список записей группы,
+ * находящихся в основном кэше (по времени обращения, связан через поля самих записей).
+ * Ограничения объема группы делятся поровну между сегментами.
+ */
+typedef struct _shard_group
+{
+   Counters counters; // <-- статистика группы
+
+   gsize soft_quota; // <-- мягкое ограничение объема данных группы в сегменте, байт (0 -- без ограничения)
+   gsize hard_quota; // <-- жесткое ограничение объема данных группы в сегменте, байт (0 -- без ограничения)
+   guint weight; // <-- вес группы при вытеснении: запись пропускается weight - 1 раз
+
+   GpSmartCacheRecycleFunc recycle; // <-- функция, которой передаются освобождаемые данные группы (или NULL)
+   gpointer recycle_data; // <-- пользовательские данные для recycle
+
+   Record *head; // <-- последняя использованная запись группы
+   Record *tail; // <-- давно не использованная запись группы
+} ShardGroup;
+
+/*
+ * Функция повторного использования данных группы, см. gp_smart_cache_set_group_recycle_func.
+ */
+typedef struct _recycler
+{
+   GpSmartCacheRecycleFunc func;
+   gpointer user_data;
+   GDestroyNotify destroy;
+} Recycler;
+
+#define GROUP_OVER_QUOTA( G ) ( ( G )->soft_quota && ( G )->counters.bytes > ( G )->soft_quota )
+
+typedef struct _record_list
+{
+   Record *head; // <-- последняя использованная запись
+   Record *tail; // <-- кандидат на вытеснение
+   gsize bytes; // <-- суммарный размер данных записей списка
+   guint count; // <-- количество записей в списке
+} RecordList;
+
+/*
+ * Сегмент кэша: хэш-таблица с открытой адресацией (линейное пробирование)
+ * и списки записей политики вытеснения, связанные через поля самих записей.
+ * Все поля, кроме мьютекса, доступны только под мьютексом сегмента.
+ */
+typedef struct _shard
 {
    GMutex mutex;
+
+   Record **slots; // <-- ячейки хэш-таблицы, NULL -- свободная ячейка
+   guint capacity; // <-- количество ячеек, степень двойки
+   guint count; // <-- количество записей в таблице
+
+   RecordList lists[LISTS_NUM]; // <-- списки записей политики вытеснения
+   gsize arc_p; // <-- целевой объем данных в LIST_T1 для политики ARC, байт
+   gsize slru_protected; // <-- максимальный объем защищенного сегмента SLRU, байт
+
+   gsize compressed_max; // <-- доля объема сжатого уровня, приходящаяся на сегмент, байт (0 -- уровень отключен)
+   gsize compressed_bytes; // <-- объем сжатых данных сегмента, байт
+
+   GSList *detached; // <-- удаленные, но еще используемые данные (Detached)
+
+   Counters total; // <-- статистика по всем данным сегмента
+   GHashTable *groups; // <-- группы: номер группы -> ShardGroup
+   guint over_quota; // <-- количество групп, превысивших мягкое ограничение объема
+   guint64 lock_contended; // <-- количество захватов мьютекса сегмента с ожиданием
+   gint64 lock_wait; // <-- суммарное время ожидания мьютекса сегмента, мкс
+} Shard;
+
+/*
+ * Порядок захвата мьютексов: mutex -> мьютексы сегментов (по возрастанию номера) -> space_mutex.
+ * Удерживать одновременно мьютексы нескольких сегментов может только gp_smart_cache_set_size.
+ */
+struct _GpSmartCachePriv
+{
+   GMutex mutex; // <-- защищает groups, сериализует изменение размера кэша
    GFreeFunc free_func; // <-- функция освобождения данных
+   GpSmartCachePolicy policy; // <-- политика вытеснения данных (задается при создании)
 
    GArray *groups; // <-- выданные идентификаторы груп
 
+   GMutex space_mutex; // <-- защищает size, free и epoch
    gsize size; // <-- максимальный размер кэша
    gsize free; // <-- счетчик свободной памяти
+   guint epoch; // <-- номер "поколения" кэша, увеличивается при каждой его очистке в gp_smart_cache_set_size
+                // (только под мьютексами всех сегментов, поэтому читать можно под мьютексом любого сегмента)
+
+   gsize compressed_size; // <-- объем сжатого уровня кэша (под mutex)
 
-   Record *records; // <-- массив данных, отсортирован идентификатору
-   guint records_count;
+   DiskTier *disk; // <-- дисковый уровень кэша или NULL, изменяется только под mutex и мьютексами всех сегментов
+                   // (поэтому использовать можно под mutex или мьютексом любого сегмента)
+   GHashTable *group_stamps; // <-- поколения данных групп на диске: номер группы -> guint64 (под mutex)
+   GHashTable *recyclers; // <-- функции повторного использования данных групп: номер группы -> Recycler (под mutex)
 
-   GList *access; // <-- список идентификаторов данных, отсортирован по времени доступа
+   volatile gint clock; // <-- счетчик обращений к данным, источник значений Record::stamp
+   gint64 created; // <-- время создания кэша (g_get_monotonic_time), мкс
+
+   Shard shards[SHARDS_NUM]; // <-- сегменты с данными
 
   #ifdef GP_SMART_CACHE_ENABLE_GUI
     GtkWidget *grid; // <-- виджет, содержащий настройки GpSmartCache
-    gboolean mapped; // <-- флаг (под мьютексом), что виджет grid сейчас на экране
-    gboolean refresh_gui_pending; // <-- флаг (под мьютексом), что создан и еще не отработал g_idle на обновление GUI со статистикой кэша
+    volatile gint mapped; // <-- флаг (атомарный), что виджет grid сейчас на экране
+    volatile gint refresh_gui_pending; // <-- флаг (атомарный), что создан и еще не отработал g_idle на обновление GUI со статистикой кэша
     GtkWidget *spin; // <--  unowned-ссылка на виджет, содержащий поле для ввода размера кеша
     GtkWidget *progress; // <-- unowned-ссылка на виджет, показывающий степень заполнения кеша
+    GtkWidget *stats; // <-- unowned-ссылка на виджет, показывающий статистику работы кеша
+    guint stats_timeout_id; // <-- таймер обновления статистики, пока виджет grid на экране
   #endif
 };
 
-static inline RecordId *record_id_copy( RecordId *id )
+/*
+ * Хэш идентификатора записи (финализатор MurmurHash3 над 64-битным индексом,
+ * в который предварительно подмешан номер группы).
+ * Старшие биты хэша выбирают сегмент, младшие -- ячейку в таблице сегмента.
+ */
+static inline guint record_id_hash( guint group, guint64 index )
+{
+   guint64 h = index ^ ( group * G_GUINT64_CONSTANT( 0x9e3779b97f4a7c15 ));
+
+   h ^= h >> 33;
+   h *= G_GUINT64_CONSTANT( 0xff51afd7ed558ccd );
+   h ^= h >> 33;
+   h *= G_GUINT64_CONSTANT( 0xc4ceb9fe1a85ec53 );
+   h ^= h >> 33;
+
+   return (guint) h;
+}
+
+static inline Shard *get_shard( GpSmartCachePriv *priv, guint hash )
+{
+   return &priv->shards[hash >> ( 32 - SHARDS_BITS )];
+}
+
+/*
+ * Сравнение "времен" обращения к данным с учетом переполнения счетчика clock.
+ * Вернет TRUE, если обращение a было не позже обращения b.
+ */
+static inline gboolean stamp_older( guint a, guint b )
+{
+   return (gint) ( a - b ) <= 0;
+}
+
+/*
+ * Добавляет запись в голову списка list сегмента.
+ */
+static inline void list_push_head( Shard *shard, guint list, Record *record )
 {
-   RecordId *self;
+   RecordList *l = &shard->lists[list];
 
-   self = g_malloc( sizeof(RecordId) );
+   record->list = list;
+   record->prev = NULL;
+   record->next = l->head;
 
-   self->group = id->group;
-   self->index = id->index;
+   if (l->head)
+      l->head->prev = record;
+   else
+      l->tail = record;
 
-   return self;
+   l->head = record;
+   l->bytes += record->size;
+   l->count++ ;
 }
 
-static inline gint record_id_cmp( RecordId *a, RecordId *b )
+/*
+ * Исключает запись из списка сегмента, в котором она находится.
+ */
+static inline void list_unlink( Shard *shard, Record *record )
 {
-   if (a->group > b->group)
-      return 1;
+   RecordList *l = &shard->lists[record->list];
+
+   if (record->prev)
+      record->prev->next = record->next;
    else
-      if (a->group < b->group)
-         return -1;
-      else
-      {
-         if (a->index > b->index)
-            return 1;
-         else
-            if (a->index < b->index)
-               return -1;
-            else
-               return 0;
-      }
+      l->head = record->next;
+
+   if (record->next)
+      record->next->prev = record->prev;
+   else
+      l->tail = record->prev;
+
+   l->bytes -= record->size;
+   l->count-- ;
+}
+
+/*
+ * Перемещает запись в голову списка list сегмента.
+ */
+static inline void list_move_to_head( Shard *shard, guint list, Record *record )
+{
+   if (record->list == list && shard->lists[list].head == record)
+      return;
+
+   list_unlink( shard, record );
+   list_push_head( shard, list, record );
+}
+
+/*
+ * Захватывает мьютекс сегмента, учитывая время ожидания в статистике.
+ * Время замеряется только если мьютекс занят, поэтому без конкуренции накладных расходов нет.
+ */
+static inline void shard_lock( Shard *shard )
+{
+   gint64 start;
+
+   if (G_LIKELY( g_mutex_trylock( &shard->mutex )))
+      return;
+
+   start = g_get_monotonic_time();
+   g_mutex_lock( &shard->mutex );
+
+   shard->lock_contended++ ;
+   shard->lock_wait += g_get_monotonic_time() - start;
+}
+
+/*
+ * Текущее время, мкс от создания кэша.
+ */
+static inline gint64 cache_now( GpSmartCachePriv *priv )
+{
+   return g_get_monotonic_time() - priv->created;
 }
 
 /*
- * Поиск записи с указанным идентификатором.
- * Если запись существует, вернет TRUE и запишет в n ее номер.
- * Если запись не найдена, вернет FALSE и запишет в n номер элемента, рядом с которым она должны была находиться.
+ * Вернет группу в сегменте, при необходимости создав ее.
  */
-static inline gboolean find_record( Record *records, guint records_count, guint group, guint index, guint *n )
+static inline ShardGroup *shard_group( Shard *shard, guint group )
 {
-   guint start = 0;
-   guint end = records_count - 1;
-   RecordId id =
-   { .group = group, .index = index };
+   ShardGroup *result = g_hash_table_lookup( shard->groups, GUINT_TO_POINTER( group ));
 
-   if ( !records_count)
+   if (G_UNLIKELY( !result ))
    {
-      *n = 0;
-      return FALSE;
+      result = g_slice_new0( ShardGroup );
+      result->weight = 1;
+      g_hash_table_insert( shard->groups, GUINT_TO_POINTER( group ), result );
    }
 
-   while ( TRUE )
+   return result;
+}
+
+/*
+ * Освобождает данные группы: передает их функции повторного использования группы,
+ * если она задана (см. gp_smart_cache_set_group_recycle_func), иначе -- free_func.
+ * Вызывается под мьютексом сегмента.
+ */
+static inline void shard_free_data( GpSmartCachePriv *priv, Shard *shard, guint group, gpointer data, guint size )
+{
+   ShardGroup *group_data = g_hash_table_lookup( shard->groups, GUINT_TO_POINTER( group ));
+
+   if (group_data && group_data->recycle)
+      group_data->recycle( data, size, group_data->recycle_data );
+   else
+      priv->free_func( data );
+}
+
+/*
+ * Вернет счетчики статистики группы в сегменте, при необходимости создав их.
+ */
+static inline Counters *group_counters( Shard *shard, guint group )
+{
+   return &shard_group( shard, group )->counters;
+}
+
+/*
+ * Освобождает группу в сегменте (GDestroyNotify для _shard::groups).
+ */
+static void shard_group_free( gpointer group_data )
+{
+   g_slice_free( ShardGroup, group_data );
+}
+
+/*
+ * Освобождает функцию повторного использования данных группы (GDestroyNotify для _GpSmartCachePriv::recyclers).
+ */
+static void recycler_free( gpointer data )
+{
+   Recycler *recycler = data;
+
+   if (recycler->destroy)
+      recycler->destroy( recycler->user_data );
+
+   g_slice_free( Recycler, recycler );
+}
+
+/*
+ * Задает функцию повторного использования данных группы во всех сегментах.
+ * Вызывается под mutex.
+ */
+static void set_group_recycle_func( GpSmartCachePriv *priv, guint group, GpSmartCacheRecycleFunc func,
+                                    gpointer user_data, GDestroyNotify destroy )
+{
+   guint s;
+
+   for ( s = 0; s < SHARDS_NUM; s++ )
    {
-      guint mid;
-      gint cmp;
+      Shard *shard = &priv->shards[s];
+      ShardGroup *group_data;
 
-      mid = start + ( end - start ) / 2; // вычисление середины с защитой от переполнения
-      cmp = record_id_cmp( &id, &records[mid].id );
+      shard_lock( shard );
 
-      // Найдена запись с указанным идентификатором
-      if (cmp == 0)
+      group_data = func ? shard_group( shard, group ) : g_hash_table_lookup( shard->groups, GUINT_TO_POINTER( group ));
+      if (group_data)
       {
-         *n = mid;
-         return TRUE;
+         group_data->recycle = func;
+         group_data->recycle_data = user_data;
       }
 
-      // Запись с указанным идентификатором не найдена
-      if (start == end)
-      {
-         *n = start;
-         return FALSE;
-      }
+      g_mutex_unlock( &shard->mutex );
+   }
 
-      // Делим отрезок пополам
-      if (cmp > 0)
-         start = mid + 1;
-      else
-         if (cmp < 0)
-            end = mid;
+   // Старую функцию освобождаем после того, как сегменты перестали ее использовать
+   if (func)
+   {
+      Recycler *recycler = g_slice_new( Recycler );
+
+      recycler->func = func;
+      recycler->user_data = user_data;
+      recycler->destroy = destroy;
+
+      g_hash_table_replace( priv->recyclers, GUINT_TO_POINTER( group ), recycler );
    }
+   else
+      g_hash_table_remove( priv->recyclers, GUINT_TO_POINTER( group ));
 }
 
 /*
- * Освобождение памяти кэша.
- * Вернет количество особожденных байт.
+ * Обнуляет счетчики обращений, оставляя сведения о хранимых данных.
  */
-static inline guint free_space( Record **records, guint *records_count, GFreeFunc free_func, GList **access,
-                                gsize space )
+static void counters_reset( gpointer key, Counters *counters, gpointer user_data )
 {
-   guint rec_n;
-   gsize freed = 0;
-   guint initial_count = *records_count;
+   counters->hits = counters->misses = counters->inserts = counters->evictions = 0;
+   counters->bytes_evicted = 0;
+   counters->evicted_age = 0;
+   counters->compressions = counters->decompressions = counters->compressed_evictions = 0;
+   counters->disk_stores = counters->disk_loads = 0;
+}
 
-   if ( ! *records_count)
-      return 0;
+/*
+ * Обнуляет счетчики обращений группы (GHFunc для _shard::groups).
+ */
+static void shard_group_reset( gpointer key, ShardGroup *group_data, gpointer user_data )
+{
+   counters_reset( NULL, &group_data->counters, NULL );
+}
 
-   // Для ускорения работы изменим направление списка
-   *access = g_list_reverse( *access );
+/*
+ * Изменение счетчика статистики сегмента и группы.
+ */
+#define COUNTERS_ADD( SHARD, GROUP_COUNTERS, FIELD, VALUE ) \
+   G_STMT_START { ( SHARD )->total.FIELD += ( VALUE ); ( GROUP_COUNTERS )->FIELD += ( VALUE ); } G_STMT_END
 
-   // Удаляем старые данные
-   while ( freed < space && *access )
-   {
-      GList *link;
-      RecordId *link_id;
+/*
+ * Добавляет запись в голову списка группы.
+ */
+static inline void group_push_head( ShardGroup *group, Record *record )
+{
+   record->group_prev = NULL;
+   record->group_next = group->head;
 
-      // Берем звено с последним временем доступа
-      link = g_list_first( *access );
-      link_id = (RecordId*) link->data;
+   if (group->head)
+      group->head->group_prev = record;
+   else
+      group->tail = record;
 
-      // Найдем данные, соответствующие звену
-      g_assert( find_record( *records, *records_count, link_id->group, link_id->index, &rec_n ) );
+   group->head = record;
+}
 
-      // Удалим данные
-      free_func( ( *records )[rec_n].data );
-      freed += ( *records )[rec_n].size;
+/*
+ * Исключает запись из списка группы.
+ */
+static inline void group_unlink( ShardGroup *group, Record *record )
+{
+   if (record->group_prev)
+      record->group_prev->group_next = record->group_next;
+   else
+      group->head = record->group_next;
 
-      // Сместим данные
-      if ( *records_count > rec_n + 1)
-         memmove( &( *records )[rec_n], &( *records )[rec_n + 1], ( *records_count - ( rec_n + 1 ) ) * sizeof(Record) );
+   if (record->group_next)
+      record->group_next->group_prev = record->group_prev;
+   else
+      group->tail = record->group_prev;
+}
 
-      *records_count -= 1;
+/*
+ * Учитывает изменение объема данных группы в количестве групп сегмента, превысивших мягкое ограничение.
+ */
+static inline void group_check_quota( Shard *shard, ShardGroup *group, gboolean was_over_quota )
+{
+   if (GROUP_OVER_QUOTA( group ) != was_over_quota)
+      shard->over_quota += was_over_quota ? -1 : 1;
+}
 
-      // Если размер массива данных сильно уменьшился, освободим его память
-      if ( *records_count <= initial_count / 2)
-      {
-         *records = g_realloc( *records, *records_count * sizeof(Record) );
-         initial_count = *records_count;
-      }
+/*
+ * Учитывает в статистике и в списке группы появление у записи данных в основном кэше.
+ */
+static inline void stats_add_record( Shard *shard, Record *record )
+{
+   ShardGroup *group = shard_group( shard, record->id.group );
+   gboolean over_quota = GROUP_OVER_QUOTA( group );
 
-      // Удалим звено
-      g_free( link_id );
-      *access = g_list_delete_link( *access, link );
-   }
+   COUNTERS_ADD( shard, &group->counters, records, 1 );
+   COUNTERS_ADD( shard, &group->counters, bytes, record->size );
+   COUNTERS_ADD( shard, &group->counters, born_sum, record->born );
 
-   // Вернем направление списка
-   *access = g_list_reverse( *access );
+   group_push_head( group, record );
+   group_check_quota( shard, group, over_quota );
+}
 
-   return freed;
+/*
+ * Учитывает в статистике и в списке группы удаление данных записи из основного кэша.
+ */
+static inline void stats_remove_record( Shard *shard, Record *record )
+{
+   ShardGroup *group = shard_group( shard, record->id.group );
+   gboolean over_quota = GROUP_OVER_QUOTA( group );
+
+   COUNTERS_ADD( shard, &group->counters, records, -1 );
+   COUNTERS_ADD( shard, &group->counters, bytes, -(gssize) record->size );
+   COUNTERS_ADD( shard, &group->counters, born_sum, -record->born );
+
+   group_unlink( group, record );
+   group_check_quota( shard, group, over_quota );
 }
 
 /*
- * Находит элемент, расположенный слева или справа от номера n и относящийся к группе group.
- * Если такой элемент существует, вернет TRUE и сохранит его номер в n.
+ * Учитывает в статистике обращение к данным.
  */
-static inline gboolean find_neighbour_record( Record *records, guint records_count, guint group, guint *n )
+static inline void stats_access( Shard *shard, guint group, gboolean hit )
 {
-   if ( *n >= 0 && *n < records_count)
-      if (records[ *n].id.group == group)
-         return TRUE;
+   Counters *counters = group_counters( shard, group );
 
-   if ( *n > 0 && *n < records_count)
-      if (records[ *n - 1].id.group == group)
-      {
-         *n -= 1;
-         return TRUE;
-      }
+   if (hit)
+      COUNTERS_ADD( shard, counters, hits, 1 );
+   else
+      COUNTERS_ADD( shard, counters, misses, 1 );
+}
+
+/*
+ * Заменяет данные записи, учитывая новый размер в списке, в котором она находится.
+ */
+static inline void record_set_data( Shard *shard, Record *record, gpointer data, guint size )
+{
+   shard->lists[record->list].bytes -= record->size;
+   shard->lists[record->list].bytes += size;
+
+   record->data = data;
+   record->size = size;
+}
+
+/*
+ * Поиск записи с указанным идентификатором в таблице сегмента.
+ * Если запись существует, вернет TRUE и запишет в n номер ее ячейки.
+ * Если запись не найдена, вернет FALSE и запишет в n номер свободной ячейки, куда ее можно поместить.
+ */
+static inline gboolean shard_find( Shard *shard, guint hash, guint group, guint64 index, guint *n )
+{
+   guint mask = shard->capacity - 1;
+   guint i = hash & mask;
+   Record *record;
 
-   if ( *n >= 0 && *n < records_count - 1)
-      if (records[ *n + 1].id.group == group)
+   while ( ( record = shard->slots[i] ) )
+   {
+      if (record->hash == hash && record->id.group == group && record->id.index == index)
       {
-         *n += 1;
+         *n = i;
          return TRUE;
       }
 
+      i = ( i + 1 ) & mask;
+   }
+
+   *n = i;
    return FALSE;
 }
 
 /*
- * Перемещает звено в начало списка.
+ * Изменяет емкость таблицы сегмента, заново раскладывая записи по ячейкам.
  */
-static inline void make_first( GList **access, GList *link )
+static void shard_resize( Shard *shard, guint capacity )
 {
-   *access = g_list_remove_link( *access, link );
+   Record **old_slots = shard->slots;
+   guint old_capacity = shard->capacity;
+   guint mask = capacity - 1;
+   guint n;
 
-   if ( *access)
-      ( *access )->prev = link;
+   shard->slots = g_new0( Record*, capacity );
+   shard->capacity = capacity;
 
-   link->next = *access;
+   for ( n = 0; n < old_capacity; n++ )
+      if (old_slots[n])
+      {
+         guint i = old_slots[n]->hash & mask;
+
+         while ( shard->slots[i] )
+            i = ( i + 1 ) & mask;
+
+         shard->slots[i] = old_slots[n];
+      }
 
-   *access = link;
+   g_free( old_slots );
 }
 
-guint gp_smart_cache_reg_group (GpSmartCache *self)
+/*
+ * Удаляет запись из ячейки n таблицы сегмента (данные записи не освобождаются).
+ * Следующие за ней записи той же цепочки сдвигаются назад,
+ * поэтому таблице не нужны пометки удаленных ячеек.
+ */
+static void shard_unlink( Shard *shard, guint n )
 {
-   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
-   guint group;
-   gboolean generate = TRUE;
-
-   g_mutex_lock( &priv->mutex );
+   guint mask = shard->capacity - 1;
+   guint i = n;
+   guint j = n;
 
-   // Сгенерируем случайный номер
-   group = rand();
+   shard->slots[i] = NULL;
 
-   // Посмотрим, нет ли уже такой группы
-   while ( generate )
+   while ( TRUE )
    {
-      guint n;
+      guint k;
 
-      generate = FALSE;
-
-      for ( n = 0; n < priv->groups->len; n++ )
-         if (g_array_index( priv->groups, guint, n ) == group)
-         {
-            // Возьмем следующий номер
-            group++ ;
+      j = ( j + 1 ) & mask;
+      if ( !shard->slots[j])
+         break;
 
-            generate = TRUE;
-         }
+      // Запись из ячейки j можно перенести в освободившуюся ячейку i,
+      // если ее "родная" ячейка k не лежит (циклически) в интервале (i, j].
+      k = shard->slots[j]->hash & mask;
+      if (( j > i ) ? ( k <= i || k > j ) : ( k <= i && k > j ))
+      {
+         shard->slots[i] = shard->slots[j];
+         shard->slots[j] = NULL;
+         i = j;
+      }
    }
 
-   g_array_append_val( priv->groups, group );
-
-   g_mutex_unlock( &priv->mutex );
+   shard->count-- ;
 
-   return group;
+   // Если записей стало сильно меньше, уменьшим таблицу
+   if (shard->capacity > SHARD_MIN_CAPACITY && shard->count * 8 < shard->capacity)
+      shard_resize( shard, shard->capacity / 2 );
+}
+
+/*
+ * Освобождает данные записи. Если данные еще используются после gp_smart_cache_acquire,
+ * они переносятся в список удаленных данных сегмента и освобождаются при gp_smart_cache_release.
+ * Вернет размер освобожденных данных (у "призраков" ARC данных нет, вернет 0;
+ * сжатые данные учитываются в объеме сжатого уровня, для основного кэша тоже вернет 0).
+ */
+static inline guint record_drop_data( GpSmartCachePriv *priv, Shard *shard, Record *record )
+{
+   if (RECORD_IS_GHOST( record ))
+      return 0;
+
+   if (RECORD_IS_COMPRESSED( record ))
+   {
+      Counters *counters = group_counters( shard, record->id.group );
+
+      COUNTERS_ADD( shard, counters, compressed_records, -1 );
+      COUNTERS_ADD( shard, counters, compressed_bytes, -(gssize) record->csize );
+      shard->compressed_bytes -= record->csize;
+
+      g_free( record->data );
+
+      return 0;
+   }
+
+   stats_remove_record( shard, record );
+
+   if (record->pins)
+   {
+      Detached *detached = g_slice_new( Detached );
+
+      detached->data = record->data;
+      detached->size = record->size;
+      detached->group = record->id.group;
+      detached->pins = record->pins;
+      detached->epoch = priv->epoch;
+
+      shard->detached = g_slist_prepend( shard->detached, detached );
+      record->pins = 0;
+
+      return 0;
+   }
+
+   shard_free_data( priv, shard, record->id.group, record->data, record->size );
+
+   return record->size;
+}
+
+/*
+ * Удаляет запись из ячейки n таблицы сегмента и освобождает ее данные.
+ * Вернет размер освобожденных данных.
+ */
+static inline guint shard_delete( GpSmartCachePriv *priv, Shard *shard, guint n )
+{
+   Record *record = shard->slots[n];
+   guint size;
+
+   list_unlink( shard, record );
+   shard_unlink( shard, n );
+
+   size = record_drop_data( priv, shard, record );
+   g_slice_free( Record, record );
+
+   return size;
+}
+
+/*
+ * Удаляет все записи сегмента.
+ * Вернет количество особожденных байт.
+ */
+static gsize shard_clear( GpSmartCachePriv *priv, Shard *shard )
+{
+   gsize freed = 0;
+   guint n;
+
+   for ( n = 0; n < shard->capacity; n++ )
+      if (shard->slots[n])
+      {
+         freed += record_drop_data( priv, shard, shard->slots[n] );
+         g_slice_free( Record, shard->slots[n] );
+      }
+
+   memset( shard->lists, 0, sizeof( shard->lists ));
+   shard->arc_p = 0;
+   shard->compressed_bytes = 0;
+
+   g_free( shard->slots );
+   shard->slots = g_new0( Record*, SHARD_MIN_CAPACITY );
+   shard->capacity = SHARD_MIN_CAPACITY;
+   shard->count = 0;
+
+   return freed;
+}
+
+/*
+ * Отмечает обращение к данным записи согласно политике вытеснения.
+ */
+static inline void policy_hit( GpSmartCachePriv *priv, Shard *shard, Record *record )
+{
+   record->stamp = (guint) g_atomic_int_add( &priv->clock, 1 );
+   record->chances = 0;
+
+   switch (priv->policy)
+   {
+      case GP_SMART_CACHE_POLICY_CLOCK:
+         // Запись не перемещается, только получает "второй шанс"
+         record->referenced = TRUE;
+         break;
+
+      case GP_SMART_CACHE_POLICY_SLRU:
+         list_move_to_head( shard, LIST_T2, record );
+
+         // Ограничим защищенный сегмент, лишние записи вернем в испытательный
+         while ( shard->lists[LIST_T2].tail && shard->lists[LIST_T2].bytes > shard->slru_protected )
+            list_move_to_head( shard, LIST_T1, shard->lists[LIST_T2].tail );
+         break;
+
+      case GP_SMART_CACHE_POLICY_ARC:
+         list_move_to_head( shard, LIST_T2, record );
+         break;
+
+      case GP_SMART_CACHE_POLICY_LRU:
+      default:
+         list_move_to_head( shard, LIST_T1, record );
+         break;
+   }
+}
+
+/*
+ * Отмечает обращение к данным записи: согласно политике вытеснения и в списке группы.
+ */
+static inline void record_touch( GpSmartCachePriv *priv, Shard *shard, Record *record )
+{
+   ShardGroup *group = shard_group( shard, record->id.group );
+
+   policy_hit( priv, shard, record );
+
+   group_unlink( group, record );
+   group_push_head( group, record );
+}
+
+/*
+ * Помещает новую запись (или "призрака" ARC, для которого снова появились данные)
+ * в списки политики вытеснения. Поля data и size записи уже заполнены.
+ */
+static inline void policy_insert( GpSmartCachePriv *priv, Shard *shard, Record *record )
+{
+   record->stamp = (guint) g_atomic_int_add( &priv->clock, 1 );
+   record->referenced = FALSE;
+   record->chances = 0;
+
+   if (priv->policy == GP_SMART_CACHE_POLICY_ARC && RECORD_IS_GHOST( record ))
+   {
+      RecordList *b1 = &shard->lists[LIST_B1];
+      RecordList *b2 = &shard->lists[LIST_B2];
+      gsize resident = shard->lists[LIST_T1].bytes + shard->lists[LIST_T2].bytes;
+      gsize delta;
+
+      // Промах по "призраку" подсказывает, какой из списков T1/T2 стоило держать больше
+      if (record->list == LIST_B1)
+      {
+         delta = record->size * MAX( 1, b2->bytes / MAX( b1->bytes, 1 ));
+         shard->arc_p = MIN( shard->arc_p + delta, resident );
+      }
+      else
+      {
+         delta = record->size * MAX( 1, b1->bytes / MAX( b2->bytes, 1 ));
+         shard->arc_p = ( shard->arc_p > delta ) ? shard->arc_p - delta : 0;
+      }
+
+      list_unlink( shard, record );
+      list_push_head( shard, LIST_T2, record );
+      return;
+   }
+
+   list_push_head( shard, LIST_T1, record );
+}
+
+/*
+ * Возвращает список сегмента, из хвоста которого политика вытеснения выбирает запись (см. policy_victim).
+ * Если все записи выбранного списка используются после gp_smart_cache_acquire (список pinned),
+ * запись выбирается из другого списка: LIST_T1 вместо LIST_T2 и наоборот.
+ * Вернет NULL, если выбирать не из чего.
+ */
+static inline RecordList *policy_victim_list( GpSmartCachePriv *priv, Shard *shard, RecordList *pinned )
+{
+   RecordList *t1 = &shard->lists[LIST_T1];
+   RecordList *t2 = &shard->lists[LIST_T2];
+   RecordList *list;
+
+   switch (priv->policy)
+   {
+      case GP_SMART_CACHE_POLICY_CLOCK:
+         list = t1;
+         break;
+
+      case GP_SMART_CACHE_POLICY_ARC:
+         list = ( t1->tail && ( t1->bytes > shard->arc_p || !t2->tail ) ) ? t1 : t2;
+         break;
+
+      case GP_SMART_CACHE_POLICY_SLRU:
+      case GP_SMART_CACHE_POLICY_LRU:
+      default:
+         list = t1->tail ? t1 : t2;
+         break;
+   }
+
+   if (list == pinned)
+      list = ( list == t1 ) ? t2 : t1;
+
+   return ( list != pinned && list->tail ) ? list : NULL;
+}
+
+/*
+ * Возвращает запись сегмента, которую политика вытеснения предлагает удалить первой,
+ * либо NULL, если в сегменте нет данных (см. policy_victim_list про pinned).
+ */
+static inline Record *policy_victim( GpSmartCachePriv *priv, Shard *shard, RecordList *pinned )
+{
+   RecordList *t1 = &shard->lists[LIST_T1];
+   RecordList *list;
+
+   // Записи с битом обращения пропускаем, сбрасывая бит
+   if (priv->policy == GP_SMART_CACHE_POLICY_CLOCK)
+      while ( t1->tail && t1->tail->referenced )
+      {
+         t1->tail->referenced = FALSE;
+         list_move_to_head( shard, LIST_T1, t1->tail );
+      }
+
+   list = policy_victim_list( priv, shard, pinned );
+
+   return list ? list->tail : NULL;
+}
+
+/*
+ * Очередность вытеснения записи между сегментами: для SLRU и ARC записи из LIST_T1
+ * вытесняются раньше записей из LIST_T2 независимо от времени обращения,
+ * иначе однократный просмотр большого объема данных вытеснил бы часто используемые данные.
+ */
+static inline guint policy_rank( GpSmartCachePriv *priv, Record *record )
+{
+   if (priv->policy == GP_SMART_CACHE_POLICY_SLRU || priv->policy == GP_SMART_CACHE_POLICY_ARC)
+      return record->list;
+
+   return 0;
+}
+
+/*
+ * Вернет давно не использованную запись группы, не используемую после gp_smart_cache_acquire,
+ * или NULL, если таких записей нет.
+ */
+static inline Record *group_victim( ShardGroup *group )
+{
+   Record *record;
+
+   for ( record = group->tail; record && record->pins; record = record->group_prev );
+
+   return record;
+}
+
+/*
+ * Вернет запись группы сегмента, превысившей мягкое ограничение объема,
+ * к которой дольше всего не было обращений, либо NULL, если таких групп нет.
+ */
+static Record *shard_quota_victim( Shard *shard )
+{
+   Record *victim = NULL;
+   GHashTableIter iter;
+   gpointer group;
+
+   if (G_LIKELY( !shard->over_quota ))
+      return NULL;
+
+   g_hash_table_iter_init( &iter, shard->groups );
+   while ( g_hash_table_iter_next( &iter, NULL, &group ))
+   {
+      Record *record;
+
+      if ( !GROUP_OVER_QUOTA( (ShardGroup*) group ) || !( record = group_victim( group ) ))
+         continue;
+
+      if ( !victim || stamp_older( record->stamp, victim->stamp ))
+         victim = record;
+   }
+
+   return victim;
+}
+
+/*
+ * Возвращает запись сегмента, которую следует вытеснить первой, и в rank -- очередность ее вытеснения
+ * между сегментами (меньше -- раньше).
+ *
+ * Первыми вытесняются записи групп, превысивших мягкое ограничение объема.
+ * Остальные записи выбирает политика вытеснения, при этом пропускаются:
+ * - используемые после gp_smart_cache_acquire записи;
+ * - записи групп с весом больше 1, еще не исчерпавшие пропуски (см. ShardGroup::weight).
+ * Пропущенные записи переносятся в голову своего списка.
+ * Если используются все записи выбранного политикой списка, запись берется из другого списка.
+ *
+ * Вернет NULL, если вытеснять нечего.
+ */
+static inline Record *shard_victim( GpSmartCachePriv *priv, Shard *shard, guint *rank )
+{
+   RecordList *pinned = NULL;
+   guint skipped = 0;
+   Record *record;
+
+   if (( record = shard_quota_victim( shard ) ))
+   {
+      *rank = 0;
+      return record;
+   }
+
+   while ( ( record = policy_victim( priv, shard, pinned ) ) )
+   {
+      RecordList *list = &shard->lists[record->list];
+
+      if (record->pins)
+      {
+         // Все записи списка используются -- выбираем из другого списка
+         if ( ++skipped >= list->count )
+         {
+            if (pinned)
+               return NULL;
+
+            pinned = list;
+            skipped = 0;
+            continue;
+         }
+      }
+      else if (record->chances + 1u < shard_group( shard, record->id.group )->weight)
+      {
+         record->chances++ ;
+         skipped = 0;
+      }
+      else
+         break;
+
+      list_move_to_head( shard, record->list, record );
+   }
+
+   if (record)
+      *rank = 1 + policy_rank( priv, record );
+
+   return record;
+}
+
+/*
+ * Возвращает запись списка сегмента, которую shard_victim выберет первой, не изменяя список.
+ * Если все записи списка еще могут быть пропущены, вернет последнюю неиспользуемую:
+ * shard_victim выберет одну из них, когда пропуски закончатся.
+ * Вернет NULL, если все записи списка используются после gp_smart_cache_acquire.
+ */
+static inline Record *list_victim_peek( GpSmartCachePriv *priv, Shard *shard, RecordList *list )
+{
+   Record *fallback = NULL;
+   Record *record;
+
+   for ( record = list->tail; record; record = record->prev )
+   {
+      if (record->pins)
+         continue;
+
+      if ( !fallback)
+         fallback = record;
+
+      if (priv->policy == GP_SMART_CACHE_POLICY_CLOCK && record->referenced)
+         continue;
+
+      if (record->chances + 1u < shard_group( shard, record->id.group )->weight)
+         continue;
+
+      break;
+   }
+
+   return record ? record : fallback;
+}
+
+/*
+ * То же, что shard_victim, но без изменения сегмента: записи не переносятся в голову списка,
+ * пропуски групп и биты обращения CLOCK не расходуются. Нужна, чтобы сравнить кандидатов
+ * всех сегментов, не затрагивая те, из которых вытеснять не будем.
+ */
+static inline Record *shard_victim_peek( GpSmartCachePriv *priv, Shard *shard, guint *rank )
+{
+   RecordList *list;
+   Record *record;
+
+   if (( record = shard_quota_victim( shard ) ))
+   {
+      *rank = 0;
+      return record;
+   }
+
+   if (( list = policy_victim_list( priv, shard, NULL ) ))
+   {
+      record = list_victim_peek( priv, shard, list );
+
+      // Все записи списка используются -- кандидат из другого списка
+      if ( !record && ( list = policy_victim_list( priv, shard, list ) ))
+         record = list_victim_peek( priv, shard, list );
+   }
+
+   if (record)
+      *rank = 1 + policy_rank( priv, record );
+
+   return record;
+}
+
+/*
+ * Вернет TRUE, если кандидат (rank_a, stamp_a) должен быть вытеснен не позже кандидата (rank_b, stamp_b).
+ */
+static inline gboolean victim_older( guint rank_a, guint stamp_a, guint rank_b, guint stamp_b )
+{
+   if (rank_a != rank_b)
+      return rank_a < rank_b;
+
+   return stamp_older( stamp_a, stamp_b );
+}
+
+/*
+ * Переносит запись record в сжатый уровень кэша, если он включен и данные записи хорошо сжимаются.
+ * Чтобы сжатые данные поместились, вытесняет давно перенесенные записи сжатого уровня сегмента
+ * (при этом ячейки таблицы сегмента сдвигаются).
+ * Вернет TRUE, если запись перенесена.
+ */
+static gboolean record_compress( GpSmartCachePriv *priv, Shard *shard, Record *record )
+{
+   Counters *counters;
+   gpointer cdata;
+   guint csize;
+
+   if ( !shard->compressed_max || record->pins)
+      return FALSE;
+
+   cdata = rle_compress( record->data, record->size,
+                         MIN( record->size / COMPRESSED_MIN_RATIO, shard->compressed_max ), &csize );
+   if ( !cdata)
+      return FALSE;
+
+   while ( shard->compressed_bytes + csize > shard->compressed_max )
+   {
+      Record *old = shard->lists[LIST_C].tail;
+      guint old_n;
+
+      COUNTERS_ADD( shard, group_counters( shard, old->id.group ), compressed_evictions, 1 );
+
+      shard_find( shard, old->hash, old->id.group, old->id.index, &old_n );
+      shard_delete( priv, shard, old_n );
+   }
+
+   stats_remove_record( shard, record );
+
+   shard_free_data( priv, shard, record->id.group, record->data, record->size );
+   record->data = cdata;
+   record->csize = csize;
+
+   list_unlink( shard, record );
+   list_push_head( shard, LIST_C, record );
+   shard->compressed_bytes += csize;
+
+   counters = group_counters( shard, record->id.group );
+   COUNTERS_ADD( shard, counters, compressions, 1 );
+   COUNTERS_ADD( shard, counters, compressed_records, 1 );
+   COUNTERS_ADD( shard, counters, compressed_bytes, csize );
+
+   return TRUE;
+}
+
+/*
+ * Вытесняет запись record из ячейки n таблицы сегмента.
+ * Если включен дисковый уровень кэша, данные записи сохраняются на диск (если их там еще нет).
+ * Если включен сжатый уровень кэша, запись по возможности переносится в него.
+ * Для политики ARC запись становится "призраком": данные удаляются,
+ * а идентификатор остается в таблице, чтобы повторный промах по нему подстроил политику.
+ * Вернет количество освобожденных байт.
+ */
+static inline guint policy_evict( GpSmartCachePriv *priv, Shard *shard, Record *record, guint n )
+{
+   Counters *counters = group_counters( shard, record->id.group );
+   guint size = record->size;
+
+   if (priv->disk && GROUP_IS_PERSISTENT( record->id.group ) &&
+       disk_tier_store( priv->disk, record->id.group, record->id.index, record->data, size ))
+      COUNTERS_ADD( shard, counters, disk_stores, 1 );
+
+   if (record_compress( priv, shard, record ))
+      return size;
+
+   COUNTERS_ADD( shard, counters, evictions, 1 );
+   COUNTERS_ADD( shard, counters, bytes_evicted, size );
+   COUNTERS_ADD( shard, counters, evicted_age, cache_now( priv ) - record->born );
+
+   if (priv->policy != GP_SMART_CACHE_POLICY_ARC)
+      return shard_delete( priv, shard, n );
+
+   stats_remove_record( shard, record );
+
+   shard_free_data( priv, shard, record->id.group, record->data, size );
+   record->data = NULL;
+
+   list_unlink( shard, record );
+   list_push_head( shard, ( record->list == LIST_T1 ) ? LIST_B1 : LIST_B2, record );
+
+   // "Призраков" храним не больше, чем записей с данными
+   while ( shard->lists[LIST_B1].count + shard->lists[LIST_B2].count >
+           shard->lists[LIST_T1].count + shard->lists[LIST_T2].count )
+   {
+      guint list = ( shard->lists[LIST_B1].count > shard->lists[LIST_B2].count ) ? LIST_B1 : LIST_B2;
+      Record *ghost = shard->lists[list].tail;
+      guint ghost_n;
+
+      shard_find( shard, ghost->hash, ghost->id.group, ghost->id.index, &ghost_n );
+      shard_delete( priv, shard, ghost_n );
+   }
+
+   return size;
+}
+
+/*
+ * Возвращает освобожденную память в счетчик свободной памяти кэша.
+ * Вызывается под мьютексом сегмента, из которого была удалена запись.
+ */
+static inline void release_space( GpSmartCache *self, GpSmartCachePriv *priv, gsize size )
+{
+   if ( !size)
+      return;
+
+   g_mutex_lock( &priv->space_mutex );
+   priv->free += size;
+   g_mutex_unlock( &priv->space_mutex );
+
+   free_changed( self );
+}
+
+/*
+ * Соблюдение жесткого ограничения объема группы: если после добавления size байт данных группа
+ * превысит ограничение в сегменте, вытесняет ее давно использованные записи.
+ * Вызывается под мьютексом сегмента.
+ * Вернет FALSE, если данные больше ограничения объема группы во всем кэше.
+ */
+static gboolean shard_fit_quota( GpSmartCache *self, GpSmartCachePriv *priv, Shard *shard, guint group, gsize size )
+{
+   ShardGroup *group_data = shard_group( shard, group );
+   gsize freed = 0;
+   Record *record;
+
+   if ( !group_data->hard_quota)
+      return TRUE;
+
+   if (size > group_data->hard_quota * SHARDS_NUM)
+      return FALSE;
+
+   while ( group_data->counters.bytes + size > group_data->hard_quota &&
+           ( record = group_victim( group_data ) ) )
+   {
+      guint n;
+
+      shard_find( shard, record->hash, record->id.group, record->id.index, &n );
+      freed += policy_evict( priv, shard, record, n );
+   }
+
+   release_space( self, priv, freed );
+
+   return TRUE;
+}
+
+/*
+ * Освобождение памяти кэша.
+ *
+ * Удаляет данные, к которым дольше всего не было обращений (среди всех сегментов),
+ * пока не освободится space байт или пока кэш не опустеет.
+ * Сегменты блокируются по одному, поэтому функцию можно вызывать
+ * только не удерживая мьютекс ни одного из сегментов.
+ *
+ * Вернет количество освобожденных байт (они уже учтены в счетчике свободной памяти).
+ */
+static gsize free_space( GpSmartCache *self, GpSmartCachePriv *priv, gsize space )
+{
+   gsize freed = 0;
+
+   while ( freed < space )
+   {
+      Shard *victim = NULL;
+      guint oldest = 0, oldest_rank = 0;
+      guint next_oldest = 0, next_rank = 0;
+      gboolean has_next = FALSE;
+      guint s;
+
+      // Найдем сегмент, кандидат на вытеснение из которого использовался раньше всех,
+      // а также время использования самого старого кандидата среди остальных сегментов
+      for ( s = 0; s < SHARDS_NUM; s++ )
+      {
+         Shard *shard = &priv->shards[s];
+
+         shard_lock( shard );
+
+         guint rank;
+         Record *candidate = shard_victim_peek( priv, shard, &rank );
+
+         if (candidate)
+         {
+            guint stamp = candidate->stamp;
+
+            if ( !victim || victim_older( rank, stamp, oldest_rank, oldest ))
+            {
+               if (victim)
+               {
+                  next_oldest = oldest;
+                  next_rank = oldest_rank;
+                  has_next = TRUE;
+               }
+
+               oldest = stamp;
+               oldest_rank = rank;
+               victim = shard;
+            }
+            else
+               if ( !has_next || victim_older( rank, stamp, next_rank, next_oldest ))
+               {
+                  next_oldest = stamp;
+                  next_rank = rank;
+                  has_next = TRUE;
+               }
+         }
+
+         g_mutex_unlock( &shard->mutex );
+      }
+
+      // Кэш пуст
+      if ( !victim)
+         break;
+
+      // Удаляем из найденного сегмента записи, пока они старше записей остальных сегментов.
+      // Хотя бы одну запись удаляем в любом случае, чтобы цикл гарантированно продвигался.
+      shard_lock( victim );
+      {
+         gsize shard_freed = 0;
+         Record *record;
+         guint rank;
+
+         while ( freed + shard_freed < space && ( record = shard_victim( priv, victim, &rank ) ) )
+         {
+            guint n;
+
+            if (shard_freed && has_next && !victim_older( rank, record->stamp, next_rank, next_oldest ))
+               break;
+
+            shard_find( victim, record->hash, record->id.group, record->id.index, &n );
+            shard_freed += policy_evict( priv, victim, record, n );
+         }
+
+         release_space( self, priv, shard_freed );
+         freed += shard_freed;
+      }
+      g_mutex_unlock( &victim->mutex );
+   }
+
+   return freed;
+}
+
+/*
+ * Резервирует size байт под новые данные, при необходимости удаляя старые.
+ * В epoch запишет номер поколения кэша, в котором сделано резервирование.
+ * Вернет FALSE, если данные не помещаются в кэш.
+ */
+static gboolean reserve_space( GpSmartCache *self, GpSmartCachePriv *priv, gsize size, guint *epoch )
+{
+   while ( TRUE )
+   {
+      g_mutex_lock( &priv->space_mutex );
+
+      if (priv->size < size)
+      {
+         g_mutex_unlock( &priv->space_mutex );
+         return FALSE;
+      }
+
+      if (priv->free >= size)
+      {
+         priv->free -= size;
+         *epoch = priv->epoch;
+         g_mutex_unlock( &priv->space_mutex );
+
+         if (size)
+            free_changed( self );
+
+         return TRUE;
+      }
+
+      g_mutex_unlock( &priv->space_mutex );
+
+      // Освободим место
+      if ( !free_space( self, priv, size * GP_SMART_CACHE_FREE_K ))
+         return FALSE;
+   }
+}
+
+/*
+ * Сохраняет данные в сегменте, если записи с данными с таким идентификатором в нем нет.
+ * rec_n -- результат shard_find: ячейка "призрака" ARC или свободная ячейка.
+ * Вернет запись, которой принадлежат данные.
+ */
+static Record *shard_insert( GpSmartCachePriv *priv, Shard *shard, guint hash, guint group, guint64 index,
+                             guint rec_n, gpointer data, guint size )
+{
+   Record *record;
+
+   if (shard->slots[rec_n])
+   {
+      /*
+       * Найден "призрак" ARC с указанным идентификатором.
+       * Вернем ему данные.
+       */
+
+      record = shard->slots[rec_n];
+
+      policy_insert( priv, shard, record );
+      record_set_data( shard, record, data, size );
+
+      return record;
+   }
+
+   /*
+    * Запись с указанным идентификатором не найдена.
+    * Добавим новую запись.
+    */
+
+   // Если таблица заполнена более чем на 3/4, увеличим ее
+   if (( shard->count + 1 ) * 4 > shard->capacity * 3)
+   {
+      shard_resize( shard, shard->capacity * 2 );
+      shard_find( shard, hash, group, index, &rec_n );
+   }
+
+   record = g_slice_new( Record );
+   record->id.group = group;
+   record->id.index = index;
+   record->hash = hash;
+   record->data = data;
+   record->size = size;
+   record->pins = 0;
+   record->list = LIST_T1; // <-- новая запись не является "призраком"
+
+   policy_insert( priv, shard, record );
+
+   shard->slots[rec_n] = record;
+   shard->count++ ;
+
+   return record;
+}
+
+/*
+ * Загружает данные с дискового уровня кэша, если их нет в сегменте.
+ * Вызывается под мьютексом сегмента, но на время резервирования памяти освобождает его,
+ * поэтому после вызова запись нужно искать в таблице заново.
+ * Вернет FALSE, если данных на диске нет или они не помещаются в кэш.
+ */
+static gboolean shard_load( GpSmartCache *self, GpSmartCachePriv *priv, Shard *shard,
+                            guint hash, guint group, guint64 index )
+{
+   Record *record;
+   gpointer data;
+   guint epoch;
+   gboolean stale;
+   guint size;
+   guint rec_n;
+
+   if ( !priv->disk || !GROUP_IS_PERSISTENT( group ) || !disk_tier_lookup( priv->disk, group, index, &size ) ||
+        !shard_fit_quota( self, priv, shard, group, size ))
+      return FALSE;
+
+   g_mutex_unlock( &shard->mutex );
+
+   if ( !reserve_space( self, priv, size, &epoch ))
+   {
+      shard_lock( shard );
+      return FALSE;
+   }
+
+   data = g_malloc( size );
+
+   shard_lock( shard );
+
+   g_mutex_lock( &priv->space_mutex );
+   stale = ( epoch != priv->epoch );
+   g_mutex_unlock( &priv->space_mutex );
+
+   if (stale)
+   {
+      g_free( data );
+      return TRUE;
+   }
+
+   // Пока мьютекс сегмента был свободен, данные могли сохранить в кэш
+   if (shard_find( shard, hash, group, index, &rec_n ) && !RECORD_IS_GHOST( shard->slots[rec_n] ))
+   {
+      g_free( data );
+      release_space( self, priv, size );
+      return TRUE;
+   }
+
+   // Данные считываются под мьютексом сегмента: уровень не может быть отключен, пока он захвачен
+   if ( !priv->disk || !disk_tier_read( priv->disk, group, index, data, size ))
+   {
+      g_free( data );
+      release_space( self, priv, size );
+      return FALSE;
+   }
+
+   record = shard_insert( priv, shard, hash, group, index, rec_n, data, size );
+   record->born = cache_now( priv );
+   stats_add_record( shard, record );
+   COUNTERS_ADD( shard, group_counters( shard, group ), disk_loads, 1 );
+
+   return TRUE;
+}
+
+/*
+ * Возвращает запись сжатого уровня в основной кэш, распаковывая ее данные.
+ * Вызывается под мьютексом сегмента, но на время резервирования памяти освобождает его,
+ * поэтому после вызова запись нужно искать в таблице заново.
+ * Вернет FALSE, если распакованные данные не помещаются в кэш.
+ */
+static gboolean shard_decompress( GpSmartCache *self, GpSmartCachePriv *priv, Shard *shard, Record *record )
+{
+   RecordId id = record->id;
+   guint hash = record->hash;
+   guint size = record->size;
+   gpointer data;
+   guint epoch;
+   gboolean stale;
+   guint rec_n;
+
+   if ( !shard_fit_quota( self, priv, shard, id.group, size ))
+      return FALSE;
+
+   g_mutex_unlock( &shard->mutex );
+
+   if ( !reserve_space( self, priv, size, &epoch ))
+   {
+      shard_lock( shard );
+      return FALSE;
+   }
+
+   data = g_malloc( size );
+
+   shard_lock( shard );
+
+   g_mutex_lock( &priv->space_mutex );
+   stale = ( epoch != priv->epoch );
+   g_mutex_unlock( &priv->space_mutex );
+
+   // Пока мьютекс сегмента был свободен, кэш могли очистить, а запись -- заменить или удалить
+   if (stale || !shard_find( shard, hash, id.group, id.index, &rec_n ) ||
+       !RECORD_IS_COMPRESSED( shard->slots[rec_n] ) || shard->slots[rec_n]->size != size)
+   {
+      g_free( data );
+
+      if ( !stale)
+         release_space( self, priv, size );
+
+      return TRUE;
+   }
+
+   record = shard->slots[rec_n];
+
+   if ( !rle_decompress( record->data, record->csize, data, size ))
+   {
+      g_critical( "GpSmartCache: corrupted compressed data (group %u, index %" G_GUINT64_FORMAT ")", id.group, id.index );
+
+      g_free( data );
+      shard_delete( priv, shard, rec_n );
+      release_space( self, priv, size );
+
+      return TRUE;
+   }
+
+   COUNTERS_ADD( shard, group_counters( shard, id.group ), decompressions, 1 );
+
+   // Освободим сжатые данные и вернем запись в списки политики вытеснения
+   record_drop_data( priv, shard, record );
+   list_unlink( shard, record );
+
+   record->data = data;
+   record->list = LIST_T1;
+   policy_insert( priv, shard, record );
+   stats_add_record( shard, record );
+
+   return TRUE;
+}
+
+/*
+ * Поиск данных в сегменте под его мьютексом. Данные из сжатого и дискового уровней
+ * возвращаются в основной кэш.
+ * Вернет запись с данными или NULL, если данных нет.
+ */
+static Record *shard_lookup( GpSmartCache *self, GpSmartCachePriv *priv, Shard *shard,
+                             guint hash, guint group, guint64 index )
+{
+   guint rec_n;
+
+   while ( TRUE )
+   {
+      // "Призраки" ARC данных не содержат
+      if (shard_find( shard, hash, group, index, &rec_n ) && !RECORD_IS_GHOST( shard->slots[rec_n] ))
+      {
+         Record *record = shard->slots[rec_n];
+
+         if ( !RECORD_IS_COMPRESSED( record ))
+            return record;
+
+         if ( !shard_decompress( self, priv, shard, record ))
+            return NULL;
+      }
+      else if ( !shard_load( self, priv, shard, hash, group, index ))
+         return NULL;
+   }
+}
+
+/*
+ * Вызывает функцию func для данных записи. Данные записи сжатого уровня распаковываются
+ * во временный буфер, а если func их изменила (modified), сжимаются заново.
+ * Вернет результат func.
+ */
+static gboolean record_access( GpSmartCachePriv *priv, Shard *shard, Record *record,
+                               GpSmartCacheAccessFunc func, gpointer user_data, gboolean modified )
+{
+   gpointer data, cdata;
+   gboolean result;
+   guint csize;
+
+   if ( !RECORD_IS_COMPRESSED( record ))
+      return func( record->data, record->size, user_data );
+
+   data = g_malloc( record->size );
+
+   if ( !rle_decompress( record->data, record->csize, data, record->size ))
+   {
+      g_free( data );
+      return FALSE;
+   }
+
+   result = func( data, record->size, user_data );
+
+   if (modified)
+   {
+      // Измененные данные могут сжиматься хуже, но сжатие в любом случае удастся:
+      // кодирование длин серий увеличивает размер данных не более чем на одно слово
+      cdata = rle_compress( data, record->size, record->size + 2 * sizeof( guint32 ), &csize );
+
+      if (cdata)
+      {
+         Counters *counters = group_counters( shard, record->id.group );
+
+         COUNTERS_ADD( shard, counters, compressed_bytes, (gssize) csize - (gssize) record->csize );
+         shard->compressed_bytes += csize;
+         shard->compressed_bytes -= record->csize;
+
+         g_free( record->data );
+         record->data = cdata;
+         record->csize = csize;
+      }
+   }
+
+   g_free( data );
+
+   return result;
+}
+
+guint gp_smart_cache_reg_group (GpSmartCache *self)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   guint group;
+   gboolean generate = TRUE;
+
+   g_mutex_lock( &priv->mutex );
+
+   // Сгенерируем случайный номер вне диапазона постоянных групп
+   group = rand() % GP_SMART_CACHE_PERSISTENT_GROUP_MIN;
+
+   // Посмотрим, нет ли уже такой группы
+   while ( generate )
+   {
+      guint n;
+
+      generate = FALSE;
+
+      for ( n = 0; n < priv->groups->len; n++ )
+         if (g_array_index( priv->groups, guint, n ) == group)
+         {
+            // Возьмем следующий номер
+            group = ( group + 1 ) % GP_SMART_CACHE_PERSISTENT_GROUP_MIN;
+
+            generate = TRUE;
+         }
+   }
+
+   g_array_append_val( priv->groups, group );
+
+   g_mutex_unlock( &priv->mutex );
+
+   return group;
+}
+
+gboolean gp_smart_cache_reg_persistent_group (GpSmartCache *self, guint group)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   guint n;
+
+   if ( !GROUP_IS_PERSISTENT( group ))
+      return FALSE;
+
+   g_mutex_lock( &priv->mutex );
+
+   for ( n = 0; n < priv->groups->len; n++ )
+      if (g_array_index( priv->groups, guint, n ) == group)
+      {
+         g_mutex_unlock( &priv->mutex );
+         return FALSE;
+      }
+
+   g_array_append_val( priv->groups, group );
+
+   g_mutex_unlock( &priv->mutex );
+
+   return TRUE;
+}
+
+guint gp_smart_cache_persistent_group_id (const gchar *name)
+{
+   guint32 hash = 2166136261u;
+
+   // FNV-1a: в отличие от g_str_hash, результат зафиксирован этой реализацией
+   for ( ; *name; name++ )
+      hash = ( hash ^ (guchar) *name ) * 16777619u;
+
+   return GP_SMART_CACHE_PERSISTENT_GROUP_MIN | hash;
+}
+
+guint gp_smart_cache_reg_group_full (GpSmartCache *self, gsize soft_quota, gsize hard_quota, guint weight)
+{
+   guint group = gp_smart_cache_reg_group( self );
+
+   gp_smart_cache_set_group_quota( self, group, soft_quota, hard_quota, weight );
+
+   return group;
+}
+
+void gp_smart_cache_set_group_recycle_func (GpSmartCache *self, guint group, GpSmartCacheRecycleFunc func,
+                                            gpointer user_data, GDestroyNotify destroy)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+
+   g_mutex_lock( &priv->mutex );
+   set_group_recycle_func( priv, group, func, user_data, destroy );
+   g_mutex_unlock( &priv->mutex );
+}
+
+void gp_smart_cache_set_group_quota (GpSmartCache *self, guint group, gsize soft_quota, gsize hard_quota,
+                                     guint weight)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   guint s;
+
+   for ( s = 0; s < SHARDS_NUM; s++ )
+   {
+      Shard *shard = &priv->shards[s];
+      ShardGroup *group_data;
+      gboolean over_quota;
+
+      shard_lock( shard );
+
+      group_data = shard_group( shard, group );
+      over_quota = GROUP_OVER_QUOTA( group_data );
+
+      // Ограничения делятся между сегментами, но не обнуляются при делении
+      group_data->soft_quota = soft_quota ? MAX( soft_quota / SHARDS_NUM, 1 ) : 0;
+      group_data->hard_quota = hard_quota ? MAX( hard_quota / SHARDS_NUM, 1 ) : 0;
+      group_data->weight = CLAMP( weight, 1, GROUP_MAX_WEIGHT );
+
+      group_check_quota( shard, group_data, over_quota );
+
+      // Лишние данные вытесним сразу
+      shard_fit_quota( self, priv, shard, group, 0 );
+
+      g_mutex_unlock( &shard->mutex );
+   }
 }
 
 
@@ -323,191 +1829,494 @@ GpSmartCache *gp_smart_cache_new ()
   return g_object_new(GP_SMART_CACHE_TYPE, NULL);
 }
 
-
-void gp_smart_cache_unreg_group (GpSmartCache *self, guint group)
+
+GpSmartCache *gp_smart_cache_new_with_policy (GpSmartCachePolicy policy)
+{
+  return g_object_new(GP_SMART_CACHE_TYPE, "policy", policy, NULL);
+}
+
+
+GpSmartCachePolicy gp_smart_cache_get_policy (GpSmartCache *self)
+{
+  return GP_SMART_CACHE_GET_PRIVATE( self )->policy;
+}
+
+
+GType gp_smart_cache_policy_get_type (void)
+{
+  static volatile gsize type_id = 0;
+
+  if( g_once_init_enter( &type_id ))
+  {
+    static const GEnumValue values[] =
+    {
+      { GP_SMART_CACHE_POLICY_LRU, "GP_SMART_CACHE_POLICY_LRU", "lru" },
+      { GP_SMART_CACHE_POLICY_CLOCK, "GP_SMART_CACHE_POLICY_CLOCK", "clock" },
+      { GP_SMART_CACHE_POLICY_SLRU, "GP_SMART_CACHE_POLICY_SLRU", "slru" },
+      { GP_SMART_CACHE_POLICY_ARC, "GP_SMART_CACHE_POLICY_ARC", "arc" },
+      { 0, NULL, NULL }
+    };
+
+    g_once_init_leave( &type_id, g_enum_register_static( "GpSmartCachePolicy", values ));
+  }
+
+  return type_id;
+}
+
+
+void gp_smart_cache_unreg_group (GpSmartCache *self, guint group)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   guint n;
+
+   g_mutex_lock( &priv->mutex );
+
+   for ( n = 0; n < priv->groups->len; n++ )
+      if (g_array_index( priv->groups, guint, n ) == group)
+      {
+         g_array_remove_index( priv->groups, n );
+         break;
+      }
+
+   // Данные группы, оставшиеся в кэше, будут освобождаться через free_func
+   set_group_recycle_func( priv, group, NULL, NULL, NULL );
+
+   // Удалим статистику и ограничения группы
+   // (если данные группы еще в кэше, обнулим только счетчики обращений и снимем ограничения)
+   for ( n = 0; n < SHARDS_NUM; n++ )
+   {
+      Shard *shard = &priv->shards[n];
+      ShardGroup *group_data;
+
+      shard_lock( shard );
+
+      group_data = g_hash_table_lookup( shard->groups, GUINT_TO_POINTER( group ));
+
+      if (group_data && !group_data->counters.records && !group_data->counters.compressed_records)
+         g_hash_table_remove( shard->groups, GUINT_TO_POINTER( group ));
+      else if (group_data)
+      {
+         gboolean over_quota = GROUP_OVER_QUOTA( group_data );
+
+         counters_reset( NULL, &group_data->counters, NULL );
+         group_data->soft_quota = group_data->hard_quota = 0;
+         group_data->weight = 1;
+         group_check_quota( shard, group_data, over_quota );
+      }
+
+      g_mutex_unlock( &shard->mutex );
+   }
+
+   g_mutex_unlock( &priv->mutex );
+}
+
+void gp_smart_cache_set_size (GpSmartCache *self, gsize size)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   gint s;
+
+   g_mutex_lock( &priv->mutex );
+
+   for ( s = 0; s < SHARDS_NUM; s++ )
+      g_mutex_lock( &priv->shards[s].mutex );
+
+   // Очистим кэш
+   for ( s = 0; s < SHARDS_NUM; s++ )
+   {
+      shard_clear( priv, &priv->shards[s] );
+      priv->shards[s].slru_protected = size / SHARDS_NUM / 100 * SLRU_PROTECTED_PERCENT;
+   }
+
+   g_mutex_lock( &priv->space_mutex );
+
+   priv->size = size;
+   priv->free = size;
+   priv->epoch++ ;
+
+   g_mutex_unlock( &priv->space_mutex );
+
+   for ( s = SHARDS_NUM - 1; s >= 0; s-- )
+      g_mutex_unlock( &priv->shards[s].mutex );
+
+   g_mutex_unlock( &priv->mutex );
+
+   free_changed(self);
+}
+
+gsize gp_smart_cache_get_size (GpSmartCache *self)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   gsize size;
+
+   g_mutex_lock( &priv->space_mutex );
+
+   size = priv->size;
+
+   g_mutex_unlock( &priv->space_mutex );
+
+   return size;
+}
+
+gsize gp_smart_cache_get_free (GpSmartCache *self)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   gsize free;
+
+   g_mutex_lock( &priv->space_mutex );
+
+   free = priv->free;
+
+   g_mutex_unlock( &priv->space_mutex );
+
+   return free;
+}
+
+
+void gp_smart_cache_set_compressed_size (GpSmartCache *self, gsize size)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   gint s;
+
+   g_mutex_lock( &priv->mutex );
+
+   for ( s = 0; s < SHARDS_NUM; s++ )
+   {
+      Shard *shard = &priv->shards[s];
+
+      shard_lock( shard );
+
+      // Удалим записи сжатого уровня
+      while ( shard->lists[LIST_C].tail )
+      {
+         Record *record = shard->lists[LIST_C].tail;
+         guint rec_n;
+
+         shard_find( shard, record->hash, record->id.group, record->id.index, &rec_n );
+         shard_delete( priv, shard, rec_n );
+      }
+
+      shard->compressed_max = size / SHARDS_NUM;
+
+      g_mutex_unlock( &shard->mutex );
+   }
+
+   priv->compressed_size = size;
+
+   g_mutex_unlock( &priv->mutex );
+}
+
+gsize gp_smart_cache_get_compressed_size (GpSmartCache *self)
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   gsize size;
+
+   g_mutex_lock( &priv->mutex );
+
+   size = priv->compressed_size;
+
+   g_mutex_unlock( &priv->mutex );
+
+   return size;
+}
+
+
+/*
+ * Удаляет из памяти данные группы, удовлетворяющие условию (все данные, если condition равна NULL).
+ * Дисковый уровень не затрагивается.
+ */
+static void cache_clean_records( GpSmartCache *self, GpSmartCachePriv *priv, guint group,
+                                 GpSmartCacheAccessFunc condition, gpointer user_data )
+{
+  GPtrArray *deleted = g_ptr_array_new();
+  guint s;
+  guint n;
+
+  for ( s = 0; s < SHARDS_NUM; s++ )
+  {
+    Shard *shard = &priv->shards[s];
+    gsize freed = 0;
+
+    shard_lock( shard );
+
+    // Удаление сдвигает записи в таблице, поэтому сначала соберем удаляемые записи,
+    // а затем удалим их по одной.
+    for ( n = 0; n < shard->capacity; n++ )
+    {
+      Record *record = shard->slots[n];
+
+      if( !record || record->id.group != group )
+        continue;
+
+      // "Призраки" удаляем только вместе со всей группой
+      if( RECORD_IS_GHOST( record ))
+      {
+        if( !condition )
+          g_ptr_array_add( deleted, record );
+        continue;
+      }
+
+      if( !condition || record_access( priv, shard, record, condition, user_data, FALSE ))
+        g_ptr_array_add( deleted, record );
+    }
+
+    for ( n = 0; n < deleted->len; n++ )
+    {
+      Record *record = g_ptr_array_index( deleted, n );
+      guint rec_n;
+
+      shard_find( shard, record->hash, record->id.group, record->id.index, &rec_n );
+      freed += shard_delete( priv, shard, rec_n );
+    }
+
+    release_space( self, priv, freed );
+
+    g_mutex_unlock( &shard->mutex );
+
+    g_ptr_array_set_size( deleted, 0 );
+  }
+
+  g_ptr_array_free( deleted, TRUE );
+}
+
+typedef struct _record_store_data
+{
+   DiskTier *disk;
+   RecordId id;
+} RecordStoreData;
+
+/*
+ * Сохраняет данные записи на диск (gp_smart_cache_sync_disk), см. record_access.
+ */
+static gboolean record_store( gconstpointer data, guint size, RecordStoreData *store )
+{
+   return disk_tier_store( store->disk, store->id.group, store->id.index, data, size );
+}
+
+gboolean gp_smart_cache_set_disk_file (GpSmartCache *self, const gchar *filename, gsize size)
 {
    GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
-   guint n;
+   DiskTier *disk = NULL;
+   GHashTableIter iter;
+   gpointer group, stamp;
+   gint s;
 
    g_mutex_lock( &priv->mutex );
 
-   for ( n = 0; n < priv->groups->len; n++ )
-      if (g_array_index( priv->groups, guint, n ) == group)
-      {
-         g_array_remove_index( priv->groups, n );
-         break;
-      }
+   if (filename && !( disk = disk_tier_open( filename, size ) ))
+   {
+      g_mutex_unlock( &priv->mutex );
+      return FALSE;
+   }
+
+   // Поколения данных групп, заданные до открытия файла
+   if (disk)
+   {
+      g_hash_table_iter_init( &iter, priv->group_stamps );
+      while ( g_hash_table_iter_next( &iter, &group, &stamp ))
+         disk_tier_set_group_stamp( disk, GPOINTER_TO_UINT( group ), *(guint64*) stamp );
+   }
+
+   for ( s = 0; s < SHARDS_NUM; s++ )
+      g_mutex_lock( &priv->shards[s].mutex );
+
+   if (priv->disk)
+      disk_tier_close( priv->disk );
+
+   priv->disk = disk;
+
+   for ( s = SHARDS_NUM - 1; s >= 0; s-- )
+      g_mutex_unlock( &priv->shards[s].mutex );
 
    g_mutex_unlock( &priv->mutex );
+
+   return TRUE;
 }
 
-void gp_smart_cache_set_size (GpSmartCache *self, gsize size)
+void gp_smart_cache_set_group_stamp (GpSmartCache *self, guint group, guint64 stamp)
 {
    GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   guint64 *old_stamp;
+   gboolean changed;
 
    g_mutex_lock( &priv->mutex );
 
-   // Очистим кэш
-   priv->free += free_space( &priv->records, &priv->records_count, priv->free_func, &priv->access, priv->size );
-   g_assert( priv->free == priv->size );
+   old_stamp = g_hash_table_lookup( priv->group_stamps, GUINT_TO_POINTER( group ));
+   changed = ( old_stamp ? *old_stamp : 0 ) != stamp;
 
-   priv->size = size;
-   priv->free = size;
-   free_changed(self);
+   // Данные в памяти получены для прежнего поколения: при вытеснении они попали бы на диск с новым,
+   // поэтому удаляем их до того, как новое поколение станет известно дисковому уровню.
+   // Записи, вытесненные до этого момента, сохранены с прежним поколением и будут удалены с диска ниже
+   if (changed)
+      cache_clean_records( self, priv, group, NULL, NULL );
+
+   g_hash_table_insert( priv->group_stamps, GUINT_TO_POINTER( group ), g_memdup( &stamp, sizeof( stamp )));
+
+   if (priv->disk)
+      disk_tier_set_group_stamp( priv->disk, group, stamp );
 
    g_mutex_unlock( &priv->mutex );
 }
 
-gsize gp_smart_cache_get_size (GpSmartCache *self)
+void gp_smart_cache_sync_disk (GpSmartCache *self)
 {
    GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
-   gsize size;
+   guint s;
+   guint n;
 
    g_mutex_lock( &priv->mutex );
 
-   size = priv->size;
+   if ( !priv->disk)
+   {
+      g_mutex_unlock( &priv->mutex );
+      return;
+   }
 
-   g_mutex_unlock( &priv->mutex );
+   // Сохраним данные, которых еще нет на диске
+   for ( s = 0; s < SHARDS_NUM; s++ )
+   {
+      Shard *shard = &priv->shards[s];
 
-   return size;
-}
+      shard_lock( shard );
 
-gsize gp_smart_cache_get_free (GpSmartCache *self)
-{
-   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
-   gsize free;
+      for ( n = 0; n < shard->capacity; n++ )
+      {
+         Record *record = shard->slots[n];
+         RecordStoreData store;
 
-   g_mutex_lock( &priv->mutex );
+         if ( !record || RECORD_IS_GHOST( record ) || !GROUP_IS_PERSISTENT( record->id.group ))
+            continue;
 
-   free = priv->free;
+         store.disk = priv->disk;
+         store.id = record->id;
 
-   g_mutex_unlock( &priv->mutex );
+         if (record_access( priv, shard, record, (GpSmartCacheAccessFunc) record_store, &store, FALSE ))
+            COUNTERS_ADD( shard, group_counters( shard, record->id.group ), disk_stores, 1 );
+      }
 
-   return free;
+      g_mutex_unlock( &shard->mutex );
+   }
+
+   disk_tier_sync( priv->disk );
+
+   g_mutex_unlock( &priv->mutex );
 }
 
 
-void gp_smart_cache_set_unowned(GpSmartCache *self, guint group, guint index, gpointer data, guint size)
+void gp_smart_cache_set_unowned(GpSmartCache *self, guint group, guint64 index, gpointer data, guint size)
 {
   gp_smart_cache_set(self, group, index, g_memdup(data, size), size);
 }
 
 
-void gp_smart_cache_set (GpSmartCache *self, guint group, guint index, gpointer data, guint size)
+void gp_smart_cache_set (GpSmartCache *self, guint group, guint64 index, gpointer data, guint size)
 {
    GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
-   RecordId id =
-   { .group = group, .index = index };
+   guint hash = record_id_hash( group, index );
+   Shard *shard = get_shard( priv, hash );
+   Record *record;
+   guint epoch;
+   gboolean stale;
+   gboolean fits;
    guint rec_n;
 
-   g_mutex_lock( &priv->mutex );
+   // Соблюдем ограничение объема группы
+   shard_lock( shard );
+   fits = shard_fit_quota( self, priv, shard, group, size );
+   g_mutex_unlock( &shard->mutex );
 
-   if (priv->size < size)
+   // Освободим место
+   if ( !fits || !reserve_space( self, priv, size, &epoch ))
    {
       priv->free_func( data );
-      g_mutex_unlock( &priv->mutex );
       return;
    }
 
-   gsize old_free = priv->free;
+   shard_lock( shard );
 
-   // Освободим место
-   if (priv->free < size)
+   // Если пока мы освобождали место кэш был очищен, резервирование недействительно
+   g_mutex_lock( &priv->space_mutex );
+   stale = ( epoch != priv->epoch );
+   g_mutex_unlock( &priv->space_mutex );
+
+   if (stale)
    {
-      priv->free += free_space( &priv->records, &priv->records_count, priv->free_func, &priv->access, size
-            * GP_SMART_CACHE_FREE_K );
-      g_assert( priv->free >= size );
+      g_mutex_unlock( &shard->mutex );
+      priv->free_func( data );
+      return;
    }
 
    // Поищем данные с таким-же идентификатором в кэше
-   if (find_record( priv->records, priv->records_count, group, index, &rec_n ))
+   if (shard_find( shard, hash, group, index, &rec_n ) && !RECORD_IS_GHOST( shard->slots[rec_n] ))
    {
       /*
        * Найдена запись с указанным идентификатором.
        * Заменим ее данные.
        */
 
-      // Переместим звено в начало списка
-      make_first( &priv->access, priv->records[rec_n].access );
+      record = shard->slots[rec_n];
 
       // Удалим старые данные
-      priv->free_func( priv->records[rec_n].data );
-      priv->free += priv->records[rec_n].size;
-
-      // Сохраним данные
-      priv->records[rec_n].data = data;
-      priv->records[rec_n].size = size;
-      priv->free -= size;
-   }
-   else
-   {
-      guint new_rec_n = 0; // номер новой записи в массиве
+      release_space( self, priv, record_drop_data( priv, shard, record ));
 
-      /*
-       * Запись с указанным идентификатором не найдена.
-       * Добавим новую запись.
-       */
+      // Сохраним новые данные и отметим обращение к записи
+      if (RECORD_IS_COMPRESSED( record ))
+      {
+         // Запись сжатого уровня возвращается в основной кэш как новая
+         list_unlink( shard, record );
 
-      // Найдем куда вставить новый элемент
-      if (priv->records_count)
+         record->data = data;
+         record->size = size;
+         record->list = LIST_T1;
+         policy_insert( priv, shard, record );
+      }
+      else
       {
-         if (record_id_cmp( &id, &priv->records[rec_n].id ) < 0)
-            new_rec_n = rec_n;
-         else
-            new_rec_n = rec_n + 1;
+         record_set_data( shard, record, data, size );
+         policy_hit( priv, shard, record );
       }
-
-      priv->records = g_realloc( priv->records, ( priv->records_count + 1 ) * sizeof(Record) );
-
-      // Сместим данные, выделив место под новый элемент
-      if (priv->records_count > new_rec_n)
-         memmove( &priv->records[new_rec_n + 1], &priv->records[new_rec_n], ( priv->records_count - new_rec_n )
-               * sizeof(Record) );
-
-      // Добавим звено в начало списка
-      priv->access = g_list_prepend( priv->access, record_id_copy( &id ) );
-
-      // Сохраним данные
-      priv->records[new_rec_n].id = id;
-      priv->records[new_rec_n].data = data;
-      priv->records[new_rec_n].size = size;
-      priv->records[new_rec_n].access = g_list_first( priv->access );
-
-      priv->free -= size;
-      priv->records_count++ ;
    }
+   else
+      record = shard_insert( priv, shard, hash, group, index, rec_n, data, size );
 
-   if(priv->free != old_free)
-     free_changed(self);
+   // Данные на диске устарели
+   if (priv->disk && GROUP_IS_PERSISTENT( group ))
+      disk_tier_remove( priv->disk, group, index );
 
-   g_mutex_unlock( &priv->mutex );
+   record->born = cache_now( priv );
+   stats_add_record( shard, record );
+   COUNTERS_ADD( shard, group_counters( shard, group ), inserts, 1 );
+
+   g_mutex_unlock( &shard->mutex );
 }
 
-gboolean gp_smart_cache_get (GpSmartCache *self, guint group, guint index, guint *size, gpointer buff, guint buff_size)
+gboolean gp_smart_cache_get (GpSmartCache *self, guint group, guint64 index, guint *size, gpointer buff, guint buff_size)
 {
   return gp_smart_cache_get2 (self, group, index, size, buff, buff_size, NULL, 0);
 }
 
-gboolean gp_smart_cache_get2 (GpSmartCache *self, guint group, guint index, guint *size, gpointer buff1,
+gboolean gp_smart_cache_get2 (GpSmartCache *self, guint group, guint64 index, guint *size, gpointer buff1,
                               guint buff1_size, gpointer buff2, guint buff2_size)
 {
   g_return_val_if_fail(self, FALSE);
   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
-  guint rec_n;
+  guint hash = record_id_hash( group, index );
+  Shard *shard = get_shard( priv, hash );
+  Record *record;
 
-  g_mutex_lock( &priv->mutex );
+  shard_lock( shard );
 
   // Найдем элемент
-  if ( !find_record( priv->records, priv->records_count, group, index, &rec_n ))
+  if ( !( record = shard_lookup( self, priv, shard, hash, group, index ) ))
   {
-    g_mutex_unlock( &priv->mutex );
+    stats_access( shard, group, FALSE );
+    g_mutex_unlock( &shard->mutex );
     return FALSE;
   }
 
-  Record *record = priv->records + rec_n;
+  stats_access( shard, group, TRUE );
 
-  // Переместим звено в начало списка
-  make_first( &priv->access, record->access );
+  // Отметим обращение к записи
+  record_touch( priv, shard, record );
 
   // Вернем данные -->
     if(size)
@@ -522,142 +2331,273 @@ gboolean gp_smart_cache_get2 (GpSmartCache *self, guint group, guint index, guin
           MIN(buff2_size, record->size - buff1_size));
   // Вернем данные <--
 
-  g_mutex_unlock( &priv->mutex );
+  g_mutex_unlock( &shard->mutex );
 
   return TRUE;
 }
 
 
-void gp_smart_cache_modify (GpSmartCache *self, guint group,
-                            GpSmartCacheAccessFunc condition, gpointer condition_user_data,
-                            GpSmartCacheAccessFunc modifier, gpointer modifier_user_data)
+const guint8 *gp_smart_cache_acquire (GpSmartCache *self, guint group, guint64 index, guint *size)
 {
-  //g_return_if_fail( condition );
-  g_return_if_fail( modifier );
-
+  g_return_val_if_fail(self, NULL);
   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
-  guint left, right;
-  guint n;
+  guint hash = record_id_hash( group, index );
+  Shard *shard = get_shard( priv, hash );
+  const guint8 *data = NULL;
+  Record *record;
 
-  g_mutex_lock( &priv->mutex );
+  shard_lock( shard );
 
-  if ( !priv->records_count )
+  if ( ( record = shard_lookup( self, priv, shard, hash, group, index ) ))
   {
-    g_mutex_unlock( &priv->mutex );
-    return;
+    stats_access( shard, group, TRUE );
+
+    record_touch( priv, shard, record );
+    record->pins++ ;
+
+    data = record->data;
+
+    if(size)
+      *size = record->size;
   }
+  else
+    stats_access( shard, group, FALSE );
+
+  g_mutex_unlock( &shard->mutex );
+
+  return data;
+}
+
+void gp_smart_cache_release (GpSmartCache *self, guint group, guint64 index, gconstpointer data)
+{
+  g_return_if_fail(self);
+  g_return_if_fail(data);
+  GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+  guint hash = record_id_hash( group, index );
+  Shard *shard = get_shard( priv, hash );
+  guint rec_n;
+  GSList *link;
 
-  find_record( priv->records, priv->records_count, group, 0, &left );
-  if ( !find_neighbour_record( priv->records, priv->records_count, group, &left ))
+  shard_lock( shard );
+
+  // Данные все еще хранятся в кэше
+  if ( shard_find( shard, hash, group, index, &rec_n ) && shard->slots[rec_n]->data == data &&
+       shard->slots[rec_n]->pins)
   {
-    g_mutex_unlock( &priv->mutex );
+    shard->slots[rec_n]->pins-- ;
+    g_mutex_unlock( &shard->mutex );
     return;
   }
 
-  find_record( priv->records, priv->records_count, group, G_MAXUINT, &right );
-  if ( !find_neighbour_record( priv->records, priv->records_count, group, &right ))
+  // Данные уже удалены из кэша, но еще используются
+  for( link = shard->detached; link; link = link->next )
   {
-    g_mutex_unlock( &priv->mutex );
+    Detached *detached = link->data;
+
+    if( detached->data != data )
+      continue;
+
+    if( --detached->pins == 0 )
+    {
+      shard->detached = g_slist_delete_link( shard->detached, link );
+
+      shard_free_data( priv, shard, detached->group, detached->data, detached->size );
+
+      // Память, выделенная до очистки кэша в gp_smart_cache_set_size, уже возвращена
+      g_mutex_lock( &priv->space_mutex );
+      if( detached->epoch == priv->epoch )
+        priv->free += detached->size;
+      g_mutex_unlock( &priv->space_mutex );
+
+      free_changed( self );
+
+      g_slice_free( Detached, detached );
+    }
+
+    g_mutex_unlock( &shard->mutex );
     return;
   }
 
-  if(!condition)
-  {
-    for ( n = left; n <= right; n++ )
-      modifier( priv->records[n].data, priv->records[n].size, modifier_user_data );
-  }
-  else
-  {
-    for ( n = left; n <= right; n++ )
-      if( condition(priv->records[n].data, priv->records[n].size, condition_user_data ))
-        modifier( priv->records[n].data, priv->records[n].size, modifier_user_data );
-  }
+  g_mutex_unlock( &shard->mutex );
 
-  g_mutex_unlock( &priv->mutex );
+  g_warning("GpSmartCache: releasing data that was not acquired (group %u, index %" G_GUINT64_FORMAT ")", group, index);
 }
 
 
-void gp_smart_cache_clean (GpSmartCache *self, guint group)
+/*
+ * Добавляет счетчики сегмента к снимку статистики.
+ * Среднее время хранения в stats на этом этапе -- сумма в мкс, см. stats_finish.
+ */
+static void stats_append( GpSmartCacheStats *stats, const Counters *counters, gint64 now )
 {
-   gp_smart_cache_clean_by_condition (self, group, NULL, NULL);
+   stats->hits += counters->hits;
+   stats->misses += counters->misses;
+   stats->inserts += counters->inserts;
+   stats->evictions += counters->evictions;
+   stats->bytes_evicted += counters->bytes_evicted;
+   stats->records += counters->records;
+   stats->bytes += counters->bytes;
+   stats->avg_age += (gdouble) ( now * counters->records - counters->born_sum );
+   stats->avg_evicted_age += (gdouble) counters->evicted_age;
+   stats->compressions += counters->compressions;
+   stats->decompressions += counters->decompressions;
+   stats->compressed_evictions += counters->compressed_evictions;
+   stats->compressed_records += counters->compressed_records;
+   stats->compressed_bytes += counters->compressed_bytes;
+   stats->disk_stores += counters->disk_stores;
+   stats->disk_loads += counters->disk_loads;
 }
 
+/*
+ * Переводит суммы времени хранения в снимке статистики в средние значения, секунды.
+ */
+static void stats_finish( GpSmartCacheStats *stats )
+{
+   stats->avg_age = stats->records ? stats->avg_age / stats->records / G_USEC_PER_SEC : 0;
+   stats->avg_evicted_age = stats->evictions ? stats->avg_evicted_age / stats->evictions / G_USEC_PER_SEC : 0;
+}
 
-void gp_smart_cache_clean_by_condition (GpSmartCache *self, guint group, GpSmartCacheAccessFunc condition,
-                                        gpointer user_data)
+void gp_smart_cache_get_stats (GpSmartCache *self, GpSmartCacheStats *stats)
 {
+  g_return_if_fail(self);
+  g_return_if_fail(stats);
   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
-  guint left, right;
-  guint n;
-  guint deleted_records_num = 0;
+  gint64 lock_wait = 0;
+  guint s;
 
-  g_mutex_lock( &priv->mutex );
+  memset( stats, 0, sizeof( *stats ));
 
-  if ( !priv->records_count)
+  for( s = 0; s < SHARDS_NUM; s++ )
   {
-    g_mutex_unlock( &priv->mutex );
-    return;
+    Shard *shard = &priv->shards[s];
+
+    shard_lock( shard );
+
+    stats_append( stats, &shard->total, cache_now( priv ));
+    stats->lock_contended += shard->lock_contended;
+    lock_wait += shard->lock_wait;
+
+    g_mutex_unlock( &shard->mutex );
   }
 
-  find_record( priv->records, priv->records_count, group, 0, &left );
-  if ( !find_neighbour_record( priv->records, priv->records_count, group, &left ))
+  stats->lock_wait = (gdouble) lock_wait / G_USEC_PER_SEC;
+  stats_finish( stats );
+
+  g_mutex_lock( &priv->mutex );
+  if( priv->disk )
+    disk_tier_get_usage( priv->disk, &stats->disk_records, &stats->disk_bytes );
+  g_mutex_unlock( &priv->mutex );
+}
+
+void gp_smart_cache_get_group_stats (GpSmartCache *self, guint group, GpSmartCacheStats *stats)
+{
+  g_return_if_fail(self);
+  g_return_if_fail(stats);
+  GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+  guint s;
+
+  memset( stats, 0, sizeof( *stats ));
+
+  for( s = 0; s < SHARDS_NUM; s++ )
   {
-    g_mutex_unlock( &priv->mutex );
-    return;
+    Shard *shard = &priv->shards[s];
+    ShardGroup *group_data;
+
+    shard_lock( shard );
+
+    group_data = g_hash_table_lookup( shard->groups, GUINT_TO_POINTER( group ));
+    if( group_data )
+      stats_append( stats, &group_data->counters, cache_now( priv ));
+
+    g_mutex_unlock( &shard->mutex );
   }
 
-  find_record( priv->records, priv->records_count, group, G_MAXUINT, &right );
-  if ( !find_neighbour_record( priv->records, priv->records_count, group, &right ))
+  stats_finish( stats );
+}
+
+void gp_smart_cache_reset_stats (GpSmartCache *self)
+{
+  g_return_if_fail(self);
+  GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+  guint s;
+
+  for( s = 0; s < SHARDS_NUM; s++ )
   {
-    g_mutex_unlock( &priv->mutex );
-    return;
+    Shard *shard = &priv->shards[s];
+
+    shard_lock( shard );
+
+    counters_reset( NULL, &shard->total, NULL );
+    g_hash_table_foreach( shard->groups, (GHFunc) shard_group_reset, NULL );
+    shard->lock_contended = 0;
+    shard->lock_wait = 0;
+
+    g_mutex_unlock( &shard->mutex );
   }
 
-  if(!condition)
-    for ( n = left; n <= right; n++ ) // Удалим все данные, без условий.
-    {
-      // Удалим данные
-      priv->free_func( priv->records[n].data );
-      priv->free += priv->records[n].size;
-      free_changed(self);
+  free_changed( self );
+}
 
-      // Удалим звено
-      g_free( priv->records[n].access->data );
-      priv->access = g_list_delete_link( priv->access, priv->records[n].access );
 
-      deleted_records_num++;
-    }
-  else
-    for ( n = left; n <= right; n++ ) // Удалим данные по условию condition.
+/*
+ * Данные одной группы разбросаны по всем сегментам, поэтому операции над группой
+ * (gp_smart_cache_modify, gp_smart_cache_clean_by_condition) просматривают таблицы всех сегментов,
+ * блокируя сегменты по одному.
+ */
+void gp_smart_cache_modify (GpSmartCache *self, guint group,
+                            GpSmartCacheAccessFunc condition, gpointer condition_user_data,
+                            GpSmartCacheAccessFunc modifier, gpointer modifier_user_data)
+{
+  //g_return_if_fail( condition );
+  g_return_if_fail( modifier );
+
+  GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+  guint s;
+  guint n;
+
+  for ( s = 0; s < SHARDS_NUM; s++ )
+  {
+    Shard *shard = &priv->shards[s];
+
+    shard_lock( shard );
+
+    for ( n = 0; n < shard->capacity; n++ )
     {
-      if(condition(priv->records[n].data, priv->records[n].size, user_data))
-      {
-        // Удалим данные
-        priv->free_func( priv->records[n].data );
-        priv->free += priv->records[n].size;
-        free_changed(self);
+      Record *record = shard->slots[n];
 
-        // Удалим звено
-        g_free( priv->records[n].access->data );
-        priv->access = g_list_delete_link( priv->access, priv->records[n].access );
+      if( !record || record->id.group != group || RECORD_IS_GHOST( record ))
+        continue;
 
-        deleted_records_num++;
-      }
-      else
-      {
-        // Элемент не удален, сместим его в массиве ближе к началу,
-        // к последнему неудаленному элементу слева от него.
-        priv->records[n - deleted_records_num] = priv->records[n];
-      }
+      if( !condition || record_access( priv, shard, record, condition, condition_user_data, FALSE ))
+        record_access( priv, shard, record, modifier, modifier_user_data, TRUE );
     }
 
-  // Сместим данные
-  if (priv->records_count > right + 1)
-    memmove( &priv->records[right + 1 - deleted_records_num], &priv->records[right + 1],
-      ( priv->records_count - ( right + 1 ) ) * sizeof(Record) );
+    g_mutex_unlock( &shard->mutex );
+  }
+
+  g_mutex_lock( &priv->mutex );
+  if( priv->disk && GROUP_IS_PERSISTENT( group ))
+    disk_tier_modify( priv->disk, group, condition, condition_user_data, modifier, modifier_user_data );
+  g_mutex_unlock( &priv->mutex );
+}
+
+
+void gp_smart_cache_clean (GpSmartCache *self, guint group)
+{
+   gp_smart_cache_clean_by_condition (self, group, NULL, NULL);
+}
+
+
+void gp_smart_cache_clean_by_condition (GpSmartCache *self, guint group, GpSmartCacheAccessFunc condition,
+                                        gpointer user_data)
+{
+  GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
 
-  priv->records_count -= deleted_records_num;
+  cache_clean_records( self, priv, group, condition, user_data );
 
+  g_mutex_lock( &priv->mutex );
+  if( priv->disk && GROUP_IS_PERSISTENT( group ))
+    disk_tier_clean( priv->disk, group, condition, user_data );
   g_mutex_unlock( &priv->mutex );
 }
 
@@ -665,47 +2605,144 @@ void gp_smart_cache_clean_by_condition (GpSmartCache *self, guint group, GpSmart
 static void gp_smart_cache_init (GpSmartCache *self)
 {
    GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   guint s;
 
    g_mutex_init(&priv->mutex);
+   g_mutex_init(&priv->space_mutex);
    priv->free_func = g_free;
+   priv->policy = GP_SMART_CACHE_POLICY_LRU;
 
    priv->groups = g_array_new( FALSE, FALSE, sizeof(guint) );
    priv->size = 0;
    priv->free = 0;
-
-   priv->access = NULL;
-   priv->records = NULL;
-   priv->records_count = 0;
+   priv->epoch = 0;
+   priv->clock = 0;
+   priv->created = g_get_monotonic_time();
+   priv->compressed_size = 0;
+   priv->disk = NULL;
+   priv->group_stamps = g_hash_table_new_full( g_direct_hash, g_direct_equal, NULL, g_free );
+   priv->recyclers = g_hash_table_new_full( g_direct_hash, g_direct_equal, NULL, recycler_free );
+
+   for ( s = 0; s < SHARDS_NUM; s++ )
+   {
+      Shard *shard = &priv->shards[s];
+
+      g_mutex_init( &shard->mutex );
+      shard->slots = g_new0( Record*, SHARD_MIN_CAPACITY );
+      shard->capacity = SHARD_MIN_CAPACITY;
+      shard->count = 0;
+      memset( shard->lists, 0, sizeof( shard->lists ));
+      shard->arc_p = 0;
+      shard->slru_protected = 0;
+      shard->compressed_max = 0;
+      shard->compressed_bytes = 0;
+      shard->detached = NULL;
+
+      memset( &shard->total, 0, sizeof( shard->total ));
+      shard->groups = g_hash_table_new_full( g_direct_hash, g_direct_equal, NULL, shard_group_free );
+      shard->over_quota = 0;
+      shard->lock_contended = 0;
+      shard->lock_wait = 0;
+   }
 }
 
 static void gp_smart_cache_finalize (GpSmartCache *self)
 {
    GObjectClass *parent_class = g_type_class_peek_parent( g_type_class_peek(GP_SMART_CACHE_TYPE ) );
    GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( self );
+   guint s;
 
    #ifdef GP_SMART_CACHE_ENABLE_GUI
+     if(priv->stats_timeout_id)
+       g_source_remove(priv->stats_timeout_id);
      g_clear_object(&priv->grid);
    #endif
 
-   g_mutex_lock( &priv->mutex );
+   // Очистим кэш
+   for ( s = 0; s < SHARDS_NUM; s++ )
+   {
+      Shard *shard = &priv->shards[s];
 
-     // Очистим кэш
-     priv->free += free_space( &priv->records, &priv->records_count, priv->free_func, &priv->access, priv->size );
-     g_assert( priv->free == priv->size );
+      priv->free += shard_clear( priv, shard );
 
-     g_array_free( priv->groups, TRUE );
+      // Данные, не возвращенные через gp_smart_cache_release, освобождаем принудительно
+      while( shard->detached )
+      {
+        Detached *detached = shard->detached->data;
 
-   g_mutex_unlock( &priv->mutex );
+        g_warning("GpSmartCache: %u bytes are still acquired on finalize", detached->size);
 
+        priv->free_func( detached->data );
+
+        if( detached->epoch == priv->epoch )
+          priv->free += detached->size;
+
+        g_slice_free( Detached, detached );
+        shard->detached = g_slist_delete_link( shard->detached, shard->detached );
+      }
+
+      g_free( shard->slots );
+      g_hash_table_destroy( shard->groups );
+      g_mutex_clear( &shard->mutex );
+   }
+
+   g_assert( priv->free == priv->size );
+
+   if (priv->disk)
+      disk_tier_close( priv->disk );
+   g_hash_table_destroy( priv->group_stamps );
+   g_hash_table_destroy( priv->recyclers );
+
+   g_array_free( priv->groups, TRUE );
+
+   g_mutex_clear(&priv->space_mutex);
    g_mutex_clear(&priv->mutex);
 
    parent_class->finalize( (GObject*) self );
 }
 
+static void gp_smart_cache_set_property( GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec )
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( object );
+
+   switch ( prop_id )
+   {
+      case PROP_POLICY:
+         priv->policy = g_value_get_enum( value );
+         break;
+
+      default:
+         G_OBJECT_WARN_INVALID_PROPERTY_ID( object, prop_id, pspec );
+         break;
+   }
+}
+
+static void gp_smart_cache_get_property( GObject *object, guint prop_id, GValue *value, GParamSpec *pspec )
+{
+   GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE( object );
+
+   switch ( prop_id )
+   {
+      case PROP_POLICY:
+         g_value_set_enum( value, priv->policy );
+         break;
+
+      default:
+         G_OBJECT_WARN_INVALID_PROPERTY_ID( object, prop_id, pspec );
+         break;
+   }
+}
+
 static void gp_smart_cache_class_init(GpSmartCacheClass *self)
 {
    GObjectClass *this_class = G_OBJECT_CLASS( self );
    this_class->finalize = (void*) gp_smart_cache_finalize;
+   this_class->set_property = gp_smart_cache_set_property;
+   this_class->get_property = gp_smart_cache_get_property;
+
+   g_object_class_install_property( this_class, PROP_POLICY,
+     g_param_spec_enum( "policy", "Policy", "Cache eviction policy", GP_SMART_CACHE_TYPE_POLICY,
+                        GP_SMART_CACHE_POLICY_LRU, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY ) );
 
    g_type_class_add_private( self, sizeof(GpSmartCachePriv) );
 }
@@ -735,11 +2772,12 @@ static void gp_smart_cache_class_init(GpSmartCacheClass *self)
     GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE(cache);
     g_return_if_fail(priv);
 
-    g_mutex_lock(&priv->mutex);
+    g_atomic_int_set(&priv->refresh_gui_pending, FALSE);
+
+    g_mutex_lock(&priv->space_mutex);
       gsize size = priv->size;
       gsize free = priv->free;
-      priv->refresh_gui_pending = FALSE;
-    g_mutex_unlock(&priv->mutex);
+    g_mutex_unlock(&priv->space_mutex);
 
     gchar str[16];
     g_snprintf(str, sizeof(str), "%zu", (size - free) / (1024 * 1024));
@@ -747,6 +2785,39 @@ static void gp_smart_cache_class_init(GpSmartCacheClass *self)
     gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(priv->progress), (gdouble)(size - free) / size);
 
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(priv->spin), (gdouble)(size / (1024 * 1024)));
+
+    GpSmartCacheStats stats;
+    gp_smart_cache_get_stats(cache, &stats);
+
+    gchar *text = g_strdup_printf(_("Hits: %llu, misses: %llu (%.1f%% hits)\n"
+                                    "Inserts: %llu, evictions: %llu (%llu Mb)\n"
+                                    "Records: %u, average age: %.1f s, evicted at age: %.1f s\n"
+                                    "Compressed: %u (%llu Mb), compressions: %llu, decompressions: %llu\n"
+                                    "On disk: %u (%llu Mb), stores: %llu, loads: %llu\n"
+                                    "Lock waits: %llu (%.3f s)"),
+      (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+      (stats.hits + stats.misses) ? 100. * stats.hits / (stats.hits + stats.misses) : 0.,
+      (unsigned long long)stats.inserts, (unsigned long long)stats.evictions,
+      (unsigned long long)(stats.bytes_evicted / (1024 * 1024)),
+      stats.records, stats.avg_age, stats.avg_evicted_age,
+      stats.compressed_records, (unsigned long long)(stats.compressed_bytes / (1024 * 1024)),
+      (unsigned long long)stats.compressions, (unsigned long long)stats.decompressions,
+      stats.disk_records, (unsigned long long)(stats.disk_bytes / (1024 * 1024)),
+      (unsigned long long)stats.disk_stores, (unsigned long long)stats.disk_loads,
+      (unsigned long long)stats.lock_contended, stats.lock_wait);
+    gtk_label_set_text(GTK_LABEL(priv->stats), text);
+    g_free(text);
+  }
+
+  static gboolean stats_timeout(GpSmartCache *cache)
+  {
+    refresh_gui(cache);
+    return G_SOURCE_CONTINUE;
+  }
+
+  static void reset_stats_clicked(GtkButton *button, GpSmartCache *cache)
+  {
+    gp_smart_cache_reset_stats(cache);
   }
 
   static void spin_value_changed(GtkSpinButton *spin_button, GpSmartCache *cache)
@@ -762,11 +2833,13 @@ static void gp_smart_cache_class_init(GpSmartCacheClass *self)
     GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE(cache);
     g_return_if_fail(priv);
 
-    g_mutex_lock(&priv->mutex);
-      priv->mapped = TRUE;
-    g_mutex_unlock(&priv->mutex);
+    g_atomic_int_set(&priv->mapped, TRUE);
 
     refresh_gui(cache);
+
+    // Обращения к данным не меняют свободное место, поэтому статистику обновляем по таймеру
+    if(priv->stats_timeout_id == 0)
+      priv->stats_timeout_id = g_timeout_add_seconds(1, (GSourceFunc)stats_timeout, cache);
   }
 
   static void grid_unmap(GtkWidget *grid, GpSmartCache *cache)
@@ -774,7 +2847,13 @@ static void gp_smart_cache_class_init(GpSmartCacheClass *self)
     GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE(cache);
     g_return_if_fail(priv);
 
-    priv->mapped = FALSE;
+    g_atomic_int_set(&priv->mapped, FALSE);
+
+    if(priv->stats_timeout_id)
+    {
+      g_source_remove(priv->stats_timeout_id);
+      priv->stats_timeout_id = 0;
+    }
   }
 
   static void free_changed(GpSmartCache *cache)
@@ -782,10 +2861,10 @@ static void gp_smart_cache_class_init(GpSmartCacheClass *self)
     GpSmartCachePriv *priv = GP_SMART_CACHE_GET_PRIVATE(cache);
     g_return_if_fail(priv);
 
-    if(priv->mapped && !priv->refresh_gui_pending)
+    if(g_atomic_int_get(&priv->mapped) &&
+       g_atomic_int_compare_and_exchange(&priv->refresh_gui_pending, FALSE, TRUE))
     {
       g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)refresh_gui, g_object_ref(cache), g_object_unref);
-      priv->refresh_gui_pending = TRUE;
     }
   }
 
@@ -817,9 +2896,21 @@ static void gp_smart_cache_class_init(GpSmartCacheClass *self)
       gtk_grid_attach(GTK_GRID(priv->grid), label, 0, 2, 1, 1);
 
       priv->spin = gtk_spin_button_new_with_range(0, 128000, 50);
+      gtk_grid_attach(GTK_GRID(priv->grid), priv->spin, 0, 3, 1, 1);
+
+      label = gtk_label_new(_("Cache statistics:"));
+      gtk_grid_attach(GTK_GRID(priv->grid), label, 0, 4, 1, 1);
+
+      priv->stats = gtk_label_new(NULL);
+      gtk_label_set_selectable(GTK_LABEL(priv->stats), TRUE); //< Чтобы статистику можно было скопировать.
+      gtk_grid_attach(GTK_GRID(priv->grid), priv->stats, 0, 5, 1, 1);
+
+      GtkWidget *button = gtk_button_new_with_label(_("Reset statistics"));
+      g_signal_connect(button, "clicked", G_CALLBACK(reset_stats_clicked), self);
+      gtk_grid_attach(GTK_GRID(priv->grid), button, 0, 6, 1, 1);
+
       refresh_gui(cache); //< Нужно выставить актуальные значения до установки сигнала "value-changed".
       g_signal_connect(priv->spin, "value-changed", G_CALLBACK(spin_value_changed), self);
-      gtk_grid_attach(GTK_GRID(priv->grid), priv->spin, 0, 3, 1, 1);
 
       gtk_widget_show_all(GTK_WIDGET(priv->grid));
     }
@@ -0,0 +1,170 @@
+/*
+ * GP_SMART_CACHE - data caching library, this library is part of GRTL.
+ *
+ * This file is part of GRTL.
+ *
+ * GRTL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * GRTL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with GRTL. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Формат сжатых данных -- последовательность блоков из 32-битных слов.
+ * Первое слово блока -- заголовок:
+ *
+ * - старший бит установлен: серия, младшие 31 бит -- количество повторов слова,
+ *   следующего за заголовком;
+ * - старший бит сброшен: младшие 31 бит -- количество слов, скопированных без изменений
+ *   и следующих за заголовком.
+ *
+ * Последние size % 4 байт исходных данных записываются в конец без изменений.
+ */
+
+#include "rle.h"
+
+#include <string.h>
+
+#define RLE_RUN_FLAG 0x80000000U
+#define RLE_COUNT_MASK 0x7FFFFFFFU
+
+// Минимальная длина серии, которую выгодно кодировать отдельным блоком
+#define RLE_MIN_RUN 3
+
+gpointer rle_compress( gconstpointer data, guint size, guint max_csize, guint *csize )
+{
+   const guint32 *src = data;
+   guint words = size / sizeof( guint32 );
+   guint tail = size % sizeof( guint32 );
+   guint32 *dst;
+   guint capacity, out = 0;
+   guint i = 0, literal = 0;
+
+   if (max_csize < tail + sizeof( guint32 ))
+      return NULL;
+
+   capacity = ( max_csize - tail ) / sizeof( guint32 );
+   dst = g_malloc( capacity * sizeof( guint32 ) + tail );
+
+   // Записывает в dst блок из count слов, начиная с src[from]
+   #define RLE_FLUSH_LITERAL( from, count ) \
+      G_STMT_START { \
+         if (( count ) > 0) \
+         { \
+            if (out + 1 + ( count ) > capacity) \
+               goto fail; \
+            dst[out++] = ( count ); \
+            memcpy( dst + out, src + ( from ), ( count ) * sizeof( guint32 )); \
+            out += ( count ); \
+         } \
+      } G_STMT_END
+
+   while ( i < words )
+   {
+      guint run = 1;
+
+      while ( i + run < words && run < RLE_COUNT_MASK && src[i + run] == src[i] )
+         run++ ;
+
+      if (run >= RLE_MIN_RUN)
+      {
+         RLE_FLUSH_LITERAL( i - literal, literal );
+         literal = 0;
+
+         if (out + 2 > capacity)
+            goto fail;
+
+         dst[out++] = RLE_RUN_FLAG | run;
+         dst[out++] = src[i];
+      }
+      else
+      {
+         if (literal + run > RLE_COUNT_MASK)
+         {
+            RLE_FLUSH_LITERAL( i - literal, literal );
+            literal = 0;
+         }
+
+         literal += run;
+      }
+
+      i += run;
+   }
+
+   RLE_FLUSH_LITERAL( i - literal, literal );
+
+   #undef RLE_FLUSH_LITERAL
+
+   memcpy( (guint8*) ( dst + out ), (const guint8*) data + words * sizeof( guint32 ), tail );
+
+   *csize = out * sizeof( guint32 ) + tail;
+
+   return g_realloc( dst, *csize );
+
+fail:
+   g_free( dst );
+   return NULL;
+}
+
+gboolean rle_decompress( gconstpointer cdata, guint csize, gpointer data, guint size )
+{
+   const guint32 *src = cdata;
+   guint32 *dst = data;
+   guint words = size / sizeof( guint32 );
+   guint tail = size % sizeof( guint32 );
+   guint in_words, in = 0, out = 0;
+
+   if (csize < tail || ( csize - tail ) % sizeof( guint32 ))
+      return FALSE;
+
+   in_words = ( csize - tail ) / sizeof( guint32 );
+
+   while ( in < in_words )
+   {
+      guint32 header = src[in++];
+      guint count = header & RLE_COUNT_MASK;
+
+      if (out + count > words)
+         return FALSE;
+
+      if (header & RLE_RUN_FLAG)
+      {
+         guint32 value;
+         guint n;
+
+         if (in >= in_words)
+            return FALSE;
+
+         value = src[in++];
+
+         for ( n = 0; n < count; n++ )
+            dst[out + n] = value;
+      }
+      else
+      {
+         if (in + count > in_words)
+            return FALSE;
+
+         memcpy( dst + out, src + in, count * sizeof( guint32 ));
+         in += count;
+      }
+
+      out += count;
+   }
+
+   if (out != words)
+      return FALSE;
+
+   memcpy( (guint8*) data + words * sizeof( guint32 ), (const guint8*) ( src + in_words ), tail );
+
+   return TRUE;
+}
@@ -0,0 +1,63 @@
+/*
+ * GP_SMART_CACHE - data caching library, this library is part of GRTL.
+ *
+ * This file is part of GRTL.
+ *
+ * GRTL is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * GRTL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with GRTL. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * \file rle.h
+ *
+ * \brief Сжатие данных сжатого уровня кэша.
+ *
+ * Данные сжимаются кодированием длин серий 32-битных слов: так сжимаются
+ * изображения ARGB32 с однотонными областями (прозрачный фон, заливка),
+ * из которых в основном и состоят хранимые в кэше плитки.
+ * Используется только внутри реализации GpSmartCache.
+ *
+ */
+
+#ifndef _rle_h
+#define _rle_h
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Сжатие данных.
+ *
+ * Сжимает size байт data. Если сжатые данные займут больше max_csize байт,
+ * сжатие прерывается (хранить такие данные сжатыми невыгодно).
+ *
+ * Вернет сжатые данные (выделены g_malloc) и запишет их размер в csize,
+ * либо вернет NULL, если данные не удалось сжать до max_csize байт.
+ */
+gpointer rle_compress( gconstpointer data, guint size, guint max_csize, guint *csize );
+
+/*
+ * Распаковка данных.
+ *
+ * Распаковывает csize байт cdata, полученных от rle_compress, в буфер data размером size байт
+ * (size -- размер исходных данных).
+ *
+ * Вернет FALSE, если сжатые данные повреждены.
+ */
+gboolean rle_decompress( gconstpointer cdata, guint csize, gpointer data, guint size );
+
+G_END_DECLS
+
+#endif /* _rle_h */
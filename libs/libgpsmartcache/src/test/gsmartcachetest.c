@@ -7,6 +7,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <glib/gstdio.h>
 #include "gp-smartcache.h"
 
 typedef struct _rec
@@ -22,6 +23,670 @@ typedef struct _rec
 #define CACHE_SIZE ( COUNT / 10 ) // количество хранимых в кэше индексов
 #define GROUP_SIZE ( CACHE_SIZE / 10 ) // количество индексов в группе
 #define DATA_SIZE 1024 // размер индекса
+
+#define THREADS_NUM 8 // количество потоков в многопоточной проверке
+#define THREAD_OPS 20000 // количество обращений к кэшу из каждого потока
+
+typedef struct _thread_data
+{
+   GpSmartCache *cache;
+   guint group;
+   guint32 seed; // <-- начальное значение генератора индексов потока
+} thread_data;
+
+/*
+ * Поток многопоточной проверки: пишет и читает данные своей группы,
+ * проверяя, что из кэша всегда возвращаются данные, записанные по этому идентификатору.
+ */
+static gpointer thread_func( thread_data *td )
+{
+   // rand() не потокобезопасна, у каждого потока свой генератор с повторяемой последовательностью
+   GRand *rng = g_rand_new_with_seed( td->seed );
+   guchar buff[DATA_SIZE];
+   gint n;
+
+   for ( n = 0; n < THREAD_OPS; n++ )
+   {
+      guint index = g_rand_int_range( rng, 0, CACHE_SIZE / 2 );
+      guint data_size;
+
+      if (gp_smart_cache_get (td->cache, td->group, index, &data_size, buff, DATA_SIZE))
+      {
+         g_assert( data_size == DATA_SIZE );
+         g_assert( buff[0] == (guchar) ( td->group + index ) && buff[DATA_SIZE - 1] == buff[0] );
+      }
+      else
+      {
+         memset( buff, (guchar) ( td->group + index ), DATA_SIZE );
+         gp_smart_cache_set_unowned (td->cache, td->group, index, buff, DATA_SIZE);
+      }
+   }
+
+   g_rand_free( rng );
+
+   return NULL;
+}
+
+/*
+ * Многопоточная проверка кэша: каждый поток работает со своей группой данных.
+ */
+static void threads_check( GpSmartCache *cache, GTimer *timer )
+{
+   thread_data td[THREADS_NUM];
+   GThread *threads[THREADS_NUM];
+   gint n;
+
+   g_timer_start( timer );
+
+   for ( n = 0; n < THREADS_NUM; n++ )
+   {
+      td[n].cache = cache;
+      td[n].group = gp_smart_cache_reg_group (cache);
+      td[n].seed = n + 1;
+      threads[n] = g_thread_new( "cache-test", (GThreadFunc) thread_func, &td[n] );
+   }
+
+   for ( n = 0; n < THREADS_NUM; n++ )
+      g_thread_join( threads[n] );
+
+   printf( "%i threads made %i requests each in %.3f ms (policy %d)\n", THREADS_NUM, THREAD_OPS,
+           g_timer_elapsed( timer, NULL ) * 1000, gp_smart_cache_get_policy (cache) );
+
+   // После очистки всех групп кэш должен оказаться пустым
+   for ( n = 0; n < THREADS_NUM; n++ )
+   {
+      gp_smart_cache_clean (cache, td[n].group);
+      gp_smart_cache_unreg_group (cache, td[n].group);
+   }
+
+   g_assert( gp_smart_cache_get_free (cache) == gp_smart_cache_get_size (cache) );
+}
+
+/*
+ * Проверка устойчивости политики вытеснения к однократному просмотру:
+ * часто используемые данные, к которым обращались дважды, затем вытесняются потоком
+ * однократно записываемых данных в HOT_K раз больше объема кэша.
+ * Вернет количество часто используемых данных, оставшихся в кэше.
+ */
+#define HOT_COUNT ( CACHE_SIZE / 4 ) // количество часто используемых индексов
+#define SCAN_K 4 // во сколько раз объем просматриваемых данных больше размера кэша
+
+static guint scan_check( GpSmartCachePolicy policy )
+{
+   GpSmartCache *cache = gp_smart_cache_new_with_policy (policy);
+   guint hot_group, scan_group;
+   guint hits = 0;
+   guchar buff[DATA_SIZE];
+   gint n;
+
+   g_assert( gp_smart_cache_get_policy (cache) == policy );
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+
+   hot_group = gp_smart_cache_reg_group (cache);
+   scan_group = gp_smart_cache_reg_group (cache);
+
+   memset( buff, 0, DATA_SIZE );
+
+   for ( n = 0; n < HOT_COUNT; n++ )
+      gp_smart_cache_set_unowned (cache, hot_group, n, buff, DATA_SIZE);
+
+   for ( n = 0; n < HOT_COUNT; n++ )
+      g_assert( gp_smart_cache_get (cache, hot_group, n, NULL, NULL, 0) );
+
+   for ( n = 0; n < CACHE_SIZE * SCAN_K; n++ )
+      gp_smart_cache_set_unowned (cache, scan_group, n, buff, DATA_SIZE);
+
+   for ( n = 0; n < HOT_COUNT; n++ )
+      if (gp_smart_cache_get (cache, hot_group, n, NULL, NULL, 0))
+         hits++ ;
+
+   printf( "Policy %d: %u of %u hot elements survived the scan\n", policy, hits, HOT_COUNT );
+
+   gp_smart_cache_clean (cache, hot_group);
+   gp_smart_cache_clean (cache, scan_group);
+   g_assert( gp_smart_cache_get_free (cache) == gp_smart_cache_get_size (cache) );
+
+   g_object_unref( cache );
+
+   return hits;
+}
+
+/*
+ * Проверка доступа к данным без копирования: захваченные данные не вытесняются
+ * и остаются доступными после замены и очистки, а память возвращается кэшу при освобождении.
+ */
+static void acquire_check( void )
+{
+   GpSmartCache *cache = gp_smart_cache_new ();
+   const guint8 *pinned, *replaced;
+   guchar buff[DATA_SIZE];
+   guint group, size;
+   gint n;
+
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   group = gp_smart_cache_reg_group (cache);
+
+   memset( buff, 1, DATA_SIZE );
+   gp_smart_cache_set_unowned (cache, group, 0, buff, DATA_SIZE);
+
+   pinned = gp_smart_cache_acquire (cache, group, 0, &size);
+   g_assert( pinned && size == DATA_SIZE && pinned[0] == 1 );
+   g_assert( !gp_smart_cache_acquire (cache, group, 1, &size) );
+
+   // Захваченные данные не вытесняются
+   for ( n = 1; n < CACHE_SIZE * 2; n++ )
+      gp_smart_cache_set_unowned (cache, group, n, buff, DATA_SIZE);
+
+   g_assert( gp_smart_cache_get (cache, group, 0, NULL, NULL, 0) );
+
+   // Замена захваченных данных не освобождает их
+   memset( buff, 2, DATA_SIZE );
+   gp_smart_cache_set_unowned (cache, group, 0, buff, DATA_SIZE);
+
+   replaced = gp_smart_cache_acquire (cache, group, 0, &size);
+   g_assert( replaced && replaced != pinned && replaced[0] == 2 );
+   g_assert( pinned[0] == 1 && pinned[DATA_SIZE - 1] == 1 );
+
+   // Очистка группы тоже
+   gp_smart_cache_clean (cache, group);
+   g_assert( !gp_smart_cache_get (cache, group, 0, NULL, NULL, 0) );
+   g_assert( replaced[0] == 2 );
+   g_assert( gp_smart_cache_get_free (cache) == gp_smart_cache_get_size (cache) - 2 * DATA_SIZE );
+
+   gp_smart_cache_release (cache, group, 0, pinned);
+   gp_smart_cache_release (cache, group, 0, replaced);
+   g_assert( gp_smart_cache_get_free (cache) == gp_smart_cache_get_size (cache) );
+
+   gp_smart_cache_unreg_group (cache, group);
+   g_object_unref( cache );
+}
+
+/*
+ * Проверка вытеснения SLRU, когда все записи испытательного сегмента захвачены:
+ * место под новые данные должно освобождаться за счет записей защищенного сегмента.
+ */
+#define PINNED_COUNT ( CACHE_SIZE / 2 ) // количество захватываемых индексов
+
+static void pinned_check( void )
+{
+   GpSmartCache *cache = gp_smart_cache_new_with_policy (GP_SMART_CACHE_POLICY_SLRU);
+   const guint8 **pinned = g_new( const guint8*, PINNED_COUNT );
+   guchar buff[DATA_SIZE];
+   guint group, size;
+   gint n;
+
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   group = gp_smart_cache_reg_group (cache);
+
+   memset( buff, 0, DATA_SIZE );
+
+   // Захваченные данные попадают в защищенный сегмент
+   for ( n = 0; n < PINNED_COUNT; n++ )
+   {
+      gp_smart_cache_set_unowned (cache, group, n, buff, DATA_SIZE);
+
+      pinned[n] = gp_smart_cache_acquire (cache, group, n, &size);
+      g_assert( pinned[n] && size == DATA_SIZE );
+   }
+
+   // Обращения к остальным данным вытесняют самые старые захваченные в испытательный сегмент,
+   // других записей в нем не остается
+   for ( n = PINNED_COUNT; n < CACHE_SIZE - GP_SMART_CACHE_FREE_K; n++ )
+      gp_smart_cache_set_unowned (cache, group, n, buff, DATA_SIZE);
+
+   for ( n = PINNED_COUNT; n < CACHE_SIZE - GP_SMART_CACHE_FREE_K; n++ )
+      g_assert( gp_smart_cache_get (cache, group, n, NULL, NULL, 0) );
+
+   // Новые данные помещаются в кэш
+   for ( n = CACHE_SIZE; n < CACHE_SIZE + PINNED_COUNT; n++ )
+   {
+      gp_smart_cache_set_unowned (cache, group, n, buff, DATA_SIZE);
+      g_assert( gp_smart_cache_get (cache, group, n, NULL, NULL, 0) );
+   }
+
+   for ( n = 0; n < PINNED_COUNT; n++ )
+   {
+      g_assert( gp_smart_cache_get (cache, group, n, NULL, NULL, 0) );
+      gp_smart_cache_release (cache, group, n, pinned[n]);
+   }
+
+   gp_smart_cache_clean (cache, group);
+   g_assert( gp_smart_cache_get_free (cache) == gp_smart_cache_get_size (cache) );
+
+   gp_smart_cache_unreg_group (cache, group);
+   g_object_unref( cache );
+   g_free( pinned );
+}
+
+/*
+ * Проверка статистики работы кэша.
+ */
+static void stats_check( void )
+{
+   GpSmartCache *cache = gp_smart_cache_new ();
+   GpSmartCacheStats stats, group_stats;
+   guchar buff[DATA_SIZE];
+   guint group;
+   gint n;
+
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   group = gp_smart_cache_reg_group (cache);
+
+   memset( buff, 0, DATA_SIZE );
+
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+      gp_smart_cache_set_unowned (cache, group, n, buff, DATA_SIZE);
+
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+      gp_smart_cache_get (cache, group, n, NULL, NULL, 0);
+
+   gp_smart_cache_get_stats (cache, &stats);
+   gp_smart_cache_get_group_stats (cache, group, &group_stats);
+
+   printf( "Stats: %llu hits, %llu misses, %llu inserts, %llu evictions, %u records\n",
+           (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+           (unsigned long long) stats.inserts, (unsigned long long) stats.evictions, stats.records );
+
+   g_assert( stats.inserts == CACHE_SIZE * 2 );
+   g_assert( stats.hits + stats.misses == CACHE_SIZE * 2 );
+   g_assert( stats.hits == stats.records );
+   g_assert( stats.evictions == stats.inserts - stats.records );
+   g_assert( stats.bytes_evicted == stats.evictions * DATA_SIZE );
+   g_assert( stats.bytes == gp_smart_cache_get_size (cache) - gp_smart_cache_get_free (cache) );
+   g_assert( stats.avg_age >= 0 && stats.avg_evicted_age >= 0 );
+
+   g_assert( group_stats.hits == stats.hits && group_stats.misses == stats.misses );
+   g_assert( group_stats.records == stats.records && group_stats.bytes == stats.bytes );
+
+   gp_smart_cache_reset_stats (cache);
+   gp_smart_cache_get_stats (cache, &stats);
+   g_assert( stats.hits == 0 && stats.inserts == 0 && stats.evictions == 0 );
+   g_assert( stats.records == group_stats.records );
+
+   gp_smart_cache_clean (cache, group);
+   gp_smart_cache_get_stats (cache, &stats);
+   g_assert( stats.records == 0 && stats.bytes == 0 && stats.evictions == 0 );
+
+   gp_smart_cache_unreg_group (cache, group);
+   g_object_unref( cache );
+}
+
+/*
+ * Данные проверки сжатого уровня: номер записи и однотонная заливка.
+ */
+static void compressed_fill( guchar *buff, guint index )
+{
+   memset( buff, index & 0xff, DATA_SIZE );
+   memcpy( buff, &index, sizeof( index ));
+}
+
+static gboolean compressed_modifier( gconstpointer data, guint size, gpointer user_data )
+{
+   ( (guchar*) data )[sizeof( guint )]++ ;
+   return TRUE;
+}
+
+static gboolean compressed_odd( gconstpointer data, guint size, gpointer user_data )
+{
+   return *(const guint*) data % 2;
+}
+
+/*
+ * Проверка сжатого уровня кэша.
+ */
+static void compressed_check( void )
+{
+   GpSmartCache *cache = gp_smart_cache_new ();
+   GpSmartCacheStats stats;
+   guchar buff[DATA_SIZE], expected[DATA_SIZE];
+   guint group, size;
+   guint n;
+
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   gp_smart_cache_set_compressed_size (cache, CACHE_SIZE * 64);
+   g_assert( gp_smart_cache_get_compressed_size (cache) == CACHE_SIZE * 64 );
+   group = gp_smart_cache_reg_group (cache);
+
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+   {
+      compressed_fill( buff, n );
+      gp_smart_cache_set_unowned (cache, group, n, buff, DATA_SIZE);
+   }
+
+   // Хорошо сжимаемые данные не вытесняются, а переносятся в сжатый уровень
+   gp_smart_cache_get_stats (cache, &stats);
+   g_assert( stats.compressions >= CACHE_SIZE && stats.evictions == 0 );
+   g_assert( stats.records + stats.compressed_records == CACHE_SIZE * 2 );
+   g_assert( stats.compressed_bytes < stats.compressed_records * DATA_SIZE / 2 );
+
+   // Изменение данных, в том числе хранимых в сжатом виде
+   gp_smart_cache_modify (cache, group, NULL, NULL, compressed_modifier, NULL);
+
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+   {
+      compressed_fill( expected, n );
+      expected[sizeof( guint )]++ ;
+
+      g_assert( gp_smart_cache_get (cache, group, n, &size, buff, DATA_SIZE) );
+      g_assert( size == DATA_SIZE && memcmp( buff, expected, DATA_SIZE ) == 0 );
+   }
+
+   gp_smart_cache_get_stats (cache, &stats);
+   printf( "Compressed: %llu compressions, %llu decompressions, %u records (%llu bytes)\n",
+           (unsigned long long) stats.compressions, (unsigned long long) stats.decompressions,
+           stats.compressed_records, (unsigned long long) stats.compressed_bytes );
+
+   g_assert( stats.misses == 0 && stats.decompressions >= CACHE_SIZE );
+   g_assert( stats.records + stats.compressed_records == CACHE_SIZE * 2 );
+
+   // Очистка по условию проверяет и сжатые данные
+   gp_smart_cache_clean_by_condition (cache, group, compressed_odd, NULL);
+
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+      g_assert( gp_smart_cache_get (cache, group, n, NULL, NULL, 0) == !( n % 2 ));
+
+   // Отключение сжатого уровня удаляет его данные
+   gp_smart_cache_set_compressed_size (cache, 0);
+   gp_smart_cache_get_stats (cache, &stats);
+   g_assert( stats.compressed_records == 0 && stats.compressed_bytes == 0 );
+   g_assert( stats.bytes == gp_smart_cache_get_size (cache) - gp_smart_cache_get_free (cache) );
+
+   gp_smart_cache_unreg_group (cache, group);
+   g_object_unref( cache );
+}
+
+/*
+ * Количество записей группы, оставшихся в кэше, из count сохраненных.
+ */
+static guint quota_survivors( GpSmartCache *cache, guint group, guint count )
+{
+   guint survived = 0;
+   guint n;
+
+   for ( n = 0; n < count; n++ )
+      if (gp_smart_cache_get (cache, group, n, NULL, NULL, 0))
+         survived++ ;
+
+   return survived;
+}
+
+/*
+ * Проверка ограничений объема и веса групп: "тяжелая" группа не должна вытеснять данные "легкой".
+ */
+static void quota_check( void )
+{
+   GpSmartCache *cache;
+   GpSmartCacheStats stats;
+   guchar buff[DATA_SIZE];
+   guint light, heavy, weighted;
+   guint survived, weighted_survived;
+   guint n;
+
+   memset( buff, 0, DATA_SIZE );
+
+   // Жесткое ограничение
+   cache = gp_smart_cache_new ();
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   light = gp_smart_cache_reg_group (cache);
+   heavy = gp_smart_cache_reg_group_full (cache, 0, CACHE_SIZE * DATA_SIZE / 2, 1);
+
+   for ( n = 0; n < CACHE_SIZE / 4; n++ )
+      gp_smart_cache_set_unowned (cache, light, n, buff, DATA_SIZE);
+   for ( n = 0; n < CACHE_SIZE * 3; n++ )
+      gp_smart_cache_set_unowned (cache, heavy, n, buff, DATA_SIZE);
+
+   gp_smart_cache_get_group_stats (cache, heavy, &stats);
+   g_assert( stats.bytes <= CACHE_SIZE * DATA_SIZE / 2 );
+   g_assert( quota_survivors( cache, light, CACHE_SIZE / 4 ) == CACHE_SIZE / 4 );
+
+   // Снятие ограничения
+   gp_smart_cache_set_group_quota (cache, heavy, 0, 0, 1);
+   for ( n = 0; n < CACHE_SIZE * 3; n++ )
+      gp_smart_cache_set_unowned (cache, heavy, n, buff, DATA_SIZE);
+   g_assert( quota_survivors( cache, light, CACHE_SIZE / 4 ) == 0 );
+
+   g_object_unref( cache );
+
+   // Мягкое ограничение
+   cache = gp_smart_cache_new ();
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   light = gp_smart_cache_reg_group (cache);
+   heavy = gp_smart_cache_reg_group_full (cache, CACHE_SIZE * DATA_SIZE / 2, 0, 1);
+
+   for ( n = 0; n < CACHE_SIZE / 4; n++ )
+      gp_smart_cache_set_unowned (cache, light, n, buff, DATA_SIZE);
+   for ( n = 0; n < CACHE_SIZE * 3; n++ )
+      gp_smart_cache_set_unowned (cache, heavy, n, buff, DATA_SIZE);
+
+   g_assert( quota_survivors( cache, light, CACHE_SIZE / 4 ) == CACHE_SIZE / 4 );
+
+   g_object_unref( cache );
+
+   // Вес
+   cache = gp_smart_cache_new ();
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   light = gp_smart_cache_reg_group (cache);
+   weighted = gp_smart_cache_reg_group_full (cache, 0, 0, 4);
+
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+   {
+      gp_smart_cache_set_unowned (cache, light, n, buff, DATA_SIZE);
+      gp_smart_cache_set_unowned (cache, weighted, n, buff, DATA_SIZE);
+   }
+
+   survived = quota_survivors( cache, light, CACHE_SIZE * 2 );
+   weighted_survived = quota_survivors( cache, weighted, CACHE_SIZE * 2 );
+   printf( "Weights: %u of weight 1 and %u of weight 4 survived\n", survived, weighted_survived );
+   g_assert( weighted_survived > survived * 2 );
+
+   g_object_unref( cache );
+}
+
+/*
+ * Проверка дискового уровня кэша, в том числе "теплого" старта.
+ */
+static void disk_check( void )
+{
+   gchar *filename = g_build_filename( g_get_tmp_dir(), "gsmartcachetest.disk", NULL );
+   GpSmartCache *cache = gp_smart_cache_new ();
+   GpSmartCacheStats stats;
+   guchar buff[DATA_SIZE], expected[DATA_SIZE];
+   guint group, other, size;
+   guint n;
+
+   g_remove( filename );
+
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   g_assert( gp_smart_cache_set_disk_file (cache, filename, CACHE_SIZE * DATA_SIZE * 4) );
+   group = gp_smart_cache_persistent_group_id( "gsmartcachetest" );
+   g_assert( gp_smart_cache_persistent_group_id( "gsmartcachetest" ) == group );
+   g_assert( gp_smart_cache_reg_persistent_group (cache, group) );
+   g_assert( !gp_smart_cache_reg_persistent_group (cache, group) );
+   gp_smart_cache_set_group_stamp (cache, group, 1);
+
+   // Данные группы с непостоянным номером на диск не сохраняются
+   other = gp_smart_cache_reg_group (cache);
+   g_assert( other < GP_SMART_CACHE_PERSISTENT_GROUP_MIN );
+   g_assert( !gp_smart_cache_reg_persistent_group (cache, other) );
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+   {
+      compressed_fill( buff, n );
+      gp_smart_cache_set_unowned (cache, other, n, buff, DATA_SIZE);
+   }
+
+   gp_smart_cache_get_stats (cache, &stats);
+   g_assert( stats.evictions > 0 && stats.disk_stores == 0 );
+   gp_smart_cache_clean (cache, other);
+   gp_smart_cache_unreg_group (cache, other);
+   gp_smart_cache_reset_stats (cache);
+
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+   {
+      compressed_fill( buff, n );
+      gp_smart_cache_set_unowned (cache, group, n, buff, DATA_SIZE);
+   }
+
+   // Вытесненные данные сохранены на диск и загружаются с него при обращении
+   gp_smart_cache_get_stats (cache, &stats);
+   g_assert( stats.evictions > 0 && stats.disk_stores == stats.evictions );
+
+   for ( n = 0; n < CACHE_SIZE * 2; n++ )
+   {
+      compressed_fill( expected, n );
+      g_assert( gp_smart_cache_get (cache, group, n, &size, buff, DATA_SIZE) );
+      g_assert( size == DATA_SIZE && memcmp( buff, expected, DATA_SIZE ) == 0 );
+   }
+
+   gp_smart_cache_get_stats (cache, &stats);
+   g_assert( stats.misses == 0 && stats.disk_loads >= CACHE_SIZE );
+
+   gp_smart_cache_sync_disk (cache);
+   g_object_unref( cache );
+
+   // "Теплый" старт: все данные доступны новому кэшу
+   cache = gp_smart_cache_new ();
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   g_assert( gp_smart_cache_reg_persistent_group (cache, group) );
+   gp_smart_cache_set_group_stamp (cache, group, 1);
+   g_assert( gp_smart_cache_set_disk_file (cache, filename, CACHE_SIZE * DATA_SIZE * 4) );
+
+   gp_smart_cache_get_stats (cache, &stats);
+   printf( "Disk: %u records (%llu bytes) after restart\n", stats.disk_records, (unsigned long long) stats.disk_bytes );
+   g_assert( stats.disk_records == CACHE_SIZE * 2 );
+
+   for ( n = 0; n < CACHE_SIZE * 2; n += 7 )
+   {
+      compressed_fill( expected, n );
+      g_assert( gp_smart_cache_get (cache, group, n, &size, buff, DATA_SIZE) );
+      g_assert( size == DATA_SIZE && memcmp( buff, expected, DATA_SIZE ) == 0 );
+   }
+
+   // Замененные данные на диске не используются
+   memset( buff, 0, DATA_SIZE );
+   gp_smart_cache_set_unowned (cache, group, 0, buff, DATA_SIZE);
+   gp_smart_cache_sync_disk (cache);
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   g_assert( gp_smart_cache_get (cache, group, 0, &size, buff, DATA_SIZE) && buff[DATA_SIZE - 1] == 0 );
+
+   // Данные другого поколения не выдаются
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   gp_smart_cache_set_group_stamp (cache, group, 2);
+   g_assert( !gp_smart_cache_get (cache, group, 1, NULL, NULL, 0) );
+
+   gp_smart_cache_get_stats (cache, &stats);
+   g_assert( stats.disk_records == 0 );
+
+   g_object_unref( cache );
+   g_remove( filename );
+   g_free( filename );
+}
+
+/*
+ * Проверка 64-битных номеров данных: номера, отличающиеся только
+ * старшими 32 битами, не должны совпадать, в том числе на диске.
+ */
+static void wide_index_check( void )
+{
+   gchar *filename = g_build_filename( g_get_tmp_dir(), "gsmartcachetest.wide", NULL );
+   GpSmartCache *cache = gp_smart_cache_new ();
+   guchar buff[DATA_SIZE], expected[DATA_SIZE];
+   guint group, size;
+   guint n, shift;
+
+   g_remove( filename );
+
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   g_assert( gp_smart_cache_set_disk_file (cache, filename, CACHE_SIZE * DATA_SIZE * 8) );
+   group = gp_smart_cache_persistent_group_id( "gsmartcachetest.wide" );
+   g_assert( gp_smart_cache_reg_persistent_group (cache, group) );
+
+   for ( shift = 0; shift < 64; shift += 16 )
+      for ( n = 0; n < CACHE_SIZE; n++ )
+      {
+         compressed_fill( buff, n * 64 + shift );
+         gp_smart_cache_set_unowned (cache, group, (guint64) n << shift, buff, DATA_SIZE);
+      }
+
+   for ( shift = 0; shift < 64; shift += 16 )
+      for ( n = 1; n < CACHE_SIZE; n++ )
+      {
+         compressed_fill( expected, n * 64 + shift );
+         g_assert( gp_smart_cache_get (cache, group, (guint64) n << shift, &size, buff, DATA_SIZE) );
+         g_assert( size == DATA_SIZE && memcmp( buff, expected, DATA_SIZE ) == 0 );
+      }
+
+   g_object_unref( cache );
+   g_remove( filename );
+   g_free( filename );
+}
+
+/*
+ * Функция повторного использования данных для recycle_check: складывает буферы в пул.
+ */
+static void recycle_to_pool( gpointer data, guint size, gpointer user_data )
+{
+   GPtrArray *pool = user_data;
+
+   g_assert( size == DATA_SIZE );
+   g_ptr_array_add( pool, data );
+}
+
+/*
+ * Проверка повторного использования данных: вытесненные, замененные и удаленные данные
+ * группы передаются функции группы, а не освобождаются, данные других групп -- освобождаются.
+ */
+static void recycle_check( void )
+{
+   GpSmartCache *cache = gp_smart_cache_new ();
+   GPtrArray *pool = g_ptr_array_new ();
+   guchar buff[DATA_SIZE];
+   guint group, other;
+   guint allocated = 0;
+   guint n;
+
+   gp_smart_cache_set_size (cache, CACHE_SIZE * DATA_SIZE);
+   group = gp_smart_cache_reg_group (cache);
+   other = gp_smart_cache_reg_group (cache);
+   gp_smart_cache_set_group_recycle_func (cache, group, recycle_to_pool, pool, NULL);
+
+   // Вытеснение
+   for ( n = 0; n < CACHE_SIZE * 2; n++, allocated++ )
+      gp_smart_cache_set (cache, group, n, g_malloc0( DATA_SIZE ), DATA_SIZE);
+   g_assert( pool->len >= CACHE_SIZE );
+
+   // Вытесненные буферы используются заново, замененные данные также возвращаются
+   for ( n = 0; n < CACHE_SIZE / 2; n++ )
+   {
+      gpointer data = g_ptr_array_remove_index_fast( pool, pool->len - 1 );
+
+      memset( data, n, DATA_SIZE );
+      gp_smart_cache_set (cache, group, n, data, DATA_SIZE);
+
+      g_assert( gp_smart_cache_get (cache, group, n, NULL, buff, DATA_SIZE) );
+      g_assert( buff[0] == (guchar) n && buff[DATA_SIZE - 1] == buff[0] );
+   }
+
+   // Данные другой группы освобождаются как обычно
+   for ( n = 0; n < CACHE_SIZE; n++ )
+      gp_smart_cache_set (cache, other, n, g_malloc0( DATA_SIZE ), DATA_SIZE);
+   gp_smart_cache_clean (cache, other);
+
+   // После удаления все буферы группы вернулись
+   gp_smart_cache_clean (cache, group);
+   g_assert( pool->len == allocated );
+
+   // После снятия функции данные освобождаются как обычно
+   gp_smart_cache_unreg_group (cache, group);
+   gp_smart_cache_set_unowned (cache, group, 0, buff, DATA_SIZE);
+   gp_smart_cache_clean (cache, group);
+   g_assert( pool->len == allocated );
+
+   gp_smart_cache_unreg_group (cache, other);
+   g_object_unref( cache );
+   g_ptr_array_foreach( pool, (GFunc) g_free, NULL );
+   g_ptr_array_free( pool, TRUE );
+}
+
 int main( int argc, char **argv )
 {
    GpSmartCache *cache;
@@ -158,6 +823,41 @@ int main( int argc, char **argv )
    printf( "New size:     %9zu bytes, free: %9zu bytes\n", gp_smart_cache_get_size (cache),
            gp_smart_cache_get_free (cache) );
 
+   /*
+    * Многопоточная работа
+    */
+
+   threads_check( cache, timer );
+
+   acquire_check();
+   stats_check();
+   compressed_check();
+   disk_check();
+   wide_index_check();
+   quota_check();
+   recycle_check();
+
+   /*
+    * Политики вытеснения
+    */
+
+   // LRU вытесняет все данные при однократном просмотре, SLRU и ARC должны их сохранить
+   g_assert( scan_check( GP_SMART_CACHE_POLICY_LRU ) == 0 );
+   scan_check( GP_SMART_CACHE_POLICY_CLOCK );
+   g_assert( scan_check( GP_SMART_CACHE_POLICY_SLRU ) == HOT_COUNT );
+   g_assert( scan_check( GP_SMART_CACHE_POLICY_ARC ) == HOT_COUNT );
+
+   pinned_check();
+
+   for ( n = GP_SMART_CACHE_POLICY_CLOCK; n <= GP_SMART_CACHE_POLICY_ARC; n++ )
+   {
+      GpSmartCache *policy_cache = gp_smart_cache_new_with_policy (n);
+
+      gp_smart_cache_set_size (policy_cache, CACHE_SIZE * DATA_SIZE / 2);
+      threads_check( policy_cache, timer );
+      g_object_unref( policy_cache );
+   }
+
    g_free( data );
 
    #if 1
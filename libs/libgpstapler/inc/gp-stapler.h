@@ -351,6 +351,37 @@ void gp_stapler_set_tiler_fixed_l(GpStapler *stapler, GtkTreeIter *iter, gint ty
 
 
 
+/**
+ * gp_stapler_get_tiler_prefetch:
+ * @stapler: указатель на объект #GpStapler.
+ * @iter: указатель на строку (Tiler).
+ * @ring: (out) (allow-none): ширина кольца плиток вокруг видимой области.
+ * @budget: (out) (allow-none): максимальное количество упреждающе запрашиваемых плиток.
+ *
+ * Позволяет получить параметры упреждающего запроса плиток Tiler'а.
+ */
+void gp_stapler_get_tiler_prefetch(GpStapler *stapler, GtkTreeIter *iter, guint *ring, guint *budget);
+
+
+/**
+ * gp_stapler_set_tiler_prefetch:
+ * @stapler: указатель на объект #GpStapler.
+ * @iter: указатель на строку (Tiler).
+ * @ring: ширина кольца плиток вокруг видимой области (0 -- без кольца).
+ * @budget: максимальное количество упреждающе запрашиваемых плиток (0 -- упреждающие запросы отключены).
+ *
+ * Задает параметры упреждающего запроса плиток Tiler'а.
+ *
+ * Когда все видимые плитки Tiler'а сформированы, с наименьшим приоритетом запрашиваются плитки
+ * в кольце шириной @ring вокруг видимой области и плитки соседних масштабов (кроме типов плиток
+ * с фиксированным масштабом), чтобы при сдвиге или изменении масштаба они уже были в кэше.
+ * Запрашивается не более @budget плиток с учетом уже стоящих в очереди заданий Tiler'а.
+ * По умолчанию @ring = 1, @budget = 64.
+ */
+void gp_stapler_set_tiler_prefetch(GpStapler *stapler, GtkTreeIter *iter, guint ring, guint budget);
+
+
+
 /**
  * gp_stapler_set_tiler_visible:
  * @stapler: указатель на объект #GpStapler.
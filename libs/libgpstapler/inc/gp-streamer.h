@@ -4,7 +4,8 @@
  * \author Gennady Nefediev
  * \date 17.08.2017
  *
- * Объект Streamer формирует несколько плиток и экспортирует изображение в файл.
+ * Объект Streamer формирует плитки и экспортирует изображение в файл Cloud Optimized GeoTIFF
+ * и в виде пирамиды плиток.
  *
 */
 
@@ -71,6 +72,48 @@ typedef enum
 }
 GpStreamerError;
 
+
+/**
+* GpStreamerCompression:
+* @GP_STREAMER_COMPRESSION_NONE: Без сжатия.
+* @GP_STREAMER_COMPRESSION_DEFLATE: Сжатие Deflate (zlib).
+* @GP_STREAMER_COMPRESSION_LZW: Сжатие LZW.
+* @GP_STREAMER_COMPRESSION_ZSTD: Сжатие Zstandard, если библиотека собрана с libzstd.
+*
+* Виды сжатия плиток в файле.
+*/
+typedef enum
+{
+  GP_STREAMER_COMPRESSION_NONE,
+  GP_STREAMER_COMPRESSION_DEFLATE,
+  GP_STREAMER_COMPRESSION_LZW,
+  GP_STREAMER_COMPRESSION_ZSTD
+}
+GpStreamerCompression;
+
+
+/**
+* GpStreamerTileFunc:
+* @level: номер уровня пирамиды, 0 -- исходное разрешение.
+* @tile: плитка уровня: сторона в сантиметрах и индексы в сетке плиток этой стороны.
+* @data: пиксели плитки в формате ARGB32, #GP_TILE_DATA_SIZE байт.
+* @user_data: пользовательские данные.
+*
+* Функция получения готовой плитки пирамиды. Данные действительны только во время вызова.
+*/
+typedef void (*GpStreamerTileFunc)( guint level, const GpTile *tile, const guint8 *data, gpointer user_data);
+
+
+/**
+* GpStreamerDoneFunc:
+* @streamer: объект, завершивший экспорт.
+* @success: TRUE, если все плитки получены и записаны; FALSE при отмене или ошибке.
+* @user_data: пользовательские данные.
+*
+* Функция уведомления о завершении экспорта.
+*/
+typedef void (*GpStreamerDoneFunc)( GpStreamer *streamer, gboolean success, gpointer user_data);
+
 /**
 * GP_STREAMER_ERROR:
 *
@@ -93,7 +136,7 @@ GpStreamer *gp_streamer_new( void);
 /**
  * gp_streamer_get_fraction:
  *
- * Returns: значение счетчика активности.
+ * Returns: значение счетчика активности от 0 до 1. Функцию можно вызывать во время экспорта.
  */
 gdouble gp_streamer_get_fraction( GpStreamer *streamer);
 
@@ -125,9 +168,10 @@ void gp_streamer_set_act_name( GpStreamer *streamer, gchar *name);
 
 /**
  * gp_streamer_set_tiler:
- * @tiler: указатель на объект Tiler, предназначенный для формирования плиток.
+ * @tiler: (allow-none): указатель на объект Tiler, предназначенный для формирования плиток.
  *
- * Указать Tiler.
+ * Указать Tiler. Объект хранит ссылку на Tiler до своего уничтожения,
+ * поэтому Tiler можно освободить во время экспорта. Менять Tiler после запуска экспорта нельзя.
  */
 void gp_streamer_set_tiler( GpStreamer *streamer, GpTiler *tiler);
 
@@ -137,7 +181,8 @@ void gp_streamer_set_tiler( GpStreamer *streamer, GpTiler *tiler);
  * @name: полный путь и имя файла без расширения.
  * @ext: расширение файла.
  *
- * Указать имя файла для экспорта.
+ * Указать имя файла для экспорта. Если имя не задано, файл не записывается,
+ * например, когда нужна только пирамида плиток (см. gp_streamer_set_pyramid()).
  */
 void gp_streamer_set_file_name( GpStreamer *streamer, gchar *name, gchar *ext);
 
@@ -160,6 +205,65 @@ void gp_streamer_set_tile_side( GpStreamer *streamer, gint value);
 void gp_streamer_set_view_type( GpStreamer *streamer, gint tiles_type);
 
 
+/**
+ * gp_streamer_set_compression:
+ * @compression: вид сжатия.
+ *
+ * Указать вид сжатия плиток в файле, по умолчанию #GP_STREAMER_COMPRESSION_DEFLATE.
+ * Изменять вид сжатия во время экспорта нельзя.
+ */
+void gp_streamer_set_compression( GpStreamer *streamer, GpStreamerCompression compression);
+
+
+/**
+ * gp_streamer_set_pyramid:
+ * @levels: количество уровней, включая исходное разрешение, 0 -- пока область не уместится в одну плитку.
+ * @func: (allow-none): функция получения плиток или NULL, чтобы не строить пирамиду.
+ * @user_data: пользовательские данные для @func.
+ *
+ * Построить при экспорте пирамиду плиток в сетке Tiler. Плитка уровня k имеет сторону side * 2^k
+ * и собирается усреднением пикселей плиток (2x..2x+1, 2y..2y+1) уровня k-1, поэтому уровни
+ * получаются из одного прохода по плиткам исходного разрешения.
+ *
+ * @func вызывается из потока экспорта (см. gp_streamer_start()) для каждой плитки каждого уровня
+ * по мере их готовности: плитки уровня 0 строка за строкой, плитки следующих уровней --
+ * как только заполнена строка их дочерних плиток.
+ */
+void gp_streamer_set_pyramid( GpStreamer *streamer, guint levels, GpStreamerTileFunc func, gpointer user_data);
+
+
+/**
+ * gp_streamer_set_mbtiles:
+ * @filename: (allow-none): имя файла MBTiles или NULL, чтобы не записывать файл.
+ *
+ * Записать при экспорте пирамиду плиток (см. gp_streamer_set_pyramid(), по умолчанию --
+ * пока область не уместится в одну плитку) в файл MBTiles: базу SQLite с плитками в PNG,
+ * одинаковые плитки хранятся один раз, прозрачные не хранятся.
+ *
+ * Плитки адресуются в сетке Tiler, а не в веб-меркаторе: tile_column и tile_row -- индексы x и y
+ * плитки, zoom_level = maxzoom - k для уровня k пирамиды. Сторона плиток исходного разрешения,
+ * utm-зона и область экспорта записываются в метаданные gp_tile_side, gp_utm_zone и gp_area,
+ * в метаданные scheme записывается нестандартное значение "gp-tiler".
+ *
+ * Из-за этого файл не совместим со спецификацией MBTiles (веб-меркатор, схема TMS): другие программы
+ * либо не откроют его, либо покажут плитки не на своих местах. Прочитать файл можно только
+ * с помощью Gp.MbtilesTiler.
+ */
+void gp_streamer_set_mbtiles( GpStreamer *streamer, const gchar *filename);
+
+
+/**
+ * gp_streamer_set_window:
+ * @tiles: количество плиток, запрашиваемых у Tiler одновременно, 0 -- строка плиток.
+ *
+ * Указать размер окна запросов. Плитки запрашиваются с упреждением в порядке строк,
+ * пока до первой еще не полученной плитки не больше @tiles плиток, и передаются дальше
+ * по порядку сразу после получения. Память экспорта ограничена окном, одной строкой плиток
+ * каждого уровня пирамид и плитками, ожидающими сжатия и записи (их число тоже ограничено).
+ */
+void gp_streamer_set_window( GpStreamer *streamer, guint tiles);
+
+
 /**
  * gp_streamer_set_utm_zone:
  * @zone: номер utm-зоны.
@@ -182,12 +286,32 @@ void gp_streamer_set_area( GpStreamer *streamer, gdouble from_x, gdouble to_x, g
 
 
 /**
- * gp_streamer_set_all_tiles:
+ * gp_streamer_start:
+ * @streamer: указатель на объект #GpStreamer.
+ * @func: (allow-none): функция уведомления о завершении или NULL.
+ * @user_data: пользовательские данные для @func.
+ *
+ * Запускает экспорт в отдельном потоке: формирует плитки выбранной области отображения
+ * и записывает их в один файл Cloud Optimized GeoTIFF вместе с обзорными уровнями и, если задана,
+ * строит пирамиду плиток (см. gp_streamer_set_pyramid()). Плитки запрашиваются с упреждением
+ * (см. gp_streamer_set_window()), готовые плитки сразу сжимаются в пуле потоков.
+ *
+ * @func вызывается в главном контексте (#GMainContext) потока, вызвавшего gp_streamer_start(),
+ * поэтому в нем должен работать цикл обработки событий. До вызова @func объект не уничтожается,
+ * для прерывания экспорта используется объект, возвращаемый gp_streamer_get_cancellable().
+ * Экспорт запускается один раз за время жизни объекта.
+ */
+void gp_streamer_start( GpStreamer *streamer, GpStreamerDoneFunc func, gpointer user_data);
+
+
+/**
+ * gp_streamer_save:
  * @streamer: указатель на объект #GpStreamer.
  *
- * Создает пиксельный буфер для всей выбранной области отображения и сбрасывает его в файлы.
- * 
- * Returns: TRUE в случае успеха или наоборот -- полного эпик-фейла. FALSE в случае если еще не все плитки готовы.
+ * Вариант gp_streamer_start() без уведомления: первый вызов запускает экспорт,
+ * последующие проверяют его завершение.
+ *
+ * Returns: TRUE, если экспорт завершен (успешно или нет), FALSE, если экспорт еще идет.
  */
 gboolean gp_streamer_save( GpStreamer *streamer);
 
@@ -75,25 +75,54 @@ public abstract class AsyncTiler : Tiler
 {
   /**
   * Описания нужных ("желаемых") плиток:
-  * стоящих в очереди на генерацию (в диспетчере),
-  * сгенерированных (лежащих в done_tiles),
-  * генерируемых в данный момент.
+  * стоящих в очереди на генерацию (в диспетчере), генерируемых в данный момент
+  * и сгенерированных, но еще не полученных запросившим их (лежащих в this.done_tiles).
+  * Плитка, сгенерированная по упреждающему запросу, кладется в кэш и удаляется из this.desired_tiles.
+  *
+  * Значение -- поколение задания на генерацию плитки (см. AsyncTilerTaskGetTile.generation).
+  * Задание, поколение которого не совпадает с поколением плитки в this.desired_tiles, устарело.
+  */
+  private HashTable<Gp.Tile?, uint> desired_tiles;
+  /**
+  * Поколение последнего созданного задания на генерацию плитки (всегда четное).
   */
-  private GenericSet<Gp.Tile?> desired_tiles;
+  private uint desired_generation;
   /**
-  * Мьютекс для доступа к this.desired_tiles.
+  * Младший бит поколения задания -- признак упреждающего запроса плитки (см. prefetch_from_source()).
+  */
+  private const uint GENERATION_PREFETCH = 1;
+  /**
+  * Плитки, сгенерированные по обычному запросу и ожидающие get_tile_from_source().
+  *
+  * Плитка отдается запросившему прямо отсюда, а в кэш ее кладет уже Tiler (см. Tiler.get_tile()),
+  * поэтому доходит до запросившего, даже если кэш ее не примет или сразу вытеснит.
+  * Пока плитка лежит здесь, она остается в this.desired_tiles и повторно не генерируется.
+  */
+  private HashTable<Gp.Tile?, Gp.MemTile> done_tiles;
+  /**
+  * Мьютекс для доступа к this.desired_tiles, this.done_tiles, this.desired_generation и this.focus.
   */
   private Mutex mutex_for_desired_tiles;
 
   /**
-  * Флаг, что задание TaskUpdate уже есть в очереди.
+  * Плитка в центре видимой области, см. set_focus().
+  * Пока фокус не задан (l == 0), все плитки генерируются с приоритетом по умолчанию.
   */
-  private int update_processing;
+  private Gp.Tile focus;
 
   /**
-  * Очередь готовых сгенерированных плиток.
+  * Максимальное учитываемое в приоритете расстояние (в плитках) от фокуса.
   */
-  private AsyncQueue<Gp.MemTile> done_tiles;
+  private const int PRIORITY_DISTANCE_MAX = 63;
+  /**
+  * Прибавка к приоритету за каждое отличие масштаба плитки от масштаба фокуса в 2 раза.
+  */
+  private const int PRIORITY_LOD_STEP = 8;
+
+  /**
+  * Флаг, что задание TaskUpdate уже есть в очереди.
+  */
+  private int update_processing;
 
   /**
   * Данные для отрисовки.
@@ -148,6 +177,9 @@ public abstract class AsyncTiler : Tiler
     *
     * @param immut указатель на данные для отрисовки.
     *
+    * Долгая генерация может быть прервана досрочно, если плитка стала не нужна,
+    * см. AsyncTiler.is_tile_cancelled().
+    *
     * @param tile Объект с описанием плитки, которую нужно сгенерировать.
     * @param tile Буфер, куда будут записаны сгенерированные ARGB32-данные.
     */
@@ -164,9 +196,8 @@ public abstract class AsyncTiler : Tiler
 
   construct
   {
-    this.done_tiles = new AsyncQueue<Gp.MemTile>();
-
-    this.desired_tiles = new GenericSet<Gp.Tile?>(Gp.Tile.get_index, Gp.Tile.equal_all);
+    this.desired_tiles = new HashTable<Gp.Tile?, uint>(Gp.Tile.get_index, Gp.Tile.equal_all);
+    this.done_tiles = new HashTable<Gp.Tile?, Gp.MemTile>(Gp.Tile.get_index, Gp.Tile.equal_all);
     this.mutex_for_desired_tiles = Mutex();
 
     this.immut_mutex = Mutex();
@@ -176,17 +207,6 @@ public abstract class AsyncTiler : Tiler
   ~AsyncTiler()
   {
     this.drop_tasks();
-    this.drop_done_tiles_from_queue(); //< На старых версия Vala (как минимум, на Wheezy) очереди приходится чистить вручную, иначе получим утечку памяти.
-  }
-
-
-  /**
-  * Метод очищает очередь сформированных плиток.
-  */
-  private void drop_done_tiles_from_queue()
-  {
-    while(this.done_tiles.try_pop() != null)
-      ;
   }
 
 
@@ -222,16 +242,234 @@ public abstract class AsyncTiler : Tiler
 
   /**
   * Метод очищает очередь заданий на формирование плиток.
+  * Еще не начатые задания удаляются из очереди диспетчера,
+  * выполняющиеся -- завершатся без выдачи плитки.
+  * Уже сгенерированные, но еще не полученные плитки помещаются в кэш.
   */
   public override void drop_tasks()
   {
+    var dropped = new GenericArray<Gp.MemTile>();
+
     this.mutex_for_desired_tiles.lock();
       this.desired_tiles.remove_all();
+      this.done_tiles.foreach_remove((tile, mem_tile) =>
+      {
+        dropped.add(mem_tile);
+        return true;
+      });
+    this.mutex_for_desired_tiles.unlock();
+
+    this.dispatcher.remove_queued(this.is_stale_task);
+    this.store_dropped_tiles(dropped);
+  }
+
+
+  /**
+  * Метод удаляет задания на формирование плиток типа from.type, не попадающих в видимую область.
+  * Еще не начатые задания удаляются из очереди диспетчера,
+  * выполняющиеся -- завершатся без выдачи плитки.
+  * Уже сгенерированные, но еще не полученные плитки помещаются в кэш.
+  * @param from Первая плитка видимой области.
+  * @param to Последняя плитка видимой области.
+  */
+  public override void drop_tasks_outside(Gp.Tile from, Gp.Tile to)
+  {
+    var dropped = new GenericArray<Gp.MemTile>();
+
+    this.mutex_for_desired_tiles.lock();
+      this.desired_tiles.foreach_remove((tile, generation) =>
+      {
+        return is_tile_outside(tile, from, to);
+      });
+      this.done_tiles.foreach_remove((tile, mem_tile) =>
+      {
+        if(!is_tile_outside(tile, from, to))
+          return false;
+
+        dropped.add(mem_tile);
+        return true;
+      });
+    this.mutex_for_desired_tiles.unlock();
+
+    this.dispatcher.remove_queued(this.is_stale_task);
+    this.store_dropped_tiles(dropped);
+  }
+
+
+  /**
+  * Помещает в кэш сгенерированные плитки, удаленные из this.done_tiles.
+  * Вызывается не под this.mutex_for_desired_tiles.
+  */
+  private void store_dropped_tiles(GenericArray<Gp.MemTile> dropped)
+  {
+    for(uint i = 0; i < dropped.length; i++)
+      this.store_tile(dropped[i]);
+  }
+
+
+  /**
+  * Проверяет, что плитка типа from.type не попадает в видимую область from - to.
+  */
+  private static bool is_tile_outside(Gp.Tile tile, Gp.Tile from, Gp.Tile to)
+  {
+    return tile.type == from.type &&
+      (tile.l != from.l || tile.x < from.x || tile.x > to.x || tile.y < from.y || tile.y > to.y);
+  }
+
+
+  /**
+  * Проверяет, что задание на генерацию плитки не устарело:
+  * плитка все еще нужна, еще не сгенерирована и для нее не создано более нового задания.
+  * @param task Задание.
+  * @return true, если задание актуально.
+  */
+  private bool is_task_actual(AsyncTilerTaskGetTile task)
+  {
+    bool actual;
+
+    this.mutex_for_desired_tiles.lock();
+      actual = (this.desired_tiles.lookup(task.tile) == task.generation && !this.done_tiles.contains(task.tile));
+    this.mutex_for_desired_tiles.unlock();
+
+    return actual;
+  }
+
+
+  /**
+  * Условие отбора устаревших заданий этого AsyncTiler'а в очереди диспетчера (см. Gp.WorkerFilterFunc).
+  */
+  private bool is_stale_task(Gp.Worker worker)
+  {
+    var task = worker as AsyncTilerTaskGetTile;
+
+    return task != null && task.tiler == this && !this.is_task_actual(task);
+  }
+
+
+  /**
+  * Проверяет, что плитка больше не нужна (или уже сгенерирована другим заданием).
+  * Метод thread-safe. Предназначен для использования в AsyncTiler.tile_generate(),
+  * чтобы досрочно прервать генерацию ненужной плитки (например, при смене видимой области).
+  * @param tile Генерируемая плитка.
+  * @return true, если генерацию плитки можно прервать.
+  */
+  protected bool is_tile_cancelled(Gp.Tile tile)
+  {
+    bool cancelled;
+
+    this.mutex_for_desired_tiles.lock();
+      cancelled = !this.desired_tiles.contains(tile) || this.done_tiles.contains(tile);
     this.mutex_for_desired_tiles.unlock();
+
+    return cancelled;
   }
 
 
 
+  /**
+  * Задает плитку в центре видимой области.
+  * @param focus Плитка в центре видимой области (в текущем масштабе).
+  */
+  public override void set_focus(Gp.Tile focus)
+  {
+    this.mutex_for_desired_tiles.lock();
+      this.focus = focus;
+    this.mutex_for_desired_tiles.unlock();
+  }
+
+
+  /**
+  * Вычисляет приоритет задания на генерацию плитки (на базе GLib.Priority).
+  *
+  * Чем ближе плитка к фокусу (по расстоянию Чебышёва в плитках масштаба фокуса)
+  * и чем ближе ее масштаб к масштабу фокуса, тем выше приоритет.
+  * Приоритет плиток не ниже GLib.Priority.DEFAULT и выше GLib.Priority.HIGH_IDLE.
+  *
+  * Вызывается под this.mutex_for_desired_tiles.
+  *
+  * @param tile Плитка.
+  *
+  * @return Приоритет задания.
+  */
+  private int get_tile_priority(Gp.Tile tile)
+  {
+    if(this.focus.l == 0 || tile.l == 0)
+      return GLib.Priority.DEFAULT;
+
+    double scale = (double)tile.l / this.focus.l;
+    double dx = Math.fabs((tile.x + 0.5) * scale - (this.focus.x + 0.5));
+    double dy = Math.fabs((tile.y + 0.5) * scale - (this.focus.y + 0.5));
+
+    int distance = (int)Math.fmin(Math.fmax(dx, dy), PRIORITY_DISTANCE_MAX);
+    int lod = (int)Math.fabs(Math.round(Math.log2(scale)));
+
+    return GLib.Priority.DEFAULT + int.min(distance + lod * PRIORITY_LOD_STEP, GLib.Priority.HIGH_IDLE - 1);
+  }
+
+
+  /**
+  * Ставит в очередь диспетчера задание на генерацию плитки, если такого задания еще нет.
+  *
+  * Плитка, уже запрошенная упреждающе, при обычном запросе получает новое задание
+  * с приоритетом по ее расстоянию от фокуса, а старое задание устаревает.
+  * Если старое задание уже выполняется, сгенерированная им плитка отдается по новому запросу
+  * (см. sync_get_tile()).
+  *
+  * @param tile Плитка.
+  * @param prefetch Признак упреждающего запроса (с наименьшим приоритетом).
+  *
+  * @return true, если задание поставлено в очередь.
+  */
+  private bool add_tile_task(Gp.Tile tile, bool prefetch)
+  {
+    this.mutex_for_desired_tiles.lock();
+      uint generation = this.desired_tiles.lookup(tile);
+
+      if(generation != 0 && (prefetch || (generation & GENERATION_PREFETCH) == 0))
+      {
+        this.mutex_for_desired_tiles.unlock();
+        return false;
+      }
+
+      // Поколение 0 зарезервировано за отсутствующими в this.desired_tiles плитками.
+      this.desired_generation += 2;
+      if(unlikely(this.desired_generation == 0))
+        this.desired_generation += 2;
+
+      generation = this.desired_generation | (prefetch ? GENERATION_PREFETCH : 0);
+      this.desired_tiles.insert(tile, generation);
+
+      int priority = prefetch ? GLib.Priority.LOW : this.get_tile_priority(tile);
+    this.mutex_for_desired_tiles.unlock();
+
+    try
+    {
+      this.dispatcher.add(new AsyncTilerTaskGetTile(this, tile, generation, priority));
+    }
+    catch(ThreadError e)
+    {
+      critical("failed to add AsyncTilerTaskGetTile to dispatcher");
+      return false;
+    }
+
+    return true;
+  }
+
+
+  /**
+  * Метод упреждающего запроса плитки: ставит задание на генерацию плитки с приоритетом GLib.Priority.LOW,
+  * т.е. после всех плиток, запрошенных обычным образом.
+  * @param tile Плитка, которая может вскоре понадобиться.
+  * @return true, если задание поставлено в очередь.
+  */
+  protected override bool prefetch_from_source(Gp.Tile tile)
+  {
+    return_val_if_fail(tile.type < this.tile_types_num, false);
+
+    return this.add_tile_task(tile, true);
+  }
+
+
   /**
   * Метод позволяет получить последний сгенерированный иммут (если таковой вообще есть).
   */
@@ -254,7 +492,7 @@ public abstract class AsyncTiler : Tiler
     uint rval;
 
     this.mutex_for_desired_tiles.lock();
-      rval = this.desired_tiles.length;
+      rval = this.desired_tiles.size();
     this.mutex_for_desired_tiles.unlock();
 
     return rval;
@@ -262,49 +500,33 @@ public abstract class AsyncTiler : Tiler
 
 
   /**
-  * Метод получения плитки из очереди this.done_tiles.
-  * Может вернуть и плитку, отличную от required_tile.
+  * Метод отдает сгенерированную плитку из this.done_tiles,
+  * либо ставит задание на генерацию плитки, если его еще нет.
+  * Метод thread-safe.
   *
   * @param required_tile требуемая плитка.
   * @param status Требуется плитка со статусом отрисовки более указанного.
   *
-  * @return Данные плитки (актуальные или нет), либо null, если данных для плитки пока еще нет.
+  * @return Сгенерированная плитка, либо null, если она еще не готова.
   */
   protected override Gp.MemTile? get_tile_from_source(Gp.Tile required_tile, Gp.TileStatus status)
   {
-    Gp.MemTile? mem_tile_from_queue;
-
-    while(( mem_tile_from_queue = this.done_tiles.try_pop() ) != null)
-    {
-      this.mutex_for_desired_tiles.lock();
-        this.desired_tiles.remove(mem_tile_from_queue.tile);
-      this.mutex_for_desired_tiles.unlock();
-
-      return_val_if_fail(mem_tile_from_queue.tile.type < this.tile_types_num, null);
-
-      return mem_tile_from_queue;
-    }
+    Gp.MemTile? mem_tile;
 
     this.mutex_for_desired_tiles.lock();
-    if(this.desired_tiles.contains(required_tile) == false)
-    {
-      this.desired_tiles.add(required_tile);
-
-      this.mutex_for_desired_tiles.unlock();
+      mem_tile = this.done_tiles.lookup(required_tile);
 
-      try
+      if(mem_tile != null)
       {
-        this.dispatcher.add(new AsyncTilerTaskGetTile(this, required_tile));
+        this.done_tiles.remove(required_tile);
+        this.desired_tiles.remove(required_tile);
       }
-      catch(ThreadError e)
-      {
-        critical("failed to add AsyncTilerTaskGetTile to dispatcher");
-      }
-    }
-    else
-      this.mutex_for_desired_tiles.unlock();
+    this.mutex_for_desired_tiles.unlock();
+
+    if(mem_tile == null)
+      this.add_tile_task(required_tile, false);
 
-    return null;
+    return mem_tile;
   }
 
 
@@ -382,16 +604,9 @@ public abstract class AsyncTiler : Tiler
 
   internal void sync_get_tile(AsyncTilerTaskGetTile task)
   {
-    {
-      bool desire;
-
-      this.mutex_for_desired_tiles.lock();
-        desire = this.desired_tiles.contains(task.tile);
-      this.mutex_for_desired_tiles.unlock();
-
-      if(!desire)
-        return;
-    }
+    // Задание могло устареть, пока стояло в очереди.
+    if(!this.is_task_actual(task))
+      return;
 
     Gp.MemTile mem_tile = new Gp.MemTile.with_tile(task.tile, TileStatus.ACTUAL);
 
@@ -410,12 +625,37 @@ public abstract class AsyncTiler : Tiler
             this.tile_generate(immut, mem_tile.tile, mem_tile.get_buf());
         }
 
+        // Генерация ненужной плитки могла быть прервана в tile_generate() (см. is_tile_cancelled()),
+        // такая плитка не выдается. Плитка, для которой за время генерации поставили новое задание,
+        // по-прежнему нужна и выдается ниже, а не генерируется новым заданием повторно.
+        if(this.is_tile_cancelled(task.tile))
+          return;
+
         this.immut_mutex.lock();
       }
       while(unlikely(revision_before_generate != this.immut_revision));
     this.immut_mutex.unlock();
 
-    this.done_tiles.push(mem_tile);
+    bool requested = false;
+
+    // Запрошенную плитку дожидается get_tile_from_source(), упреждающая -- сразу в кэш.
+    // Если за время генерации плитку запросили обычным образом (новым заданием),
+    // она отдается по этому запросу, а новое задание устаревает (см. is_task_actual()).
+    // Плитка, ставшая ненужной уже после генерации, тоже идет в кэш.
+    this.mutex_for_desired_tiles.lock();
+      uint generation = this.desired_tiles.lookup(task.tile);
+
+      if((generation & GENERATION_PREFETCH) != 0)
+        this.desired_tiles.remove(task.tile);
+      else if(generation != 0 && !this.done_tiles.contains(task.tile))
+      {
+        this.done_tiles.insert(task.tile, mem_tile);
+        requested = true;
+      }
+    this.mutex_for_desired_tiles.unlock();
+
+    if(!requested)
+      this.store_tile(mem_tile);
   }
 
 
@@ -0,0 +1,211 @@
+/*
+ * MbtilesTiler.vala
+ *
+ * Tiler, отдающий готовые плитки из файла MBTiles.
+ */
+
+namespace Gp
+{
+  /**
+  * Tiler, отдающий плитки из файла MBTiles, записанного Gp.Streamer (см. gp_streamer_set_mbtiles()).
+  *
+  * Плитки не формируются заново: изображение читается из базы SQLite и распаковывается из PNG
+  * прямо в вызывающем потоке, поэтому Tiler синхронный. Запрос к базе выполняется под мьютексом,
+  * распаковка -- без блокировок, параллельно в потоках, запрашивающих плитки.
+  *
+  * Плитки адресуются в сетке Tiler: плитке (x, y) стороной side * 2^k соответствует строка
+  * tile_column = x, tile_row = y, zoom_level = maxzoom - k, где side -- метаданные gp_tile_side.
+  * Плитки, которых нет в файле (прозрачные или вне области экспорта), и плитки других размеров
+  * возвращаются пустыми.
+  *
+  * Файлы MBTiles в веб-меркаторе (схемы TMS и XYZ) этим Tiler'ом не читаются: файлы Gp.Streamer
+  * отмечены в метаданных значением scheme = "gp-tiler", файлы с другой схемой отвергаются.
+  */
+  public class MbtilesTiler : Tiler
+  {
+    private Sqlite.Database db;
+    private Sqlite.Statement select_tile;
+    private Mutex db_mutex = Mutex();   //< Доступ к select_tile.
+
+    /**
+    * Значение метаданных scheme файлов, записанных Gp.Streamer (MBTILES_GP_SCHEME в mbtiles.h).
+    */
+    public const string SCHEME = "gp-tiler";
+
+    private uint side = 0;              //< Сторона плиток исходного разрешения, см.
+    private int maxzoom = 0;
+    private double[]? area = null;      //< Область экспорта: from_x, from_y, to_x, to_y.
+
+    /**
+    * Имя файла MBTiles.
+    */
+    public string file_name { get; construct; }
+
+    /**
+    * Открывает файл MBTiles на чтение.
+    *
+    * @param cache_to_set Кэш для плиток.
+    * @param file_name Имя файла.
+    */
+    public MbtilesTiler(SmartCache cache_to_set, string file_name) throws IOError
+    {
+      Object(cache : cache_to_set, tile_types_num : 1, file_name : file_name, name : Path.get_basename(file_name));
+
+      if(Sqlite.Database.open_v2(file_name, out this.db, Sqlite.OPEN_READONLY) != Sqlite.OK)
+        throw new IOError.FAILED("Error opening %s: %s", file_name, this.db.errmsg());
+
+      Sqlite.Statement metadata;
+      if(this.db.prepare_v2("SELECT name, value FROM metadata", -1, out metadata) != Sqlite.OK)
+        throw new IOError.INVALID_DATA("Error reading %s: %s", file_name, this.db.errmsg());
+
+      while(metadata.step() == Sqlite.ROW)
+      {
+        string value = metadata.column_text(1) ?? "";
+
+        switch(metadata.column_text(0))
+        {
+          // Файлы без scheme записаны прежними версиями Gp.Streamer и распознаются по gp_tile_side.
+          case "scheme":
+            if(value != SCHEME)
+              throw new IOError.NOT_SUPPORTED("%s uses \"%s\" tile scheme, only files exported by GpStreamer are supported", file_name, value);
+            break;
+
+          case "gp_tile_side":
+            this.side = (uint)int.parse(value);
+            break;
+
+          case "maxzoom":
+            this.maxzoom = int.parse(value);
+            break;
+
+          case "gp_area":
+            string[] values = value.split(",");
+
+            if(values.length == 4)
+            {
+              this.area = new double[4];
+              for(int i = 0; i < 4; i++)
+                this.area[i] = double.parse(values[i]);
+            }
+            break;
+        }
+      }
+
+      // Без стороны плитки нельзя сопоставить zoom_level с сеткой Tiler.
+      if(this.side == 0)
+        throw new IOError.INVALID_DATA("%s was not exported by GpStreamer: no gp_tile_side in metadata", file_name);
+
+      if(this.db.prepare_v2("SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+          -1, out this.select_tile) != Sqlite.OK)
+        throw new IOError.INVALID_DATA("Error reading %s: %s", file_name, this.db.errmsg());
+    }
+
+    public override bool provides_tile_type(int type)
+    {
+      return type == 0;
+    }
+
+    public override bool get_area(int type, out double from_x, out double to_x, out double from_y, out double to_y)
+    {
+      if(this.area == null)
+        return base.get_area(type, out from_x, out to_x, out from_y, out to_y);
+
+      from_x = this.area[0];
+      from_y = this.area[1];
+      to_x = this.area[2];
+      to_y = this.area[3];
+
+      return true;
+    }
+
+    /**
+    * Уровень zoom_level файла для плиток стороной l или -1, если таких плиток в файле нет.
+    */
+    private int get_zoom(uint l)
+    {
+      for(int k = 0; k <= this.maxzoom; k++)
+        if((this.side << k) == l)
+          return this.maxzoom - k;
+
+      return -1;
+    }
+
+    /**
+    * Метод чтения плитки из файла.
+    *
+    * @param required_tile требуемая плитка.
+    * @param required_status не используется: плитки из файла всегда актуальны.
+    *
+    * @return Актуальная плитка, пустая, если ее нет в файле.
+    */
+    protected override Gp.MemTile? get_tile_from_source(Gp.Tile required_tile, Gp.TileStatus required_status)
+    {
+      var res_tile = new MemTile.with_tile(required_tile, TileStatus.ACTUAL);
+
+      int zoom = this.get_zoom(required_tile.l);
+      if(required_tile.type != 0 || zoom < 0)
+        return res_tile;
+
+      uint8[]? png = null;
+
+      this.db_mutex.lock();
+        this.select_tile.bind_int(1, zoom);
+        this.select_tile.bind_int(2, required_tile.x);
+        this.select_tile.bind_int(3, required_tile.y);
+
+        if(this.select_tile.step() == Sqlite.ROW)
+        {
+          unowned uint8[] blob = (uint8[])this.select_tile.column_blob(0);
+          blob.length = this.select_tile.column_bytes(0);
+          png = blob;
+        }
+
+        this.select_tile.reset();
+      this.db_mutex.unlock();
+
+      if(png != null && !decode_png(png, (uint32*)res_tile.get_buf()))
+        warning("%s: broken tile %d, %d (zoom %d)", this.file_name, required_tile.x, required_tile.y, zoom);
+
+      return res_tile;
+    }
+
+    /**
+    * Распаковывает PNG плитки в буфер формата Cairo.Format.ARGB32.
+    */
+    private static bool decode_png(uint8[] png, uint32* buf)
+    {
+      size_t offset = 0;
+
+      var surface = new Cairo.ImageSurface.from_png_stream((data) =>
+      {
+        if(offset + data.length > png.length)
+          return Cairo.Status.READ_ERROR;
+
+        Memory.copy(data, &png[offset], data.length);
+        offset += data.length;
+
+        return Cairo.Status.SUCCESS;
+      });
+
+      if(surface.status() != Cairo.Status.SUCCESS ||
+         surface.get_width() != TILE_SIDE || surface.get_height() != TILE_SIDE)
+        return false;
+
+      surface.flush();
+
+      // Непрозрачные PNG читаются в формате RGB24 с неопределенным байтом альфа-канала.
+      uint32 alpha = (surface.get_format() == Cairo.Format.RGB24) ? 0xFF000000 : 0;
+      uint8* src = (uint8*)surface.get_data();
+
+      for(int row = 0; row < TILE_SIDE; row++)
+      {
+        uint32* line = (uint32*)(src + row * surface.get_stride());
+
+        for(int i = 0; i < TILE_SIDE; i++)
+          buf[row * TILE_SIDE + i] = line[i] | alpha;
+      }
+
+      return true;
+    }
+  }
+}
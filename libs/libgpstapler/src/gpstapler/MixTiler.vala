@@ -12,6 +12,8 @@ namespace Gp
   public class MixTiler : Tiler
   {
     PaletteBox palette_pref = null;
+    PaletteLut? lut = null;   //< Таблица цветов по palette_pref (см. get_lut()).
+    Mutex lut_mutex = Mutex();
     int[] provides_types = new int[0];
 
     struct Area
@@ -22,9 +24,22 @@ namespace Gp
       double to_y;
     }
 
-    private class Trunk<MemTile> trunk = new Trunk<MemTile>(() => { return new MemTile(); });
-
     public TreeModel main_stapler { get; construct; }
+
+    /**
+    * Снимок смешиваемых Tiler'ов main_stapler (кроме самого MixTiler'а) и их видимости.
+    * Обновляется в главном потоке по сигналам модели (см. update_sources()), а методы,
+    * вызываемые из других потоков (get_tile_from_source()), читают только снимок, не обращаясь к модели.
+    */
+    Tiler[] sources = {};
+    bool[] sources_visible = {};
+    Mutex sources_mutex = Mutex();
+
+    /**
+    * Диспетчер, в потоках которого параллельно смешиваются полосы плитки (null -- только в вызывающем потоке).
+    */
+    public Gp.Dispatcher? dispatcher { get; set; }
+
     Area area;
 
     public MixTiler(SmartCache cache_to_set, TreeModel stapler, int tile_types_num_to_set)
@@ -52,6 +67,56 @@ namespace Gp
           iter_valid = stapler.iter_next( ref iter);
         }
       }
+
+      stapler.row_changed.connect(this.on_row_changed);
+      stapler.row_inserted.connect(this.on_row_changed);
+      stapler.row_deleted.connect(this.on_row_deleted);
+      this.update_sources();
+    }
+
+    private void on_row_changed(TreePath path, TreeIter iter)
+    {
+      this.update_sources();
+    }
+
+    private void on_row_deleted(TreePath path)
+    {
+      this.update_sources();
+    }
+
+    /**
+    * Обновляет снимок смешиваемых Tiler'ов по модели main_stapler. Вызывается только в главном потоке.
+    */
+    private void update_sources()
+    {
+      Tiler[] tilers = {};
+      bool[] visible = {};
+
+      TreeIter iter;
+      if(main_stapler.get_iter_first(out iter) == true)
+      {
+        do
+        {
+          Value val;
+          main_stapler.get_value( iter, TilerTreeModelCols.TILER, out val);
+
+          // Строка могла быть только что добавлена и еще не заполнена.
+          Tiler? tiler = val.get_object() as Tiler;
+          if(tiler == null || tiler == this)
+            continue;
+
+          main_stapler.get_value( iter, TilerTreeModelCols.VISIBLE, out val);
+
+          tilers += tiler;
+          visible += (bool)val;
+        }
+        while(main_stapler.iter_next(ref iter));
+      }
+
+      this.sources_mutex.lock();
+        this.sources = (owned)tilers;
+        this.sources_visible = (owned)visible;
+      this.sources_mutex.unlock();
     }
 
     public override bool is_graphical(int type)
@@ -132,8 +197,59 @@ namespace Gp
     }
 
     /**
-    * Метод получения плитки из очереди this.done_tiles.
-    * Может вернуть и плитку, отличную от required_tile.
+    * Передает плитку в центре видимой области смешиваемым Tiler'ам.
+    */
+    public override void set_focus(Gp.Tile focus)
+    {
+      this.sources_mutex.lock();
+        Tiler[] tilers = this.sources;
+      this.sources_mutex.unlock();
+
+      foreach(Tiler tiler in tilers)
+        tiler.set_focus(focus);
+    }
+
+    /**
+    * Возвращает таблицу цветов для смешанных значений по текущей палитре,
+    * при изменении палитры таблица строится заново.
+    */
+    private PaletteLut get_lut()
+    {
+      PaletteType type = this.palette_pref.type;
+      Palette palette = this.palette_pref.get_palette();
+
+      // Значение для палитры из смешанного: для SIMPLE -- по числу градаций на отрезке [0; 255].
+      uint simple_max = (palette.n == 0) ? 255 : palette.n;
+      if(type == PaletteType.SIMPLE)
+      {
+        palette.d1 = 0;
+        palette.d2 = 255;
+      }
+
+      this.lut_mutex.lock();
+        if(this.lut == null || !this.lut.matches(palette, type))
+          this.lut = new PaletteLut.for_uint16(palette, type, (raw) =>
+          {
+            if(type == PaletteType.SIMPLE)
+              return (simple_max - raw / 256) * 255 / simple_max;
+            else if(type == PaletteType.ADVANCED)
+              return (float)raw / 10;
+            else
+              return 0;
+          }, true);
+
+        PaletteLut lut = this.lut;
+      this.lut_mutex.unlock();
+
+      return lut;
+    }
+
+    /**
+    * Метод смешивания плиток видимых не графических Tiler'ов.
+    *
+    * Плитки источников берутся из их кэша без копирования (acquire_tile), смешиваются
+    * полосами строк (см. MixJob) и раскрашиваются палитрой.
+    * Метод может вызываться из любого потока, источники берутся из снимка модели (см. update_sources()).
     *
     * @param required_tile требуемая плитка.
     * @param required_status Требуется плитка со статусом отрисовки более указанного.
@@ -144,41 +260,38 @@ namespace Gp
     {
       int visible_tilers = 0;
       TileStatus res_status = 0;
-      var guards = new Gp.Trunk.Guard<MemTile>[0]; //< Отрисованные хоть как-то плитки.
+      Tiler[] tilers = {};     //< Tiler'ы, у которых есть хоть как-то отрисованные плитки,
+      uint8*[] datas = {};     //< данные этих плиток в кэше
+      uint32*[] pixels = {};   //< и их изображения.
 
-      TreeIter iter;
-      if(main_stapler.get_iter_first(out iter) == true)
-      {
-        do
-        {
-          Value val;
-          main_stapler.get_value( iter, TilerTreeModelCols.VISIBLE, out val);
+      this.sources_mutex.lock();
+        Tiler[] sources = this.sources;
+        bool[] sources_visible = this.sources_visible;
+      this.sources_mutex.unlock();
 
-          if((bool)val == true)
-          {
-            main_stapler.get_value( iter, TilerTreeModelCols.TILER, out val);
+      for(int s = 0; s < sources.length; s++)
+      {
+        Tiler tiler = sources[s];
 
-            if((val as Tiler).is_graphical(required_tile.type) == false)
-            {
-              Trunk.Guard? cur_tiler_guard = null;
-              MemTile cur_mem_tile = trunk.access(ref cur_tiler_guard);
+        if(sources_visible[s] == true && tiler.is_graphical(required_tile.type) == false)
+        {
+          TileStatus status;
 
-              // FIXME: По идее не совсем верно передавать сюда required_status,
-              // корректней было б передать статус плитки от конкретно этого Tiler'а,
-              // полученной на предыдущей итерации. Но хранить все эти статусы сложно.
-              cur_mem_tile.status = (val as Tiler).get_tile(cur_mem_tile.get_buf(), required_tile, required_status);
+          // FIXME: По идее не совсем верно передавать сюда required_status,
+          // корректней было б передать статус плитки от конкретно этого Tiler'а,
+          // полученной на предыдущей итерации. Но хранить все эти статусы сложно.
+          unowned uint8[]? data = tiler.acquire_tile(required_tile, required_status, out status);
 
-              if(cur_mem_tile.status > TileStatus.NOT_INIT)
-              {
-                guards += cur_tiler_guard;
-                res_status +=  cur_mem_tile.status;
-              }
-
-              visible_tilers++;
-            }
+          if(data != null)
+          {
+            tilers += tiler;
+            datas += (uint8*)data;
+            pixels += (uint32*)MemTile.get_buf_from_malloc_data(data);
+            res_status += status;
           }
+
+          visible_tilers++;
         }
-        while(main_stapler.iter_next(ref iter));
       }
 
       // Вернем пустую готовую плитку, если просто не из чего миксовать.
@@ -186,244 +299,230 @@ namespace Gp
           return new MemTile.with_tile(required_tile, TileStatus.ACTUAL);
 
       // Если в теории есть из чего миксовать, но пока нет ни одной хоть как-то готовой плитки.
-      if(guards.length == 0)
+      if(tilers.length == 0)
         return null;
 
+      MemTile? res_tile = null;
       res_status = res_status / visible_tilers;
 
-      if(res_status <= required_status)
-        return null;
+      if(res_status > required_status)
+      {
+        var job = (this.palette_pref != null) ?
+          new MixJob(this.palette_pref.type, this.palette_pref.get_palette(), this.get_lut()) :
+          new MixJob(PaletteType.NONE, Palette(), null);
+        job.sources = pixels;
+
+        res_tile = new MemTile.with_tile(required_tile, res_status);
+        job.result = (uint32*)res_tile.get_buf();
+        job.execute(this.dispatcher);
+      }
+
+      for(int i = 0; i < tilers.length; i++)
+        tilers[i].release_tile(required_tile, (uint8[])datas[i]);
+
+      return res_tile;
+    }
+
+    /**
+    * Задание смешивания плиток.
+    *
+    * Плитка делится на полосы по BAND_ROWS строк, полосы обрабатываются независимо:
+    * в вызывающем потоке и (если задан диспетчер) в потоках диспетчера,
+    * каждый поток берет следующую необработанную полосу.
+    * Вызывающий поток сам обрабатывает полосы, пока они есть, и ждет только уже начатые,
+    * поэтому смешивание не блокируется, даже если все потоки диспетчера заняты.
+    *
+    * Формат данных источников (по байтам пикселя): [0] -- вид данных (0 -- нет данных),
+    * [1..2] -- значение uint16 (little endian).
+    * Для ADVANCED-палитры из нескольких значений пикселя выбирается вид с меньшим номером (1, 2, 3),
+    * значения одного вида сглаживаются медианой по тройкам.
+    * Для SIMPLE-палитры берется пиксель с большим номером вида.
+    */
+    private class MixJob : Object, Gp.Worker
+    {
+      private const int BAND_ROWS = 16;
+      private const int BANDS = Gp.TILE_SIDE / BAND_ROWS;
+      private const int BAND_PIXELS = BAND_ROWS * Gp.TILE_SIDE;
+
+      public uint32*[] sources = {};
+      public uint32* result;
+
+      private PaletteType type;
+      private PaletteLut? lut;   //< Таблица цветов для смешанных значений (null -- палитры нет).
+      private int advanced_min;  //< Диапазон значений, смешиваемых для ADVANCED-палитры.
+      private int advanced_max;
+
+      private int next_band = 0;
+      private int bands_done = 0;
+      private Mutex mutex = Mutex();
+      private Cond cond = Cond();
 
-      MemTile res_tile = new MemTile();
-      res_tile.status = res_status;
-      res_tile.tile = required_tile;
-      unowned uint8[] res_buf = res_tile.get_buf();
-      uint16 val = 0;
-      float buf_val = 0;
-      uint64 buf_int[Gp.TILE_DATA_SIZE / 4];
-      uint64 median_buf_int[Gp.TILE_DATA_SIZE / 4];
-      int64 count_data[Gp.TILE_DATA_SIZE / 4];
-      int n = 0;
-
-      for(int i = 0; i < Gp.TILE_DATA_SIZE / 4; i++)
+      public MixJob(PaletteType type, Palette palette, PaletteLut? lut)
       {
-        buf_int[i] = 0;
-        count_data[i] = 0;
+        // Палитра и ее параметры вычисляются один раз на плитку, а не для каждого пикселя.
+        this.type = type;
+        this.lut = lut;
+
+        // Условие d1 < val / 10 < d2 (деление целочисленное) в виде диапазона val.
+        double q_min = Math.floor(palette.d1) + 1;
+        double q_max = Math.ceil(palette.d2) - 1;
+        this.advanced_min = (int)(10 * q_min).clamp(0, uint16.MAX + 1);
+        this.advanced_max = (int)(10 * q_max + 9).clamp(-1, uint16.MAX);
       }
 
-      // Миксование.
+      public int get_priority()
+      {
+        return GLib.Priority.HIGH;
+      }
 
-      foreach(var g in guards)
+      /**
+      * Смешивает полосы плитки, используя потоки dispatcher, и дожидается окончания.
+      */
+      public void execute(Gp.Dispatcher? dispatcher)
       {
-        unowned uint8[] cur_buf = trunk.access(ref g).get_buf();
-        n = 0;
+        if(dispatcher != null)
+        {
+          int helpers = int.min(BANDS, (int)get_num_processors()) - 1;
+
+          try
+          {
+            for(int i = 0; i < helpers; i++)
+              dispatcher.add(this);
+          }
+          catch(ThreadError e)
+          {
+            // Оставшиеся полосы обработает вызывающий поток.
+          }
+        }
+
+        this.run();
+
+        this.mutex.lock();
+          while(this.bands_done < BANDS)
+            this.cond.wait(this.mutex);
+        this.mutex.unlock();
+      }
 
-        for(int i = 0; i < Gp.TILE_DATA_SIZE - 4; i += 4)
+      /**
+      * Обрабатывает полосы, пока есть необработанные.
+      */
+      public void run()
+      {
+        int band;
+
+        while((band = AtomicInt.add(ref this.next_band, 1)) < BANDS)
         {
-          switch(this.palette_pref.type)
+          uint32* res = this.result + band * BAND_PIXELS;
+
+          switch(this.type)
           {
             case PaletteType.SIMPLE:
-            {
-              if(cur_buf[i + 0] > res_buf[i + 0])
-              {
-                res_buf[i + 0] = cur_buf[i + 0];
-                res_buf[i + 1] = cur_buf[i + 1];
-                res_buf[i + 2] = cur_buf[i + 2];
-                res_buf[i + 3] = 0;
-              }
-            }
+              this.mix_simple(res, band * BAND_PIXELS);
             break;
             case PaletteType.ADVANCED:
-            {
-              if(cur_buf[i + 0] > 0)
-              {
-                *((uint8*)(&val) + 0) = cur_buf[i + 1];
-                *((uint8*)(&val) + 1) = cur_buf[i + 2];
-
-                if(val / 10 > this.palette_pref.get_palette().d1 && val / 10 < this.palette_pref.get_palette().d2)
-                {
-                  switch(cur_buf[i + 0])
-                  {
-                    case 3:
-                    {
-                      if(count_data[n] == 0)
-                      {
-                        buf_int[n] = val;
-                        count_data[n] = 100000;
-                        median_buf_int[n] = 0;
-                      }
-                      else
-                      {
-                        if(count_data[n] == 100000)
-                        {
-                          if(median_buf_int[n] == 0)
-                          {
-                            median_buf_int[n] = val;
-                          }
-                          else
-                          {
-                            buf_int[n] = (buf_int[n] <= median_buf_int[n] && median_buf_int[n] <= val) ? median_buf_int[n] : ((buf_int[n] <= val && val <= median_buf_int[n]) ? val : buf_int[n]);
-                            median_buf_int[n] = 0;
-                          }
-                        }
-                      }
-                    }
-                    break;
-                    case 2:
-                    {
-                      if(count_data[n] == 0 || count_data[n] == 100000)
-                      {
-                        buf_int[n] = val;
-                        count_data[n] = 1;
-                        median_buf_int[n] = 0;
-                      }
-                      else
-                      {
-                        if(count_data[n] > 0)
-                        {
-                          if(median_buf_int[n] == 0)
-                          {
-                            median_buf_int[n] = val;
-                          }
-                          else
-                          {
-                            buf_int[n] = (buf_int[n] <= median_buf_int[n] && median_buf_int[n] <= val) ? median_buf_int[n] : ((buf_int[n] <= val && val <= median_buf_int[n]) ? val : buf_int[n]);
-                            median_buf_int[n] = 0;
-                          }
-                        }
-                      }
-//~                       if(count_data[n] >= 0)
-//~                       {
-//~                         buf_int[n] += val;
-//~                         count_data[n] += 1;
-//~                       }
-//~                       else
-//~                         if(count_data[n] == 100000)
-//~                         {
-//~                           buf_int[n] = val;
-//~                           count_data[n] = 1;
-//~                         }
-                    }
-                    break;
-                    case 1:
-                    {
-                      if(count_data[n] >= 0)
-                      {
-                        buf_int[n] = val;
-                        count_data[n] = -1;
-                        median_buf_int[n] = 0;
-                      }
-                      else
-                      {
-                        if(median_buf_int[n] == 0)
-                        {
-                          median_buf_int[n] = val;
-                        }
-                        else
-                        {
-                          buf_int[n] = (buf_int[n] <= median_buf_int[n] && median_buf_int[n] <= val) ? median_buf_int[n] : ((buf_int[n] <= val && val <= median_buf_int[n]) ? val : buf_int[n]);
-                          median_buf_int[n] = 0;
-                        }
-                      }
-                      /*
-                      if(count_data[n] >= 0)
-                      {
-                        buf_int[n] = val;
-                        count_data[n] = -1;
-                      }
-                      else
-                      {
-                        buf_int[n] += val;
-                        count_data[n] += -1;
-                      }*/
-                    }
-                    break;
-                  }
-                }
-              }
-              n++;
-            }
+              this.mix_advanced(res, band * BAND_PIXELS);
             break;
             default:
+              Memory.set(res, 0, BAND_PIXELS * sizeof(uint32));
             break;
           }
+
+          this.colorize(res);
+
+          this.mutex.lock();
+            if(++this.bands_done == BANDS)
+              this.cond.broadcast();
+          this.mutex.unlock();
         }
       }
 
-      if(this.palette_pref.type == PaletteType.ADVANCED)
+      /**
+      * SIMPLE: пиксель источника с большим номером вида (без альфа-канала).
+      * Цикл без ветвлений по словам пикселей, векторизуется компилятором.
+      */
+      private void mix_simple(uint32* res, int first)
       {
-        n = 0;
-        for(int i = 0; i < Gp.TILE_DATA_SIZE - 4; i += 4)
+        Memory.set(res, 0, BAND_PIXELS * sizeof(uint32));
+
+        foreach(uint32* source in this.sources)
         {
-          if(count_data[n] != 0)
+          uint32* src = source + first;
+
+          for(int p = 0; p < BAND_PIXELS; p++)
           {
-            if(median_buf_int[n] == 0)
-              val = (uint16)(buf_int[n]);// Math.fabs(count_data[n]));
-            else
-              val = (uint16)((buf_int[n] + median_buf_int[n]) / 2);
+            uint32 w = uint32.from_little_endian(src[p]);
+            res[p] = ((w & 0xFF) > (res[p] & 0xFF)) ? (w & 0x00FFFFFF) : res[p];
           }
-          else
-            val = 0;
-
-          n++;
-          res_buf[i + 1] = *((uint8*)(&val) + 0);
-          res_buf[i + 2] = *((uint8*)(&val) + 1);
         }
       }
-      // Превращение замиксованных данных в цветные пиксели.
-      uint32 color = 0;
 
-      for(int i = 0; i < Gp.TILE_DATA_SIZE - 4; i += 4)
+      /**
+      * ADVANCED: значение вида с меньшим номером, сглаженное медианой по тройкам.
+      */
+      private void mix_advanced(uint32* res, int first)
       {
-        val = 0;
-        if(this.palette_pref != null)
-        {
-          Palette cur_plt = this.palette_pref.get_palette();
+        uint16[] buf = new uint16[BAND_PIXELS];
+        uint16[] median = new uint16[BAND_PIXELS];
+        uint8[] kind = new uint8[BAND_PIXELS]; //< 0 -- значений в пикселе нет.
 
-          *((uint8*)(&val) + 0) = res_buf[i + 1];
-          *((uint8*)(&val) + 1) = res_buf[i + 2];
+        foreach(uint32* source in this.sources)
+        {
+          uint32* src = source + first;
 
-          if(val > 0)
+          for(int p = 0; p < BAND_PIXELS; p++)
           {
-            switch(this.palette_pref.type)
+            uint32 w = uint32.from_little_endian(src[p]);
+            uint8 k = (uint8)(w & 0xFF);
+            uint16 v = (uint16)(w >> 8);
+
+            if(k == 0 || k > 3 || v < this.advanced_min || v > this.advanced_max)
+              continue;
+
+            if(kind[p] == 0 || k < kind[p])
             {
-              case PaletteType.SIMPLE:
-              {
-                cur_plt.d1 = 0;
-                cur_plt.d2 = 255;
-                uint max = (cur_plt.n == 0) ? 255 : cur_plt.n;
-                buf_val = (max - val / 256) * 255 / max;
-              }
-              break;
-              case PaletteType.ADVANCED:
+              kind[p] = k;
+              buf[p] = v;
+              median[p] = 0;
+            }
+            else if(k == kind[p])
+            {
+              if(median[p] == 0)
+                median[p] = v;
+              else
               {
-                buf_val = (float)val / 10;
+                uint16 a = buf[p], m = median[p];
+                buf[p] = (a <= m && m <= v) ? m : ((a <= v && v <= m) ? v : a);
+                median[p] = 0;
               }
-              break;
-              default:
-              break;
             }
-            color = cur_plt.get_pixel(buf_val, this.palette_pref.type);
           }
         }
 
-        if(val > 0 && color != 0)
+        for(int p = 0; p < BAND_PIXELS; p++)
         {
-          res_buf[i + 0] = *((uint8*)(&color) + 0);
-          res_buf[i + 1] = *((uint8*)(&color) + 1);
-          res_buf[i + 2] = *((uint8*)(&color) + 2);
-          res_buf[i + 3] = uint8.MAX;
+          uint32 v = (kind[p] == 0) ? 0 : ((median[p] == 0) ? buf[p] : (buf[p] + median[p]) / 2);
+          res[p] = v << 8;
         }
-        else
+      }
+
+      /**
+      * Превращение замиксованных данных в цветные пиксели (ARGB32) по таблице цветов.
+      */
+      private void colorize(uint32* res)
+      {
+        if(this.lut == null)
         {
-          res_buf[i + 0] = 0;
-          res_buf[i + 1] = 0;
-          res_buf[i + 2] = 0;
-          res_buf[i + 3] = 0;
+          Memory.set(res, 0, BAND_PIXELS * sizeof(uint32));
+          return;
         }
-      }
 
-      return res_tile;
+        uint16[] vals = new uint16[BAND_PIXELS];
+
+        for(int p = 0; p < BAND_PIXELS; p++)
+          vals[p] = (uint16)(res[p] >> 8);
+
+        this.lut.map_uint16(vals, (uint32[])res, BAND_PIXELS);
+      }
     }
   }
 }
@@ -53,15 +53,36 @@ namespace Gp
     */
     public Gp.Tile tile { construct; get; }
 
+    /**
+    * Приоритет задания (на базе GLib.Priority), см. AsyncTiler.get_tile_priority().
+    */
+    public int priority { construct; get; default = GLib.Priority.DEFAULT; }
+
+    /**
+    * Поколение задания: задание актуально, пока в AsyncTiler'е плитке соответствует это же поколение,
+    * см. AsyncTiler.is_task_actual().
+    */
+    public uint generation { construct; get; }
+
     /**
     * Создает объект AsyncTilerTaskGetTile.
     *
     * @param tiler объект GpAsyncTiler
     * @param tile описание плитки
+    * @param generation поколение задания
+    * @param priority приоритет задания
+    */
+    public AsyncTilerTaskGetTile(Gp.AsyncTiler tiler, Gp.Tile tile, uint generation, int priority = GLib.Priority.DEFAULT)
+    {
+      Object(tiler: tiler, tile: tile, generation: generation, priority: priority);
+    }
+
+    /**
+    * Приоритет задания для диспетчера.
     */
-    public AsyncTilerTaskGetTile(Gp.AsyncTiler tiler, Gp.Tile tile)
+    public int get_priority()
     {
-      Object(tiler: tiler, tile: tile);
+      return this.priority;
     }
 
     /**
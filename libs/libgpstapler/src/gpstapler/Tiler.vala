@@ -76,6 +76,20 @@ public enum TilerTreeModelCols /// Список колонок, которые G
  * Функция возвратит статус готовности плитки в виде Gp.TileStatus
  * и запишет изображение плитки в буфер, если доступна какая-то информация для отображения.
  * Если плитка еще не готова, следует запросить ее повторно через некоторое время.
+ *
+ *
+ * ==== Потокобезопасность ====
+ *
+ * Методы запроса плиток (get_tile, acquire_tile, acquire_cached_tile, release_tile, prefetch_tile)
+ * реентерабельны: один объект Tiler можно одновременно опрашивать из нескольких потоков
+ * (например, потоков подготовки слоев GpStapler, экспорта GpStreamer и GpTileViewer).
+ * Общих изменяемых буферов у Tiler нет: get_tile копирует изображение плитки в буфер вызывающего
+ * прямо из памяти кэша, удерживая данные с помощью acquire/release GpSmartCache,
+ * а собственные блокировки берет только кэш (на время поиска и учета ссылок, не на время копирования).
+ *
+ * От реализаций требуется, чтобы get_tile_from_source и prefetch_from_source
+ * также допускали одновременный вызов из нескольких потоков.
+ * Методы управления (update_data, drop_tasks, set_focus и т.п.) и сигналы -- для главного потока.
  */
 public abstract class Tiler : Object
 {
@@ -85,17 +99,17 @@ public abstract class Tiler : Object
     public signal void data_updated();
 
     /**
-    * Объект-буфер, чисто чтобы забирать данные из кэша.
-    * Используется в одном месте, чтобы получить данные из кэша
-    * и сразу вернуть их из метода, уже в виде массива.
-    * Создается один раз и живет все время жизни Gp.Tiler.
+    * Хранилище групп плиток, соответствующих зарегистрированным типам.
     */
-    private MemTile buf_for_cache_get;
+    private uint[] groups;
 
     /**
-    * Хранилище групп плиток, соответствующих зарегистрированным типам.
+    * Плитки, полученные из источника и отданные вызывающему через acquire_tile
+    * (ключ -- данные плитки). В кэш такая плитка помещается только в release_tile,
+    * поэтому доходит до вызывающего, даже если кэш ее не примет или сразу вытеснит.
     */
-    private uint[] groups;
+    private HashTable<void*, MemTile> held_tiles = new HashTable<void*, MemTile>(direct_hash, direct_equal);
+    private Mutex held_mutex = Mutex();   //< Доступ к held_tiles.
 
   // Свойства -->
     /**
@@ -111,6 +125,18 @@ public abstract class Tiler : Object
     */
     public string name { get; construct; }
 
+    /**
+    * Постоянный идентификатор данных Gp.Tiler'а для дискового уровня кэша (null -- нет).
+    *
+    * Если задан, группы кэша типов плиток регистрируются как постоянные
+    * (см. gp_smart_cache_reg_persistent_group): плитки вытесняются на диск
+    * и после перезапуска приложения загружаются с него ("теплый" старт).
+    * Идентификатор должен обозначать один и тот же источник данных во всех запусках,
+    * актуальность данных подтверждается поколением (см. set_cache_stamp).
+    * Данные постоянных групп при уничтожении Gp.Tiler'а в кэше сохраняются.
+    */
+    public string? persistent_id { get; construct; default = null; }
+
     /**
     * Количество типов плиток, с которым работает данные Tiler.
     */
@@ -138,6 +164,7 @@ public abstract class Tiler : Object
     * Метод получения плитки из некоего источника.
     *
     * Вызывается в get_tile, тогда и только тогда, когда не удалось найти запрошенную плитку в кеше.
+    * Может вызываться одновременно из нескольких потоков.
     *
     * Важно: get_tile_from_source имеет право вернуть и другую плитку, отличную от required_tile.
     * В последнем случае get_tile положет ее в кеш и повторно запросит required_tile.
@@ -210,12 +237,39 @@ public abstract class Tiler : Object
       */
       public virtual void drop_tasks() { return; }
       /**
+      * Метод удаляет асинхронные задания на формирование плиток типа from.type,
+      * не попадающих в видимую область: плиток другого масштаба (from.l)
+      * и плиток вне прямоугольника [from.x; to.x] x [from.y; to.y].
+      * Задания на формирование плиток других типов не затрагиваются.
+      * Если реализация класса Tiler работает синхронно, то этот метод переопределять не нужно.
+      * @param from Первая плитка видимой области.
+      * @param to Последняя плитка видимой области.
+      */
+      public virtual void drop_tasks_outside(Gp.Tile from, Gp.Tile to) { return; }
+      /**
       * Метод позволяет получить количество еще не обработанных асинхронных заданий
       * на формирование плиток.
       * Если реализация класса Tiler работает синхронно, то этот метод переопределять не нужно.
       * @return Количество необработанных заданий.
       */
       public virtual uint get_tasks_num() { return 0; }
+      /**
+      * Метод сообщает Tiler'у плитку в центре видимой области (в текущем масштабе).
+      * Асинхронные задания на формирование плиток, близких к ней по положению и масштабу,
+      * выполняются в первую очередь.
+      * Если реализация класса Tiler работает синхронно, то этот метод переопределять не нужно.
+      * @param focus Плитка в центре видимой области.
+      */
+      public virtual void set_focus(Gp.Tile focus) { return; }
+      /**
+      * Метод упреждающего запроса плитки из источника.
+      * Вызывается в prefetch_tile, если актуальной плитки нет в кэше.
+      * Асинхронная реализация должна поставить задание на формирование плитки с наименьшим приоритетом.
+      * Если реализация класса Tiler работает синхронно, то этот метод переопределять не нужно.
+      * @param tile Плитка, которая может вскоре понадобиться.
+      * @return true, если задание на формирование плитки поставлено.
+      */
+      protected virtual bool prefetch_from_source(Gp.Tile tile) { return false; }
     // Для Tiler'ов с асинхронными задачами <--
   // Абстрактные и виртуальные методы <--
 
@@ -223,22 +277,60 @@ public abstract class Tiler : Object
   construct
   {
     for(int i = 0; i < this.groups.length; i++)
-      this.groups[i] = this.cache.reg_group();
+    {
+      this.groups[i] = this.reg_group(i);
 
-    this.buf_for_cache_get = new MemTile();
+      // Память вытесненных из кэша плиток идет на новые объекты MemTile.
+      this.cache.set_group_recycle_func(this.groups[i], Gp.MemTile.recycle_malloc_data);
+    }
   }
 
 
   ~Tiler()
   {
     // Чистим группы кеша, зарегистрированные для типов плиток.
+    // Данные постоянных групп остаются в кэше и на диске для следующего запуска.
     foreach(uint group in this.groups)
     {
-      this.cache.clean(group);
+      if(group < Gp.SMART_CACHE_PERSISTENT_GROUP_MIN)
+        this.cache.clean(group);
       this.cache.unreg_group(group);
     }
   }
 
+  /**
+  * Регистрирует группу кэша для плиток типа type:
+  * постоянную, если задан persistent_id и ее номер свободен, иначе обычную.
+  */
+  private uint reg_group(int type)
+  {
+    if(this.persistent_id != null)
+    {
+      uint group = Gp.SmartCache.persistent_group_id("%s:%d".printf(this.persistent_id, type));
+
+      if(this.cache.reg_persistent_group(group))
+        return group;
+
+      warning("Tiler %s: cache group for \"%s\" is already in use, tiles of type %d will not be kept on disk",
+        this.name, this.persistent_id, type);
+    }
+
+    return this.cache.reg_group();
+  }
+
+  /**
+  * Задает поколение данных Gp.Tiler'а в дисковом уровне кэша (см. gp_smart_cache_set_group_stamp),
+  * например, время изменения источника данных. Плитки другого поколения из кэша не выдаются.
+  * Имеет смысл только при заданном persistent_id и вызывается до запросов плиток.
+  * @param stamp Поколение данных.
+  */
+  public void set_cache_stamp(uint64 stamp)
+  {
+    foreach(uint group in this.groups)
+      if(group >= Gp.SMART_CACHE_PERSISTENT_GROUP_MIN)
+        this.cache.set_group_stamp(group, stamp);
+  }
+
   /**
    * Очищает кэш с плитками типа "type" объекта Gp.Tiler, опционально -- по условию.
    * @param type Тип плитки;
@@ -261,6 +353,21 @@ public abstract class Tiler : Object
     this.cache.clean_by_condition(this.groups[type], cache_condition);
   }
 
+  /**
+   * Задает ограничения объема кэша с плитками типа "type" объекта Gp.Tiler и их вес при вытеснении,
+   * см. gp_smart_cache_set_group_quota().
+   * Позволяет, например, не давать Gp.Tiler'у с большим количеством плиток вытеснять плитки остальных слоев.
+   * @param type Тип плитки;
+   * @param soft_quota Мягкое ограничение объема плиток, байт (0 -- без ограничения);
+   * @param hard_quota Жесткое ограничение объема плиток, байт (0 -- без ограничения);
+   * @param weight Вес плиток при вытеснении (1 -- обычный).
+   */
+  public void set_cache_quota(int type, size_t soft_quota, size_t hard_quota, uint weight = 1)
+    requires(type < this.tile_types_num)
+  {
+    this.cache.set_group_quota(this.groups[type], soft_quota, hard_quota, weight);
+  }
+
   /**
    * Помечает плитку в кэше с плитками типа "type" объекта Gp.Tiler как неактуальную, опционально -- по условию.
    * @param type Тип плитки;
@@ -287,6 +394,211 @@ public abstract class Tiler : Object
       });
   }
 
+  /**
+  * Получает из кэша без копирования плитку со статусом отрисовки больше требуемого.
+  *
+  * @param tile Требуемая плитка
+  * @param status Требуется плитка со статусом отрисовки более указанного.
+  * @param rstatus Статус отрисовки найденной плитки, TileStatus.NOT_INIT, если плитка не найдена.
+  *
+  * @return Данные плитки в кэше (их нужно вернуть через release_tile), либо null.
+  */
+  private unowned uint8[]? acquire_from_cache(Gp.Tile tile, Gp.TileStatus status, out Gp.TileStatus rstatus)
+  {
+    uint group = this.groups[tile.type];
+    uint64 key = tile.get_key();
+
+    rstatus = TileStatus.NOT_INIT;
+
+    // Плитки вне диапазона ключей (см. Tile.get_key) в кэше не хранятся.
+    if(key == TILE_NO_KEY)
+      return null;
+
+    unowned uint8[]? data = this.cache.acquire(group, key);
+
+    if(data == null)
+      return null;
+
+    // Проверим, что нашли в кэше плитку со статусом больше требуемого.
+    if(MemTile.get_status_from_malloc_data(data) > status)
+    {
+      rstatus = MemTile.get_status_from_malloc_data(data);
+      return data;
+    }
+
+    this.cache.release(group, key, (void*)data);
+    return null;
+  }
+
+  /**
+  * Метод помещает сформированную плитку в кэш.
+  * Плитки вне диапазона ключей (см. Tile.get_key) в кэш не помещаются.
+  * Метод thread-safe, в том числе предназначен для вызова из потоков, формирующих плитки.
+  * ''После вызова объект mem_tile использовать нельзя.''
+  *
+  * @param mem_tile Плитка с данными.
+  */
+  protected void store_tile(MemTile mem_tile)
+  {
+    Gp.Tile tile = mem_tile.tile;
+    return_if_fail(tile.type < this.tile_types_num);
+
+    uint64 key = tile.get_key();
+    if(key == TILE_NO_KEY)
+      return;
+
+    this.cache.set(this.groups[tile.type], key, MemTile.free_to_malloc_data(mem_tile));
+  }
+
+  /**
+  * Метод получения плитки без копирования данных.
+  *
+  * В отличие от get_tile, не копирует изображение плитки в буфер, а возвращает данные
+  * прямо из памяти кэша (в формате, описанном в документации по Gp.MemTile,
+  * изображение можно получить с помощью MemTile.get_buf_from_malloc_data).
+  * Плитка, только что полученная из источника, отдается без копирования до помещения в кэш
+  * и помещается в него в release_tile.
+  * Данные не вытесняются из кэша и не освобождаются до вызова release_tile.
+  * Каждому вызову acquire_tile, вернувшему данные, должен соответствовать вызов release_tile.
+  *
+  * @param tile Требуемая плитка
+  * @param status Требуется плитка со статусом отрисовки более указанного.
+  * @param rstatus Статус отрисовки плитки в случае, если плитка отрисована,
+  * TileStatus.NOT_INIT в случае если нет.
+  *
+  * @return Данные плитки, либо null, если плитка не отрисована.
+  */
+  public unowned uint8[]? acquire_tile(Gp.Tile tile, Gp.TileStatus status, out Gp.TileStatus rstatus)
+  {
+    rstatus = TileStatus.NOT_INIT;
+    return_val_if_fail(tile.type < this.tile_types_num, null);
+
+    unowned uint8[]? data = this.acquire_from_cache(tile, status, out rstatus);
+
+    // Достали из кэша уже полностью готовую плитку, нет смысла дальше вызывать from_source.
+    if(rstatus == TileStatus.ACTUAL)
+      return data;
+
+    MemTile? new_memtile = this.fetch_from_source(tile, status, rstatus);
+
+    if(new_memtile != null)
+    {
+      if(data != null)
+        this.release_tile(tile, data);
+
+      rstatus = new_memtile.status;
+      data = new_memtile.get_malloc_data();
+
+      this.held_mutex.lock();
+        this.held_tiles.insert((void*)data, new_memtile);
+      this.held_mutex.unlock();
+    }
+
+    return data;
+  }
+
+  /**
+  * Запрашивает плитку у источника. Попутно полученные другие плитки помещаются в кэш.
+  *
+  * @param tile Требуемая плитка
+  * @param status Требуется плитка со статусом отрисовки более указанного.
+  * @param rstatus Статус отрисовки уже имеющейся у вызывающего плитки.
+  *
+  * @return Плитка со статусом больше rstatus (в кэш не помещена), либо null.
+  */
+  private MemTile? fetch_from_source(Gp.Tile tile, Gp.TileStatus status, Gp.TileStatus rstatus)
+  {
+    MemTile? new_memtile;
+    while((new_memtile = get_tile_from_source(tile, status)) != null)
+      if(Gp.Tile.equal_all(new_memtile.tile, tile))
+      {
+        // Обновлять кэш есть смысл только, если from_srouce вернул более актуальную плитку, чем уже есть в кэше.
+        if(new_memtile.status > rstatus)
+          return new_memtile;
+
+        break;
+      }
+      else
+        this.store_tile(new_memtile);
+
+    return null;
+  }
+
+  /**
+  * Метод получения плитки из кэша без копирования данных и без запроса плитки из источника.
+  *
+  * В отличие от acquire_tile, не ставит заданий на формирование плитки, если ее нет в кэше.
+  * Предназначен, например, для поиска в кэше плиток соседних масштабов,
+  * чтобы показать их вместо еще не сформированной плитки.
+  * Каждому вызову acquire_cached_tile, вернувшему данные, должен соответствовать вызов release_tile.
+  *
+  * @param tile Требуемая плитка
+  * @param status Требуется плитка со статусом отрисовки более указанного.
+  * @param rstatus Статус отрисовки найденной плитки, TileStatus.NOT_INIT, если плитка не найдена.
+  *
+  * @return Данные плитки в кэше, либо null, если плитки в кэше нет.
+  */
+  public unowned uint8[]? acquire_cached_tile(Gp.Tile tile, Gp.TileStatus status, out Gp.TileStatus rstatus)
+  {
+    rstatus = TileStatus.NOT_INIT;
+    return_val_if_fail(tile.type < this.tile_types_num, null);
+
+    return this.acquire_from_cache(tile, status, out rstatus);
+  }
+
+  /**
+  * Метод упреждающего запроса плитки, которая может вскоре понадобиться
+  * (например, соседней с видимой областью или соседнего масштаба).
+  *
+  * Если актуальной плитки нет в кэше, асинхронный Tiler сформирует ее
+  * с наименьшим приоритетом, после плиток, запрошенных через get_tile и acquire_tile,
+  * и положит в кэш.
+  *
+  * @param tile Плитка, которая может вскоре понадобиться.
+  *
+  * @return true, если поставлено задание на формирование плитки;
+  * false, если плитка уже есть в кэше или Tiler не поддерживает упреждающие запросы.
+  */
+  public bool prefetch_tile(Gp.Tile tile)
+  {
+    return_val_if_fail(tile.type < this.tile_types_num, false);
+
+    Gp.TileStatus rstatus;
+    unowned uint8[]? data = this.acquire_from_cache(tile, TileStatus.NOT_ACTUAL, out rstatus);
+
+    if(data != null)
+    {
+      this.release_tile(tile, data);
+      return false;
+    }
+
+    return this.prefetch_from_source(tile);
+  }
+
+  /**
+  * Метод возвращает кэшу данные плитки, полученные с помощью acquire_tile.
+  * Плитка, полученная acquire_tile прямо из источника, только здесь помещается в кэш.
+  * После вызова данные использовать нельзя.
+  *
+  * @param tile Плитка, переданная в acquire_tile.
+  * @param data Данные, которые вернул acquire_tile.
+  */
+  public void release_tile(Gp.Tile tile, [CCode(array_length = false)] uint8[] data)
+  {
+    MemTile? held;
+
+    this.held_mutex.lock();
+      held = this.held_tiles.lookup((void*)data);
+      if(held != null)
+        this.held_tiles.remove((void*)data);
+    this.held_mutex.unlock();
+
+    if(held != null)
+      this.store_tile(held);
+    else
+      this.cache.release(this.groups[tile.type], tile.get_key(), (void*)data);
+  }
+
   /**
   * Метод получения плитки, соответствующей переданным параметрам.
   *
@@ -294,6 +606,9 @@ public abstract class Tiler : Object
   * @param tile Требуемая плитка
   * @param status Требуется плитка со статусом отрисовки более указанного.
   *
+  * Метод реентерабелен (см. "Потокобезопасность" в описании класса):
+  * изображение копируется в buf прямо из кэша, без промежуточных буферов объекта.
+  *
   * @return Статус отрисовки плитки больше требуемого в случае, если плитка отрисована,
   * TileStatus.NOT_INIT в случае если нет (тогда буфер остается нетронутым).
   */
@@ -302,45 +617,29 @@ public abstract class Tiler : Object
   {
     return_val_if_fail(tile.type < this.tile_types_num, TileStatus.NOT_INIT);
 
-    var rval = TileStatus.NOT_INIT;
+    Gp.TileStatus rval;
 
-    uint index = tile.get_index();
+    unowned uint8[]? data = this.acquire_from_cache(tile, status, out rval);
 
-    if(this.cache.get(this.groups[tile.type], index, null, this.buf_for_cache_get.get_malloc_data()))
+    if(data != null)
     {
-      if(Gp.Tile.equal_pos(this.buf_for_cache_get.tile, tile))
-      {
-        // Проверим, что нашли в кэше плитку со статусом больше требуемого.
-        if(this.buf_for_cache_get.status > status)
-        {
-          Memory.copy(buf, this.buf_for_cache_get.get_buf(), TILE_DATA_SIZE);
-          rval = this.buf_for_cache_get.status;
-        }
-      }
-      else
-        debug("Cache collision, index = %x", index);
+      Memory.copy(buf, MemTile.get_buf_from_malloc_data(data), TILE_DATA_SIZE);
+      this.release_tile(tile, data);
     }
 
     // Достали из кэша уже полностью готовую плитку, нет смысла дальше вызывать from_source.
     if(rval == TileStatus.ACTUAL)
       return rval;
 
-    MemTile? new_memtile;
-    while((new_memtile = get_tile_from_source(tile, status)) != null)
-      if(Gp.Tile.equal_all(new_memtile.tile, tile))
-      {
-        // Обновлять кэш есть смысл только, если from_srouce вернул более актуальную плитку, чем уже есть в кэше.
-        if(new_memtile.status > rval)
-        {
-          rval = new_memtile.status;
-          Memory.copy(buf, new_memtile.get_buf(), TILE_DATA_SIZE);
-          this.cache.set(this.groups[tile.type], index, MemTile.free_to_malloc_data(new_memtile));
-        }
+    MemTile? new_memtile = this.fetch_from_source(tile, status, rval);
 
-        break;
-      }
-      else
-        this.cache.set(this.groups[new_memtile.tile.type], new_memtile.tile.get_index(), MemTile.free_to_malloc_data(new_memtile));
+    // Копируем до помещения в кэш: кэш может плитку не принять или сразу вытеснить.
+    if(new_memtile != null)
+    {
+      rval = new_memtile.status;
+      Memory.copy(buf, new_memtile.get_buf(), TILE_DATA_SIZE);
+      this.store_tile(new_memtile);
+    }
 
     return rval;
   }
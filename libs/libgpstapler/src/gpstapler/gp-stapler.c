@@ -58,11 +58,15 @@
 
     /// Печать временных интервалов между всеми точками.
     #define TT_PRINT printf("TT GpStapler:\n"); for(tti = 0; tti < (tt_point_num - 1); tti++) printf( "\t[%d]: %.3lf\n", tti, ( ( tttv[tti + 1].tv_usec - tttv[tti].tv_usec ) + ( 1000000 * ( tttv[tti + 1].tv_sec - tttv[tti].tv_sec) ) ) / 1000000.0 );
+
+    /// Печать времени подготовки слоя (в микросекундах) в одном из потоков пула.
+    #define TT_LAYER(LAYER_I, USEC) printf( "\tlayer %u: %.3lf\n", (LAYER_I), (USEC) / 1000000.0 );
   #else
     #define TT_MAX_NUM
     #define TT_INIT
     #define TT_POINT
     #define TT_PRINT
+    #define TT_LAYER(LAYER_I, USEC)
   #endif
 // TT: Time Test <--
 
@@ -83,6 +87,8 @@ struct _GpStaplerPriv
   gboolean data_force_update; /*!< Флаг того, что REN_DATA необходимо обязательно перерисовать (например изменился масштаб, добавился tiler или сдвинулись оси).*/
   gboolean force_restack_layers; /*!< Флаг того, что REN_DATA необходимо заново сложить слои (без обновления самих слоев), например если один из слоев был удален.*/
 
+  GThreadPool *render_pool; /*!< Пул потоков, в которых слои готовятся к наложению, см. gp_stapler_render().*/
+
   pixman_image_t *background_pimage; /*!< Pixman image для фона (под всеми слоями).*/
   pixman_image_t *highlight_pimage; /*!< Pixman image для подсвечивания (выделения) слоя.*/
 
@@ -141,6 +147,37 @@ static guint gp_stapler_signals[SIGNALS_NUM] = { 0 };
 
 
 
+/// Общие данные заданий подготовки слоев, запущенных одним вызовом gp_stapler_render().
+typedef struct
+{
+  GMutex mutex;   /*!< Мьютекс для #pending.*/
+  GCond cond;     /*!< Условие завершения всех заданий.*/
+  guint pending;  /*!< Количество незавершенных заданий.*/
+
+  const GpIcaState *state;      /*!< Состояние областей отрисовки.*/
+  gint64 *layer_times;          /*!< Время подготовки каждого слоя в микросекундах (для TT_LAYER).*/
+}
+RenderBatch;
+
+
+/// Задание подготовки слоев в пуле потоков _GpStaplerPriv::render_pool.
+///
+/// В одно задание попадают все слои с одним и тем же GpTiler'ом,
+/// чтобы один GpTiler никогда не использовался одновременно из разных потоков
+/// (слои GpMixTiler'а -- вместе со слоями смешиваемых им GpTiler'ов, см. gp_stapler_get_job_tiler()).
+/// Методы управления GpTiler'ами (layer_force_update()) вызываются до запуска заданий, в главном потоке.
+typedef struct
+{
+  RenderBatch *batch;   /*!< Общие данные заданий.*/
+  GPtrArray *layers;    /*!< Все слои (_GpStaplerPriv::layers).*/
+  GArray *indices;      /*!< Индексы слоев задания в массиве #layers.*/
+  gboolean restack;     /*!< Результат: у одного из слоев изменился статус отрисовки, слои нужно заново наложить.*/
+  pixman_region32_t damage; /*!< Результат: перерисованная часть изображений слоев (в координатах видимой области).*/
+}
+RenderJob;
+
+
+
 /// Типы колонок, которые GpStapler предоставляет через интерфейс GtkTreeModel.
 static GType GP_STAPLER_COL_TYPES[] =
 {
@@ -452,6 +489,21 @@ G_STATIC_ASSERT(G_N_ELEMENTS( GP_STAPLER_COL_TYPES ) == GP_TILER_TREE_MODEL_COLS
   ///
   /// \param object - указатель на объект GpStapler.
   static void gp_stapler_finalize( GObject *object );
+
+  /// Подготавливает слои задания к наложению: рендерит плитки слоя
+  /// и размещает их на изображении слоя в размере видимой области.
+  ///
+  /// Функция вызывается в потоках пула _GpStaplerPriv::render_pool (совместима с GFunc).
+  ///
+  /// \param job - задание;
+  /// \param user_data - не используется.
+  static void gp_stapler_render_layers( RenderJob *job, gpointer user_data );
+
+  /// Возвращает GpTiler, по которому слой \a layer_i попадает в задание gp_stapler_render_layers().
+  ///
+  /// GpMixTiler запрашивает плитки смешиваемых им GpTiler'ов, поэтому его слои
+  /// и слои смешиваемых им (не графических) GpTiler'ов попадают в одно задание с первым GpMixTiler'ом.
+  static GpTiler *gp_stapler_get_job_tiler( GpStapler *stapler, guint layer_i );
 /// @}
 
 
@@ -572,27 +624,124 @@ G_DEFINE_TYPE_EXTENDED( GpStapler, gp_stapler, G_TYPE_INITIALLY_UNOWNED, 0,
 
         pixman_image_t *tmp_data_pimage = priv->tmp_data_pimage;
 
-        guint layer_i;
-        for(layer_i = 0; layer_i < priv->layers->len; layer_i++)
+        gboolean restack = FALSE;   //< У одного из слоев изменился статус отрисовки.
+        pixman_region32_t damage;   //< Изменившаяся часть изображения REN_DATA.
+        pixman_region32_init(&damage);
+
+        // Подготовка слоев в пуле потоков -->
         {
-          Layer *layer = g_ptr_array_index(priv->layers, layer_i);
+          RenderBatch batch;
+          GPtrArray *jobs = g_ptr_array_new();
+          guint layer_i, job_i;
+
+          g_mutex_init(&batch.mutex);
+          g_cond_init(&batch.cond);
+          batch.state = priv->state;
+          batch.layer_times = g_new0(gint64, priv->layers->len);
 
+          // Фокус и удаление ненужных заданий GpTiler'ов -- только из главного потока.
           if(priv->data_force_update)
-            if(G_UNLIKELY(!layer_force_update(layer, priv->state)))
-              layer_set_finished(layer, 1000); //< Ошибка layer_force_update(), не трогаем слой.
+            for(layer_i = 0; layer_i < priv->layers->len; layer_i++)
+            {
+              Layer *layer = g_ptr_array_index(priv->layers, layer_i);
+
+              if(G_UNLIKELY(!layer_force_update(layer, priv->state)))
+                layer_set_finished(layer, 1000); //< Ошибка layer_force_update(), не трогаем слой.
+            }
+
+          // Слои с одним GpTiler'ом -- в одно задание.
+          for(layer_i = 0; layer_i < priv->layers->len; layer_i++)
+          {
+            GpTiler *tiler = gp_stapler_get_job_tiler(GP_STAPLER(stapler), layer_i);
+            RenderJob *job = NULL;
+
+            for(job_i = 0; job_i < jobs->len && !job; job_i++)
+            {
+              RenderJob *cur_job = g_ptr_array_index(jobs, job_i);
+              guint first_i = g_array_index(cur_job->indices, guint, 0);
+
+              if(gp_stapler_get_job_tiler(GP_STAPLER(stapler), first_i) == tiler)
+                job = cur_job;
+            }
+
+            if(!job)
+            {
+              job = g_new0(RenderJob, 1);
+              job->batch = &batch;
+              job->layers = priv->layers;
+              job->indices = g_array_new(FALSE, FALSE, sizeof(guint));
+              pixman_region32_init(&job->damage);
+              g_ptr_array_add(jobs, job);
+            }
+
+            g_array_append_val(job->indices, layer_i);
+          }
+
+          // Первое задание выполняем сами, остальные -- в пуле.
+          batch.pending = jobs->len;
+
+          for(job_i = 1; job_i < jobs->len; job_i++)
+            g_thread_pool_push(priv->render_pool, g_ptr_array_index(jobs, job_i), NULL);
+
+          if(jobs->len)
+            gp_stapler_render_layers(g_ptr_array_index(jobs, 0), NULL);
+
+          g_mutex_lock(&batch.mutex);
+            while(batch.pending)
+              g_cond_wait(&batch.cond, &batch.mutex);
+          g_mutex_unlock(&batch.mutex);
+
+          for(job_i = 0; job_i < jobs->len; job_i++)
+          {
+            RenderJob *job = g_ptr_array_index(jobs, job_i);
+
+            if(job->restack)
+              restack = TRUE;
+
+            pixman_region32_union(&damage, &damage, &job->damage);
+            pixman_region32_fini(&job->damage);
 
-          if(layer_get_finished(layer) != 1000 && layer_get_visible(layer))
-            if(layer_render_tiles_pimage(layer))
-              if(layer_get_finished(layer) != layer_get_prev_finished(layer))
-                priv->force_restack_layers = TRUE;
+            g_array_free(job->indices, TRUE);
+            g_free(job);
+          }
+
+          for(layer_i = 0; layer_i < priv->layers->len; layer_i++)
+          {
+            TT_LAYER(layer_i, batch.layer_times[layer_i])
+          }
+
+          g_free(batch.layer_times);
+          g_ptr_array_free(jobs, TRUE);
+          g_cond_clear(&batch.cond);
+          g_mutex_clear(&batch.mutex);
         }
+        // Подготовка слоев в пуле потоков <--
   TT_POINT
 
+        GpIcaRendererAvailability availability = GP_ICA_RENDERER_AVAIL_ALL;
+
+        // Слои складываются заново целиком, только если изменилось что-то кроме плиток слоев,
+        // иначе -- только в перерисованной части изображений слоев.
         if(priv->force_restack_layers || priv->data_force_update)
         {
           priv->data_force_update = FALSE;
           priv->force_restack_layers = FALSE;
 
+          pixman_region32_fini(&damage);
+          pixman_region32_init_rect(&damage, 0, 0, priv->state->visible_width, priv->state->visible_height);
+        }
+        else if(pixman_region32_not_empty(&damage))
+        {
+          availability = GP_ICA_RENDERER_AVAIL_PART;
+
+          pixman_image_set_clip_region32(icarenderer_data_pimage, &damage);
+          pixman_image_set_clip_region32(tmp_data_pimage, &damage);
+        }
+        else
+          availability = GP_ICA_RENDERER_AVAIL_NOT_CHANGED;
+
+        if(availability != GP_ICA_RENDERER_AVAIL_NOT_CHANGED)
+        {
           // Фон.
           pixman_image_composite(PIXMAN_OP_SRC, priv->background_pimage, NULL, icarenderer_data_pimage,
             0, 0, 0, 0, 0, 0, priv->state->visible_width, priv->state->visible_height);
@@ -602,32 +751,49 @@ G_DEFINE_TYPE_EXTENDED( GpStapler, gp_stapler, G_TYPE_INITIALLY_UNOWNED, 0,
           {
             Layer *layer = g_ptr_array_index(priv->layers, signed_layer_i);
 
-            if(layer_get_visible(layer))
+            // Изображение слоя уже подготовлено в gp_stapler_render_layers(),
+            // здесь слои только накладываются друг на друга по порядку.
+            pixman_image_t *placed_pimage = layer_get_visible(layer) ? layer_get_placed_pimage(layer, priv->state, NULL) : NULL;
+
+            if(placed_pimage)
             {
               if(layer_get_highlight(layer))
               {
-                layer_place_on_icarenderer_data_pimage(layer, priv->state, tmp_data_pimage, PIXMAN_OP_SRC);
+                pixman_image_composite(PIXMAN_OP_SRC, placed_pimage, NULL, tmp_data_pimage,
+                  0, 0, 0, 0, 0, 0, priv->state->visible_width, priv->state->visible_height);
                 pixman_image_composite(PIXMAN_OP_ATOP, priv->highlight_pimage, NULL, tmp_data_pimage,
                   0, 0, 0, 0, 0, 0, priv->state->visible_width, priv->state->visible_height);
                 pixman_image_composite(PIXMAN_OP_OVER, tmp_data_pimage, NULL, icarenderer_data_pimage,
                   0, 0, 0, 0, 0, 0, priv->state->visible_width, priv->state->visible_height);
               }
               else
-                layer_place_on_icarenderer_data_pimage(layer, priv->state, icarenderer_data_pimage, PIXMAN_OP_OVER);
+                pixman_image_composite(PIXMAN_OP_OVER, placed_pimage, NULL, icarenderer_data_pimage,
+                  0, 0, 0, 0, 0, 0, priv->state->visible_width, priv->state->visible_height);
             }
           }
 
+          pixman_image_set_clip_region32(icarenderer_data_pimage, NULL);
+          pixman_image_set_clip_region32(tmp_data_pimage, NULL);
+        }
+
+        // Статус отрисовки мог измениться и без новых плиток на экране.
+        if(availability != GP_ICA_RENDERER_AVAIL_NOT_CHANGED || restack)
           g_signal_emit(stapler, gp_stapler_signals[RESTACKED], 0);
+
+        if(availability != GP_ICA_RENDERER_AVAIL_NOT_CHANGED)
+        {
+          pixman_box32_t *extents = pixman_region32_extents(&damage);
+          if(x) *x = extents->x1;
+          if(y) *y = extents->y1;
+          if(width) *width = extents->x2 - extents->x1;
+          if(height) *height = extents->y2 - extents->y1;
         }
-        else
-          return GP_ICA_RENDERER_AVAIL_NOT_CHANGED;
+
+        pixman_region32_fini(&damage);
 
   TT_POINT
   TT_PRINT
-        if(x) *x = 0;
-        if(y) *y = 0;
-        if(width) *width = priv->state->visible_width;
-        if(height) *height = priv->state->visible_height;
+        return availability;
       }
       break;
     }
@@ -1396,6 +1562,8 @@ static void gp_stapler_init( GpStapler *stapler )
   priv->data_force_update = TRUE;
   priv->force_restack_layers = TRUE;
 
+  priv->render_pool = g_thread_pool_new((GFunc)gp_stapler_render_layers, NULL, g_get_num_processors(), FALSE, NULL);
+
   // background_pimage -->
     pixman_color_t background_color = {
       GP_BACKGROUND_RED   * 0xFFFF,
@@ -1561,6 +1729,26 @@ void gp_stapler_set_tiler_fixed_l(GpStapler *stapler, GtkTreeIter *iter, gint ty
 
 
 
+void gp_stapler_get_tiler_prefetch(GpStapler *stapler, GtkTreeIter *iter, guint *ring, guint *budget)
+{
+  g_return_if_fail(GP_STAPLER_IS(stapler));
+
+  Layer *layer = g_ptr_array_index(stapler->priv->layers, GPOINTER_TO_UINT(iter->user_data2));
+  layer_get_prefetch(layer, ring, budget);
+}
+
+
+
+void gp_stapler_set_tiler_prefetch(GpStapler *stapler, GtkTreeIter *iter, guint ring, guint budget)
+{
+  g_return_if_fail(GP_STAPLER_IS(stapler));
+
+  Layer *layer = g_ptr_array_index(stapler->priv->layers, GPOINTER_TO_UINT(iter->user_data2));
+  layer_set_prefetch(layer, ring, budget);
+}
+
+
+
 void gp_stapler_set_tiler_visible( GpStapler *stapler, GtkTreeIter *iter, gboolean visible )
 {
   g_return_if_fail( GP_STAPLER_IS(stapler));
@@ -1581,6 +1769,61 @@ void gp_stapler_set_tiler_visible( GpStapler *stapler, GtkTreeIter *iter, gboole
 
 
 
+static GpTiler *gp_stapler_get_job_tiler( GpStapler *stapler, guint layer_i )
+{
+  GPtrArray *layers = stapler->priv->layers;
+  Layer *layer = g_ptr_array_index(layers, layer_i);
+  GpTiler *tiler = layer_get_tiler(layer);
+  guint i;
+
+  for(i = 0; i < layers->len; i++)
+  {
+    Layer *mixer_layer = g_ptr_array_index(layers, i);
+    GpTiler *mixer = layer_get_tiler(mixer_layer);
+
+    if(!GP_IS_MIX_TILER(mixer) || gp_mix_tiler_get_main_stapler(GP_MIX_TILER(mixer)) != GTK_TREE_MODEL(stapler))
+      continue;
+
+    if(GP_IS_MIX_TILER(tiler) || !gp_tiler_is_graphical(tiler, layer_get_tiles_type(mixer_layer)))
+      return mixer;
+  }
+
+  return tiler;
+}
+
+
+
+static void gp_stapler_render_layers( RenderJob *job, gpointer user_data )
+{
+  RenderBatch *batch = job->batch;
+  guint i;
+
+  for(i = 0; i < job->indices->len; i++)
+  {
+    guint layer_i = g_array_index(job->indices, guint, i);
+    Layer *layer = g_ptr_array_index(job->layers, layer_i);
+    gint64 start = g_get_monotonic_time();
+
+    if(layer_get_finished(layer) != 1000 && layer_get_visible(layer))
+      if(layer_render_tiles_pimage(layer))
+        if(layer_get_finished(layer) != layer_get_prev_finished(layer))
+          job->restack = TRUE;
+
+    // Масштабирование плиток на изображение слоя -- самая затратная часть наложения слоев.
+    if(layer_get_visible(layer))
+      layer_get_placed_pimage(layer, batch->state, &job->damage);
+
+    batch->layer_times[layer_i] = g_get_monotonic_time() - start;
+  }
+
+  g_mutex_lock(&batch->mutex);
+    if(--batch->pending == 0)
+      g_cond_signal(&batch->cond);
+  g_mutex_unlock(&batch->mutex);
+}
+
+
+
 static void gp_stapler_dispose( GObject *object )
 {
   GpStapler *stapler = GP_STAPLER(object);
@@ -1610,6 +1853,8 @@ static void gp_stapler_finalize( GObject *object )
   GpStapler *stapler = GP_STAPLER(object);
   GpStaplerPriv *priv = stapler->priv;
 
+  g_thread_pool_free(priv->render_pool, FALSE, TRUE);
+
   if(priv->icarenderer_data_pimage) pixman_image_unref(priv->icarenderer_data_pimage);
   if(priv->tmp_data_pimage) pixman_image_unref(priv->tmp_data_pimage);
 
@@ -4,24 +4,116 @@
  * \author Gennady Nefediev
  * \date 17.08.2017
  *
- * Объект Streamer формирует несколько плиток и экспортирует изображение в файл.
+ * Объект Streamer формирует плитки и экспортирует изображение в файл.
+ *
+ * Экспорт выполняется в отдельном потоке. Плитки запрашиваются у Tiler с упреждением: одновременно
+ * запрошено не более window плиток, следующих в порядке строк за первой еще не полученной.
+ * Готовые плитки по порядку проходят через две пирамиды уровней и освобождают место в окне.
+ * В пирамиде каждый следующий уровень получается усреднением блоков 2x2 пикселей предыдущего:
+ * плитка сразу уменьшается в четверть родительской, а заполненная строка родительских плиток
+ * обрабатывается так же. Повторного формирования плиток Tiler для уменьшенных уровней не требуется.
+ *
+ * Первая пирамида -- файл Cloud Optimized GeoTIFF: плитки исходного разрешения и обзорные уровни.
+ * Ее плитки сжимаются в пуле потоков, а единственный поток записи сохраняет их во временный файл
+ * в порядке поступления. Число плиток, ожидающих сжатия и записи, ограничено: при его превышении
+ * поток экспорта ждет, не запрашивая новых плиток. После получения всех плиток формируется итоговый файл: сначала каталоги (IFD)
+ * всех уровней, затем данные уровней от самого мелкого обзорного до исходного разрешения.
+ *
+ * Вторая пирамида строится в сетке плиток Tiler (сторона плитки уровня k равна side * 2^k,
+ * родительская плитка (x, y) собирается из плиток (2x..2x+1, 2y..2y+1)) и передается
+ * пользователю через #GpStreamerTileFunc и/или записывается в файл MBTiles (см. mbtiles.h).
+ *
+ * По завершении экспорта в главном контексте потока, запустившего экспорт, вызывается #GpStreamerDoneFunc.
  *
 */
 
 #include "gp-streamer.h"
+#include "mbtiles.h"
 #include <gp-core.h>
 #include <gp-stapler.h>
 
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <glib/gstdio.h>
+
+#if ZSTD_FOUND
+  #include <zstd.h>
+#endif
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
 #if GEOTIFF_FOUND
   //#include <tiffio.h>
   #include <xtiffio.h>
   #include <geotiffio.h>
+
+  //Отложенная запись таблиц смещений плиток (libtiff >= 4.1) позволяет разместить все каталоги в начале файла.
+  #if TIFFLIB_VERSION >= 20191103
+    #define GP_STREAMER_COG_LAYOUT 1
+  #endif
 #endif
 
+#define GP_STREAMER_POLL_INTERVAL  10000  ///Период проверки готовности плиток, мкс
+#define GP_STREAMER_JOBS_PER_THREAD    4  ///Плиток, ожидающих сжатия и записи, на один поток сжатия
+
+#ifdef G_OS_WIN32
+  #define gp_streamer_fseek _fseeki64
+#else
+  #define gp_streamer_fseek fseeko
+#endif
+
+
+//Уровень изображения: исходное разрешение или обзорный.
+typedef struct
+{
+  gint width;        ///Размер в пикселях
+  gint height;
+  gint nx;           ///Размер в плитках
+  gint ny;
+
+  gint col0;         ///Индексы левой верхней плитки в сетке уровня, строки нумеруются сверху вниз
+  gint row0;
+
+  gint row;          ///Номер заполняемой строки плиток
+  guint8 **tiles;    ///Заполняемая строка плиток, nx штук (кроме уровня 0)
+
+  goffset *offsets;  ///Смещения сжатых плиток во временном файле, nx * ny штук
+  guint32 *sizes;    ///Размеры сжатых плиток
+}
+GpStreamerLevel;
 
-#define  GP_TILES_PER_FILE  100
-#define  GP_TILES_PER_SIDE  30
-#define  GP_TILES_PER_BUF   GP_TILES_PER_SIDE + 1
+
+//Обработка готовой плитки уровня l. Функция может забрать буфер *data себе, обнулив указатель.
+typedef void (*GpStreamerEmitFunc)( GpStreamer *streamer, guint l, gint index, guint8 **data);
+
+//Пирамида уровней.
+typedef struct
+{
+  GpStreamerLevel *levels;  ///Уровни, NULL если пирамида не строится
+  guint n_levels;
+
+  GpStreamerEmitFunc emit;
+}
+GpStreamerPyramid;
+
+
+//Плитка, переданная на сжатие и запись.
+typedef struct
+{
+  guint seq;      ///Порядковый номер записи во временный файл
+  guint level;    ///Номер уровня
+  gint index;     ///Номер плитки в уровне (построчно)
+
+  guint8 *data;   ///Пиксели ARGB32, после сжатия -- сжатые данные
+  gsize size;     ///Размер сжатых данных или 0 в случае ошибки
+}
+GpStreamerJob;
+
+//Признак завершения для потока записи.
+static GpStreamerJob gp_streamer_writer_stop;
 
 
 struct _GpStreamerPriv
@@ -31,31 +123,61 @@ struct _GpStreamerPriv
   gdouble from_y;
   gdouble to_y;
 
-  gdouble x;    ///Начало области отображения для отдельного файла
-  gdouble y;
-  gdouble x2;   ///Конец области отображения для отдельного файла
-  gdouble y2;
-
-  gint nx;  ///Кол-во плиток в отдельном файле
+  gint x0;  ///Индексы левой верхней плитки изображения
+  gint y0;
+  gint nx;  ///Размер изображения в плитках
   gint ny;
 
   gint side;    ///Размер стороны плитки, см
   gint type;    ///Тип плиток
   guint zone;   ///Зона UTM
 
-  gboolean started;  ///Запущена подготовка изображения и запись в очередной файл
-  gboolean single;   ///Экспорт укладывается в один файл
+  GpStreamerCompression compression;  ///Сжатие плиток в файле
+
+  gboolean started;  ///Экспорт запущен
+  gint done;         ///Экспорт завершен (атомарно)
+  gboolean success;  ///Все плитки получены и записаны
+
+  GThread *exporter;              ///Поток экспорта
+  GMainContext *context;          ///Контекст, в котором вызывается done_func
+  GpStreamerDoneFunc done_func;   ///Получатель уведомления о завершении экспорта
+  gpointer done_data;
+
+  guint window;                 ///Заданный размер окна запросов, плиток (0 -- строка плиток)
+  gint window_size;             ///Размер окна запросов текущего экспорта
+  gint next;                    ///Номер (в порядке строк) первой еще не полученной плитки
+  guint8 **window_tiles;        ///Буферы плиток окна, плитка n хранится в ячейке n % window_size
+  GpTileStatus *window_status;  ///Статус формирования плиток окна
+
+  GpStreamerPyramid cog;      ///Уровни файла GeoTIFF
+  GpStreamerPyramid tree;     ///Пирамида плиток в сетке Tiler
+
+  guint tree_levels;              ///Запрошенное количество уровней пирамиды плиток
+  GpStreamerTileFunc tree_func;   ///Получатель плиток пирамиды
+  gpointer tree_data;
 
-  GpTileStatus *tile_status;  ///Статус формирования для каждой плитки
-  uint32_t *tiles_buf;        ///Массив пикселей, плитка за плиткой
+  gchar *mbtiles_name;        ///Имя файла MBTiles для пирамиды плиток
+  MbtilesWriter *mbtiles;
+
+  GThreadPool *encode_pool;   ///Пул потоков для сжатия плиток
+  GThread *writer;            ///Поток записи сжатых плиток во временный файл
+  GAsyncQueue *write_queue;   ///Очередь сжатых плиток для потока записи
+  guint seq;                  ///Порядковый номер следующей плитки
+
+  GMutex jobs_mutex;          ///Ограничение числа плиток, ожидающих сжатия и записи
+  GCond jobs_cond;
+  guint jobs;
+  guint jobs_max;
+
+  FILE *stage;                ///Временный файл сжатых плиток
+  gchar *stage_name;
+  gboolean write_failed;      ///Ошибка сжатия или записи во временный файл
 
-  gint fcnt;         ///Счетчик файлов
   gchar *file_name;  ///Полный путь и имя файла, но без расширения
   gchar *file_ext;   ///Расширение файла
 
   gchar *act_name;  ///Имя активности
-  gdouble acnt;     ///Счетчик активности
-  gdouble frac;     ///Приращение счетчика активности
+  gint acnt;        ///Счетчик активности, промилле (атомарно)
   GCancellable *cancellable;  ///Опциональный объект для отмены процесса записи данных
 
   GpTiler *tiler;
@@ -68,9 +190,21 @@ G_DEFINE_TYPE( GpStreamer, gp_streamer, G_TYPE_INITIALLY_UNOWNED);
 
 
 static void gp_streamer_finalize( GObject *object);
-static gboolean gp_streamer_save_one_image( GpStreamer *streamer, gdouble x, gdouble y, gdouble x2, gdouble y2);
+static gboolean gp_streamer_export_begin( GpStreamer *streamer);
+static void gp_streamer_export_end( GpStreamer *streamer, gboolean write);
+static gboolean gp_streamer_cog_begin( GpStreamer *streamer);
+static void gp_streamer_cog_end( GpStreamer *streamer, gboolean write);
+static gpointer gp_streamer_export( GpStreamer *streamer);
+static gboolean gp_streamer_export_done( GpStreamer *streamer);
+static void gp_streamer_mbtiles_end( GpStreamer *streamer, gboolean write);
+static gboolean gp_streamer_request_window( GpStreamer *streamer);
+static void gp_streamer_push_tile( GpStreamer *streamer, GpStreamerPyramid *pyramid, guint l, gint j, guint8 **data);
+static void gp_streamer_cog_emit( GpStreamer *streamer, guint l, gint index, guint8 **data);
+static void gp_streamer_tree_emit( GpStreamer *streamer, guint l, gint index, guint8 **data);
+static void gp_streamer_encode( GpStreamerJob *job, GpStreamer *streamer);
+static gpointer gp_streamer_write( GpStreamer *streamer);
 #if GEOTIFF_FOUND
-static gboolean gp_streamer_save_gtiff( GpStreamer *streamer, void *buf, gint pix_x, gint pix_y, gdouble cx, gdouble cy, const gchar *filename, GError **error);
+static gboolean gp_streamer_save_gtiff( GpStreamer *streamer, gdouble cx, gdouble cy, const gchar *filename, GError **error);
 #endif
 
 
@@ -88,6 +222,9 @@ static void gp_streamer_class_init( GpStreamerClass *klass)
 static void gp_streamer_init( GpStreamer *streamer)
 {
   streamer->priv = G_TYPE_INSTANCE_GET_PRIVATE( streamer, GP_STREAMER_TYPE, GpStreamerPriv);
+
+  g_mutex_init( &streamer->priv->jobs_mutex);
+  g_cond_init( &streamer->priv->jobs_cond);
 }
 
 //Уничтожение объекта
@@ -96,13 +233,17 @@ static void gp_streamer_finalize( GObject *object)
   GpStreamer *streamer = GP_STREAMER(object);
   GpStreamerPriv *priv = streamer->priv;
 
-  if (priv->tile_status) g_free( priv->tile_status);
-  if (priv->tiles_buf) g_free( priv->tiles_buf);
+  //Поток экспорта держит ссылку на объект, поэтому здесь экспорт уже завершен
   if (priv->file_name) g_free( priv->file_name);
   if (priv->file_ext) g_free( priv->file_ext);
   if (priv->act_name) g_free( priv->act_name);
+  if (priv->mbtiles_name) g_free( priv->mbtiles_name);
 
   g_clear_object( &priv->cancellable);
+  g_clear_object( &priv->tiler);
+
+  g_mutex_clear( &priv->jobs_mutex);
+  g_cond_clear( &priv->jobs_cond);
 
   G_OBJECT_CLASS(gp_streamer_parent_class)->finalize(object);
 }
@@ -131,15 +272,36 @@ GpStreamer *gp_streamer_new( void)
 
   priv->type = 0;
   priv->side = 0;
+  priv->compression = GP_STREAMER_COMPRESSION_DEFLATE;
 
-  priv->frac = 0;
   priv->acnt = 0;
-  priv->fcnt = 0;
   priv->started = FALSE;
-  priv->single = FALSE;
+  priv->done = FALSE;
+  priv->success = FALSE;
+
+  priv->exporter = NULL;
+  priv->context = NULL;
+  priv->done_func = NULL;
+  priv->done_data = NULL;
+
+  priv->window = 0;
+  priv->window_tiles = NULL;
+  priv->window_status = NULL;
 
-  priv->tile_status = NULL;
-  priv->tiles_buf = NULL;
+  priv->cog.levels = NULL;
+  priv->cog.n_levels = 0;
+  priv->cog.emit = gp_streamer_cog_emit;
+
+  priv->tree.levels = NULL;
+  priv->tree.n_levels = 0;
+  priv->tree.emit = gp_streamer_tree_emit;
+
+  priv->tree_levels = 0;
+  priv->tree_func = NULL;
+  priv->tree_data = NULL;
+
+  priv->mbtiles_name = NULL;
+  priv->mbtiles = NULL;
 
   priv->act_name = NULL;
   priv->file_name = NULL;
@@ -159,11 +321,6 @@ void gp_streamer_set_area( GpStreamer *streamer, gdouble x_min, gdouble x_max, g
   priv->to_x = x_max;
   priv->from_y = y_min;
   priv->to_y = y_max;
-
-  priv->x = priv->from_x;
-  priv->y = priv->to_y;
-  priv->x2 = priv->to_x;
-  priv->y2 = priv->from_y;
 }
 
 
@@ -191,6 +348,49 @@ void gp_streamer_set_view_type( GpStreamer *streamer, gint type)
 }
 
 
+void gp_streamer_set_compression( GpStreamer *streamer, GpStreamerCompression compression)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  g_return_if_fail( !priv->started);
+
+  priv->compression = compression;
+}
+
+
+void gp_streamer_set_pyramid( GpStreamer *streamer, guint levels, GpStreamerTileFunc func, gpointer user_data)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  g_return_if_fail( !priv->started);
+
+  priv->tree_levels = levels;
+  priv->tree_func = func;
+  priv->tree_data = user_data;
+}
+
+
+void gp_streamer_set_mbtiles( GpStreamer *streamer, const gchar *filename)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  g_return_if_fail( !priv->started);
+
+  g_free( priv->mbtiles_name);
+  priv->mbtiles_name = g_strdup( filename);
+}
+
+
+void gp_streamer_set_window( GpStreamer *streamer, guint tiles)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  g_return_if_fail( !priv->started);
+
+  priv->window = tiles;
+}
+
+
 void gp_streamer_set_file_name( GpStreamer *streamer, gchar *name, gchar *ext)
 {
   GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
@@ -204,6 +404,12 @@ void gp_streamer_set_tiler( GpStreamer *streamer, GpTiler *tiler)
 {
   GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
 
+  g_return_if_fail( !priv->started);
+
+  //Поток экспорта обращается к Tiler, пока работает главный поток, поэтому храним ссылку на него
+  if (tiler) g_object_ref( tiler);
+  if (priv->tiler) g_object_unref( priv->tiler);
+
   priv->tiler = tiler;
 }
 
@@ -237,7 +443,25 @@ gdouble gp_streamer_get_fraction( GpStreamer *streamer)
 {
   GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
 
-  return priv->acnt;
+  return g_atomic_int_get( &priv->acnt) / 1000.0;
+}
+
+
+///Запуск экспорта в отдельном потоке
+void gp_streamer_start( GpStreamer *streamer, GpStreamerDoneFunc func, gpointer user_data)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  g_return_if_fail( !priv->started);
+
+  priv->started = TRUE;
+  priv->done_func = func;
+  priv->done_data = user_data;
+  priv->context = g_main_context_ref_thread_default();
+
+  //Ссылка освобождается после уведомления о завершении
+  g_object_ref( streamer);
+  priv->exporter = g_thread_new( "streamer export", (GThreadFunc)gp_streamer_export, streamer);
 }
 
 
@@ -246,271 +470,858 @@ gboolean gp_streamer_save( GpStreamer *streamer)
 {
   GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
 
-  g_return_val_if_fail( priv->from_x < priv->to_x && priv->from_y < priv->to_y, TRUE);
-  g_return_val_if_fail( priv->side, TRUE);
-  g_return_val_if_fail( priv->tiler, TRUE);
+  if (!priv->started) gp_streamer_start( streamer, NULL, NULL);
 
-  if (g_cancellable_is_cancelled(priv->cancellable)) return TRUE;
+  return g_atomic_int_get( &priv->done);
+}
 
 
-  gdouble width = priv->side / 100.0;  //Сторона плитки в метрах
-  gdouble step = GP_TILES_PER_SIDE * width; //Смещение в метрах от файла к файлу
+//Поток экспорта: запрашивает плитки окна, пока все они не будут получены, и формирует файл.
+static gpointer gp_streamer_export( GpStreamer *streamer)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  if (priv->from_x < priv->to_x && priv->from_y < priv->to_y && priv->side && priv->tiler)
+  {
+    if (gp_streamer_export_begin( streamer))
+    {
+      gint total = priv->nx * priv->ny;
+
+      while (priv->next < total && !g_cancellable_is_cancelled( priv->cancellable))
+      {
+        //Плитки формируются в потоках Tiler, уведомлений о готовности нет -- проверяем периодически
+        if (!gp_streamer_request_window( streamer))
+          g_usleep( GP_STREAMER_POLL_INTERVAL);
 
+        g_atomic_int_set( &priv->acnt, (gint)(900.0 * priv->next / total));
+      }
 
-  //Настройка первого фрагмента (возможно единственного)
-  if (!priv->tile_status)
+      priv->success = (priv->next == total);
+      gp_streamer_export_end( streamer, priv->success);
+    }
+  }
+  else
   {
-    //Кол-во плиток для всего экспорта
-    gint x_size = (gint)(priv->to_x / width) - (gint)(priv->from_x / width) + 1;
-    gint y_size = (gint)(priv->to_y / width) - (gint)(priv->from_y / width) + 1;
+    g_critical("%s: Area, tile side and tiler must be set", G_STRFUNC);
+  }
 
-    if (x_size <= GP_TILES_PER_BUF && y_size <= GP_TILES_PER_BUF) priv->single = TRUE;
+  g_atomic_int_set( &priv->acnt, 1000);
+  g_atomic_int_set( &priv->done, TRUE);
 
-    //Кол-во плиток для отдельного файла
-    priv->nx = (x_size < GP_TILES_PER_BUF) ? x_size : GP_TILES_PER_BUF;
-    priv->ny = (y_size < GP_TILES_PER_BUF) ? y_size : GP_TILES_PER_BUF;
-    priv->frac = 1.0 / (gdouble)((x_size / priv->nx + 1) * (y_size / priv->ny + 1));
+  //Не g_main_context_invoke(): он вызывает функцию сразу, если контекст никем не занят
+  GSource *source = g_idle_source_new();
+  g_source_set_callback( source, (GSourceFunc)gp_streamer_export_done, streamer, NULL);
+  g_source_attach( source, priv->context);
+  g_source_unref( source);
+
+  return NULL;
+}
 
-    //Резервируем буферы
-    gint mem_size = priv->nx * priv->ny * GP_TILE_DATA_SIZE;
-    priv->tiles_buf = g_try_malloc0( mem_size);
-    priv->tile_status = g_try_malloc0( priv->nx * priv->ny * sizeof(GpTileStatus));
 
-    if (!priv->tile_status || !priv->tiles_buf)
+//Уведомить о завершении экспорта в контексте потока, запустившего экспорт.
+static gboolean gp_streamer_export_done( GpStreamer *streamer)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  g_thread_join( priv->exporter);
+  priv->exporter = NULL;
+
+  if (priv->done_func)
+    priv->done_func( streamer, priv->success, priv->done_data);
+
+  g_main_context_unref( priv->context);
+  priv->context = NULL;
+
+  g_object_unref( streamer);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+//Индекс родительской плитки (деление на 2 с округлением вниз).
+static inline gint gp_streamer_parent_index( gint index)
+{
+  return (index >= 0) ? index / 2 : -((1 - index) / 2);
+}
+
+
+//Подготовить пирамиду уровней. Уровень 0 имеет размер nx * ny плиток, его левая верхняя плитка --
+//(col0, row0) в сетке уровня. n_levels == 0 -- уровни строятся, пока уровень не уместится в одну плитку.
+static void gp_streamer_pyramid_init( GpStreamerPyramid *pyramid, guint n_levels, gint col0, gint row0, gint nx, gint ny)
+{
+  GpStreamerLevel *levels = NULL;
+  guint l;
+
+  for( l=0; n_levels == 0 || l < n_levels; l++)
+  {
+    levels = g_renew( GpStreamerLevel, levels, l + 1);
+    memset( &levels[l], 0, sizeof(GpStreamerLevel));
+
+    levels[l].col0 = col0;
+    levels[l].row0 = row0;
+    levels[l].nx = nx;
+    levels[l].ny = ny;
+    levels[l].width = (l == 0) ? nx * GP_TILE_SIDE : (levels[l - 1].width + 1) / 2;
+    levels[l].height = (l == 0) ? ny * GP_TILE_SIDE : (levels[l - 1].height + 1) / 2;
+
+    if (l > 0) levels[l].tiles = g_new0( guint8*, nx);
+
+    if (n_levels == 0 && nx == 1 && ny == 1)
     {
-      g_critical("%s: Cannot allocate enough memory: %d bytes", G_STRFUNC, mem_size);
-      return TRUE;
+      l++;
+      break;
     }
 
-    //Нач. координаты для первого буфера
-    priv->x = priv->from_x;
-    priv->y = priv->to_y;
+    //Размер следующего уровня
+    gint col1 = gp_streamer_parent_index( col0 + nx - 1);
+    gint row1 = gp_streamer_parent_index( row0 + ny - 1);
+
+    col0 = gp_streamer_parent_index( col0);
+    row0 = gp_streamer_parent_index( row0);
+    nx = col1 - col0 + 1;
+    ny = row1 - row0 + 1;
+  }
 
-    //Конеч. координаты для первого буфера
-    priv->x2 = (GP_TILES_PER_BUF < x_size) ? priv->x + step : priv->to_x;
-    priv->y2 = (GP_TILES_PER_BUF < y_size) ? priv->y - step : priv->from_y;
+  pyramid->levels = levels;
+  pyramid->n_levels = l;
+}
 
-    priv->started = TRUE;  //Первый буфер настроен
+
+//Освободить уровни пирамиды.
+static void gp_streamer_pyramid_free( GpStreamerPyramid *pyramid)
+{
+  guint l;
+  gint j;
+
+  for( l=0; l < pyramid->n_levels; l++)
+  {
+    if (pyramid->levels[l].tiles)
+      for( j=0; j < pyramid->levels[l].nx; j++)
+        g_free( pyramid->levels[l].tiles[j]);
+
+    g_free( pyramid->levels[l].tiles);
+    g_free( pyramid->levels[l].offsets);
+    g_free( pyramid->levels[l].sizes);
   }
 
+  g_free( pyramid->levels);
+
+  pyramid->levels = NULL;
+  pyramid->n_levels = 0;
+}
+
+
+//Подготовить окно запросов плиток и пирамиды уровней.
+//Возвращает FALSE, если экспорт невозможен.
+static gboolean gp_streamer_export_begin( GpStreamer *streamer)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  gdouble width = priv->side / 100.0;  //Сторона плитки в метрах
+
+  //Кол-во плиток для всего экспорта
+  priv->nx = (gint)(priv->to_x / width) - (gint)(priv->from_x / width) + 1;
+  priv->ny = (gint)(priv->to_y / width) - (gint)(priv->from_y / width) + 1;
+
+  priv->x0 = (gint)(priv->from_x / width);
+  priv->y0 = (gint)(priv->to_y / width);
 
-  //Настройка каждого последующего фрагмента
-  if (priv->started == FALSE)
+  if (priv->mbtiles_name && (priv->mbtiles = mbtiles_writer_open( priv->mbtiles_name)) == NULL)
+    return FALSE;
+
+  if (priv->file_name && !gp_streamer_cog_begin( streamer))
   {
-    //Смотрим, к каким плиткам относятся координаты для след. порций
-    gint x_cur = (gint)((priv->x + step) / width);
-    gint y_cur = (gint)((priv->y - step) / width);
+    if (priv->mbtiles) mbtiles_writer_close( priv->mbtiles, FALSE);
+    priv->mbtiles = NULL;
+    return FALSE;
+  }
 
-    gint x_num = (gint)(priv->to_x / width);
-    gint y_num = (gint)(priv->from_y / width);
+  //Строки сетки плиток нумеруются сверху вниз: плитке y соответствует строка -y-1
+  if (priv->tree_func || priv->mbtiles)
+    gp_streamer_pyramid_init( &priv->tree, priv->tree_levels, priv->x0, -priv->y0 - 1, priv->nx, priv->ny);
 
-    //Выходим ли за рамки экспорта по обеим осям?
-    if (x_cur >= x_num && y_cur <= y_num) return TRUE;
+  if (!priv->cog.levels && !priv->tree.levels)
+  {
+    g_warning("%s: Nothing to export", G_STRFUNC);
+    return FALSE;
+  }
 
-    //Обнуляем буферы под следующий файл
-    memset( priv->tiles_buf, 0, priv->nx * priv->ny * GP_TILE_DATA_SIZE);
-    memset( priv->tile_status, 0, priv->nx * priv->ny * sizeof(GpTileStatus));
+  //Окно запросов: по умолчанию -- строка плиток, но не больше всего изображения
+  priv->window_size = priv->window ? (gint)MIN( priv->window, (guint)(priv->nx * priv->ny)) : priv->nx;
+
+  priv->next = 0;
+  priv->window_tiles = g_new0( guint8*, priv->window_size);
+  priv->window_status = g_new0( GpTileStatus, priv->window_size);
+
+  g_atomic_int_set( &priv->acnt, 0);
+
+  return TRUE;
+}
+
+
+//Завершить экспорт и освободить его ресурсы.
+//write -- сформировать итоговый файл GeoTIFF.
+static void gp_streamer_export_end( GpStreamer *streamer, gboolean write)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  gint j;
+
+  if (priv->cog.levels) gp_streamer_cog_end( streamer, write);
+  if (priv->mbtiles) gp_streamer_mbtiles_end( streamer, write);
+  if (priv->tree.levels) gp_streamer_pyramid_free( &priv->tree);
+
+  for( j=0; j < priv->window_size; j++)
+    g_free( priv->window_tiles[j]);
+
+  g_free( priv->window_tiles);
+  g_free( priv->window_status);
+
+  priv->window_tiles = NULL;
+  priv->window_status = NULL;
+}
+
+
+//Подготовить уровни файла GeoTIFF, временный файл, пул потоков сжатия и поток записи.
+//Возвращает FALSE, если запись файла невозможна.
+static gboolean gp_streamer_cog_begin( GpStreamer *streamer)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+#if !GEOTIFF_FOUND
+  #warning "GEOTIFF_FOUND =  FALSE"
+  g_warning("GpStreamer: GEOTIFF_FOUND =  FALSE");
+  return FALSE;
+#endif
+
+#if !ZSTD_FOUND
+  if (priv->compression == GP_STREAMER_COMPRESSION_ZSTD)
+  {
+    g_critical("%s: ZSTD compression is not supported by this build", G_STRFUNC);
+    return FALSE;
+  }
+#endif
 
-    //Нач. координаты файла
-    if (x_cur >= x_num)  //Сдвиг вниз и на начало по горизонтали
+  gchar *stage_name = g_strdup_printf("%s.%s.part", priv->file_name, priv->file_ext);
+  FILE *stage = g_fopen( stage_name, "w+b");
+
+  if (!stage)
+  {
+    g_critical("%s: Error opening file %s", G_STRFUNC, stage_name);
+    g_free( stage_name);
+    return FALSE;
+  }
+
+  //Обзорные уровни строятся, пока изображение не поместится в одну плитку
+  gp_streamer_pyramid_init( &priv->cog, 0, 0, 0, priv->nx, priv->ny);
+
+  guint l;
+  for( l=0; l < priv->cog.n_levels; l++)
+  {
+    GpStreamerLevel *level = &priv->cog.levels[l];
+
+    level->offsets = g_new0( goffset, level->nx * level->ny);
+    level->sizes = g_new0( guint32, level->nx * level->ny);
+  }
+
+  priv->stage = stage;
+  priv->stage_name = stage_name;
+  priv->write_failed = FALSE;
+  priv->seq = 0;
+
+  priv->jobs = 0;
+  priv->jobs_max = GP_STREAMER_JOBS_PER_THREAD * g_get_num_processors();
+
+  priv->write_queue = g_async_queue_new();
+  priv->writer = g_thread_new( "streamer writer", (GThreadFunc)gp_streamer_write, streamer);
+  priv->encode_pool = g_thread_pool_new( (GFunc)gp_streamer_encode, streamer, g_get_num_processors(), FALSE, NULL);
+
+  return TRUE;
+}
+
+
+//Дождаться сжатия и записи всех плиток, при необходимости сформировать итоговый файл
+//и освободить ресурсы записи файла.
+static void gp_streamer_cog_end( GpStreamer *streamer, gboolean write)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  g_thread_pool_free( priv->encode_pool, FALSE, TRUE);
+  g_async_queue_push( priv->write_queue, &gp_streamer_writer_stop);
+  g_thread_join( priv->writer);
+  g_async_queue_unref( priv->write_queue);
+
+  if (write && priv->write_failed)
+    g_critical("%s: Error writing to %s", G_STRFUNC, priv->stage_name);
+
+#if GEOTIFF_FOUND
+  if (write && !priv->write_failed && !g_cancellable_is_cancelled( priv->cancellable))
+  {
+    GError *err = NULL;
+    gchar *fname = g_strdup_printf("%s.%s", priv->file_name, priv->file_ext);
+
+    gdouble width = priv->side / 100.0;
+    gdouble cx = priv->x0 * width;  //utm-координаты для верхней левой точки изображения
+    gdouble cy = (priv->y0 + 1) * width;
+
+    fflush( priv->stage);
+    gp_streamer_save_gtiff( streamer, cx, cy, fname, &err);
+
+    if (err)
     {
-      priv->x = priv->from_x;
-      priv->y -= step;
+      g_critical("%s", err->message);
+      g_error_free( err);
     }
-    else
-      priv->x += step;  //Сдвиг вправо
 
-    //Конеч. координаты файла
-    x_cur = (gint)((priv->x + step) / width);
-    y_cur = (gint)((priv->y - step) / width);
+    g_free( fname);
+  }
+#endif
+
+  fclose( priv->stage);
+  g_remove( priv->stage_name);
+  g_free( priv->stage_name);
 
-    priv->x2 = (x_cur < x_num) ? priv->x + step : priv->to_x;
-    priv->y2 = (y_cur > y_num) ? priv->y - step : priv->from_y;
+  gp_streamer_pyramid_free( &priv->cog);
+}
 
-    priv->started = TRUE;  //Буфер настроен
-  }
 
+//Записать метаданные и завершить запись файла MBTiles.
+//write -- сохранить файл, иначе файл удаляется.
+static void gp_streamer_mbtiles_end( GpStreamer *streamer, gboolean write)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
 
-  //Готовим плитки и пишем в файл.
-  gp_streamer_save_one_image( streamer, priv->x, priv->y, priv->x2, priv->y2);
+  write = write && !g_cancellable_is_cancelled( priv->cancellable);
 
-  return FALSE;
+  if (write)
+  {
+    gchar buf[4][G_ASCII_DTOSTR_BUF_SIZE];
+    gchar *value;
+
+    value = g_path_get_basename( priv->mbtiles_name);
+    mbtiles_writer_set_metadata( priv->mbtiles, "name", value);
+    g_free( value);
+
+    mbtiles_writer_set_metadata( priv->mbtiles, "type", "baselayer");
+    mbtiles_writer_set_metadata( priv->mbtiles, "version", "1.1");
+    mbtiles_writer_set_metadata( priv->mbtiles, "format", "png");
+    mbtiles_writer_set_metadata( priv->mbtiles, "minzoom", "0");
+
+    value = g_strdup_printf("%u", priv->tree.n_levels - 1);
+    mbtiles_writer_set_metadata( priv->mbtiles, "maxzoom", value);
+    g_free( value);
+
+    //Координаты -- сетка плиток Tiler в utm-зоне, а не веб-меркатор
+    mbtiles_writer_set_metadata( priv->mbtiles, "scheme", MBTILES_GP_SCHEME);
+    mbtiles_writer_set_metadata( priv->mbtiles, "description", "Tiles in GpTiler grid (see gp_tile_side, gp_utm_zone), not Web Mercator");
+
+    value = g_strdup_printf("%d", priv->side);
+    mbtiles_writer_set_metadata( priv->mbtiles, "gp_tile_side", value);
+    g_free( value);
+
+    value = g_strdup_printf("%u", priv->zone);
+    mbtiles_writer_set_metadata( priv->mbtiles, "gp_utm_zone", value);
+    g_free( value);
+
+    value = g_strjoin( ",", g_ascii_formatd( buf[0], sizeof(buf[0]), "%.2f", priv->from_x),
+                            g_ascii_formatd( buf[1], sizeof(buf[1]), "%.2f", priv->from_y),
+                            g_ascii_formatd( buf[2], sizeof(buf[2]), "%.2f", priv->to_x),
+                            g_ascii_formatd( buf[3], sizeof(buf[3]), "%.2f", priv->to_y), NULL);
+    mbtiles_writer_set_metadata( priv->mbtiles, "gp_area", value);
+    g_free( value);
+  }
+
+  mbtiles_writer_close( priv->mbtiles, write);
+  priv->mbtiles = NULL;
 }
 
 
-//Подготовить пиксельный буфер на заданное количество плиток, сделать запрос на получение каждой плитки,
-//дождаться, пока все они будут готовы, и вызвать метод для записи буфера в файл.
-//Возвращает TRUE, если попытка записи завершена -- удачно или нет.
-//Возвращает FALSE, если продолжается подготовка каких-то плиток.
-static gboolean gp_streamer_save_one_image( GpStreamer *streamer, gdouble x, gdouble y, gdouble x2, gdouble y2)
+//Запросить плитки окна и передать в пирамиды готовые плитки, следующие по порядку.
+//Возвращает TRUE, если получена хотя бы одна плитка.
+static gboolean gp_streamer_request_window( GpStreamer *streamer)
 {
   GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
 
+  gint total = priv->nx * priv->ny;
+  gint end = MIN( priv->next + priv->window_size, total);
+  gint n;
+
   GpTile tile;
   tile.l = priv->side;
   tile.type = priv->type;
 
-  //Количество плиток
-  gdouble width = priv->side / 100.0;
-  gint x_tiles = (gint)(x2 / width) - (gint)(x / width) + 1;
-  gint y_tiles = (gint)(y / width) - (gint)(y2 / width) + 1;
+  for( n=priv->next; n < end; n++)
+  {
+    gint k = n % priv->window_size;
 
-  gint i, j, tile_cnt;
-  gboolean rval = TRUE;
-  GpTileStatus status;
+    if (priv->window_status[ k ] == GP_TILE_STATUS_ACTUAL) continue;
 
-  //Для каждой плитки надо сделать запрос и проверить статус готовности
-  for( i=0; i < y_tiles; i++)
-    for( j=0; j < x_tiles; j++)
-    {
-      tile_cnt = i * x_tiles + j;
+    if (!priv->window_tiles[ k ]) priv->window_tiles[ k ] = g_malloc0( GP_TILE_DATA_SIZE);
 
-      if (priv->tile_status[ tile_cnt ] != GP_TILE_STATUS_ACTUAL)
-      {
-        tile.x = (gint)(x / width) + j;
-        tile.y = (gint)(y / width) - i;
+    tile.x = priv->x0 + n % priv->nx;
+    tile.y = priv->y0 - n / priv->nx;
 
-        status = (GpTileStatus)gp_tiler_get_tile(priv->tiler,
-          (guint8 *)priv->tiles_buf + tile_cnt * GP_TILE_DATA_SIZE, &tile,
-          GP_TILE_STATUS_ACTUAL - 1); //< Нужны актуальные данные, другие не подойдут!
+    priv->window_status[ k ] = (GpTileStatus)gp_tiler_get_tile(priv->tiler, priv->window_tiles[ k ], &tile,
+      GP_TILE_STATUS_ACTUAL - 1); //< Нужны актуальные данные, другие не подойдут!
+  }
 
-        if (status == GP_TILE_STATUS_ACTUAL)
-          priv->tile_status[ tile_cnt ] = GP_TILE_STATUS_ACTUAL;
-        else
-          rval = FALSE;
-      }
-    }
+  gboolean rval = FALSE;
 
-  //Проверить признак, все ли плитки готовы
-  if (rval == FALSE) return FALSE;
-
-/*
-  //Все плитки готовы -- надо собрать общий буфер
-  for( i=0; i < y_tiles; i++)
-    for( j=0; j < x_tiles; j++)
-      for( n=0; n < GP_TILE_SIDE; n++)
-        memcpy( (uint8 *)priv->image_buf + (i * x_tiles) * GP_TILE_DATA_SIZE + (n * x_tiles + j) * GP_TILE_STRIDE,
-                (uint8 *)priv->tiles_buf + (i * x_tiles + j) * GP_TILE_DATA_SIZE + n * GP_TILE_STRIDE,
-                GP_TILE_STRIDE);
-*/
+  //Пирамида плиток только читает плитку, файлу GeoTIFF буфер передается во владение
+  while (priv->next < total && priv->window_status[ priv->next % priv->window_size ] == GP_TILE_STATUS_ACTUAL)
+  {
+    gint k = priv->next % priv->window_size;
+    gint j = priv->next % priv->nx;
+
+    if (priv->tree.levels) gp_streamer_push_tile( streamer, &priv->tree, 0, j, &priv->window_tiles[ k ]);
+    if (priv->cog.levels) gp_streamer_push_tile( streamer, &priv->cog, 0, j, &priv->window_tiles[ k ]);
+
+    priv->window_status[ k ] = GP_TILE_STATUS_NOT_INIT;
+    priv->next++;
+
+    rval = TRUE;
+  }
+
+  return rval;
+}
+
+
+//Уменьшить плитку вдвое усреднением блоков 2x2 пикселей и поместить результат
+//в четверть (qx, qy) плитки dst. Каналы усредняются попарно в 16-битных полях слова.
+static void gp_streamer_downsample( const guint32 *src, guint32 *dst, gint qx, gint qy)
+{
+  const gint half = GP_TILE_SIDE / 2;
+  gint i, j;
 
-  //ARGB32 -> ABGR
-  for( i=0; i < x_tiles * y_tiles * GP_TILE_DATA_SIZE / 4; i++)
+  for( i=0; i < half; i++)
   {
-    guint32 d = priv->tiles_buf[i];
-    priv->tiles_buf[i] = (0xFF00FF00 & d) + (0xFF0000 & (d<<16)) + (0xFF & (d>>16));
-    //priv->tiles_buf[i] |= 0xFF000000;
+    const guint32 *s0 = src + 2 * i * GP_TILE_SIDE;
+    const guint32 *s1 = s0 + GP_TILE_SIDE;
+    guint32 *d = dst + (qy * half + i) * GP_TILE_SIDE + qx * half;
+
+    for( j=0; j < half; j++)
+    {
+      guint32 a = s0[ 2 * j ], b = s0[ 2 * j + 1 ];
+      guint32 c = s1[ 2 * j ], e = s1[ 2 * j + 1 ];
+
+      guint32 lo = (a & 0x00FF00FF) + (b & 0x00FF00FF) + (c & 0x00FF00FF) + (e & 0x00FF00FF) + 0x00020002;
+      guint32 hi = ((a >> 8) & 0x00FF00FF) + ((b >> 8) & 0x00FF00FF) +
+                   ((c >> 8) & 0x00FF00FF) + ((e >> 8) & 0x00FF00FF) + 0x00020002;
+
+      d[ j ] = ((lo >> 2) & 0x00FF00FF) | ((hi << 6) & 0xFF00FF00);
+    }
   }
+}
 
 
-  //Запись в файл
-  gchar *fname = NULL;
-  if (priv->single == TRUE)
-    fname = g_strdup_printf("%s.%s", priv->file_name, priv->file_ext);
-  else
-    fname = g_strdup_printf("%s_%02d.%s", priv->file_name, priv->fcnt, priv->file_ext);
+//Передать готовую плитку j заполняемой строки уровня l пирамиды, уменьшив ее в четверть родительской.
+//Когда строка родительских плиток заполнена, ее плитки обрабатываются так же.
+//Плитки уровня 0 принадлежат окну запросов, плитки остальных уровней -- пирамиде.
+static void gp_streamer_push_tile( GpStreamer *streamer, GpStreamerPyramid *pyramid, guint l, gint j, guint8 **data)
+{
+  GpStreamerLevel *level = &pyramid->levels[l];
+  GpStreamerLevel *parent = (l + 1 < pyramid->n_levels) ? &pyramid->levels[l + 1] : NULL;
 
-#if GEOTIFF_FOUND
-  GError *err = NULL;
+  gint row = level->row0 + level->row;  //Строка в сетке уровня
+  gint col = level->col0 + j;
+
+  if (!*data) *data = g_malloc0( GP_TILE_DATA_SIZE);
 
-  gdouble cx = ((int)(x / width)) * width;  //utm-координаты для верхней левой точки буфера
-  gdouble cy = ((int)(y / width) + 1) * width;
+  if (parent)
+  {
+    gint pj = gp_streamer_parent_index( col) - parent->col0;
 
-  gp_streamer_save_gtiff( streamer, priv->tiles_buf, x_tiles, y_tiles, cx, cy, fname, &err);
+    if (!parent->tiles[ pj ]) parent->tiles[ pj ] = g_malloc0( GP_TILE_DATA_SIZE);
 
-  if (err)
+    gp_streamer_downsample( (guint32 *)*data, (guint32 *)parent->tiles[ pj ], col & 1, row & 1);
+  }
+
+  pyramid->emit( streamer, l, level->row * level->nx + j, data);
+
+  if (l > 0)
   {
-    g_critical("%s", err->message);
-    g_error_free( err);
+    g_free( *data);
+    *data = NULL;
   }
-#else
-  #warning "GEOTIFF_FOUND =  FALSE"
-  g_warning("GpStreamer: GEOTIFF_FOUND =  FALSE");
-#endif
 
-  if (fname) g_free( fname);
+  if (j < level->nx - 1) return;
 
-  priv->fcnt++;
-  priv->started = FALSE;
+  level->row++;
 
-  priv->acnt += priv->frac;
+  //Строка родителя заполнена, если это была нижняя половина его плиток или последняя строка уровня
+  if (parent && ((row & 1) == 1 || level->row == level->ny))
+    for( j=0; j < parent->nx; j++)
+      gp_streamer_push_tile( streamer, pyramid, l + 1, j, &parent->tiles[ j ]);
+}
 
-  return TRUE;
+
+//Передать готовую плитку файла GeoTIFF на сжатие.
+static void gp_streamer_cog_emit( GpStreamer *streamer, guint l, gint index, guint8 **data)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  GpStreamerJob *job = g_slice_new( GpStreamerJob);
+
+  job->seq = priv->seq++;
+  job->level = l;
+  job->index = index;
+  job->data = *data;
+  job->size = 0;
+
+  *data = NULL;
+
+  //Сжатие не успевает за формированием плиток -- ждем, не запрашивая новых
+  g_mutex_lock( &priv->jobs_mutex);
+    while (priv->jobs >= priv->jobs_max)
+      g_cond_wait( &priv->jobs_cond, &priv->jobs_mutex);
+    priv->jobs++;
+  g_mutex_unlock( &priv->jobs_mutex);
+
+  g_thread_pool_push( priv->encode_pool, job, NULL);
 }
 
 
-#if GEOTIFF_FOUND
-//Записать буфер на nx * ny плиток в gtiff-файл.
-//cx, cy -- utm-координаты левой верхней точки буфера.
-//Возвращает TRUE, если файл успешно записан.
-static gboolean gp_streamer_save_gtiff( GpStreamer *streamer, void *buf, gint nx, gint ny, gdouble cx, gdouble cy, const gchar *filename, GError **error)
+//Передать готовую плитку пирамиды пользователю.
+static void gp_streamer_tree_emit( GpStreamer *streamer, guint l, gint index, guint8 **data)
 {
   GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+  GpStreamerLevel *level = &priv->tree.levels[l];
 
-  g_return_val_if_fail(buf != NULL, FALSE);
-  g_return_val_if_fail(nx > 0 && ny > 0, FALSE);
-  g_return_val_if_fail(1 <= priv->zone && priv->zone <= 60, FALSE);
+  GpTile tile;
+  tile.l = priv->side << l;
+  tile.type = priv->type;
+  tile.x = level->col0 + index % level->nx;
+  tile.y = -(level->row0 + index / level->nx) - 1;
 
-  TIFF *ftif = NULL;
-  GTIF *gtif = NULL;
+  if (priv->tree_func)
+    priv->tree_func( l, &tile, *data, priv->tree_data);
 
-  //Открыть файл на запись
-  if ((ftif = TIFFOpen(filename, "w")) == NULL)
+  //В MBTiles больший zoom_level -- более подробный уровень
+  if (priv->mbtiles)
+    mbtiles_writer_add_tile( priv->mbtiles, priv->tree.n_levels - 1 - l, tile.x, tile.y, *data);
+}
+
+
+//Переставить каналы ARGB32 -> ABGR (байты RGBA в памяти).
+static void gp_streamer_swizzle( guint32 *data, gsize n)
+{
+  gsize i = 0;
+
+#ifdef __SSE2__
+  const __m128i ag = _mm_set1_epi32( (gint)0xFF00FF00);
+  const __m128i r = _mm_set1_epi32( 0x00FF0000);
+  const __m128i b = _mm_set1_epi32( 0x000000FF);
+
+  for( ; i + 4 <= n; i += 4)
   {
-    g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_OPEN, "%s: Error opening file %s.", G_STRFUNC, filename);
-    return FALSE;
+    __m128i d = _mm_loadu_si128( (const __m128i *)(data + i));
+
+    d = _mm_or_si128( _mm_and_si128( d, ag),
+        _mm_or_si128( _mm_and_si128( _mm_slli_epi32( d, 16), r),
+                      _mm_and_si128( _mm_srli_epi32( d, 16), b)));
+
+    _mm_storeu_si128( (__m128i *)(data + i), d);
   }
+#endif
+
+  for( ; i < n; i++)
+  {
+    guint32 d = data[i];
+    data[i] = (0xFF00FF00 & d) + (0xFF0000 & (d<<16)) + (0xFF & (d>>16));
+  }
+}
 
-  gint pix_x = nx * GP_TILE_SIDE;
-  gint pix_y = ny * GP_TILE_SIDE;
 
-  //Установить тэги для записи данных
-  if (TIFFSetField( ftif, TIFFTAG_IMAGEWIDTH, pix_x) == 0 ||
-      TIFFSetField( ftif, TIFFTAG_IMAGELENGTH, pix_y) == 0 ||
-      TIFFSetField( ftif, TIFFTAG_TILEWIDTH, GP_TILE_SIDE) == 0 ||
-      TIFFSetField( ftif, TIFFTAG_TILELENGTH, GP_TILE_SIDE) == 0 ||
-      TIFFSetField( ftif, TIFFTAG_BITSPERSAMPLE, 8) == 0 ||
-      TIFFSetField( ftif, TIFFTAG_SAMPLESPERPIXEL, 4) == 0 ||
-      TIFFSetField( ftif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG) == 0 ||
-      TIFFSetField( ftif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB) == 0 ||
-      TIFFSetField( ftif, TIFFTAG_COMPRESSION, COMPRESSION_NONE) == 0)
+#define GP_STREAMER_LZW_CLEAR  256
+#define GP_STREAMER_LZW_EOI    257
+#define GP_STREAMER_LZW_FIRST  258
+#define GP_STREAMER_LZW_LIMIT  4094   ///При достижении таблица сбрасывается
+#define GP_STREAMER_LZW_HBITS  13
+
+//Записать код LZW разрядностью nbits, старшими битами вперед.
+#define GP_STREAMER_LZW_PUT(code, nbits)                \
+  G_STMT_START {                                        \
+    acc = (acc << (nbits)) | (code);                    \
+    nacc += (nbits);                                    \
+    while (nacc >= 8)                                   \
+    {                                                   \
+      nacc -= 8;                                        \
+      *out++ = (guint8)(acc >> nacc);                   \
+    }                                                   \
+  } G_STMT_END
+
+//Сжатие LZW в варианте TIFF: коды от 9 до 12 бит, разрядность увеличивается
+//на один код раньше заполнения ("early change"), как в libtiff.
+//Буфер dst должен вмещать size * 3 / 2 + 16 байт. Возвращает размер сжатых данных.
+static gsize gp_streamer_lzw_encode( const guint8 *src, gsize size, guint8 *dst)
+{
+  guint32 hkey[ 1 << GP_STREAMER_LZW_HBITS ];
+  guint16 hcode[ 1 << GP_STREAMER_LZW_HBITS ];
+
+  guint8 *out = dst;
+  guint64 acc = 0;
+  guint nacc = 0;
+  guint nbits = 9;
+  guint next = GP_STREAMER_LZW_FIRST;
+  guint w;
+  gsize i;
+
+  memset( hkey, 0, sizeof(hkey));
+  GP_STREAMER_LZW_PUT( GP_STREAMER_LZW_CLEAR, nbits);
+
+  if (size == 0)
   {
-    g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_TAG, "%s: Error setting tiff tags in %s.", G_STRFUNC, filename);
-    goto failure;
+    GP_STREAMER_LZW_PUT( GP_STREAMER_LZW_EOI, nbits);
+    if (nacc > 0) *out++ = (guint8)(acc << (8 - nacc));
+    return out - dst;
   }
 
-  //Записать массив пикселей
-  gint i, j;
-  uint8 *p = (uint8 *)buf;
+  w = src[0];
 
-  for( i=0; i < ny; i++)
-    for( j=0; j < nx; j++)
+  for( i=1; i <= size; i++)
+  {
+    if (i < size)
     {
-      if (TIFFWriteTile( ftif, p, j * GP_TILE_SIDE, i * GP_TILE_SIDE, 0, 0) != GP_TILE_DATA_SIZE)
+      //Ключ строки "w + c" (0 -- свободная ячейка)
+      guint32 key = ((w << 8) | src[i]) + 1;
+      guint h = (key * 2654435761u) >> (32 - GP_STREAMER_LZW_HBITS);
+
+      while (hkey[h] != 0 && hkey[h] != key)
+        h = (h + 1) & ((1 << GP_STREAMER_LZW_HBITS) - 1);
+
+      if (hkey[h] == key)
       {
-        g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_WRITE, "%s: Error writing to %s.", G_STRFUNC, filename);
-        goto failure;
+        w = hcode[h];
+        continue;
       }
 
-      p += GP_TILE_DATA_SIZE;
+      hkey[h] = key;
+      hcode[h] = next;
     }
 
-  //Добавить дополнительные тэги
-  const TIFFFieldInfo field_info[6] = {
-    { TIFFTAG_GEOPIXELSCALE, -1, -1, TIFF_DOUBLE, (guint16)FIELD_CUSTOM, 1, 1, "GeoPixelScale" },
-    { TIFFTAG_GEOTRANSMATRIX, -1, -1, TIFF_DOUBLE, (guint16)FIELD_CUSTOM, 1, 1, "GeoTransformationMatrix" },
-    { TIFFTAG_GEOTIEPOINTS, -1, -1, TIFF_DOUBLE, (guint16)FIELD_CUSTOM, 1, 1, "GeoTiePoints" },
-    { TIFFTAG_GEOKEYDIRECTORY, -1, -1, TIFF_SHORT, (guint16)FIELD_CUSTOM, 1, 1, "GeoKeyDirectory" },
-    { TIFFTAG_GEODOUBLEPARAMS, -1, -1, TIFF_DOUBLE, (guint16)FIELD_CUSTOM, 1, 1, "GeoDoubleParams" },
-    { TIFFTAG_GEOASCIIPARAMS, -1, -1, TIFF_ASCII, (guint16)FIELD_CUSTOM, 1, 1, "GeoASCIIParams" }
-  };
+    GP_STREAMER_LZW_PUT( w, nbits);
+    next++;
 
-  if (TIFFMergeFieldInfo( ftif, field_info, 6) != 0)
+    if (next == GP_STREAMER_LZW_LIMIT)
+    {
+      GP_STREAMER_LZW_PUT( GP_STREAMER_LZW_CLEAR, nbits);
+      memset( hkey, 0, sizeof(hkey));
+      next = GP_STREAMER_LZW_FIRST;
+      nbits = 9;
+    }
+    else if (next > (1u << nbits) - 1)
+    {
+      nbits++;
+    }
+
+    if (i < size) w = src[i];
+  }
+
+  GP_STREAMER_LZW_PUT( GP_STREAMER_LZW_EOI, nbits);
+  if (nacc > 0) *out++ = (guint8)(acc << (8 - nacc));
+
+  return out - dst;
+}
+
+
+//Сжать плитку в потоке пула и передать ее потоку записи.
+static void gp_streamer_encode( GpStreamerJob *job, GpStreamer *streamer)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  guint8 *packed = NULL;
+  gsize size = 0;
+
+  if (g_cancellable_is_cancelled( priv->cancellable))
+    goto done;
+
+  gp_streamer_swizzle( (guint32 *)job->data, GP_TILE_SIDE * GP_TILE_SIDE);
+
+  switch (priv->compression)
   {
-    g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_MERGE, "%s: Error merging tiff tags in %s.", G_STRFUNC, filename);
-    goto failure;
+    case GP_STREAMER_COMPRESSION_NONE:
+      packed = job->data;
+      job->data = NULL;
+      size = GP_TILE_DATA_SIZE;
+      break;
+
+    case GP_STREAMER_COMPRESSION_DEFLATE:
+    {
+      uLongf len = compressBound( GP_TILE_DATA_SIZE);
+      packed = g_malloc( len);
+
+      if (compress2( packed, &len, job->data, GP_TILE_DATA_SIZE, Z_DEFAULT_COMPRESSION) == Z_OK)
+        size = len;
+      break;
+    }
+
+    case GP_STREAMER_COMPRESSION_LZW:
+      packed = g_malloc( GP_TILE_DATA_SIZE * 3 / 2 + 16);
+      size = gp_streamer_lzw_encode( job->data, GP_TILE_DATA_SIZE, packed);
+      break;
+
+    case GP_STREAMER_COMPRESSION_ZSTD:
+#if ZSTD_FOUND
+    {
+      gsize len = ZSTD_compressBound( GP_TILE_DATA_SIZE);
+      packed = g_malloc( len);
+
+      len = ZSTD_compress( packed, len, job->data, GP_TILE_DATA_SIZE, 9);
+      if (!ZSTD_isError( len))
+        size = len;
+    }
+#endif
+      break;
+  }
+
+done:
+  g_free( job->data);
+
+  if (size == 0)
+  {
+    g_free( packed);
+    packed = NULL;
   }
 
+  job->data = packed;
+  job->size = size;
+
+  g_async_queue_push( priv->write_queue, job);
+}
+
+
+static gint gp_streamer_seq_compare( gconstpointer a, gconstpointer b)
+{
+  guint sa = GPOINTER_TO_UINT( a);
+  guint sb = GPOINTER_TO_UINT( b);
+
+  return (sa < sb) ? -1 : (sa > sb);
+}
+
+
+//Поток записи: сохраняет сжатые плитки во временный файл строго в порядке их номеров,
+//запоминая смещение и размер каждой плитки.
+static gpointer gp_streamer_write( GpStreamer *streamer)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  GTree *pending = g_tree_new( gp_streamer_seq_compare);
+  GpStreamerJob *job;
+  goffset offset = 0;
+  guint next = 0;
+
+  while ((job = g_async_queue_pop( priv->write_queue)) != &gp_streamer_writer_stop)
+  {
+    g_tree_insert( pending, GUINT_TO_POINTER( job->seq), job);
+
+    while ((job = g_tree_lookup( pending, GUINT_TO_POINTER( next))) != NULL)
+    {
+      GpStreamerLevel *level = &priv->cog.levels[ job->level ];
+
+      g_tree_remove( pending, GUINT_TO_POINTER( next));
+
+      if (job->size == 0 || fwrite( job->data, 1, job->size, priv->stage) != job->size)
+        priv->write_failed = TRUE;
+
+      level->offsets[ job->index ] = offset;
+      level->sizes[ job->index ] = job->size;
+      offset += job->size;
+
+      g_free( job->data);
+      g_slice_free( GpStreamerJob, job);
+      next++;
+
+      g_mutex_lock( &priv->jobs_mutex);
+        priv->jobs--;
+        g_cond_signal( &priv->jobs_cond);
+      g_mutex_unlock( &priv->jobs_mutex);
+    }
+  }
+
+  //Все плитки передаются в очередь до признака завершения, поэтому здесь дерево пусто
+  g_warn_if_fail( g_tree_nnodes( pending) == 0);
+
+  g_tree_destroy( pending);
+
+  return NULL;
+}
+
+
+#if GEOTIFF_FOUND
+//Установить тэги уровня l для записи данных.
+static gboolean gp_streamer_set_tiff_tags( GpStreamer *streamer, TIFF *ftif, guint l)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+  GpStreamerLevel *level = &priv->cog.levels[l];
+
+  guint16 compression = COMPRESSION_NONE;
+
+  switch (priv->compression)
+  {
+    case GP_STREAMER_COMPRESSION_NONE:    compression = COMPRESSION_NONE; break;
+    case GP_STREAMER_COMPRESSION_DEFLATE: compression = COMPRESSION_ADOBE_DEFLATE; break;
+    case GP_STREAMER_COMPRESSION_LZW:     compression = COMPRESSION_LZW; break;
+#ifdef COMPRESSION_ZSTD
+    case GP_STREAMER_COMPRESSION_ZSTD:    compression = COMPRESSION_ZSTD; break;
+#else
+    case GP_STREAMER_COMPRESSION_ZSTD:    return FALSE;
+#endif
+  }
+
+  if (l > 0 && TIFFSetField( ftif, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE) == 0)
+    return FALSE;
+
+  return TIFFSetField( ftif, TIFFTAG_IMAGEWIDTH, level->width) != 0 &&
+         TIFFSetField( ftif, TIFFTAG_IMAGELENGTH, level->height) != 0 &&
+         TIFFSetField( ftif, TIFFTAG_TILEWIDTH, GP_TILE_SIDE) != 0 &&
+         TIFFSetField( ftif, TIFFTAG_TILELENGTH, GP_TILE_SIDE) != 0 &&
+         TIFFSetField( ftif, TIFFTAG_BITSPERSAMPLE, 8) != 0 &&
+         TIFFSetField( ftif, TIFFTAG_SAMPLESPERPIXEL, 4) != 0 &&
+         TIFFSetField( ftif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG) != 0 &&
+         TIFFSetField( ftif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB) != 0 &&
+         TIFFSetField( ftif, TIFFTAG_COMPRESSION, compression) != 0;
+}
+
+
+//Перенести сжатые плитки уровня l из временного файла в tiff-файл.
+static gboolean gp_streamer_write_tiff_tiles( GpStreamer *streamer, TIFF *ftif, guint l)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+  GpStreamerLevel *level = &priv->cog.levels[l];
+
+  gint i, n = level->nx * level->ny;
+  guint32 max_size = 0;
+
+  for( i=0; i < n; i++)
+    max_size = MAX( max_size, level->sizes[i]);
+
+  guint8 *buf = g_malloc( max_size);
+  gboolean rval = TRUE;
+
+  for( i=0; i < n && rval; i++)
+  {
+    rval = gp_streamer_fseek( priv->stage, level->offsets[i], SEEK_SET) == 0 &&
+           fread( buf, 1, level->sizes[i], priv->stage) == level->sizes[i] &&
+           TIFFWriteRawTile( ftif, i, buf, level->sizes[i]) == (tmsize_t)level->sizes[i];
+  }
+
+  g_free( buf);
+
+  return rval;
+}
+
+
+//Записать GeoTIFF-ключи и привязку изображения в текущий каталог.
+//cx, cy -- utm-координаты левой верхней точки изображения.
+static gboolean gp_streamer_set_geo_tags( GpStreamer *streamer, TIFF *ftif, gdouble cx, gdouble cy, const gchar *filename, GError **error)
+{
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
+
+  GTIF *gtif = NULL;
+
+  gint pix_x = priv->cog.levels[0].width;
+  gint pix_y = priv->cog.levels[0].height;
+
   //Открыть файл как gtif
   if ((gtif = GTIFNew(ftif)) == NULL)
   {
@@ -561,66 +1372,126 @@ static gboolean gp_streamer_save_gtiff( GpStreamer *streamer, void *buf, gint nx
     goto failure;
   }
 
-//g_printf("%s: %s\n", G_STRFUNC, filename);
-
   GTIFFree(gtif);
-  TIFFClose(ftif);
 
   return TRUE;
 
 failure:
 
   if (gtif) GTIFFree(gtif);
-  if (ftif) TIFFClose(ftif);
 
   return FALSE;
 }
-#endif
 
-/*
-//Записать буфер на pix_x * pix_y пикселей в tiff-файл.
+
+//Записать все уровни изображения из временного файла в gtiff-файл.
+//cx, cy -- utm-координаты левой верхней точки изображения.
 //Возвращает TRUE, если файл успешно записан.
-static gboolean gp_streamer_save_tiff( GpStreamer *streamer, void *buf, gint pix_x, gint pix_y, const gchar *filename, GError **error)
+static gboolean gp_streamer_save_gtiff( GpStreamer *streamer, gdouble cx, gdouble cy, const gchar *filename, GError **error)
 {
-  g_return_if_fail( buf != NULL);
-  g_return_if_fail( pix_x > 0 && pix_y > 0);
+  GpStreamerPriv *priv = GP_STREAMER_GET_PRIVATE( streamer);
 
-  TIFF *ftif = TIFFOpen(filename, "w");
+  g_return_val_if_fail(priv->cog.levels != NULL, FALSE);
+  g_return_val_if_fail(1 <= priv->zone && priv->zone <= 60, FALSE);
 
-  if (ftif == NULL)
+  TIFF *ftif = NULL;
+  guint l;
+
+  //Файлы больше 4 Гб записываются в формате BigTIFF
+  guint64 total = 0;
+  for( l=0; l < priv->cog.n_levels; l++)
+  {
+    gint i;
+    for( i=0; i < priv->cog.levels[l].nx * priv->cog.levels[l].ny; i++)
+      total += priv->cog.levels[l].sizes[i];
+  }
+
+  //Открыть файл на запись
+  if ((ftif = TIFFOpen(filename, (total > G_MAXUINT32 - (1 << 24)) ? "w8" : "w")) == NULL)
   {
     g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_OPEN, "%s: Error opening file %s.", G_STRFUNC, filename);
     return FALSE;
   }
 
-  gboolean result = TRUE;
+  //Добавить дополнительные тэги
+  const TIFFFieldInfo field_info[6] = {
+    { TIFFTAG_GEOPIXELSCALE, -1, -1, TIFF_DOUBLE, (guint16)FIELD_CUSTOM, 1, 1, "GeoPixelScale" },
+    { TIFFTAG_GEOTRANSMATRIX, -1, -1, TIFF_DOUBLE, (guint16)FIELD_CUSTOM, 1, 1, "GeoTransformationMatrix" },
+    { TIFFTAG_GEOTIEPOINTS, -1, -1, TIFF_DOUBLE, (guint16)FIELD_CUSTOM, 1, 1, "GeoTiePoints" },
+    { TIFFTAG_GEOKEYDIRECTORY, -1, -1, TIFF_SHORT, (guint16)FIELD_CUSTOM, 1, 1, "GeoKeyDirectory" },
+    { TIFFTAG_GEODOUBLEPARAMS, -1, -1, TIFF_DOUBLE, (guint16)FIELD_CUSTOM, 1, 1, "GeoDoubleParams" },
+    { TIFFTAG_GEOASCIIPARAMS, -1, -1, TIFF_ASCII, (guint16)FIELD_CUSTOM, 1, 1, "GeoASCIIParams" }
+  };
 
-  if (TIFFSetField( ftif, TIFFTAG_IMAGEWIDTH, pix_x) != 0 &&
-      TIFFSetField( ftif, TIFFTAG_IMAGELENGTH, pix_y) != 0 &&
-      TIFFSetField( ftif, TIFFTAG_BITSPERSAMPLE, 8) != 0 &&
-      TIFFSetField( ftif, TIFFTAG_SAMPLESPERPIXEL, 4) != 0 &&
-      TIFFSetField( ftif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG) != 0 &&
-      TIFFSetField( ftif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB) != 0 &&
-      TIFFSetField( ftif, TIFFTAG_COMPRESSION, COMPRESSION_NONE) != 0)
+  if (TIFFMergeFieldInfo( ftif, field_info, 6) != 0)
   {
-    gint i;
-    for( i=0; i < pix_y; i++)
+    g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_MERGE, "%s: Error merging tiff tags in %s.", G_STRFUNC, filename);
+    goto failure;
+  }
+
+  //Каталоги всех уровней: исходное разрешение, затем обзорные
+  for( l=0; l < priv->cog.n_levels; l++)
+  {
+    if (!gp_streamer_set_tiff_tags( streamer, ftif, l))
     {
-      if (TIFFWriteScanline( ftif, (uint8 *)buf + i * pix_x * 4, i, 0) != 1)
-      {
-        g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_WRITE, "%s: Error writing to %s.", G_STRFUNC, filename);
-        result = FALSE;
-        break;
-      }
+      g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_TAG, "%s: Error setting tiff tags in %s.", G_STRFUNC, filename);
+      goto failure;
+    }
+
+    if (l == 0 && !gp_streamer_set_geo_tags( streamer, ftif, cx, cy, filename, error))
+      goto failure;
+
+#if GP_STREAMER_COG_LAYOUT
+    //Таблицы смещений плиток будут записаны после данных, а сейчас под них только резервируется место
+    TIFFDeferStrileArrayWriting( ftif);
+#else
+    if (!gp_streamer_write_tiff_tiles( streamer, ftif, l))
+    {
+      g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_WRITE, "%s: Error writing to %s.", G_STRFUNC, filename);
+      goto failure;
+    }
+#endif
+
+    if (TIFFWriteDirectory( ftif) == 0)
+    {
+      g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_WRITE, "%s: Error writing to %s.", G_STRFUNC, filename);
+      goto failure;
     }
   }
-  else
+
+  TIFFClose(ftif);
+  ftif = NULL;
+
+#if GP_STREAMER_COG_LAYOUT
+  //Данные уровней: от самого мелкого обзорного до исходного разрешения
+  if ((ftif = XTIFFOpen(filename, "r+")) == NULL)
   {
-    g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_TAG, "%s: Error setting tiff tag in %s.", G_STRFUNC, filename);
-    result = FALSE;
+    g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_OPEN, "%s: Error opening file %s.", G_STRFUNC, filename);
+    return FALSE;
   }
 
-  TIFFClose(ftif);
-  return result;
+  for( l=priv->cog.n_levels; l-- > 0; )
+  {
+    if (TIFFSetDirectory( ftif, l) == 0 ||
+        !gp_streamer_write_tiff_tiles( streamer, ftif, l) ||
+        TIFFForceStrileArrayWriting( ftif) == 0)
+    {
+      g_set_error( error, GP_STREAMER_ERROR, GP_STREAMER_ERROR_TIFF_WRITE, "%s: Error writing to %s.", G_STRFUNC, filename);
+      goto failure;
+    }
+  }
+
+  XTIFFClose(ftif);
+#endif
+
+//g_printf("%s: %s\n", G_STRFUNC, filename);
+
+  return TRUE;
+
+failure:
+
+  if (ftif) TIFFClose(ftif);
+
+  return FALSE;
 }
-*/
+#endif
@@ -53,6 +53,19 @@
 /// L_STEP = 2 => "соседние" масштабы отличаются в 4 раза и т.п.
 static const guint L_STEP = 1;
 
+/// Ширина (в плитках) кольца вокруг видимой области, плитки которого запрашиваются упреждающе, по умолчанию.
+static const guint PREFETCH_RING_DEFAULT = 1;
+
+/// Максимальное количество плиток, запрашиваемых упреждающе для одной видимой области, по умолчанию.
+static const guint PREFETCH_BUDGET_DEFAULT = 64;
+
+/// На сколько масштабов (с шагом L_STEP) вверх искать в кэше плитку-"предка" для заглушки, см. layer_draw_placeholder().
+static const guint PLACEHOLDER_DEPTH = 3;
+
+/// Запас (в пикселях видимой области) вокруг изменившихся плиток при частичной перерисовке #placed_pimage:
+/// фильтр PIXMAN_FILTER_GOOD при масштабировании захватывает соседние пиксели мозаики.
+static const gint PLACED_DAMAGE_MARGIN = 2;
+
 
 
 /// Информация, однозначно описывающая какими плитками заполнен слой
@@ -60,6 +73,11 @@ static const guint L_STEP = 1;
 ///
 /// Заполняется с помощью compute_tiles_params().
 /// Две такие структуры можно сравнить с помощью TILES_PARAMS_EQUAL().
+///
+/// Мозаика плиток слоя (_Layer::tiles_buf) тороидальная: плитка с координатами (x, y)
+/// всегда занимает в ней ячейку (x mod xnum, y mod ynum), см. tiles_slot().
+/// Поэтому при сдвиге видимой области плитки, оставшиеся на экране, не перемещаются
+/// и не перерисовываются, а запрашиваются только плитки в открывшихся строках и столбцах.
 typedef struct
 {
   gint from_xl; /*!< Координата первой плитки по оси X (размерность -- сторона плитки).*/
@@ -67,6 +85,7 @@ typedef struct
   gint from_yl; /*!< Координата первой плитки по оси Y (размерность -- сторона плитки).*/
   gint to_yl;   /*!< Координата последней плитки по оси Y (размерность -- сторона плитки).*/
   guint ll;     /*!< Автоматически рассчитанный размер стороны "плитки" (размер в сантиметрах = 2 ^ ll, т.е. ll -- двоичный логарифм стороны).*/
+  guint l;      /*!< Размер стороны плитки в сантиметрах (с учетом фиксированного размера).*/
 
   ///\name Вспомогательные поля, вычисляются на основе предыдущих, т.ч. к примеру  не используются при сравнении.
   /// @{
@@ -77,7 +96,7 @@ typedef struct
 
   /// Макрос сравнения объектов TilesParams.
   #define TILES_PARAMS_EQUAL(TP1, TP2) \
-    ((TP1).from_xl == (TP2).from_xl && (TP1).to_xl == (TP2).to_xl && (TP1).from_yl == (TP2).from_yl && (TP1).to_yl == (TP2).to_yl && (TP1).ll == (TP2).ll)
+    ((TP1).from_xl == (TP2).from_xl && (TP1).to_xl == (TP2).to_xl && (TP1).from_yl == (TP2).from_yl && (TP1).to_yl == (TP2).to_yl && (TP1).ll == (TP2).ll && (TP1).l == (TP2).l)
 }
 TilesParams;
 
@@ -98,19 +117,25 @@ struct _Layer
   gboolean highlight; /*!< Флаг подсвечивания (выделения) слоя.*/
   gboolean visible;   /*!< Флаг видимости слоя.*/
 
-  GpTileStatus *tile_statuses; /*!< Массив размером в tp.num элементов типа #GpTileStatus статусов плиток.*/
-  uint32_t *tiles_buf;  /*!< Буфер, в котором раскладываются плитки в размере 1:1.*/
+  GpTileStatus *tile_statuses; /*!< Массив размером в tp.num элементов типа #GpTileStatus статусов плиток (по ячейкам мозаики, см. tiles_slot()).*/
+  guint8 *placeholder_qualities; /*!< Массив размером в tp.num элементов: качество заглушек в ячейках со статусом GP_TILE_STATUS_INIT, см. layer_draw_placeholder().*/
+  uint32_t *tiles_buf;  /*!< Буфер, в котором раскладываются плитки в размере 1:1 (тороидальная мозаика, см. TilesParams).*/
   pixman_image_t *tiles_pimage; /*!< Pixman image для раскладки плиток 1:1.*/
 
+  uint32_t *placed_buf;           /*!< Буфер под изображение #placed_pimage.*/
+  pixman_image_t *placed_pimage;  /*!< Изображение слоя в размере видимой области, см. layer_get_placed_pimage().*/
+  gboolean placed_dirty;          /*!< Флаг того, что #placed_pimage нужно перерисовать целиком.*/
+  pixman_region32_t damage;       /*!< Плитки (координаты в сторонах плиток), перерисованные в мозаике после последнего обновления #placed_pimage.*/
+
   guint l_max; /*!< Максимальный размер стороны плитки (двоичный логарифм стороны в физических единицах, сантиметрах).*/
   guint *fixed_l;  /*!< Фиксированные размеры сторон плиток (для конкретных типов).*/
 
-  uint32_t *one_tile_buf;           /*!< Буфер под изображение #one_tile_pimage.*/
-  pixman_image_t *one_tile_pimage;  /*!< Pixman image для отрисовки одной плитки.*/
-
   uint32_t *blank_tile_buf;   /*!< Буфер под изображение #blank_tile.*/
   pixman_image_t *blank_tile; /*!< Pixman image с общим для всех blank-плиток фоном.*/
 
+  guint prefetch_ring;   /*!< Ширина кольца плиток вокруг видимой области, запрашиваемых упреждающе, см. layer_prefetch().*/
+  guint prefetch_budget; /*!< Максимальное количество плиток, запрашиваемых упреждающе для одной видимой области.*/
+
   guint update_data_timeout_id; /*!< ID таймера, по которому вызывается gp_tiler_update_data().*/
   guint update_data_timeout_interval; /*!< Интервал таймера, по которому вызывается gp_tiler_update_data().*/
 
@@ -143,6 +168,96 @@ struct _Layer
   /// \param pimage - pixman image (изначально пустой, заполненный нулями),
   /// на которой следует нарисовать фон blank-плитку.
   static void generate_blank_tile(pixman_image_t *pimage);
+
+  /// Остаток от деления \a value на \a num, всегда неотрицательный.
+  static inline guint tiles_mod(gint value, guint num);
+
+  /// Вычисляет положение плитки в тороидальной мозаике слоя.
+  ///
+  /// \param tp - параметры плиток слоя;
+  /// \param x - координата плитки по оси X (размерность -- сторона плитки);
+  /// \param y - координата плитки по оси Y (размерность -- сторона плитки);
+  /// \param col - указатель на переменную, куда будет помещен номер столбца плитки в мозаике, либо NULL;
+  /// \param row - указатель на переменную, куда будет помещен номер строки плитки в мозаике, либо NULL.
+  ///
+  /// \return номер ячейки плитки в массиве _Layer::tile_statuses.
+  static inline guint tiles_slot(const TilesParams *tp, gint x, gint y, guint *col, guint *row);
+
+  /// Очищает ячейку мозаики слоя и помечает ее плитку как неинициализированную.
+  ///
+  /// \param layer - указатель на объект Layer;
+  /// \param x - координата плитки по оси X (размерность -- сторона плитки);
+  /// \param y - координата плитки по оси Y (размерность -- сторона плитки).
+  static void layer_clear_slot(Layer *layer, gint x, gint y);
+
+  /// Переходит к новым параметрам плиток \a new_tp, сохраняя уже отрисованные плитки,
+  /// которые остаются на экране, и очищая ячейки открывшихся строк и столбцов.
+  ///
+  /// Вызывается только если размер мозаики и размер плиток не изменились.
+  ///
+  /// \param layer - указатель на объект Layer;
+  /// \param new_tp - новые параметры плиток.
+  static void layer_scroll(Layer *layer, const TilesParams *new_tp);
+
+  /// Частное от деления \a value на \a num с округлением вниз (в т.ч. для отрицательных \a value).
+  static inline gint tiles_div(gint value, guint num);
+
+  /// Упреждающе запрашивает плитки прямоугольника [from_x; to_x] x [from_y; to_y],
+  /// за исключением плиток внутреннего прямоугольника [hole_from_x; hole_to_x] x [hole_from_y; hole_to_y].
+  ///
+  /// \param layer - указатель на объект Layer;
+  /// \param l - размер стороны плиток в сантиметрах;
+  /// \param budget - указатель на количество плиток, которое еще можно запросить (уменьшается с каждым запросом).
+  static void layer_prefetch_rect(Layer *layer, guint l, gint from_x, gint to_x, gint from_y, gint to_y,
+    gint hole_from_x, gint hole_to_x, gint hole_from_y, gint hole_to_y, guint *budget);
+
+  /// Упреждающе запрашивает у GpTiler'а плитки, которые вероятно понадобятся при следующем
+  /// действии пользователя: кольца плиток вокруг видимой области (на случай сдвига)
+  /// и плитки соседних масштабов (на случай изменения масштаба).
+  ///
+  /// Вызывается, когда все плитки видимой области уже сформированы,
+  /// поэтому упреждающие запросы не задерживают отрисовку.
+  /// Количество запросов ограничено _Layer::prefetch_budget за вычетом уже стоящих в очереди заданий GpTiler'а.
+  ///
+  /// \param layer - указатель на объект Layer.
+  static void layer_prefetch(Layer *layer);
+
+  /// Рисует в ячейке мозаики плитку \a src_tile из кэша, если она там есть.
+  ///
+  /// \param layer - указатель на объект Layer;
+  /// \param src_tile - плитка, которую нужно нарисовать;
+  /// \param dst_x, dst_y - координаты области на _Layer::tiles_pimage, куда рисуется плитка;
+  /// \param size - размер стороны области на _Layer::tiles_pimage;
+  /// \param src_x, src_y - координаты (в масштабе области) фрагмента плитки, который попадет в область;
+  /// \param scale - во сколько раз сторона плитки больше стороны области (< 1 при увеличении).
+  ///
+  /// \return TRUE, если плитка нашлась в кэше и нарисована.
+  static gboolean layer_draw_cached(Layer *layer, GpTile *src_tile, gint dst_x, gint dst_y, gint size,
+    gint src_x, gint src_y, gdouble scale);
+
+  /// Рисует в ячейке мозаики заглушку для еще не сформированной плитки \a tile
+  /// из уже имеющихся в кэше плиток соседних масштабов.
+  ///
+  /// Качество заглушки тем выше, чем ближе масштаб ее плиток к масштабу \a tile:
+  /// 0 -- blank-плитка, PLACEHOLDER_DEPTH + 1 -- плитки-"дети" (уменьшенные),
+  /// PLACEHOLDER_DEPTH + 1 - d -- "предок" на d масштабов выше (увеличенный фрагмент).
+  /// Заглушка рисуется, только если она лучше уже нарисованной в ячейке.
+  ///
+  /// \param layer - указатель на объект Layer;
+  /// \param tile - плитка, для которой нужна заглушка;
+  /// \param col - номер столбца плитки в мозаике;
+  /// \param row - номер строки плитки в мозаике;
+  /// \param quality - указатель на качество нарисованной в ячейке заглушки (обновляется).
+  ///
+  /// \return TRUE, если нарисована новая заглушка.
+  static gboolean layer_draw_placeholder(Layer *layer, GpTile *tile, guint col, guint row, guint8 *quality);
+
+  /// Переводит _Layer::damage в координаты видимой области.
+  ///
+  /// \param layer - указатель на объект Layer;
+  /// \param state - состояние областей отрисовки;
+  /// \param region - инициализированная область, куда будет помещен результат.
+  static void layer_damage_to_visible(Layer *layer, const GpIcaState *state, pixman_region32_t *region);
 /// @}
 
 
@@ -172,6 +287,8 @@ void compute_tiles_params(const GpIcaState *const state, TilesParams *tp, guint
   else
     l_cm = fixed_l;
 
+  tp->l = l_cm;
+
   // Ниже нужен именно floor(), нельзя просто в gint перевести,
   // иначе некорректно будет округляться до целого при отрицательных значениях.
   tp->from_xl = floor((state->from_x + delta_x) / l_cm * 100);
@@ -298,6 +415,244 @@ void generate_blank_tile(pixman_image_t *pimage)
 
 
 
+guint tiles_mod(gint value, guint num)
+{
+  gint rest = value % (gint)num;
+  return rest < 0 ? rest + num : rest;
+}
+
+
+
+guint tiles_slot(const TilesParams *tp, gint x, gint y, guint *col, guint *row)
+{
+  // Строки мозаики идут сверху вниз, т.е. по убыванию y.
+  if(col) *col = tiles_mod(x, tp->xnum);
+  if(row) *row = tiles_mod(-y, tp->ynum);
+
+  return tiles_mod(x, tp->xnum) * tp->ynum + tiles_mod(y, tp->ynum);
+}
+
+
+
+void layer_clear_slot(Layer *layer, gint x, gint y)
+{
+  guint col, row, line;
+  guint width = layer->tp.xnum * GP_TILE_SIDE;
+
+  guint i = tiles_slot(&layer->tp, x, y, &col, &row);
+
+  layer->tile_statuses[i] = GP_TILE_STATUS_NOT_INIT;
+  layer->placeholder_qualities[i] = 0;
+
+  for(line = 0; line < GP_TILE_SIDE; line++)
+    memset(layer->tiles_buf + (row * GP_TILE_SIDE + line) * width + col * GP_TILE_SIDE, 0, 4 * GP_TILE_SIDE);
+}
+
+
+
+void layer_scroll(Layer *layer, const TilesParams *new_tp)
+{
+  TilesParams old_tp = layer->tp;
+  gint x, y;
+
+  layer->tp = *new_tp;
+  layer->finished = 0;
+  layer->prev_finished = -1;
+
+  // Ячейка сохраняется, если и столбец, и строка мозаики по-прежнему
+  // содержат плитки с теми же координатами, иначе ее плитка больше не видна.
+  for(x = new_tp->from_xl; x <= new_tp->to_xl; x++)
+    for(y = new_tp->from_yl; y <= new_tp->to_yl; y++)
+      if(x < old_tp.from_xl || x > old_tp.to_xl || y < old_tp.from_yl || y > old_tp.to_yl)
+        layer_clear_slot(layer, x, y);
+}
+
+
+
+gint tiles_div(gint value, guint num)
+{
+  return (value - (gint)tiles_mod(value, num)) / (gint)num;
+}
+
+
+
+void layer_prefetch_rect(Layer *layer, guint l, gint from_x, gint to_x, gint from_y, gint to_y,
+  gint hole_from_x, gint hole_to_x, gint hole_from_y, gint hole_to_y, guint *budget)
+{
+  GpTile tile = { .l = l, .type = layer->cur_type };
+
+  for(tile.x = from_x; tile.x <= to_x && *budget > 0; tile.x++)
+    for(tile.y = from_y; tile.y <= to_y && *budget > 0; tile.y++)
+    {
+      if(tile.x >= hole_from_x && tile.x <= hole_to_x && tile.y >= hole_from_y && tile.y <= hole_to_y)
+        continue;
+
+      if(gp_tiler_prefetch_tile(layer->tiler, &tile))
+        (*budget)--;
+    }
+}
+
+
+
+void layer_prefetch(Layer *layer)
+{
+  const TilesParams *tp = &layer->tp;
+  guint tasks_num = gp_tiler_get_tasks_num(layer->tiler);
+  guint budget = (tasks_num < layer->prefetch_budget) ? layer->prefetch_budget - tasks_num : 0;
+  gint r;
+
+  // Кольца вокруг видимой области, от ближних к дальним.
+  for(r = 1; r <= (gint)layer->prefetch_ring && budget > 0; r++)
+    layer_prefetch_rect(layer, tp->l,
+      tp->from_xl - r, tp->to_xl + r, tp->from_yl - r, tp->to_yl + r,
+      tp->from_xl - r + 1, tp->to_xl + r - 1, tp->from_yl - r + 1, tp->to_yl + r - 1, &budget);
+
+  // Соседние масштабы есть только при автоматическом расчете размера плиток, см. compute_tiles_params().
+  if(layer->fixed_l[layer->cur_type] != 0)
+    return;
+
+  {
+    const guint k = 1 << L_STEP; //< Во сколько раз отличаются стороны плиток соседних масштабов.
+
+    // При уменьшении масштаба видимую область покроют плитки-"родители".
+    if(tp->ll + L_STEP <= layer->l_max && budget > 0)
+      layer_prefetch_rect(layer, LL_TO_CM(tp->ll + L_STEP),
+        tiles_div(tp->from_xl, k), tiles_div(tp->to_xl, k), tiles_div(tp->from_yl, k), tiles_div(tp->to_yl, k),
+        1, 0, 1, 0, &budget);
+
+    // При увеличении масштаба видна только центральная часть видимой области, ее и покроем плитками-"детьми".
+    if(tp->ll >= L_STEP && budget > 0)
+    {
+      gint margin_x = tp->xnum / (2 * k);
+      gint margin_y = tp->ynum / (2 * k);
+
+      layer_prefetch_rect(layer, LL_TO_CM(tp->ll - L_STEP),
+        (tp->from_xl + margin_x) * k, (tp->to_xl - margin_x) * k + k - 1,
+        (tp->from_yl + margin_y) * k, (tp->to_yl - margin_y) * k + k - 1,
+        1, 0, 1, 0, &budget);
+    }
+  }
+}
+
+
+
+gboolean layer_draw_cached(Layer *layer, GpTile *src_tile, gint dst_x, gint dst_y, gint size,
+  gint src_x, gint src_y, gdouble scale)
+{
+  GpTileStatus rstatus;
+  gint data_len;
+  guint8 *data = gp_tiler_acquire_cached_tile(layer->tiler, src_tile, GP_TILE_STATUS_INIT, &rstatus, &data_len);
+
+  if(!data)
+    return FALSE;
+
+  pixman_image_t *image = pixman_image_create_bits(PIXMAN_a8r8g8b8, GP_TILE_SIDE, GP_TILE_SIDE,
+    (uint32_t *) gp_mem_tile_get_buf_from_malloc_data(data, data_len), 4 * GP_TILE_SIDE);
+
+  if(image)
+  {
+    struct pixman_transform transform;
+    pixman_transform_init_scale(&transform, pixman_double_to_fixed(scale), pixman_double_to_fixed(scale));
+
+    pixman_image_set_transform(image, &transform);
+    pixman_image_set_filter(image, PIXMAN_FILTER_BILINEAR, NULL, 0);
+    pixman_image_set_repeat(image, PIXMAN_REPEAT_PAD);
+
+    pixman_image_composite(PIXMAN_OP_SRC, image, NULL, layer->tiles_pimage,
+      src_x, src_y, 0, 0, dst_x, dst_y, size, size);
+
+    pixman_image_unref(image);
+  }
+
+  gp_tiler_release_tile(layer->tiler, src_tile, data);
+
+  return image != NULL;
+}
+
+
+
+gboolean layer_draw_placeholder(Layer *layer, GpTile *tile, guint col, guint row, guint8 *quality)
+{
+  const guint k = 1 << L_STEP; //< Во сколько раз отличаются стороны плиток соседних масштабов.
+  const gint dst_x = col * GP_TILE_SIDE;
+  const gint dst_y = row * GP_TILE_SIDE;
+  guint d;
+
+  // Соседние масштабы есть только при автоматическом расчете размера плиток, см. compute_tiles_params().
+  if(layer->fixed_l[layer->cur_type] != 0 || *quality > PLACEHOLDER_DEPTH)
+    return FALSE;
+
+  // Плитки-"дети": используем, только если в кэше есть все k * k плиток.
+  if(layer->tp.ll >= L_STEP)
+  {
+    GpTile child = { .l = LL_TO_CM(layer->tp.ll - L_STEP), .type = tile->type };
+    GpTileStatus rstatus;
+    gint data_len;
+    gboolean complete = TRUE;
+    guint i, j;
+
+    for(i = 0; i < k && complete; i++)
+      for(j = 0; j < k && complete; j++)
+      {
+        child.x = tile->x * (gint)k + i;
+        child.y = tile->y * (gint)k + j;
+
+        guint8 *data = gp_tiler_acquire_cached_tile(layer->tiler, &child, GP_TILE_STATUS_INIT, &rstatus, &data_len);
+        if(data)
+          gp_tiler_release_tile(layer->tiler, &child, data);
+        else
+          complete = FALSE;
+      }
+
+    if(complete)
+    {
+      // Строки мозаики идут сверху вниз, а ось Y -- снизу вверх.
+      for(i = 0; i < k; i++)
+        for(j = 0; j < k; j++)
+        {
+          child.x = tile->x * (gint)k + i;
+          child.y = tile->y * (gint)k + j;
+
+          layer_draw_cached(layer, &child,
+            dst_x + i * GP_TILE_SIDE / k, dst_y + (k - 1 - j) * GP_TILE_SIDE / k, GP_TILE_SIDE / k,
+            0, 0, k);
+        }
+
+      *quality = PLACEHOLDER_DEPTH + 1;
+      return TRUE;
+    }
+  }
+
+  // Плитки-"предки": чем ближе масштаб, тем лучше.
+  for(d = 1; d <= PLACEHOLDER_DEPTH && PLACEHOLDER_DEPTH + 1 - d > *quality; d++)
+  {
+    guint f = 1 << (d * L_STEP); //< Во сколько раз сторона "предка" больше стороны плитки.
+
+    if(layer->tp.ll + d * L_STEP > layer->l_max)
+      break;
+
+    GpTile ancestor = {
+      .x = tiles_div(tile->x, f),
+      .y = tiles_div(tile->y, f),
+      .l = LL_TO_CM(layer->tp.ll + d * L_STEP),
+      .type = tile->type };
+
+    // Фрагмент "предка", соответствующий плитке, в масштабе плитки.
+    gint src_x = tiles_mod(tile->x, f) * GP_TILE_SIDE;
+    gint src_y = (f - 1 - tiles_mod(tile->y, f)) * GP_TILE_SIDE;
+
+    if(layer_draw_cached(layer, &ancestor, dst_x, dst_y, GP_TILE_SIDE, src_x, src_y, 1. / f))
+    {
+      *quality = PLACEHOLDER_DEPTH + 1 - d;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+
+
 void layer_set_status_not_actual(Layer *layer)
 {
   guint i;
@@ -318,7 +673,10 @@ void layer_set_status_not_init(Layer *layer)
   for(i = 0; i < layer->tp.num; i++)
     layer->tile_statuses[i] = GP_TILE_STATUS_NOT_INIT;
 
+  memset(layer->placeholder_qualities, 0, layer->tp.num);
+
   memset(layer->tiles_buf, 0, 4 * layer->tp.num * GP_TILE_SIDE * GP_TILE_SIDE);
+  layer->placed_dirty = TRUE;
 }
 
 
@@ -351,14 +709,16 @@ void layer_destroy(Layer *layer)
   g_object_unref(layer->tiler);
 
   g_free(layer->tile_statuses);
+  g_free(layer->placeholder_qualities);
 
   if(layer->tiles_pimage) pixman_image_unref(layer->tiles_pimage);
   g_free(layer->tiles_buf);
 
-  g_free(layer->fixed_l);
+  if(layer->placed_pimage) pixman_image_unref(layer->placed_pimage);
+  g_free(layer->placed_buf);
+  pixman_region32_fini(&layer->damage);
 
-  if(layer->one_tile_pimage) pixman_image_unref(layer->one_tile_pimage);
-  g_free(layer->one_tile_buf);
+  g_free(layer->fixed_l);
 
   if(layer->blank_tile) pixman_image_unref(layer->blank_tile);
   g_free(layer->blank_tile_buf);
@@ -415,21 +775,6 @@ Layer *layer_new( GpTiler *tiler, gint tiles_type)
     generate_blank_tile(blank_tile);
   // blank_tile <--
 
-  // one_tile -->
-    uint32_t *one_tile_buf = g_malloc(GP_TILE_DATA_SIZE);
-    pixman_image_t *one_tile_pimage = pixman_image_create_bits(PIXMAN_a8r8g8b8,
-      GP_TILE_SIDE, GP_TILE_SIDE, one_tile_buf, 4 * GP_TILE_SIDE);
-
-    if(!one_tile_pimage)
-    {
-      g_warning("Failed to create pixman image for one tile of new layer.");
-      pixman_image_unref(blank_tile);
-      g_free(blank_tile_buf);
-      g_free(one_tile_buf);
-      return NULL;
-    }
-  // one_tile <--
-
   guint l_max;
   if(GP_TILE_SIDE != 1)
     l_max = 8 * sizeof(guint) + log2(GP_TILE_SIDE) - 1;
@@ -453,14 +798,20 @@ Layer *layer_new( GpTiler *tiler, gint tiles_type)
     layer->delta_y = 0;
 
     layer->tile_statuses = NULL;
+    layer->placeholder_qualities = NULL;
     layer->tiles_buf = NULL;
     layer->tiles_pimage = NULL;
 
+    layer->placed_buf = NULL;
+    layer->placed_pimage = NULL;
+    layer->placed_dirty = TRUE;
+    pixman_region32_init(&layer->damage);
+
     layer->l_max = l_max;
     layer->fixed_l = g_new0(guint, gp_tiler_get_tile_types_num(tiler));
 
-    layer->one_tile_buf = one_tile_buf;
-    layer->one_tile_pimage = one_tile_pimage;
+    layer->prefetch_ring = PREFETCH_RING_DEFAULT;
+    layer->prefetch_budget = PREFETCH_BUDGET_DEFAULT;
 
     layer->blank_tile_buf = blank_tile_buf;
     layer->blank_tile = blank_tile;
@@ -480,34 +831,66 @@ gboolean layer_force_update(Layer *layer, const GpIcaState *state)
   TilesParams new_tp;
   compute_tiles_params(state, &new_tp, layer->fixed_l[layer->cur_type], layer->l_max, layer->delta_x, layer->delta_y);
 
+  // Изменились масштаб или координаты видимой области.
+  layer->placed_dirty = TRUE;
+
+  gboolean resized = (layer->tp.xnum != new_tp.xnum || layer->tp.ynum != new_tp.ynum);
+
   // Пересоздадим layer->tiles_pimage если у нас изменилось кол-во плиток.
-  if(layer->tp.xnum != new_tp.xnum || layer->tp.ynum != new_tp.ynum)
+  if(resized)
   {
     gint width = new_tp.xnum * GP_TILE_SIDE;
     gint height = new_tp.ynum * GP_TILE_SIDE;
 
     layer->tile_statuses = g_realloc(layer->tile_statuses, sizeof( GpTileStatus ) * new_tp.num);
+    layer->placeholder_qualities = g_realloc(layer->placeholder_qualities, new_tp.num);
+
+    if(layer->tiles_pimage)
+      pixman_image_unref(layer->tiles_pimage);
 
     layer->tiles_buf = g_realloc(layer->tiles_buf, 4 * width * height);
     layer->tiles_pimage = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, layer->tiles_buf, 4 * width);
 
     g_return_val_if_fail(layer->tiles_pimage, FALSE);
 
-    pixman_image_set_repeat(layer->tiles_pimage, PIXMAN_REPEAT_NONE);
+    // Мозаика тороидальная, поэтому изображение повторяется, см. layer_place_on_icarenderer_data_pimage().
+    pixman_image_set_repeat(layer->tiles_pimage, PIXMAN_REPEAT_NORMAL);
     pixman_image_set_filter(layer->tiles_pimage, PIXMAN_FILTER_GOOD, NULL, 0);
   }
 
   if(!TILES_PARAMS_EQUAL(layer->tp, new_tp))
   {
-    layer->tp = new_tp;
-
-    layer_set_status_not_init(layer);
+    // Плитки ближе к центру видимой области GpTiler сгенерирует раньше.
+    GpTile focus = {
+      .x = (new_tp.from_xl + new_tp.to_xl) / 2,
+      .y = (new_tp.from_yl + new_tp.to_yl) / 2,
+      .l = new_tp.l,
+      .type = layer->cur_type };
+
+    gp_tiler_set_focus(layer->tiler, &focus);
+
+    // При сдвиге видимой области без изменения масштаба перерисовываем только открывшиеся плитки.
+    if(!resized && layer->tp.ll == new_tp.ll && layer->tp.l == new_tp.l)
+      layer_scroll(layer, &new_tp);
+    else
+    {
+      layer->tp = new_tp;
+      layer_set_status_not_init(layer);
+    }
 
-    if(gp_tiler_get_tasks_num(layer->tiler) > 2 * (gint)new_tp.num || !gp_tiler_get_cache(layer->tiler))
+    if(!gp_tiler_get_cache(layer->tiler))
     {
       g_debug("☺ Dropping tasks: tasks num = %d, new_tp.num = %d", gp_tiler_get_tasks_num(layer->tiler), new_tp.num);
       gp_tiler_drop_tasks(layer->tiler);
     }
+    else
+    {
+      // Плитки, ушедшие из видимой области, генерировать больше не нужно.
+      GpTile from = { .x = new_tp.from_xl, .y = new_tp.from_yl, .l = new_tp.l, .type = layer->cur_type };
+      GpTile to = { .x = new_tp.to_xl, .y = new_tp.to_yl, .l = new_tp.l, .type = layer->cur_type };
+
+      gp_tiler_drop_tasks_outside(layer->tiler, &from, &to);
+    }
   }
 
   return TRUE;
@@ -561,6 +944,15 @@ uint32_t layer_get_pixel(Layer *layer, gdouble x, gdouble y)
   gint x_pix = (x - from_x) * width / x_len;
   gint y_pix = height - (y - from_y) * height / y_len;
 
+  // Переходим к координатам в тороидальной мозаике.
+  {
+    guint col, row;
+    tiles_slot(&layer->tp, layer->tp.from_xl, layer->tp.to_yl, &col, &row);
+
+    x_pix = tiles_mod(x_pix + col * GP_TILE_SIDE, width);
+    y_pix = tiles_mod(y_pix + row * GP_TILE_SIDE, height);
+  }
+
   g_assert_cmpint(width * y_pix + x_pix, <, layer->tp.num * GP_TILE_SIDE * GP_TILE_SIDE);
 
   return layer->tiles_buf[width * y_pix + x_pix];
@@ -581,12 +973,17 @@ void layer_place_on_icarenderer_data_pimage(Layer *layer, const GpIcaState *stat
 
   gdouble m_in_pix_on_tiles_pimage = (gdouble)l_in_meters / GP_TILE_SIDE;
 
+  // Ячейка мозаики, в которой лежит левая верхняя плитка.
+  guint col, row;
+  tiles_slot(&layer->tp, layer->tp.from_xl, layer->tp.to_yl, &col, &row);
+
   struct pixman_f_transform ftransform;
   pixman_f_transform_init_identity (&ftransform);
 
+  // Сдвиг на начало тороидальной мозаики, остальное "заворачивается" за счет PIXMAN_REPEAT_NORMAL.
   pixman_f_transform_translate( NULL,&ftransform,
-      ((gdouble)layer->tp.from_xl * l_in_meters - state->from_x - layer->delta_x) / m_in_pix_on_tiles_pimage,
-      (-(gdouble)(layer->tp.to_yl + 1) * l_in_meters + state->to_y + layer->delta_y) / m_in_pix_on_tiles_pimage);
+      ((gdouble)layer->tp.from_xl * l_in_meters - state->from_x - layer->delta_x) / m_in_pix_on_tiles_pimage - (gdouble)(col * GP_TILE_SIDE),
+      (-(gdouble)(layer->tp.to_yl + 1) * l_in_meters + state->to_y + layer->delta_y) / m_in_pix_on_tiles_pimage - (gdouble)(row * GP_TILE_SIDE));
 
   pixman_f_transform_scale(NULL, &ftransform,
     m_in_pix_on_tiles_pimage / state->cur_scale_x,
@@ -620,59 +1017,167 @@ gboolean layer_render_tiles_pimage(Layer *layer)
     GpTile tile = { .l = l, .type = layer->cur_type };
 
     GpTileStatus rval;
-    guint i = 0; //< Номер плитки в массиве tile_statuses.
 
     for(tile.x = layer->tp.from_xl; tile.x <= layer->tp.to_xl; tile.x++)
       for(tile.y = layer->tp.from_yl; tile.y <= layer->tp.to_yl; tile.y++)
       {
+        guint col, row;
+        guint i = tiles_slot(&layer->tp, tile.x, tile.y, &col, &row); //< Номер плитки в массиве tile_statuses.
+
         if(layer->tile_statuses[i] != GP_TILE_STATUS_ACTUAL)
         {
-          rval = gp_tiler_get_tile(layer->tiler, (guint8 *) layer->one_tile_buf, &tile, layer->tile_statuses[i]);
+          // Данные плитки берем прямо из памяти кэша, без копирования.
+          gint data_len;
+          guint8 *data = gp_tiler_acquire_tile(layer->tiler, &tile, layer->tile_statuses[i], &rval, &data_len);
 
           if(rval > 0)
             total_finished += rval;
 
-          pixman_image_t *image_to_draw;
+          pixman_image_t *image_to_draw = NULL;
 
-          // Если плитка не инициализирована на tiles_pimage и у нас нет данных,
-          // чтобы нарисовать их, инициализируем плитку заглушкой.
-          // Иначе -- рисуем ранее полученную плитку.
-          if(layer->tile_statuses[i] == GP_TILE_STATUS_NOT_INIT && rval == GP_TILE_STATUS_NOT_INIT)
+          // Если у нас нет данных плитки, показываем на ее месте заглушку (статус GP_TILE_STATUS_INIT):
+          // плитки соседних масштабов из кэша, а если их нет -- blank-плитку.
+          // Заглушку заменим на лучшую, как только такая появится в кэше.
+          // Иначе -- рисуем полученную плитку.
+          if(layer->tile_statuses[i] <= GP_TILE_STATUS_INIT && rval == GP_TILE_STATUS_NOT_INIT)
           {
-            image_to_draw = layer->blank_tile;
-            rval = GP_TILE_STATUS_INIT; //< Как бы сымитируем, что у нас есть что нарисовать.
+            if(layer_draw_placeholder(layer, &tile, col, row, &layer->placeholder_qualities[i]))
+            {
+              got_something_new_to_draw = TRUE;
+              layer->tile_statuses[i] = GP_TILE_STATUS_INIT;
+              pixman_region32_union_rect(&layer->damage, &layer->damage, tile.x, tile.y, 1, 1);
+            }
+            else if(layer->tile_statuses[i] == GP_TILE_STATUS_NOT_INIT)
+            {
+              image_to_draw = pixman_image_ref(layer->blank_tile);
+              rval = GP_TILE_STATUS_INIT; //< Как бы сымитируем, что у нас есть что нарисовать.
+            }
           }
-          else
-            image_to_draw = layer->one_tile_pimage;
+          else if(data)
+            image_to_draw = pixman_image_create_bits(PIXMAN_a8r8g8b8, GP_TILE_SIDE, GP_TILE_SIDE,
+              (uint32_t *) gp_mem_tile_get_buf_from_malloc_data(data, data_len), 4 * GP_TILE_SIDE);
 
           // Рисуем, если данные изменились и есть хоть что-нибудь, что можно нарисовать.
-          if(rval != layer->tile_statuses[i] && rval != GP_TILE_STATUS_NOT_INIT)
+          if(rval != layer->tile_statuses[i] && rval != GP_TILE_STATUS_NOT_INIT && image_to_draw)
           {
             got_something_new_to_draw = TRUE;
             pixman_image_composite(PIXMAN_OP_SRC, image_to_draw, NULL, layer->tiles_pimage,
               0, 0, 0, 0,
-              (tile.x - layer->tp.from_xl) * GP_TILE_SIDE,
-              (layer->tp.to_yl - tile.y) * GP_TILE_SIDE,
+              col * GP_TILE_SIDE,
+              row * GP_TILE_SIDE,
               GP_TILE_SIDE, GP_TILE_SIDE);
 
             layer->tile_statuses[i] = rval;
+            pixman_region32_union_rect(&layer->damage, &layer->damage, tile.x, tile.y, 1, 1);
           }
+
+          if(image_to_draw)
+            pixman_image_unref(image_to_draw);
+
+          if(data)
+            gp_tiler_release_tile(layer->tiler, &tile, data);
         }
         else
           total_finished += 1000;
-
-        i++;
       }
   } // Генерация плиток <--
 
   layer->prev_finished = layer->finished;
   layer->finished = total_finished / layer->tp.num;
 
+  // Видимая область полностью сформирована -- можно заняться плитками, которые понадобятся позже.
+  if(layer->finished == 1000 && layer->prev_finished != 1000)
+    layer_prefetch(layer);
+
   return got_something_new_to_draw;
 }
 
 
 
+void layer_damage_to_visible(Layer *layer, const GpIcaState *state, pixman_region32_t *region)
+{
+  gdouble l_in_meters;
+
+  if(layer->fixed_l[layer->cur_type] == 0)
+    l_in_meters = LL_TO_M(layer->tp.ll);
+  else
+    l_in_meters = (double)layer->fixed_l[layer->cur_type] / 100;
+
+  gint n_boxes, i;
+  pixman_box32_t *boxes = pixman_region32_rectangles(&layer->damage, &n_boxes);
+
+  for(i = 0; i < n_boxes; i++)
+  {
+    // Ось Y видимой области направлена вниз, поэтому верхний край -- по y2.
+    gint x1 = floor(((gdouble)boxes[i].x1 * l_in_meters - layer->delta_x - state->from_x) / state->cur_scale_x);
+    gint x2 = ceil(((gdouble)boxes[i].x2 * l_in_meters - layer->delta_x - state->from_x) / state->cur_scale_x);
+    gint y1 = floor((state->to_y - ((gdouble)boxes[i].y2 * l_in_meters - layer->delta_y)) / state->cur_scale_y);
+    gint y2 = ceil((state->to_y - ((gdouble)boxes[i].y1 * l_in_meters - layer->delta_y)) / state->cur_scale_y);
+
+    pixman_region32_union_rect(region, region,
+      x1 - PLACED_DAMAGE_MARGIN, y1 - PLACED_DAMAGE_MARGIN,
+      x2 - x1 + 2 * PLACED_DAMAGE_MARGIN, y2 - y1 + 2 * PLACED_DAMAGE_MARGIN);
+  }
+
+  pixman_region32_intersect_rect(region, region, 0, 0, state->visible_width, state->visible_height);
+}
+
+
+
+pixman_image_t *layer_get_placed_pimage(Layer *layer, const GpIcaState *state, pixman_region32_t *changed)
+{
+  if(!layer->tiles_pimage)
+    return NULL;
+
+  if(!layer->placed_pimage ||
+     pixman_image_get_width(layer->placed_pimage) != (gint)state->visible_width ||
+     pixman_image_get_height(layer->placed_pimage) != (gint)state->visible_height)
+  {
+    if(layer->placed_pimage)
+      pixman_image_unref(layer->placed_pimage);
+
+    layer->placed_buf = g_realloc(layer->placed_buf, 4 * state->visible_width * state->visible_height);
+    layer->placed_pimage = pixman_image_create_bits(PIXMAN_a8r8g8b8, state->visible_width, state->visible_height,
+      layer->placed_buf, 4 * state->visible_width);
+
+    g_return_val_if_fail(layer->placed_pimage, NULL);
+
+    layer->placed_dirty = TRUE;
+  }
+
+  if(layer->placed_dirty)
+  {
+    layer_place_on_icarenderer_data_pimage(layer, state, layer->placed_pimage, PIXMAN_OP_SRC);
+    layer->placed_dirty = FALSE;
+
+    if(changed)
+      pixman_region32_union_rect(changed, changed, 0, 0, state->visible_width, state->visible_height);
+  }
+  else if(pixman_region32_not_empty(&layer->damage))
+  {
+    // Перерисовываем только пиксели, на которые попали изменившиеся плитки.
+    pixman_region32_t region;
+    pixman_region32_init(&region);
+    layer_damage_to_visible(layer, state, &region);
+
+    pixman_image_set_clip_region32(layer->placed_pimage, &region);
+      layer_place_on_icarenderer_data_pimage(layer, state, layer->placed_pimage, PIXMAN_OP_SRC);
+    pixman_image_set_clip_region32(layer->placed_pimage, NULL);
+
+    if(changed)
+      pixman_region32_union(changed, changed, &region);
+
+    pixman_region32_fini(&region);
+  }
+
+  pixman_region32_fini(&layer->damage);
+  pixman_region32_init(&layer->damage);
+
+  return layer->placed_pimage;
+}
+
+
+
 GpTiler *layer_get_tiler(Layer *layer)
 {
   return layer->tiler;
@@ -711,6 +1216,22 @@ void layer_set_fixed_l(Layer *layer, gint type, guint l)
 
 
 
+void layer_get_prefetch(Layer *layer, guint *ring, guint *budget)
+{
+  if(ring) *ring = layer->prefetch_ring;
+  if(budget) *budget = layer->prefetch_budget;
+}
+
+
+
+void layer_set_prefetch(Layer *layer, guint ring, guint budget)
+{
+  layer->prefetch_ring = ring;
+  layer->prefetch_budget = budget;
+}
+
+
+
 
 gboolean layer_get_visible(Layer *layer)
 {
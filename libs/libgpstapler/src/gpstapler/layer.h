@@ -132,6 +132,8 @@ void layer_set_finished(Layer *layer, gint finished);
 /// из чего следует, что нужно пересчитать внутренние переменные,
 /// возможно пересоздать внутренние буферы и поверхности,
 /// а также пометить плитки как незавершенные.
+/// Функция вызывает методы управления GpTiler'ом (фокус, удаление заданий),
+/// поэтому вызывается только из главного потока.
 ///
 /// \return TRUE в случае успеха, иначе -- FALSE.
 gboolean layer_force_update(Layer *layer, const GpIcaState *state);
@@ -196,6 +198,24 @@ void layer_place_on_icarenderer_data_pimage(Layer *layer, const GpIcaState *stat
 gboolean layer_render_tiles_pimage(Layer *layer);
 
 
+/// Позволяет получить изображение слоя в размере видимой области,
+/// готовое к наложению на остальные слои (оператором PIXMAN_OP_OVER).
+///
+/// Изображение хранится в слое и перерисовывается (с помощью layer_place_on_icarenderer_data_pimage())
+/// только если с прошлого вызова изменились плитки слоя или параметры отрисовки.
+/// Если изменились только отдельные плитки (см. layer_render_tiles_pimage()),
+/// перерисовываются только занимаемые ими пиксели.
+/// Функцию можно вызывать не из главного потока, если одновременно с ней
+/// не используются другие функции этого же слоя.
+///
+/// \param layer - указатель на объект Layer;
+/// \param state - состояние областей отрисовки;
+/// \param changed - область, к которой будут добавлены перерисованные пиксели изображения, либо NULL.
+///
+/// \return изображение слоя, либо NULL, если плитки слоя еще не размещены (см. layer_force_update()).
+pixman_image_t *layer_get_placed_pimage(Layer *layer, const GpIcaState *state, pixman_region32_t *changed);
+
+
 /**
  * layer_get_fixed_l:
  * @layer: указатель на объект Layer.
@@ -221,6 +241,27 @@ guint layer_get_fixed_l(Layer *layer, gint type);
 void layer_set_fixed_l(Layer *layer, gint type, guint l);
 
 
+/// Позволяет получить параметры упреждающего запроса плиток слоя.
+///
+/// \param layer - указатель на объект Layer;
+/// \param ring - указатель на переменную, куда будет помещена ширина кольца плиток вокруг видимой области, либо NULL;
+/// \param budget - указатель на переменную, куда будет помещено максимальное количество
+/// упреждающе запрашиваемых плиток, либо NULL.
+void layer_get_prefetch(Layer *layer, guint *ring, guint *budget);
+
+
+/// Задает параметры упреждающего запроса плиток слоя.
+///
+/// Когда все плитки видимой области сформированы, слой запрашивает с наименьшим приоритетом
+/// плитки в кольце шириной \a ring вокруг видимой области и плитки соседних масштабов,
+/// но не более \a budget плиток (с учетом уже стоящих в очереди заданий GpTiler'а).
+///
+/// \param layer - указатель на объект Layer;
+/// \param ring - ширина кольца плиток вокруг видимой области (0 -- без кольца);
+/// \param budget - максимальное количество упреждающе запрашиваемых плиток (0 -- упреждающие запросы отключены).
+void layer_set_prefetch(Layer *layer, guint ring, guint budget);
+
+
 /// Позволяет получить флаг видимости слоя.
 ///
 /// \param layer - указатель на объект Layer
@@ -0,0 +1,260 @@
+/*!
+ * \file mbtiles.c
+ *
+ * Объект MbtilesWriter записывает пирамиду плиток в файл MBTiles (база SQLite).
+ *
+ * Плитки сначала ищутся по SHA1 пикселей среди уже записанных: повторная плитка добавляет
+ * только строку в таблицу map. Новые плитки сжимаются в PNG в пуле потоков, запись в базу
+ * выполняется под мьютексом в одной транзакции. Индексы строятся после записи всех плиток.
+ *
+*/
+
+#include "mbtiles.h"
+#include <gp-core.h>
+
+#include <string.h>
+#include <cairo.h>
+#include <sqlite3.h>
+#include <glib/gstdio.h>
+
+#define MBTILES_JOBS_PER_THREAD  4  ///Плиток, ожидающих сжатия, на один поток сжатия
+
+
+struct _MbtilesWriter
+{
+  gchar *filename;
+
+  sqlite3 *db;
+  sqlite3_stmt *insert_map;     ///Добавление строки в таблицу map
+  sqlite3_stmt *insert_image;   ///Добавление изображения в таблицу images
+  GHashTable *images;           ///Идентификаторы уже добавленных изображений
+  gboolean failed;              ///Ошибка записи в базу
+
+  GMutex mutex;                 ///Доступ к базе, images, failed и jobs
+  GCond cond;
+
+  GThreadPool *pool;            ///Пул потоков для сжатия плиток в PNG
+  guint jobs;                   ///Плиток, ожидающих сжатия
+  guint jobs_max;
+};
+
+
+//Плитка, переданная на сжатие.
+typedef struct
+{
+  gchar *tile_id;
+  guint8 *data;
+}
+MbtilesJob;
+
+
+static void mbtiles_writer_encode( MbtilesJob *job, MbtilesWriter *writer);
+
+
+
+//Выполнить sql-запрос без результата.
+static gboolean mbtiles_exec( sqlite3 *db, const gchar *sql)
+{
+  gchar *err = NULL;
+
+  if (sqlite3_exec( db, sql, NULL, NULL, &err) == SQLITE_OK)
+    return TRUE;
+
+  g_critical("%s: %s", G_STRFUNC, err);
+  sqlite3_free( err);
+
+  return FALSE;
+}
+
+
+MbtilesWriter *mbtiles_writer_open( const gchar *filename)
+{
+  MbtilesWriter *writer = g_new0( MbtilesWriter, 1);
+
+  g_remove( filename);
+
+  writer->filename = g_strdup( filename);
+
+  //Файл формируется целиком за одну транзакцию и при ошибке удаляется, журнал не нужен
+  if (sqlite3_open( filename, &writer->db) != SQLITE_OK ||
+      !mbtiles_exec( writer->db,
+        "PRAGMA journal_mode = OFF;"
+        "PRAGMA synchronous = OFF;"
+        "CREATE TABLE metadata (name TEXT, value TEXT);"
+        "CREATE TABLE map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id TEXT);"
+        "CREATE TABLE images (tile_data BLOB, tile_id TEXT);"
+        "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column,"
+        "  map.tile_row AS tile_row, images.tile_data AS tile_data"
+        "  FROM map JOIN images ON images.tile_id = map.tile_id;"
+        "BEGIN;") ||
+      sqlite3_prepare_v2( writer->db, "INSERT INTO map VALUES (?, ?, ?, ?);", -1, &writer->insert_map, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2( writer->db, "INSERT INTO images VALUES (?, ?);", -1, &writer->insert_image, NULL) != SQLITE_OK)
+  {
+    g_critical("%s: Error creating %s: %s", G_STRFUNC, filename, sqlite3_errmsg( writer->db));
+
+    sqlite3_finalize( writer->insert_map);
+    sqlite3_close( writer->db);
+    g_remove( filename);
+    g_free( writer->filename);
+    g_free( writer);
+
+    return NULL;
+  }
+
+  writer->images = g_hash_table_new_full( g_str_hash, g_str_equal, g_free, NULL);
+
+  g_mutex_init( &writer->mutex);
+  g_cond_init( &writer->cond);
+
+  writer->jobs_max = MBTILES_JOBS_PER_THREAD * g_get_num_processors();
+  writer->pool = g_thread_pool_new( (GFunc)mbtiles_writer_encode, writer, g_get_num_processors(), FALSE, NULL);
+
+  return writer;
+}
+
+
+void mbtiles_writer_set_metadata( MbtilesWriter *writer, const gchar *name, const gchar *value)
+{
+  gchar *sql = sqlite3_mprintf("INSERT INTO metadata VALUES (%Q, %Q);", name, value);
+
+  g_mutex_lock( &writer->mutex);
+    if (!mbtiles_exec( writer->db, sql))
+      writer->failed = TRUE;
+  g_mutex_unlock( &writer->mutex);
+
+  sqlite3_free( sql);
+}
+
+
+void mbtiles_writer_add_tile( MbtilesWriter *writer, guint zoom, gint column, gint row, const guint8 *data)
+{
+  const guint32 *pixels = (const guint32 *)data;
+  gint i;
+
+  //Пустые плитки не записываются: отсутствующая плитка читается как прозрачная
+  for( i=0; i < GP_TILE_SIDE * GP_TILE_SIDE && pixels[i] == 0; i++);
+
+  if (i == GP_TILE_SIDE * GP_TILE_SIDE) return;
+
+  gchar *tile_id = g_compute_checksum_for_data( G_CHECKSUM_SHA1, data, GP_TILE_DATA_SIZE);
+  gboolean known;
+
+  g_mutex_lock( &writer->mutex);
+
+    sqlite3_bind_int( writer->insert_map, 1, zoom);
+    sqlite3_bind_int( writer->insert_map, 2, column);
+    sqlite3_bind_int( writer->insert_map, 3, row);
+    sqlite3_bind_text( writer->insert_map, 4, tile_id, -1, SQLITE_TRANSIENT);
+
+    if (sqlite3_step( writer->insert_map) != SQLITE_DONE)
+      writer->failed = TRUE;
+
+    sqlite3_reset( writer->insert_map);
+
+    known = g_hash_table_contains( writer->images, tile_id);
+
+    if (!known)
+    {
+      g_hash_table_add( writer->images, g_strdup( tile_id));
+
+      //Сжатие не успевает за поступлением плиток -- ждем
+      while (writer->jobs >= writer->jobs_max)
+        g_cond_wait( &writer->cond, &writer->mutex);
+
+      writer->jobs++;
+    }
+
+  g_mutex_unlock( &writer->mutex);
+
+  if (known)
+  {
+    g_free( tile_id);
+    return;
+  }
+
+  MbtilesJob *job = g_slice_new( MbtilesJob);
+
+  job->tile_id = tile_id;
+  job->data = g_memdup( data, GP_TILE_DATA_SIZE);
+
+  g_thread_pool_push( writer->pool, job, NULL);
+}
+
+
+static cairo_status_t mbtiles_png_write( GByteArray *png, const guchar *data, guint length)
+{
+  g_byte_array_append( png, data, length);
+
+  return CAIRO_STATUS_SUCCESS;
+}
+
+
+//Сжать плитку в PNG в потоке пула и записать ее в таблицу images.
+static void mbtiles_writer_encode( MbtilesJob *job, MbtilesWriter *writer)
+{
+  GByteArray *png = g_byte_array_new();
+
+  cairo_surface_t *surface = cairo_image_surface_create_for_data( job->data, CAIRO_FORMAT_ARGB32,
+    GP_TILE_SIDE, GP_TILE_SIDE, GP_TILE_SIDE * sizeof(guint32));
+
+  cairo_status_t status = cairo_surface_write_to_png_stream( surface, (cairo_write_func_t)mbtiles_png_write, png);
+
+  cairo_surface_destroy( surface);
+
+  g_mutex_lock( &writer->mutex);
+
+    if (status == CAIRO_STATUS_SUCCESS)
+    {
+      sqlite3_bind_blob( writer->insert_image, 1, png->data, png->len, SQLITE_STATIC);
+      sqlite3_bind_text( writer->insert_image, 2, job->tile_id, -1, SQLITE_STATIC);
+
+      if (sqlite3_step( writer->insert_image) != SQLITE_DONE)
+        writer->failed = TRUE;
+
+      sqlite3_reset( writer->insert_image);
+      sqlite3_clear_bindings( writer->insert_image);
+    }
+    else
+    {
+      writer->failed = TRUE;
+    }
+
+    writer->jobs--;
+    g_cond_signal( &writer->cond);
+
+  g_mutex_unlock( &writer->mutex);
+
+  g_byte_array_unref( png);
+  g_free( job->data);
+  g_free( job->tile_id);
+  g_slice_free( MbtilesJob, job);
+}
+
+
+gboolean mbtiles_writer_close( MbtilesWriter *writer, gboolean commit)
+{
+  g_thread_pool_free( writer->pool, FALSE, TRUE);
+
+  if (commit && writer->failed)
+    g_critical("%s: Error writing to %s: %s", G_STRFUNC, writer->filename, sqlite3_errmsg( writer->db));
+
+  commit = commit && !writer->failed &&
+    mbtiles_exec( writer->db,
+      "CREATE UNIQUE INDEX map_index ON map (zoom_level, tile_column, tile_row);"
+      "CREATE UNIQUE INDEX images_id ON images (tile_id);"
+      "COMMIT;");
+
+  sqlite3_finalize( writer->insert_map);
+  sqlite3_finalize( writer->insert_image);
+  sqlite3_close( writer->db);
+
+  if (!commit) g_remove( writer->filename);
+
+  g_hash_table_destroy( writer->images);
+  g_mutex_clear( &writer->mutex);
+  g_cond_clear( &writer->cond);
+  g_free( writer->filename);
+  g_free( writer);
+
+  return commit;
+}
@@ -0,0 +1,89 @@
+/*!
+ * \file mbtiles.h
+ *
+ * Объект MbtilesWriter записывает пирамиду плиток в файл MBTiles (база SQLite).
+ * Используется только внутри реализации объекта Streamer.
+ *
+ * Схема файла -- MBTiles с дедупликацией: таблицы metadata, map (zoom_level, tile_column,
+ * tile_row, tile_id), images (tile_data, tile_id) и представление tiles. Плитки хранятся в PNG,
+ * одинаковые плитки записываются один раз (tile_id -- SHA1 пикселей плитки),
+ * полностью прозрачные плитки не записываются вовсе.
+ *
+ * Координаты плиток -- сетка Tiler, а не веб-меркатор: tile_column и tile_row -- индексы x и y
+ * плитки (y растет на север, как в TMS), zoom_level = maxzoom - k для плиток стороной side * 2^k.
+ * Сторона плиток исходного разрешения и utm-зона записываются в метаданные gp_tile_side и gp_utm_zone.
+ *
+ * Поэтому такой файл не является MBTiles в смысле спецификации: картографические программы
+ * (ожидающие веб-меркатор и схему TMS) покажут его плитки не в том месте, прочитать его правильно
+ * может только Gp.MbtilesTiler. Чтобы это было видно по самому файлу, в метаданные записывается
+ * нестандартное значение scheme = MBTILES_GP_SCHEME.
+ *
+*/
+
+#ifndef _mbtiles_h
+#define _mbtiles_h
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+
+
+/// Значение метаданных scheme: координаты плиток -- сетка Tiler, а не веб-меркатор.
+#define MBTILES_GP_SCHEME "gp-tiler"
+
+
+/// Объект записи файла MBTiles.
+typedef struct _MbtilesWriter MbtilesWriter;
+
+
+
+/// Создание объекта.
+///
+/// Создает файл (существующий файл перезаписывается) и начинает транзакцию записи плиток.
+///
+/// \param filename - имя файла.
+///
+/// \return указатель на объект, либо NULL в случае неудачи.
+MbtilesWriter *mbtiles_writer_open( const gchar *filename);
+
+
+
+/// Записать значение метаданных.
+///
+/// \param writer - указатель на объект;
+/// \param name - имя значения;
+/// \param value - значение.
+void mbtiles_writer_set_metadata( MbtilesWriter *writer, const gchar *name, const gchar *value);
+
+
+
+/// Добавить плитку.
+///
+/// Пиксели копируются, сжатие в PNG и запись выполняются в пуле потоков объекта.
+/// Если сжатие не успевает, функция ждет, пока не освободится место в очереди.
+///
+/// \param writer - указатель на объект;
+/// \param zoom - уровень zoom_level;
+/// \param column - столбец плитки;
+/// \param row - строка плитки;
+/// \param data - пиксели плитки в формате CAIRO_FORMAT_ARGB32, GP_TILE_DATA_SIZE байт.
+void mbtiles_writer_add_tile( MbtilesWriter *writer, guint zoom, gint column, gint row, const guint8 *data);
+
+
+
+/// Завершить запись и уничтожить объект.
+///
+/// Дожидается записи всех плиток, строит индексы и завершает транзакцию.
+///
+/// \param writer - указатель на объект;
+/// \param commit - сохранить файл; FALSE -- отменить запись и удалить файл.
+///
+/// \return TRUE, если файл успешно записан.
+gboolean mbtiles_writer_close( MbtilesWriter *writer, gboolean commit);
+
+
+
+G_END_DECLS
+
+#endif // _mbtiles_h
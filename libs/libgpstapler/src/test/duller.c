@@ -9,6 +9,7 @@ struct _DullerPriv
 {
   gint cur_type; /*!< Тип плиток для данного слоя.*/
   guint id; /*!< Идентификатор (номер) GpAsyncTiler'а.*/
+  gulong delay; /*!< Задержка формирования плитки, мкс.*/
 };
 
 
@@ -86,6 +87,7 @@ Duller *duller_new(GpSmartCache *cache, GpDispatcher *dispatcher)
 
   priv->cur_type = 0;
   priv->id = STATIC_TEST_ID;
+  priv->delay = G_USEC_PER_SEC;
 
   STATIC_TEST_ID++;
 
@@ -94,6 +96,13 @@ Duller *duller_new(GpSmartCache *cache, GpDispatcher *dispatcher)
 
 
 
+void duller_set_delay(Duller *self, gulong delay)
+{
+  DULLER(self)->priv->delay = delay;
+}
+
+
+
 GObject *immut_generate_imp(GpAsyncTiler *tiler, GObject *old_immut)
 {
   DullerPriv *priv = DULLER(tiler)->priv;
@@ -125,14 +134,16 @@ void tile_generate_imp(GpAsyncTiler* tiler, GObject* immut, GpTile* tile, guint8
   guint i, j;
 
   //~ usleep(1000000);
-  usleep(1000000);
+  if(priv->delay)
+    usleep(priv->delay);
 
   static guint STATIC_TEST_ID = 0;
 
   // В Duller только один тип плиток, перепроверем это дело.
   g_assert(tile->type == 0);
 
-  g_print("GENERATE: id = %d, tiler = %p\n", priv->id, tiler);
+  if(priv->delay)
+    g_print("GENERATE: id = %d, tiler = %p\n", priv->id, tiler);
 
   switch(priv->id)
   {
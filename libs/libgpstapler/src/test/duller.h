@@ -70,6 +70,14 @@ Duller *duller_new(GpSmartCache *cache, GpDispatcher *dispatcher);
 gint duller_get_tiles_type(Duller *self);
 
 
+/// Задает задержку формирования каждой плитки (по умолчанию -- 1 секунда).
+/// При нулевой задержке плитки формируются без отладочного вывода.
+///
+/// \param self - указатель на объект Duller;
+/// \param delay - задержка, мкс.
+void duller_set_delay(Duller *self, gulong delay);
+
+
 
 G_END_DECLS
 
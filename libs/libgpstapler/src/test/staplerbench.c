@@ -0,0 +1,530 @@
+/*
+ * staplerbench.c
+ *
+ * Тест производительности GpTiler, GpAsyncTiler, GpMixTiler и GpStapler без окна. См. --help.
+ *
+ * Тестовые Tiler'ы (Weigher, Duller, Muddy, GpMixTiler) и GpStapler с ними же в качестве слоев
+ * проходят один и тот же сценарий: сдвиги видимой области вправо и вверх, затем приближение и отдаление.
+ * Сценарий проходится дважды: с пустым кэшем (cold) и сразу повторно (warm). Для каждого прохода печатается:
+ * - tiles/s -- плиток в секунду: полученных от Tiler'а или (для GpStapler) сохраненных в кэш;
+ * - задержка (p50/p90/p99): для Tiler'а -- от запроса плитки до получения актуальной плитки,
+ *   для GpStapler -- от смены видимой области до полностью сформированного изображения;
+ * - hits -- доля обращений к кэшу, при которых плитка уже была готова
+ *   (для GpStapler -- по статистике GpSmartCache);
+ * - copied -- объем скопированных данных: плиток в буфер (Tiler) или изменившейся части изображения
+ *   в буфере вывода (GpStapler, по областям, возвращаемым gp_ica_renderer_render()).
+ *
+ * Если плитки или изображение не готовы за --timeout секунд, тест завершается с ошибкой.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "duller.h"
+#include "muddy.h"
+#include "weigher.h"
+#include "gp-icastaterenderer.h"
+#include "gp-stapler.h"
+#include "gp-tiler.h"
+
+#include "gp-smartcache.h"
+
+
+#define POLL_INTERVAL 1000 ///< Интервал опроса готовности плиток и изображения, мкс.
+
+
+/// Видимая область, метры.
+typedef struct
+{
+  gdouble from_x;
+  gdouble to_x;
+  gdouble from_y;
+  gdouble to_y;
+}
+BenchView;
+
+
+/// Результаты одного прохода сценария.
+typedef struct
+{
+  GArray *latencies; ///< Задержки, секунды.
+  guint64 tiles;     ///< Плиток получено (Tiler) или сохранено в кэш (GpStapler).
+  guint64 hits;      ///< Обращений к кэшу, при которых плитка была готова.
+  guint64 lookups;   ///< Всего обращений к кэшу.
+  guint64 copied;    ///< Скопировано байт.
+  guint timeouts;    ///< Плиток или кадров, которые не дождались.
+  gdouble elapsed;   ///< Время прохода, секунды.
+}
+BenchResult;
+
+
+/// Плитка, которую формирует асинхронный Tiler.
+typedef struct
+{
+  GpTile tile;
+  gint64 start;
+}
+BenchPending;
+
+
+static gint threads_num = 0;
+static gboolean work_stealing = FALSE;
+static gint width = 800;
+static gint height = 600;
+static gint steps = 8;
+static gint zooms = 3;
+static gint duller_delay = 0;
+static gint cache_size = 256;
+static gint timeout = 10;
+
+
+
+static void bench_script_add(GArray *script, gdouble cx, gdouble cy, gdouble w, gdouble h)
+{
+  BenchView view = { cx - w / 2, cx + w / 2, cy - h / 2, cy + h / 2 };
+  g_array_append_val(script, view);
+}
+
+
+/// Сценарий: steps сдвигов на четверть экрана вправо, steps -- вверх,
+/// zooms приближений в 2 раза и zooms отдалений обратно.
+static GArray *bench_script_new(gdouble cx, gdouble cy, gdouble span)
+{
+  GArray *script = g_array_new(FALSE, FALSE, sizeof(BenchView));
+  gdouble w = span, h = span * height / width;
+  gint i;
+
+  bench_script_add(script, cx, cy, w, h);
+
+  for(i = 0; i < steps; i++)
+    bench_script_add(script, cx += w / 4, cy, w, h);
+
+  for(i = 0; i < steps; i++)
+    bench_script_add(script, cx, cy += h / 4, w, h);
+
+  for(i = 0; i < zooms; i++)
+    bench_script_add(script, cx, cy, w /= 2, h /= 2);
+
+  for(i = 0; i < zooms; i++)
+    bench_script_add(script, cx, cy, w *= 2, h *= 2);
+
+  return script;
+}
+
+
+/// Плитки, покрывающие видимую область: размер плитки подбирается по масштабу, как в GpStapler.
+static void bench_view_tiles(const BenchView *view, GpTile *from, GpTile *to)
+{
+  guint cm_per_tile = (view->to_x - view->from_x) / width * 100 * GP_TILE_SIDE;
+  guint l = 1;
+
+  while(2 * l <= cm_per_tile)
+    l *= 2;
+
+  from->l = to->l = l;
+  from->type = to->type = 0;
+  from->x = floor(view->from_x / l * 100);
+  to->x   = floor(view->to_x / l * 100);
+  from->y = floor(view->from_y / l * 100);
+  to->y   = floor(view->to_y / l * 100);
+}
+
+
+static void bench_result_init(BenchResult *res)
+{
+  memset(res, 0, sizeof(BenchResult));
+  res->latencies = g_array_new(FALSE, FALSE, sizeof(gdouble));
+}
+
+
+static void bench_result_add(BenchResult *res, gint64 start)
+{
+  gdouble latency = (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+  g_array_append_val(res->latencies, latency);
+}
+
+
+static gint bench_compare_doubles(gconstpointer a, gconstpointer b)
+{
+  gdouble da = *(const gdouble *)a, db = *(const gdouble *)b;
+  return (da > db) - (da < db);
+}
+
+
+static gdouble bench_percentile(GArray *sorted, guint percent)
+{
+  if(!sorted->len)
+    return 0;
+
+  return g_array_index(sorted, gdouble, (sorted->len - 1) * percent / 100);
+}
+
+
+static void bench_result_print(const gchar *name, const gchar *pass, BenchResult *res)
+{
+  g_array_sort(res->latencies, bench_compare_doubles);
+
+  printf("  %-24s %s: %10.0f tiles/s, latency p50 %8.2f ms, p90 %8.2f ms, p99 %8.2f ms, hits %5.1f%%, copied %8.1f MiB",
+    name, pass,
+    res->elapsed > 0 ? res->tiles / res->elapsed : 0,
+    1000 * bench_percentile(res->latencies, 50),
+    1000 * bench_percentile(res->latencies, 90),
+    1000 * bench_percentile(res->latencies, 99),
+    res->lookups ? 100. * res->hits / res->lookups : 0,
+    (gdouble)res->copied / (1024 * 1024));
+
+  if(res->timeouts)
+    printf(", TIMEOUTS %u", res->timeouts);
+
+  printf("\n");
+
+  g_array_free(res->latencies, TRUE);
+}
+
+
+/// Ждет, пока главный цикл не обработает сигнал "data-updated" (AsyncTiler формирует плитки только после него).
+static gboolean bench_wait_flag(gboolean *flag)
+{
+  gint64 deadline = g_get_monotonic_time() + (gint64)timeout * G_USEC_PER_SEC;
+
+  while(!*flag && g_get_monotonic_time() < deadline)
+    if(!g_main_context_iteration(NULL, FALSE))
+      g_usleep(POLL_INTERVAL);
+
+  return *flag;
+}
+
+
+static void on_flag(gpointer instance, gboolean *flag)
+{
+  *flag = TRUE;
+}
+
+
+/// Копирует актуальную плитку из кэша, не запрашивая ее у источника (как gp_tiler_get_tile при попадании в кэш).
+static gboolean bench_copy_cached(GpTiler *tiler, GpTile *tile, guint8 *buf)
+{
+  GpTileStatus rstatus;
+  gint data_len;
+  guint8 *data = gp_tiler_acquire_cached_tile(tiler, tile, GP_TILE_STATUS_ACTUAL - 1, &rstatus, &data_len);
+
+  if(!data)
+    return FALSE;
+
+  if(rstatus == GP_TILE_STATUS_ACTUAL)
+    memcpy(buf, gp_mem_tile_get_buf_from_malloc_data(data, data_len), GP_TILE_DATA_SIZE);
+
+  gp_tiler_release_tile(tiler, tile, data);
+
+  return rstatus == GP_TILE_STATUS_ACTUAL;
+}
+
+
+/// Проход сценария с запросом плиток видимой области прямо у Tiler'а.
+static void bench_tiler(GpTiler *tiler, GArray *script, BenchResult *res)
+{
+  guint8 *buf = g_malloc(GP_TILE_DATA_SIZE);
+  GArray *pending = g_array_new(FALSE, FALSE, sizeof(BenchPending));
+  gint64 bench_start = g_get_monotonic_time();
+  guint view_i;
+  gint i;
+
+  for(view_i = 0; view_i < script->len; view_i++)
+  {
+    GpTile from, to;
+    BenchPending p = { { 0 } };
+
+    bench_view_tiles(&g_array_index(script, BenchView, view_i), &from, &to);
+
+    p.tile = from;
+
+    for(p.tile.y = from.y; p.tile.y <= to.y; p.tile.y++)
+      for(p.tile.x = from.x; p.tile.x <= to.x; p.tile.x++)
+      {
+        p.start = g_get_monotonic_time();
+        res->lookups++;
+
+        if(bench_copy_cached(tiler, &p.tile, buf))
+          res->hits++;
+        else if(gp_tiler_get_tile(tiler, buf, &p.tile, GP_TILE_STATUS_ACTUAL - 1) != GP_TILE_STATUS_ACTUAL)
+        {
+          g_array_append_val(pending, p);
+          continue;
+        }
+
+        bench_result_add(res, p.start);
+        res->tiles++;
+        res->copied += GP_TILE_DATA_SIZE;
+      }
+
+    // Плитки асинхронного Tiler'а формируются в потоках диспетчера -- ждем их появления в кэше.
+    gint64 deadline = g_get_monotonic_time() + (gint64)timeout * G_USEC_PER_SEC;
+
+    while(pending->len && g_get_monotonic_time() < deadline)
+    {
+      g_main_context_iteration(NULL, FALSE);
+      g_usleep(POLL_INTERVAL);
+
+      for(i = pending->len - 1; i >= 0; i--)
+      {
+        BenchPending *cur = &g_array_index(pending, BenchPending, i);
+
+        if(bench_copy_cached(tiler, &cur->tile, buf))
+        {
+          bench_result_add(res, cur->start);
+          res->tiles++;
+          res->copied += GP_TILE_DATA_SIZE;
+          g_array_remove_index_fast(pending, i);
+        }
+      }
+    }
+
+    res->timeouts += pending->len;
+    g_array_set_size(pending, 0);
+  }
+
+  res->elapsed = (gdouble)(g_get_monotonic_time() - bench_start) / G_USEC_PER_SEC;
+
+  g_array_free(pending, TRUE);
+  g_free(buf);
+}
+
+
+/// Проход сценария с формированием изображения GpStapler'ом, как при просмотре в GpCifroArea.
+static void bench_stapler(GpStapler *stapler, GpSmartCache *cache, GArray *script, BenchResult *res)
+{
+  GpIcaRenderer *renderers[] = { GP_ICA_RENDERER(gp_stapler_get_state_renderer(stapler)), GP_ICA_RENDERER(stapler) };
+  GpSmartCacheStats stats;
+  guint view_i, r;
+
+  gp_smart_cache_reset_stats(cache);
+
+  gint64 bench_start = g_get_monotonic_time();
+
+  for(view_i = 0; view_i < script->len; view_i++)
+  {
+    BenchView *view = &g_array_index(script, BenchView, view_i);
+    gint64 start = g_get_monotonic_time();
+    gint64 deadline = start + (gint64)timeout * G_USEC_PER_SEC;
+
+    for(r = 0; r < G_N_ELEMENTS(renderers); r++)
+      gp_ica_renderer_set_shown(renderers[r], view->from_x, view->to_x, view->from_y, view->to_y);
+
+    for(;;)
+    {
+      gint x, y, w, h;
+
+      GpIcaRendererAvailability avail = gp_ica_renderer_render(GP_ICA_RENDERER(stapler), 0, &x, &y, &w, &h);
+
+      if(avail == GP_ICA_RENDERER_AVAIL_ALL || avail == GP_ICA_RENDERER_AVAIL_PART)
+        res->copied += (guint64)w * h * 4;
+
+      if(gp_ica_renderer_get_completion(GP_ICA_RENDERER(stapler), 0) == 1000)
+      {
+        bench_result_add(res, start);
+        break;
+      }
+
+      if(g_get_monotonic_time() > deadline)
+      {
+        res->timeouts++;
+        break;
+      }
+
+      g_main_context_iteration(NULL, FALSE);
+      g_usleep(POLL_INTERVAL);
+    }
+  }
+
+  res->elapsed = (gdouble)(g_get_monotonic_time() - bench_start) / G_USEC_PER_SEC;
+
+  gp_smart_cache_get_stats(cache, &stats);
+  res->tiles = stats.inserts;
+  res->hits = stats.hits;
+  res->lookups = stats.hits + stats.misses;
+}
+
+
+static void bench_clean(GpTiler **tilers, guint tilers_num)
+{
+  guint i;
+
+  for(i = 0; i < tilers_num; i++)
+    gp_tiler_cache_clean_by_condition(tilers[i], 0, NULL, NULL);
+}
+
+
+int main(int argc, char **argv)
+{
+  GOptionEntry entries[] =
+  {
+    { "threads-num", 'n', 0, G_OPTION_ARG_INT, &threads_num, "Number of dispatcher threads (0 -- number of processors)", NULL },
+    { "work-stealing", 'w', 0, G_OPTION_ARG_NONE, &work_stealing, "Generate tiles with work-stealing dispatcher", NULL },
+    { "width", 'W', 0, G_OPTION_ARG_INT, &width, "Visible area width, pixels", NULL },
+    { "height", 'H', 0, G_OPTION_ARG_INT, &height, "Visible area height, pixels", NULL },
+    { "steps", 's', 0, G_OPTION_ARG_INT, &steps, "Pans to the right and then up, a quarter of the screen each", NULL },
+    { "zooms", 'z', 0, G_OPTION_ARG_INT, &zooms, "Zooms in and then out, twice each", NULL },
+    { "duller-delay", 'd', 0, G_OPTION_ARG_INT, &duller_delay, "Duller tile generation delay, us", NULL },
+    { "cache-size", 'c', 0, G_OPTION_ARG_INT, &cache_size, "Cache size, MiB", NULL },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &timeout, "Max time to wait for tiles of one view, seconds", NULL },
+    { NULL }
+  };
+
+  GOptionContext *context = g_option_context_new("- GpStapler benchmark");
+  g_option_context_add_main_entries(context, entries, NULL);
+
+  if(!g_option_context_parse(context, &argc, &argv, NULL))
+  {
+    g_warning("Failed to parse options.");
+    return -1;
+  }
+
+  g_option_context_free(context);
+
+  if(threads_num <= 0)
+    threads_num = g_get_num_processors();
+
+  if(width < 64 || height < 64)
+  {
+    g_warning("Visible area should be at least 64x64 pixels.");
+    return -1;
+  }
+
+  GpSmartCache *cache = gp_smart_cache_new();
+  gp_smart_cache_set_size(cache, (gsize)cache_size * 1024 * 1024);
+
+  GpDispatcher *pool;
+  if(work_stealing)
+    pool = GP_DISPATCHER(gp_dispatcher_work_stealing_new(threads_num, NULL));
+  else
+    pool = GP_DISPATCHER(gp_dispatcher_thread_pool_new(threads_num, TRUE, NULL));
+
+  // Слои как в staplertest, но веса Weigher'ов -- данные для GpMixTiler и Muddy.
+  GpIcaStateRenderer *state_renderer = gp_ica_state_renderer_new();
+  g_object_ref_sink(state_renderer);
+
+  GpStapler *stapler = gp_stapler_new(state_renderer);
+  GtkTreeIter iter;
+
+  Duller *duller = duller_new(cache, pool);
+  duller_set_delay(duller, duller_delay);
+
+  Weigher *weighers[2] = { weigher_new(cache), weigher_new(cache) };
+  weigher_set_area(weighers[0], 55, 155, 500, 100, 0.5);
+  weigher_set_area(weighers[1], 55, 155, 100, 500, 0.5);
+
+  guint i;
+  for(i = 0; i < G_N_ELEMENTS(weighers); i++)
+  {
+    weigher_set_bottom_type(weighers[i], i);
+    weigher_set_data_type(weighers[i], 1);
+  }
+
+  gp_stapler_append_tiler(stapler, GP_TILER(duller), duller_get_tiles_type(duller), &iter);
+
+  for(i = 0; i < G_N_ELEMENTS(weighers); i++)
+  {
+    gp_stapler_append_tiler(stapler, GP_TILER(weighers[i]), weigher_get_tiles_type(weighers[i]), &iter);
+    gp_stapler_set_tiler_fixed_l(stapler, &iter, weigher_get_tiles_type(weighers[i]), 10000 /* 10 метров*/);
+  }
+
+  GpMixTiler *mixer = gp_mix_tiler_new(cache, GTK_TREE_MODEL(stapler), 1);
+  gp_mix_tiler_set_dispatcher(mixer, pool);
+  gp_stapler_prepend_tiler(stapler, GP_TILER(mixer), 0, &iter);
+
+  Muddy *muddy = muddy_new(cache);
+  muddy_set_model(muddy, GTK_TREE_MODEL(stapler), GP_TILER_TREE_MODEL_COLS_TILER, GP_TILER_TREE_MODEL_COLS_VISIBLE);
+  gp_stapler_append_tiler(stapler, GP_TILER(muddy), muddy_get_tiles_type(muddy), &iter);
+
+  GpTiler *tilers[] = { GP_TILER(duller), GP_TILER(weighers[0]), GP_TILER(weighers[1]), GP_TILER(mixer), GP_TILER(muddy) };
+
+  // Область вывода без окантовки и поворота, как у GpCifroArea размером width x height.
+  {
+    GpIcaRenderer *renderers[] = { GP_ICA_RENDERER(state_renderer), GP_ICA_RENDERER(stapler) };
+    guint r;
+
+    for(r = 0; r < G_N_ELEMENTS(renderers); r++)
+    {
+      gp_ica_renderer_set_border(renderers[r], 0, 0, 0, 0);
+      gp_ica_renderer_set_swap(renderers[r], FALSE, FALSE);
+      gp_ica_renderer_set_angle(renderers[r], 0);
+      gp_ica_renderer_set_shown_limits(renderers[r], -G_MAXDOUBLE, G_MAXDOUBLE, -G_MAXDOUBLE, G_MAXDOUBLE);
+      gp_ica_renderer_set_area_size(renderers[r], width, height);
+      gp_ica_renderer_set_visible_size(renderers[r], width, height);
+    }
+  }
+
+  guchar *surface = g_malloc0((gsize)width * height * 4);
+  gp_ica_renderer_set_surface(GP_ICA_RENDERER(stapler), 0, surface, width, height, width * 4);
+
+  // AsyncTiler формирует плитки только после обновления данных.
+  gboolean updated = FALSE;
+  g_signal_connect(duller, "data-updated", G_CALLBACK(on_flag), &updated);
+  gp_async_tiler_update_data_all(GP_ASYNC_TILER(duller));
+
+  if(!bench_wait_flag(&updated))
+  {
+    g_warning("Duller data was not updated in %d s.", timeout);
+    return -1;
+  }
+
+  // Начало -- в области Weigher'ов, видимая область 60 метров по ширине.
+  GArray *script = bench_script_new(105, 205, 60);
+  guint timeouts = 0;
+
+  printf("threads: %d%s, view: %dx%d, script: %u views, duller delay: %d us\n",
+    threads_num, work_stealing ? " (work stealing)" : "", width, height, script->len, duller_delay);
+
+  struct
+  {
+    const gchar *name;
+    GpTiler *tiler;
+  }
+  subjects[] =
+  {
+    { "Weigher (Tiler)",        GP_TILER(weighers[0]) },
+    { "Duller (AsyncTiler)",    GP_TILER(duller) },
+    { "Muddy (Tiler of Tilers)", GP_TILER(muddy) },
+    { "MixTiler",               GP_TILER(mixer) },
+    { "GpStapler",              NULL }
+  };
+
+  for(i = 0; i < G_N_ELEMENTS(subjects); i++)
+  {
+    const gchar *passes[] = { "cold", "warm" };
+    guint pass;
+
+    for(pass = 0; pass < G_N_ELEMENTS(passes); pass++)
+    {
+      BenchResult res;
+      bench_result_init(&res);
+
+      if(pass == 0)
+        bench_clean(tilers, G_N_ELEMENTS(tilers));
+
+      if(subjects[i].tiler)
+        bench_tiler(subjects[i].tiler, script, &res);
+      else
+        bench_stapler(stapler, cache, script, &res);
+
+      timeouts += res.timeouts;
+      bench_result_print(subjects[i].name, passes[pass], &res);
+    }
+  }
+
+  g_array_free(script, TRUE);
+
+  g_object_unref(stapler);
+  g_object_unref(state_renderer);
+  g_object_unref(muddy);
+  g_object_unref(mixer);
+  g_object_unref(weighers[0]);
+  g_object_unref(weighers[1]);
+  g_object_unref(duller);
+  g_object_unref(pool);
+  g_object_unref(cache);
+  g_free(surface);
+
+  return timeouts ? -1 : 0;
+}
@@ -147,6 +147,7 @@ int main( int argc, char **argv )
     gboolean one_tiler = FALSE;
     gboolean online = FALSE;
     gint threads_num = 4;
+    gboolean work_stealing = FALSE;
 
     {
       GOptionContext *context = NULL;
@@ -158,6 +159,7 @@ int main( int argc, char **argv )
         { "one_tiler", '1', 0, G_OPTION_ARG_NONE, &one_tiler, "Create only one tiler", NULL },
         { "online", 'o', 0, G_OPTION_ARG_NONE, &online, "Update tiler online", NULL },
         { "threads_num",'t', 0, G_OPTION_ARG_INT,     &threads_num,       "Threads num for generating tiles with aqua data", NULL },
+        { "work_stealing", 'w', 0, G_OPTION_ARG_NONE, &work_stealing, "Generate tiles with work-stealing dispatcher", NULL },
         { NULL }
       };
 
@@ -210,7 +212,9 @@ puts("Adding state");
   gp_cifro_area_add_layer (carea, state_renderer);
 
   GpDispatcher *pool;
-  if(threads_num)
+  if(threads_num && work_stealing)
+    pool = GP_DISPATCHER(gp_dispatcher_work_stealing_new(threads_num, NULL));
+  else if(threads_num)
     pool = GP_DISPATCHER(gp_dispatcher_thread_pool_new(threads_num, TRUE, NULL));
   else
     pool = GP_DISPATCHER(gp_dispatcher_loop_new());
@@ -240,6 +244,7 @@ puts("Adding stapler");
   else
   {
     GpMixTiler *mixer = GP_MIX_TILER(gp_mix_tiler_new(cache, GTK_TREE_MODEL(GP_STAPLER), 1));
+    gp_mix_tiler_set_dispatcher(mixer, pool);
     gp_stapler_append_tiler( GP_STAPLER, GP_TILER(mixer), 0, &iter );
 
     tiler = GP_TILER(duller_new(cache, pool));
@@ -0,0 +1,430 @@
+/*
+ * streamertest.c
+ *
+ * Проверка файлов GeoTIFF, записываемых GpStreamer: изображение из нескольких плиток экспортируется
+ * с каждым видом сжатия (GpStreamerCompression), читается обратно средствами libtiff
+ * (TIFFReadEncodedTile) и попиксельно сравнивается с плитками Tiler'а.
+ *
+ * Плитки содержат чередование шума и градиентов, чтобы сжатие LZW использовало коды всех разрядностей
+ * и несколько раз сбрасывало таблицу строк.
+ *
+ * Файл MBTiles (gp_streamer_set_mbtiles) экспортируется из мозаики плиток разных видов -- одинаковых,
+ * прозрачных, непрозрачных и полупрозрачных, читается обратно Gp.MbtilesTiler и сравнивается
+ * на всех уровнях пирамиды; таблицы map и images проверяются запросами к базе.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <tiffio.h>
+#include <sqlite3.h>
+
+#include "gp-streamer.h"
+#include "gp-tiler.h"
+
+#include "gp-smartcache.h"
+
+
+#define TEST_TILE_SIDE 1000 ///< Сторона плитки, см.
+#define TEST_UTM_ZONE 37
+
+/// Область экспорта, метры: 4 x 3 плитки с левой верхней плиткой (100, 202).
+#define TEST_FROM_X 1005.0
+#define TEST_TO_X   1035.0
+#define TEST_FROM_Y 2005.0
+#define TEST_TO_Y   2025.0
+#define TEST_X0 100
+#define TEST_Y0 202
+#define TEST_NX 4
+#define TEST_NY 3
+
+
+
+/// Функция, вычисляющая пиксель ARGB32 плитки (x, y) в строке i, столбце j.
+typedef guint32 (*PatternPixelFunc)(gint x, gint y, gint i, gint j);
+
+/// Тестовый Tiler: синхронно формирует плитки, пиксели которых вычисляются по координатам.
+typedef struct
+{
+  GpTiler parent;
+
+  PatternPixelFunc pixel;
+}
+PatternTiler;
+
+typedef struct
+{
+  GpTilerClass parent_class;
+}
+PatternTilerClass;
+
+static GType pattern_tiler_get_type(void);
+
+G_DEFINE_TYPE(PatternTiler, pattern_tiler, GP_TYPE_TILER);
+
+
+/// Пиксель ARGB32 плитки (x, y) в строке i, столбце j.
+/// Левая половина плитки -- шум, правая -- градиент, в каждой четвертой строке прозрачность меняется.
+static guint32 pattern_pixel(gint x, gint y, gint i, gint j)
+{
+  guint32 alpha = (i % 4 == 0) ? (guint32)(j & 0xFF) : 0xFF;
+
+  if(j < GP_TILE_SIDE / 2)
+  {
+    guint32 h = (guint32)x * 73856093u ^ (guint32)y * 19349663u ^ (guint32)(i * GP_TILE_SIDE + j) * 2654435761u;
+
+    h ^= h >> 15;
+    h *= 2246822519u;
+    h ^= h >> 13;
+
+    return (alpha << 24) | (h & 0xFFFFFF);
+  }
+
+  return (alpha << 24) | (((guint32)(x + i) & 0xFF) << 16) | (((guint32)(y + j) & 0xFF) << 8) | (guint32)(i / 16);
+}
+
+
+/// Пиксель мозаики для MBTiles: в отличие от pattern_pixel цвет умножен на прозрачность,
+/// как в CAIRO_FORMAT_ARGB32, иначе PNG не сохранит его. Плитки области экспорта по строкам:
+/// 0 -- одинаковые непрозрачные, 1 -- непрозрачные и полупрозрачные через одну,
+/// 2 -- две прозрачные, затем непрозрачные.
+static guint32 mosaic_pixel(gint x, gint y, gint i, gint j)
+{
+  gint c = x - TEST_X0, r = TEST_Y0 - y;
+  guint32 p = pattern_pixel(x, y, i, j);
+  guint32 alpha;
+
+  if(r == 0)
+    return 0xFF000000 | ((guint32)(i & 0xFF) << 16) | ((guint32)(j & 0xFF) << 8) | (guint32)((i ^ j) & 0xFF);
+
+  if(r == 2 && c < 2)
+    return 0;
+
+  if(r != 1 || c % 2 == 0)
+    return 0xFF000000 | (p & 0xFFFFFF);
+
+  alpha = (guint32)(i + j + x) & 0xFF;
+
+  return (alpha << 24) | ((((p >> 16) & 0xFF) * alpha / 255) << 16) |
+                         ((((p >> 8) & 0xFF) * alpha / 255) << 8) | ((p & 0xFF) * alpha / 255);
+}
+
+
+static GpMemTile *pattern_tiler_get_tile_from_source(GpTiler *tiler, GpTile *tile, GpTileStatus status)
+{
+  GpMemTile *memtile = gp_mem_tile_new_with_tile(tile, GP_TILE_STATUS_ACTUAL);
+  guint32 *buf = (guint32 *)gp_mem_tile_get_buf(memtile);
+  gint i, j;
+
+  for(i = 0; i < GP_TILE_SIDE; i++)
+    for(j = 0; j < GP_TILE_SIDE; j++)
+      buf[i * GP_TILE_SIDE + j] = ((PatternTiler *)tiler)->pixel(tile->x, tile->y, i, j);
+
+  return memtile;
+}
+
+
+static void pattern_tiler_class_init(PatternTilerClass *klass)
+{
+  GP_TILER_CLASS(klass)->get_tile_from_source = pattern_tiler_get_tile_from_source;
+}
+
+
+static void pattern_tiler_init(PatternTiler *tiler)
+{
+  tiler->pixel = pattern_pixel;
+}
+
+
+
+/// Уведомление о завершении экспорта.
+static void streamer_done(GpStreamer *streamer, gboolean success, gpointer user_data)
+{
+  GMainLoop *loop = user_data;
+
+  g_assert(success);
+  g_main_loop_quit(loop);
+}
+
+
+/// Проверяет, что плитки уровня 0 файла совпадают с плитками Tiler'а.
+static void check_file(const gchar *filename, guint16 compression)
+{
+  guint8 *buf = g_malloc(GP_TILE_DATA_SIZE);
+  guint32 width = 0, height = 0, tile_width = 0, tile_height = 0;
+  guint16 file_compression = 0;
+  gint nx = TEST_NX, ny = TEST_NY;
+  gint x0 = TEST_X0, y0 = TEST_Y0;
+  gint r, c, i, j;
+
+  TIFF *tif = TIFFOpen(filename, "r");
+  g_assert(tif != NULL);
+
+  g_assert(TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width));
+  g_assert(TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height));
+  g_assert(TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tile_width));
+  g_assert(TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_height));
+  g_assert(TIFFGetField(tif, TIFFTAG_COMPRESSION, &file_compression));
+
+  g_assert(width == (guint32)(nx * GP_TILE_SIDE) && height == (guint32)(ny * GP_TILE_SIDE));
+  g_assert(tile_width == GP_TILE_SIDE && tile_height == GP_TILE_SIDE);
+  g_assert(file_compression == compression);
+  g_assert(TIFFNumberOfTiles(tif) == (guint32)(nx * ny));
+
+  // Плитки файла идут по строкам сверху вниз, строке r соответствует плитка y0 - r
+  for(r = 0; r < ny; r++)
+    for(c = 0; c < nx; c++)
+    {
+      g_assert(TIFFReadEncodedTile(tif, r * nx + c, buf, GP_TILE_DATA_SIZE) == GP_TILE_DATA_SIZE);
+
+      for(i = 0; i < GP_TILE_SIDE; i++)
+        for(j = 0; j < GP_TILE_SIDE; j++)
+        {
+          guint32 p = pattern_pixel(x0 + c, y0 - r, i, j);
+          const guint8 *rgba = buf + 4 * (i * GP_TILE_SIDE + j);
+
+          if(rgba[0] != ((p >> 16) & 0xFF) || rgba[1] != ((p >> 8) & 0xFF) ||
+             rgba[2] != (p & 0xFF) || rgba[3] != (p >> 24))
+          {
+            g_error("%s: tile (%d, %d) pixel (%d, %d) mismatch", filename, c, r, j, i);
+          }
+        }
+    }
+
+  TIFFClose(tif);
+  g_free(buf);
+}
+
+
+/// Экспортирует изображение со сжатием compression и проверяет записанный файл.
+static void streamer_check(GpTiler *tiler, const gchar *dir, GpStreamerCompression compression, guint16 tiff_compression)
+{
+  gchar *name = g_strdup_printf("%s/streamer-%d", dir, compression);
+  gchar *filename = g_strdup_printf("%s.tif", name);
+  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+
+  GpStreamer *streamer = gp_streamer_new();
+  g_object_ref_sink(streamer);
+
+  gp_streamer_set_tiler(streamer, tiler);
+  gp_streamer_set_tile_side(streamer, TEST_TILE_SIDE);
+  gp_streamer_set_view_type(streamer, 0);
+  gp_streamer_set_utm_zone(streamer, TEST_UTM_ZONE);
+  gp_streamer_set_area(streamer, TEST_FROM_X, TEST_TO_X, TEST_FROM_Y, TEST_TO_Y);
+  gp_streamer_set_compression(streamer, compression);
+  gp_streamer_set_file_name(streamer, name, "tif");
+
+  gp_streamer_start(streamer, streamer_done, loop);
+  g_main_loop_run(loop);
+
+  check_file(filename, tiff_compression);
+  printf("compression %d: OK\n", compression);
+
+  g_object_unref(streamer);
+  g_main_loop_unref(loop);
+
+  g_remove(filename);
+  g_free(filename);
+  g_free(name);
+}
+
+
+/// Ожидаемый пиксель плитки (x, y) уровня k пирамиды мозаики. Плитка уровня k собирается из четырех
+/// плиток уровня k-1: левая верхняя -- (2x, 2y+1), пиксель -- среднее четырех пикселей с округлением.
+/// Плитки вне области экспорта прозрачны.
+static guint32 mosaic_expected_pixel(gint x, gint y, guint k, gint i, gint j)
+{
+  const gint half = GP_TILE_SIDE / 2;
+  guint32 sum[4] = { 2, 2, 2, 2 };
+  gint qx = j / half, qy = i / half;
+  gint di, dj, b;
+
+  if(k == 0)
+  {
+    if(x < TEST_X0 || x >= TEST_X0 + TEST_NX || y > TEST_Y0 || y <= TEST_Y0 - TEST_NY)
+      return 0;
+
+    return mosaic_pixel(x, y, i, j);
+  }
+
+  for(di = 0; di < 2; di++)
+    for(dj = 0; dj < 2; dj++)
+    {
+      guint32 p = mosaic_expected_pixel(2 * x + qx, 2 * y + 1 - qy, k - 1, 2 * (i % half) + di, 2 * (j % half) + dj);
+
+      for(b = 0; b < 4; b++)
+        sum[b] += (p >> (8 * b)) & 0xFF;
+    }
+
+  return ((sum[3] >> 2) << 24) | ((sum[2] >> 2) << 16) | ((sum[1] >> 2) << 8) | (sum[0] >> 2);
+}
+
+
+/// Проверяет плитку (x, y) уровня k, прочитанную MbtilesTiler'ом. PNG хранит цвет без умножения
+/// на прозрачность, поэтому у полупрозрачных пикселей допускается отличие цвета на единицу.
+static void check_mbtiles_tile(GpTiler *reader, guint8 *buf, gint x, gint y, guint k)
+{
+  GpTile tile = { x, y, TEST_TILE_SIDE << k, 0 };
+  const guint32 *pixels = (const guint32 *)buf;
+  gint i, j, b;
+
+  memset(buf, 0xAA, GP_TILE_DATA_SIZE);
+  g_assert(gp_tiler_get_tile(reader, buf, &tile, GP_TILE_STATUS_ACTUAL - 1) == GP_TILE_STATUS_ACTUAL);
+
+  for(i = 0; i < GP_TILE_SIDE; i++)
+    for(j = 0; j < GP_TILE_SIDE; j++)
+    {
+      guint32 e = mosaic_expected_pixel(x, y, k, i, j);
+      guint32 p = pixels[i * GP_TILE_SIDE + j];
+      gboolean ok = (p >> 24) == (e >> 24);
+
+      for(b = 0; b < 3 && ok; b++)
+      {
+        gint d = (gint)((p >> (8 * b)) & 0xFF) - (gint)((e >> (8 * b)) & 0xFF);
+        ok = ((e >> 24) == 0xFF) ? (d == 0) : (ABS(d) <= 1);
+      }
+
+      if(!ok)
+        g_error("mbtiles: tile (%d, %d) level %u pixel (%d, %d) is %08x, expected %08x", x, y, k, j, i, p, e);
+    }
+}
+
+
+/// Выполняет запрос и возвращает целое число из первого столбца первой строки результата.
+static gint sql_int(sqlite3 *db, const gchar *sql)
+{
+  sqlite3_stmt *stmt;
+  gint value;
+
+  g_assert(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK);
+  g_assert(sqlite3_step(stmt) == SQLITE_ROW);
+
+  value = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  return value;
+}
+
+
+/// Экспортирует мозаику в файл MBTiles и проверяет его.
+/// Пирамида области 4 x 3 плитки: уровень 1 -- 2 x 2 плитки (50..51, 100..101), уровень 2 -- плитка (25, 50),
+/// поэтому maxzoom = 2 и уровню k соответствует zoom_level = 2 - k.
+static void mbtiles_check(GpSmartCache *cache, const gchar *dir)
+{
+  gchar *filename = g_strdup_printf("%s/streamer.mbtiles", dir);
+  GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+  guint8 *buf = g_malloc(GP_TILE_DATA_SIZE);
+  GError *error = NULL;
+  sqlite3 *db;
+  gint x, y;
+
+  GpTiler *tiler = g_object_new(pattern_tiler_get_type(),
+    "cache", cache,
+    "name", "Mosaic",
+    "tile-types-num", 1,
+  NULL);
+  ((PatternTiler *)tiler)->pixel = mosaic_pixel;
+
+  GpStreamer *streamer = gp_streamer_new();
+  g_object_ref_sink(streamer);
+
+  gp_streamer_set_tiler(streamer, tiler);
+  gp_streamer_set_tile_side(streamer, TEST_TILE_SIDE);
+  gp_streamer_set_view_type(streamer, 0);
+  gp_streamer_set_utm_zone(streamer, TEST_UTM_ZONE);
+  gp_streamer_set_area(streamer, TEST_FROM_X, TEST_TO_X, TEST_FROM_Y, TEST_TO_Y);
+  gp_streamer_set_mbtiles(streamer, filename);
+
+  gp_streamer_start(streamer, streamer_done, loop);
+  g_main_loop_run(loop);
+
+  g_object_unref(streamer);
+  g_object_unref(tiler);
+  g_main_loop_unref(loop);
+
+  // Таблицы базы
+  g_assert(sqlite3_open_v2(filename, &db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK);
+
+  g_assert_cmpint(sql_int(db, "SELECT CAST(value AS INTEGER) FROM metadata WHERE name = 'maxzoom'"), ==, 2);
+  g_assert_cmpint(sql_int(db, "SELECT CAST(value AS INTEGER) FROM metadata WHERE name = 'gp_tile_side'"), ==, TEST_TILE_SIDE);
+  g_assert_cmpint(sql_int(db, "SELECT count(*) FROM metadata WHERE name = 'scheme' AND value = 'gp-tiler'"), ==, 1);
+
+  // Две прозрачные плитки уровня 0 не записаны
+  g_assert_cmpint(sql_int(db, "SELECT count(*) FROM map WHERE zoom_level = 2"), ==, TEST_NX * TEST_NY - 2);
+  g_assert_cmpint(sql_int(db, "SELECT count(*) FROM map WHERE zoom_level = 2 AND tile_row = 200 AND tile_column < 102"), ==, 0);
+  g_assert_cmpint(sql_int(db, "SELECT count(*) FROM map WHERE zoom_level = 1"), ==, 4);
+  g_assert_cmpint(sql_int(db, "SELECT count(*) FROM map WHERE zoom_level = 0 AND tile_column = 25 AND tile_row = 50"), ==, 1);
+  g_assert_cmpint(sql_int(db, "SELECT count(*) FROM map"), ==, 15);
+
+  // Четыре одинаковые плитки строки 202 (и две их общие родительские) хранятся одним изображением
+  g_assert_cmpint(sql_int(db, "SELECT count(DISTINCT tile_id) FROM map WHERE zoom_level = 2 AND tile_row = 202"), ==, 1);
+  g_assert_cmpint(sql_int(db, "SELECT count(DISTINCT tile_id) FROM map WHERE zoom_level = 1 AND tile_row = 101"), ==, 1);
+  g_assert_cmpint(sql_int(db, "SELECT count(*) FROM images WHERE tile_id IN "
+                              "(SELECT tile_id FROM map WHERE zoom_level = 2 AND tile_row = 202)"), ==, 1);
+  g_assert_cmpint(sql_int(db, "SELECT count(*) FROM images"), ==, 11);
+  g_assert_cmpint(sql_int(db, "SELECT count(DISTINCT tile_id) FROM images"), ==, 11);
+
+  sqlite3_close(db);
+
+  // Плитки, прочитанные Gp.MbtilesTiler, на уровне 0 и на уровнях пирамиды
+  GpTiler *reader = GP_TILER(gp_mbtiles_tiler_new(cache, filename, &error));
+  g_assert_no_error(error);
+
+  for(y = TEST_Y0 - TEST_NY + 1; y <= TEST_Y0; y++)
+    for(x = TEST_X0; x < TEST_X0 + TEST_NX; x++)
+      check_mbtiles_tile(reader, buf, x, y, 0);
+
+  for(y = 100; y <= 101; y++)
+    for(x = 50; x <= 51; x++)
+      check_mbtiles_tile(reader, buf, x, y, 1);
+
+  check_mbtiles_tile(reader, buf, 25, 50, 2);
+
+  g_object_unref(reader);
+  printf("mbtiles: OK
+");
+
+  g_remove(filename);
+  g_free(filename);
+  g_free(buf);
+}
+
+
+int main(int argc, char **argv)
+{
+  GError *error = NULL;
+  gchar *dir = g_dir_make_tmp("streamertest-XXXXXX", &error);
+
+  g_assert_no_error(error);
+
+  // Тэги GeoTIFF неизвестны libtiff без libgeotiff, предупреждения о них не нужны
+  TIFFSetWarningHandler(NULL);
+
+  GpSmartCache *cache = gp_smart_cache_new();
+  GpTiler *tiler = g_object_new(pattern_tiler_get_type(),
+    "cache", cache,
+    "name", "Pattern",
+    "tile-types-num", 1,
+  NULL);
+
+#if GEOTIFF_FOUND
+  streamer_check(tiler, dir, GP_STREAMER_COMPRESSION_NONE, COMPRESSION_NONE);
+  streamer_check(tiler, dir, GP_STREAMER_COMPRESSION_DEFLATE, COMPRESSION_ADOBE_DEFLATE);
+  streamer_check(tiler, dir, GP_STREAMER_COMPRESSION_LZW, COMPRESSION_LZW);
+
+#if ZSTD_FOUND && defined(COMPRESSION_ZSTD)
+  if(TIFFIsCODECConfigured(COMPRESSION_ZSTD))
+    streamer_check(tiler, dir, GP_STREAMER_COMPRESSION_ZSTD, COMPRESSION_ZSTD);
+#endif
+#endif
+
+  mbtiles_check(cache, dir);
+
+  g_object_unref(tiler);
+  g_object_unref(cache);
+
+  g_rmdir(dir);
+  g_free(dir);
+
+  return 0;
+}
@@ -29,6 +29,7 @@ G_DEFINE_TYPE(Weigher, weigher, GP_TYPE_TILER );
 
 static GpMemTile *weigher_get_tile_from_source(GpTiler *tiler, GpTile* tile, GpTileStatus status);
 gboolean weigher_get_area(GpTiler *weigher, gint type, gdouble* from_x, gdouble* to_x, gdouble* from_y, gdouble* to_y);
+static gboolean weigher_is_graphical(GpTiler *tiler, gint type);
 
 gboolean check_tile(GpTile *tile, gpointer user_data)
 {
@@ -49,6 +50,7 @@ static void weigher_class_init(WeigherClass *klass)
 
   parent_class->get_tile_from_source = weigher_get_tile_from_source;
   parent_class->get_area = weigher_get_area;
+  parent_class->is_graphical = weigher_is_graphical;
 }
 
 gint weigher_get_tiles_type(Weigher *self)
@@ -133,6 +135,12 @@ gboolean is_graphical(Weigher *weigher, gint type)
     return FALSE;
 }
 
+// Плитки с весами (data_type 1) -- не изображение, а данные для GpMixTiler.
+gboolean weigher_is_graphical(GpTiler *tiler, gint type)
+{
+  return WEIGHER(tiler)->priv->data_type == 0;
+}
+
 gdouble weigher_depth_generator(Weigher *weigher, gdouble x, gdouble y)
 {
   WeigherPriv *priv = weigher->priv;